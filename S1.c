@@ -13,26 +13,51 @@
  * - S1 handles client connections via forked child processes.
  * - Only .c files are stored locally; other types are transferred to:
  *      .pdf → S2, .txt → S3, .zip → S4
- * - Clients are unaware of S2/S3/S4 and interact only with S1.
+ * - As a gateway, .c files are transferred to S5 as well, so several S1
+ *   instances can serve clients behind a load balancer.
+ * - Clients are unaware of S2/S3/S4 and interact only with S1, unless they
+ *   ask for a redirected transfer: S1 then checks the request as usual and
+ *   hands out a short-lived ticket signed with the key in ~/.w25.ticket.key.
  * - S1 ensures proper routing, error checking, and communication between components.
  * - Maintains transparency - clients only see ~S1/ paths
- * - Uses 'U'pload, 'D'ownload, 'R'emove , Download 'T'ar, Directory 'L'isting commands
+ * - Uses 'U'pload, 'D'ownload, 'R'emove , Download 'T'ar (its ind'E'x and 'B'yte ranges), Directory 'L'isting, 'S'tat, 'W'atch, 'Z'ip listing, zip member e'X'traction, 'F'ind, 'A'ppend, 'P'write, 'K'eyword search commands
  *
  * Usage:
  * ------
- * Compile: gcc S1.c -o S1
+ * Compile: gcc S1.c -o S1 -pthread
  * Run:     ./S1
+ * Restart: ./S1 --takeover   (new S1 inherits the listening socket from the running one)
+ * Gateway: ./S1 --gateway [port] [--storage <ip>]   (stores nothing; .c files go to S5)
  *
  * Port: Default is 6071 (can be changed via macro)
  *
  * Client Command Received:
  * ------------------------
  * 
- * - uploadf: Upload files to distributed storage
- * - downlf: Download files from server
- * - removef: Delete remote files
+ * - uploadf: Upload files to distributed storage (optionally expiring after a TTL);
+ *   with the client's SHA-256 of the file, content already stored in the client's
+ *   namespace is not sent again,
+ *   and a chunked upload only sends the chunks the storage server lacks
+ * - downlf: Download files from server (optionally a prior version)
+ * - removef: Delete remote files (into a trash, restorable for TRASH_RETENTION_HOURS)
  * - downltar: Download tar of file type
  * - dispfnames: List directory contents
+ * - statf: Report existence, size, mtime and content hash of files
+ * - stats: Report integrity scrubber results of every server
+ * - versions: List the stored versions of a file
+ * - undelf: Restore a removed file from the trash
+ * - watchf: Stream changes below a path (resumable with a cursor)
+ * - zipls: List the members of a stored zip (central directory only)
+ * - grepf: Search the stored .txt files on S3, returning matching lines only
+ * - searchf: Find the .txt files containing all given words (S3's inverted index)
+ * - appendf: Append bytes to a stored .txt file (idempotent with a sequence number)
+ * - writef: Overwrite a range of a stored file in place (optionally only at an expected version)
+ * - symf: Find where a function, type or macro is defined in the stored .c files
+ * - login: Authenticate as a tenant; the session then works in the tenant's own storage roots
+ * - downlm: Download one member of a stored zip (downlf --member)
+ * - mux: Switch the connection to multiplexed mode (many logical sessions)
+ * - redirect uploadf / redirect downlf: Approve a transfer and return a signed
+ *   ticket, with which the client moves the data to or from S2-S5 directly
  * 
  * 
  * Authors: Saima Khatoon and Lokesh Jayachandran
@@ -40,6 +65,7 @@
  * Course: COMP-8567
  * Institution: University of Windsor
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,6 +81,23 @@
 #include <errno.h>
 #include <signal.h>
 #include <libgen.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <semaphore.h>
+#include <sys/xattr.h>
+#include <sys/file.h>
+#include <ftw.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <limits.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/random.h>
 #include <asm-generic/socket.h>
 
 
@@ -62,1090 +105,6180 @@
 #define PORT_S2 6072
 #define PORT_S3 6073
 #define PORT_S4 6074
+#define PORT_S5 6075
 #define BUFFER_SIZE 1024
 #define MAX_PATH_LEN 1024
+#define HANDOFF_SOCK_NAME ".S1.handoff"   // Unix socket under $HOME used for hot restart
+#define TRANSFER_CHUNK (64 * 1024)          // Size of one pooled transfer buffer
+#define TRANSFER_SLOTS 64                   // Transfer budget: 64 x 64 KB in flight across all sessions
+#define TRANSFER_WAIT_SECS 10               // How long a transfer waits for a free buffer before rejection
+#define TRANSFER_HUGEPAGES 1                // Back the pool with hugepages when the system has them
+#define MAX_UPLOAD_SIZE (16L * 1024 * 1024 * 1024)  // Largest file size accepted from a peer
+#define MUX_MAX_STREAMS 1024                // Logical sessions per multiplexed connection (ids 1..1023)
+#define MUX_WINDOW (64 * 1024)              // Per-stream flow-control window, each direction
+#define MUX_MAX_FRAME (16 * 1024)           // Largest data frame payload
+#define MUX_HEADER_LEN 9                    // stream_id (int) + type (char) + length (int)
+#define HASH_XATTR "user.w25.hash"          // Extended attribute caching the content hash
+#define CONTENT_XATTR "user.w25.sha256"     // Extended attribute proving the content of a stored file
+#define CONTENT_PROOF_LEN 32                // SHA-256 an upload proves its content with
+#define STAT_MAX_PATHS 64                   // Paths answered by one statf request
+#define USAGE_FILE ".S1.usage"              // Namespace usage counters under $HOME (memory mapped)
+#define QUOTA_FILE ".S1.quota"              // Namespace quota configuration under $HOME
+#define USAGE_SLOTS 1024                    // Namespaces tracked in the usage table
+#define USAGE_PREFIX_LEN 64                 // Longest tracked namespace name (longer ones are truncated)
+#define SCRUB_RATE (4 * 1024 * 1024)        // Scrubber read budget in bytes per second
+#define SCRUB_PAUSE_SECS 600                // Rest between two scrub passes
+#define GEN_XATTR "user.w25.gen"            // Extended attribute holding the file generation
+#define VERSIONS_DIR ".S1.versions"         // Prior versions under $HOME: <path>/<generation>
+#define VERSION_KEEP 10                     // Prior versions kept per file
+#define VERSION_MAX_DAYS 30                 // Prior versions older than this are pruned
+#define VERSION_PRUNE_SECS 3600             // Interval between pruner passes
+#define VERSION_LIST_MAX 64                 // Entries returned by one version listing
+#define TRASH_DIR ".S1.trash"               // Removed files under $HOME: <path>/<deletion time>
+#define TRASH_RETENTION_HOURS 72            // How long removed files can be restored
+#define TRASH_REAP_SECS 300                 // Interval between reaper passes
+#define TRASH_PURGE_BATCH 64                // Files purged before the reaper pauses
+#define EXPIRES_XATTR "user.w25.expires"    // Extended attribute holding the expiry time of a TTL upload
+#define EXPIRY_JOURNAL ".S1.expiry"         // TTL uploads reported by sessions to the expirer (under $HOME)
+#define EXPIRY_JOURNAL_MAX (1024 * 1024)    // Journal size at which the expirer rotates it
+#define EXPIRY_TICK_SECS 1                  // Interval between expirer passes
+#define EXPIRY_BATCH 64                     // Files deleted per expirer pass
+#define USAGE_RECONCILE_SECS 60             // Interval between usage reconciliations with S2-S4
+#define EVENT_FILE ".S1.events"             // Change event ring under $HOME (memory mapped)
+#define EVENT_SLOTS 4096                    // Changes kept for resuming watchers
+#define WATCH_POLL_MS 100                   // How often a watch checks for new changes
+#define APPEND_MAX (1024 * 1024)            // Largest append accepted in one request
+#define WRITE_MAX (1024 * 1024)             // Largest range accepted by one in-place write
+#define SYMBOL_SOCK_NAME ".S1.symbols"      // Unix socket under $HOME answering symf queries
+#define SYMBOL_BUCKETS 65536                // Hash buckets of the symbol index
+#define SYMBOL_MAX_NAME 128                 // Longest symbol name indexed
+#define SYMBOL_MAX_RESULTS 200              // Definitions returned by one symf query
+#define SYMBOL_MAX_FILE (16 * 1024 * 1024)  // Larger .c files are not indexed
+#define TENANTS_FILE ".S1.tenants"          // Tenant names, secrets and limits under $HOME
+#define TENANT_DIR ".tenants"               // Tenant <name> is stored below ~SX/.tenants/<name> on every server
+#define TENANT_MAX 32                       // Tenants read from TENANTS_FILE
+#define TENANT_NAME_LEN 32                  // Longest tenant name + 1
+#define TENANT_SECRET_LEN 128               // Longest tenant secret + 1
+#define TENANT_MAX_SESSIONS 64              // Highest session limit a tenant can have
+#define TENANT_DEFAULT_SESSIONS 8           // Session limit of a tenant configured without one
+#define TENANT_DEFAULT_BUFFERS 8            // Transfer buffers reserved for a tenant configured without a number
+#define TICKET_KEY_FILE ".w25.ticket.key"   // Key signing redirect tickets, under $HOME (shared with S2-S5)
+#define TICKET_KEY_LEN 32                   // Bytes of key material
+#define TICKET_MAC_LEN 32                   // HMAC-SHA256 tag closing every ticket
+#define TICKET_TTL_SECS 30                  // How long a redirect ticket can be presented
+#define TICKET_NONCE_LEN 16                 // Random bytes making every ticket and storage connection unique
+#define CHUNK_MAX_COUNT (1 << 20)           // Chunks accepted in one chunked upload
+#define TAR_BLOCK 512                       // Tar block size
+#define TAR_THREADS 8                       // Files read in parallel while a tar is streamed
+#define TAR_WINDOW 32                       // Files prepared ahead of the one being sent
+#define TAR_INLINE_MAX (256 * 1024)         // Larger files are sent from disk instead of being read ahead
+#define TAR_READAHEAD (4 * 1024 * 1024)     // Bytes of a larger file prefetched before it is sent
 
 /**
- * @brief Establishes connection to a target storage server
- * @param target_port Port number of the target server
- * @param client_sock The client socket descriptor to associate with logging
- * @return Socket descriptor on success, -1 on failure
+ * @brief Bounded pool of transfer buffers shared by all client sessions
  *
- * Creates TCP socket and connects to specified storage server
- * Logs connection errors to stderr
- * Attempts connection to 127.0.0.1:[target_port]
- * Used for all inter-server communications (S2/S3/S4)
+ * Lives in a shared mapping created before any fork(), so every prcclient
+ * process draws from the same budget; on a hot restart the mapping is
+ * handed to the new S1 (see map_shared_region), so the draining instance
+ * and its successor share it too. The semaphore counts free
+ * slots; owner[] records which process holds each slot so the parent can
+ * reclaim buffers of a session that died mid-transfer. The buffers
+ * themselves sit in a separate page-aligned (optionally hugepage) region,
+ * pre-faulted once at startup and reused by every request.
  */
-int connect_to_target_server(int target_port, int client_sock) {
-    // Connect to target server
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket creation failed");
-        send(client_sock, "EInternal server error", 22, 0);
-        return -1;
-    }
+typedef struct {
+    sem_t free_slots;                           /**< Number of unowned slots outside the tenants' reservations */
+    pid_t owner[TRANSFER_SLOTS];                /**< Holding pid, 0 when free */
+    int owner_tenant[TRANSFER_SLOTS];           /**< Tenant the slot was taken for, -1 for none */
+} TransferPool;
 
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));   // Initialize serv_addr to zero
-    serv_addr.sin_family = AF_INET;             // Set address family to IPv4
-    serv_addr.sin_port = htons(target_port);    // Set the target port, converting to network byte order
+TransferPool *transfer_pool = NULL;
+char *transfer_data = NULL;     // TRANSFER_SLOTS x TRANSFER_CHUNK, page aligned
+int transfer_pool_inherited = 0;    // Pool handed over by the previous S1
 
-    // Convert IP address from text to binary form and store in serv_addr
-    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);   
+/**
+ * @brief Shared regions passed to the next S1 along with the listener
+ */
+enum { REGION_POOL, REGION_BUFFERS, REGION_TENANTS, REGION_SCRUB, SHARED_REGIONS };
+int region_fd[SHARED_REGIONS] = {-1, -1, -1, -1};  // memfd of each region, -1 if not created
 
-    // Attempt to connect to the target storage server
-    if (connect(server_sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection failed");
-        close(server_sock);
-        long status = -1;
-        send(client_sock, &status, sizeof(long), 0);
-        // Close the socket and notify the client about the failure
-        const char *msg = "EConnection is not reliable";
-        int msg_len = strlen(msg);
-        send(client_sock, &msg_len, sizeof(int), 0);
-        send(client_sock, msg, msg_len, 0);
-        return -1;
+/**
+ * @brief One tenant: credentials, limits and its share of the transfer pool
+ */
+typedef struct {
+    char name[TENANT_NAME_LEN];
+    char secret[TENANT_SECRET_LEN];
+    int max_sessions;
+    int buffers;                                /**< Transfer buffers reserved for the tenant */
+    sem_t free_buffers;                         /**< Part of the reservation not in use */
+    pid_t sessions[TENANT_MAX_SESSIONS];        /**< Logged-in session pids, 0 when free */
+} Tenant;
+
+/**
+ * @brief Tenants read from $HOME/TENANTS_FILE at startup
+ *
+ * Shared like the transfer pool, so every session process counts the
+ * same sessions and draws from the same reservations. A tenant's
+ * buffers are taken out of the common pool once at startup: whatever
+ * the other tenants or the untenanted sessions do, its transfers find
+ * their buffers.
+ */
+typedef struct {
+    int count;
+    Tenant tenants[TENANT_MAX];
+} TenantTable;
+
+TenantTable *tenant_table = NULL;
+int session_tenant = -1;                    // Tenant this session logged in as, -1 for none
+char tenant_root[TENANT_NAME_LEN + 16] = "";    // Its storage root below ~S1 ("/.tenants/<name>")
+
+/**
+ * @brief Maps a region shared by every S1 process, a hot-restart successor included
+ * @param region REGION_* index; region_fd[region] >= 0 names a region handed over
+ * @param name Name of the region (shown in /proc/<pid>/maps)
+ * @param len Size of the region
+ * @param flags Extra memfd_create() flags (MFD_HUGETLB), 0 for none
+ * @param created Set to 1 if the region was created (zero-filled), 0 if handed over
+ * @return Mapping, MAP_FAILED on failure
+ *
+ * Regions live in memfds rather than anonymous memory so their
+ * descriptors can travel with the listening socket: during a drain the
+ * old and the new S1 then share one transfer budget and one count of
+ * tenant sessions. A handed-over region of the wrong size (a build with
+ * other limits) is dropped and a fresh one created.
+ */
+void *map_shared_region(int region, const char *name, size_t len, unsigned int flags, int *created) {
+    struct stat st;
+    if (region_fd[region] >= 0 && (fstat(region_fd[region], &st) < 0 || (size_t)st.st_size != len)) {
+        printf("Ignoring handed-over %s: size does not match\n", name);
+        close(region_fd[region]);
+        region_fd[region] = -1;
     }
 
-    return server_sock;  // Success
+    *created = region_fd[region] < 0;
+    if (*created) {
+        region_fd[region] = memfd_create(name, MFD_CLOEXEC | flags);
+        if (region_fd[region] < 0) return MAP_FAILED;
+        if (ftruncate(region_fd[region], len) < 0) {
+            close(region_fd[region]);
+            region_fd[region] = -1;
+            return MAP_FAILED;
+        }
+    }
+
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, region_fd[region], 0);
+    if (p == MAP_FAILED && *created) {
+        close(region_fd[region]);
+        region_fd[region] = -1;
+    }
+    return p;
 }
 
 /**
- * @brief Sends a file to a target server via TCP connection
- * 
- * @param ip Target server IP address (S2/S3/S4)
- * @param port Target server port number
- * @param filedata File content buffer to send
- * @param filesize Size of file data in bytes
- * @param relative_dest_path Destination path on server (relative)
- * @return int 1 on success, -1 on failure
- * 
- * @details Implements protocol:
- * 'U' - Upload File
- *   1. S1 → Storage: 'U' + path_len + path + file_size + file_data
- *   2. Storage → S1: Success/Failure response
+ * @brief Maps the shared transfer pool; must run before the accept loop
+ * @return 0 on success, -1 on failure
+ *
+ * The buffer region is populated up front (MAP_POPULATE) so requests never
+ * take page faults on it. Hugepages are tried first when TRANSFER_HUGEPAGES
+ * is set and silently replaced by normal pages if none are reserved.
+ *
+ * A pool handed over by the previous S1 is used as it is: its semaphore
+ * and owners already account for the sessions that instance is draining.
  */
-int send_file_to_server(const char *ip, int port, const char *filedata, long filesize, const char *relative_dest_path) {
-    int sock;
-    struct sockaddr_in server;
+int init_transfer_pool(void) {
+    // Both halves are taken over together, or neither
+    size_t data_len = (size_t)TRANSFER_SLOTS * TRANSFER_CHUNK;
+    struct stat pool_st, data_st;
+    int inherited = region_fd[REGION_POOL] >= 0 && region_fd[REGION_BUFFERS] >= 0 &&
+                    fstat(region_fd[REGION_POOL], &pool_st) == 0 && (size_t)pool_st.st_size == sizeof(TransferPool) &&
+                    fstat(region_fd[REGION_BUFFERS], &data_st) == 0 && (size_t)data_st.st_size == data_len;
+    if (!inherited) {
+        for (int r = REGION_POOL; r <= REGION_BUFFERS; r++) {
+            if (region_fd[r] >= 0) close(region_fd[r]);
+            region_fd[r] = -1;
+        }
+    }
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("Socket creation failed");
+    int created;
+    transfer_pool = map_shared_region(REGION_POOL, "S1 transfer pool", sizeof(TransferPool), 0, &created);
+    if (transfer_pool == MAP_FAILED) {
+        perror("mmap transfer pool");
+        transfer_pool = NULL;
         return -1;
     }
+    transfer_data = MAP_FAILED;
+    if (inherited) {
+        transfer_data = map_shared_region(REGION_BUFFERS, "S1 transfer buffers", data_len, 0, &created);
+        if (transfer_data == MAP_FAILED) {
+            perror("mmap transfer buffers");
+            transfer_data = NULL;
+            return -1;
+        }
+        transfer_pool_inherited = 1;
+        printf("Transfer pool: shared with the previous S1\n");
+        return 0;
+    }
 
-    server.sin_family = AF_INET;
-    server.sin_port = htons(port);
-    server.sin_addr.s_addr = inet_addr(ip);
-
-    if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
-        perror("Connection failed");
-        close(sock);
+    if (sem_init(&transfer_pool->free_slots, 1, TRANSFER_SLOTS) < 0) {
+        perror("sem_init transfer pool");
         return -1;
     }
 
-    printf("Server connected\n");
-
-    // Send download command ('D') to target server
-    char command_type = 'U';
-    send(sock, &command_type, 1, 0);
-
-    // Send path length and relative destination path to target server
-    int path_len = strlen(relative_dest_path);
-    write(sock, &path_len, sizeof(int));
-    printf("Path Length is: %d\n", path_len);
-
-    write(sock, relative_dest_path, path_len);
-    printf("Relative path is: %s\n", relative_dest_path);
-
-    // Send file size to target server
-    write(sock, &filesize, sizeof(long));
-
-    // Send file data in chunks to target server
-    long total_sent = 0;
-    while (total_sent < filesize) {
-        int chunk = write(sock, filedata + total_sent, filesize - total_sent);
-        printf("File content sent to client : %s\n", filedata);
-        if (chunk <= 0) break;
-        total_sent += chunk;
+    if (TRANSFER_HUGEPAGES)
+        transfer_data = map_shared_region(REGION_BUFFERS, "S1 transfer buffers", data_len, MFD_HUGETLB, &created);
+    if (transfer_data == MAP_FAILED) {
+        transfer_data = map_shared_region(REGION_BUFFERS, "S1 transfer buffers", data_len, 0, &created);
+        if (transfer_data == MAP_FAILED) {
+            perror("mmap transfer buffers");
+            transfer_data = NULL;
+            return -1;
+        }
+        printf("Transfer pool: %d x %d KB buffers (normal pages)\n", TRANSFER_SLOTS, TRANSFER_CHUNK / 1024);
+    } else {
+        printf("Transfer pool: %d x %d KB buffers (hugepages)\n", TRANSFER_SLOTS, TRANSFER_CHUNK / 1024);
     }
+    return 0;
+}
 
-    close(sock);
-    return total_sent == filesize ? 1 : -1;  // Return success or failure
+/**
+ * @brief Semaphore counting the free buffers a tenant may take
+ * @param tenant Tenant index, -1 for untenanted sessions (the common pool)
+ */
+sem_t *transfer_budget(int tenant) {
+    return tenant >= 0 && tenant_table ? &tenant_table->tenants[tenant].free_buffers
+                                       : &transfer_pool->free_slots;
 }
 
 /**
- * @brief Processes file upload requests from clients
- * @param client_sock Client socket descriptor
- * @param filename Name of file being uploaded
- * @param dest_path Destination path on server (~S1/...)
+ * @brief Takes one TRANSFER_CHUNK buffer from the shared pool
+ * @return Buffer on success, NULL if none became free within TRANSFER_WAIT_SECS
  *
- * Handles all file types (.c, .pdf, .txt, .zip)
- * Stores .c files locally, routes others to appropriate servers
- * Creates necessary directory structure
- * Validates file extensions and path formats
- * Implements atomic write operation
+ * Applies backpressure: when the budget is exhausted the caller blocks
+ * until another session releases a buffer, and is rejected on timeout.
  */
-void handle_upload_request(int client_sock, const char *filename, const char *dest_path){
-        // Receive file size
-        long size;
-        read(client_sock, &size, sizeof(long));
-        printf("Size of file received: %d\n", size);
+char *acquire_transfer_buffer(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TRANSFER_WAIT_SECS;
+
+    // Tenants wait on their own reservation only
+    sem_t *budget = transfer_budget(session_tenant);
+    while (sem_timedwait(budget, &deadline) < 0) {
+        if (errno != EINTR) return NULL;   // ETIMEDOUT: budget stayed exhausted
+    }
 
-        // Receive file data
-        char *filedata = malloc(size);
-        long received = 0;
-        while (received < size) {
-            int chunk = read(client_sock, filedata + received, size - received);
-            //printf("File content receive from client : %s\n", filedata);
-            if (chunk <= 0) break;
-            received += chunk;
+    // A slot is reserved for us; claim the first unowned one
+    pid_t self = getpid();
+    for (int i = 0; i < TRANSFER_SLOTS; i++) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&transfer_pool->owner[i], &expected, self, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            transfer_pool->owner_tenant[i] = session_tenant;
+            return transfer_data + (size_t)i * TRANSFER_CHUNK;
         }
+    }
 
-        // Handle file type and destination
-        char *ext = strrchr(filename, '.');
-        char moddest[1024];
-        if (strncmp(dest_path, "~S1", 3) == 0)
-            snprintf(moddest, sizeof(moddest), "%s/%s", dest_path + 3, filename);
-        else
-            snprintf(moddest, sizeof(moddest), "%s/%s", dest_path, filename);
-
-        int result = 0;  // Variable to store the result status (success/failure)
+    sem_post(budget);
+    return NULL;
+}
 
-        //printf("moddest is: %s\n", moddest);
 
-        // Determine where to send the file based on its extension
-        if (ext && strcmp(ext, ".pdf") == 0) {
-            // Send to S2 server
-            result = send_file_to_server("127.0.0.1", PORT_S2, filedata, size, moddest);
-        } else if (ext && strcmp(ext, ".txt") == 0) {
-            // Send to S3 server
-            result = send_file_to_server("127.0.0.1", PORT_S3, filedata, size, moddest);
-        } else if (ext && strcmp(ext, ".zip") == 0) {
-            // Send to S4 server 
-            result = send_file_to_server("127.0.0.1", PORT_S4, filedata, size, moddest);
-        } else if (ext && strcmp(ext, ".c") == 0) {
-            // Save locally to ~/S1
-            char fullpath[1024];
-            snprintf(fullpath, sizeof(fullpath), "%s/S1%s/%s", getenv("HOME"), dest_path + 3, filename);
-            char mkdir_cmd[1024];
-            printf("Full path is: %s\n", fullpath);
+/**
+ * @brief Returns a buffer obtained from acquire_transfer_buffer()
+ * @param buffer Buffer to release (NULL is ignored)
+ */
+void release_transfer_buffer(char *buffer) {
+    if (!buffer) return;
+    int slot = (buffer - transfer_data) / TRANSFER_CHUNK;
+    sem_t *budget = transfer_budget(transfer_pool->owner_tenant[slot]);
+    __atomic_store_n(&transfer_pool->owner[slot], 0, __ATOMIC_RELEASE);
+    sem_post(budget);
+}
 
-            snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(strdup(fullpath)));
-            system(mkdir_cmd);
-            printf("Command to create directory is: %s\n", mkdir_cmd);
+/**
+ * @brief Frees every slot still held by an exited session process
+ * @param pid Process id returned by waitpid()
+ *
+ * Async-signal-safe (only atomics and sem_post), called from SIGCHLD.
+ */
+void reclaim_transfer_buffers(pid_t pid) {
+    if (!transfer_pool) return;
+    for (int i = 0; i < TRANSFER_SLOTS; i++) {
+        pid_t expected = pid;
+        int tenant = transfer_pool->owner_tenant[i];   // Stable while the dead pid owns the slot
+        if (__atomic_compare_exchange_n(&transfer_pool->owner[i], &expected, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            sem_post(transfer_budget(tenant));
+    }
+}
 
-            FILE *fp = fopen(fullpath, "wb");
-            if (fp) {
-                fwrite(filedata, 1, size, fp);
-                fclose(fp);
-                result = 1;  // Success
-            } else {
-                perror("Write error on .c file");
-                result = -1;  // Failure
-            }
-        }
+/**
+ * @brief Streaming state of the XXH64 content hash
+ *
+ * XXH64 processes 32-byte stripes in four independent lanes, so it hashes
+ * at memory speed while the data streams through the transfer buffer.
+ */
+typedef struct {
+    unsigned long long total_len;   /**< Bytes hashed so far */
+    unsigned long long v[4];        /**< Lane accumulators */
+    unsigned char mem[32];          /**< Partial stripe carried between updates */
+    unsigned int memsize;           /**< Bytes in mem */
+} HashState;
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static unsigned long long xxh_rotl(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
 
-        // Send a response to the client indicating success or failure
-        if (result == 1) {
-            // Success: File processing was completed successfully
-            const char *response = "File uploaded successfully.";
-            write(client_sock, response, strlen(response) + 1);
-            printf("%s\n",response);
-        } else if (result == -1) {
-            // Failure: There was an issue with the file handling
-            const char *response = "Error processing the file.";
-            write(client_sock, response, strlen(response) + 1);
-            printf("%s\n",response);
-        } else {
-            // Failure: Could not connect to the appropriate server
-            const char *response = "Error sending file to destination server.";
-            write(client_sock, response, strlen(response) + 1);
-            printf("%s\n",response);
-        }
+static unsigned long long xxh_read64(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-        free(filedata);
+static unsigned long long xxh_round(unsigned long long acc, unsigned long long input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
 }
 
+static unsigned long long xxh_merge(unsigned long long acc, unsigned long long val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
 
 /**
- * @brief Processes file download requests
- * @param client_sock The client socket descriptor 
- * @param filepath The full client path (~S1/...)
- *
- * Handles .c files locally, routes others to storage servers
- * Validates paths and file existence
- * Streams files with size prefix protocol
- * 
- * @details Implements protocol:
- * 'D' - Download File  
- *   1. S1 → Storage: 'D' + path_len + path
- *   2. Storage → S1: file_size + file_data OR error
+ * @brief Starts a new hash computation (seed 0)
+ * @param state Hash state to initialise
  */
-void handle_download_request(int client_sock, const char *filepath) {
+void hash_init(HashState *state) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME64_1;
+}
 
-    // Validate input
-    if (!filepath || strlen(filepath) == 0) {
-        long error = -1;
-        send(client_sock, &error, sizeof(long), 0);
-        char *err_msg = "EEmpty file path";
-        int msg_len = strlen(err_msg);
-        send(client_sock, &msg_len, sizeof(int), 0);
-        send(client_sock, err_msg, msg_len, 0);
+/**
+ * @brief Feeds data into a running hash
+ * @param state Hash state
+ * @param data Bytes to hash
+ * @param len Number of bytes
+ */
+void hash_update(HashState *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    state->total_len += len;
+
+    if (state->memsize + len < 32) {
+        memcpy(state->mem + state->memsize, p, len);
+        state->memsize += len;
         return;
     }
 
-    // Extract file extension
-    const char *ext = strrchr(filepath, '.');
-    if (!ext) {
-        long error = -1;
-        send(client_sock, &error, sizeof(long), 0);
-        char *err_msg = "EInvalid file: no extension";
-        int msg_len = strlen(err_msg);
-        send(client_sock, &msg_len, sizeof(int), 0);
-        send(client_sock, err_msg, msg_len, 0);
-        return;
+    // Complete the stripe left over from the previous update
+    if (state->memsize) {
+        size_t fill = 32 - state->memsize;
+        memcpy(state->mem + state->memsize, p, fill);
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh_round(state->v[i], xxh_read64(state->mem + 8 * i));
+        p += fill;
+        state->memsize = 0;
     }
-    ext++; // Move past the dot
-    printf("Extension is: %s\n", ext);
 
-    // If the received file has a ".c" extension, handle it locally
-    if (strcmp(ext, "c") == 0) {
+    while (p + 32 <= end) {
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh_round(state->v[i], xxh_read64(p + 8 * i));
+        p += 32;
+    }
 
-        // Handle .c file locally
-        char local_path[MAX_PATH_LEN];
-        char *home_dir = NULL;
-        const char *s1_part = strstr(filepath, "S1/");
-        if (!s1_part) {
-            long error = -1;
-            send(client_sock, &error, sizeof(long), 0);
-            char *err_msg = "EInvalid path format";
-            int msg_len = strlen(err_msg);
-            send(client_sock, &msg_len, sizeof(int), 0);
-            send(client_sock, err_msg, msg_len, 0);
-            return;
-        }
+    if (p < end) {
+        memcpy(state->mem, p, end - p);
+        state->memsize = end - p;
+    }
+}
 
-        // Build absolute path with buffer safety
-        // Converts ~S1/.. to /home/user/S1/..
-        home_dir = getenv("HOME");
-        snprintf(local_path, MAX_PATH_LEN, "%s/S1/%s", home_dir, s1_part + 3);   // Converts ~S1/ to /home/user/S1/
-        printf("Absolute path of file in S1: %s\n",local_path);
+/**
+ * @brief Returns the digest of everything fed so far
+ * @param state Hash state (not modified)
+ * @return 64-bit XXH64 digest
+ */
+unsigned long long hash_final(const HashState *state) {
+    unsigned long long h;
+    if (state->total_len >= 32) {
+        h = xxh_rotl(state->v[0], 1) + xxh_rotl(state->v[1], 7) +
+            xxh_rotl(state->v[2], 12) + xxh_rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh_merge(h, state->v[i]);
+    } else {
+        h = state->v[2] + XXH_PRIME64_5;
+    }
+    h += state->total_len;
+
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->memsize;
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        unsigned int k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (unsigned long long)k * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
 
-        // Open file in S1
-        FILE *file = fopen(local_path, "rb");
-        if (!file) {
-            //printf("EFile not found\n");
-            // File not found: send a size of -1
-            long error = -1;
-            send(client_sock, &error, sizeof(long), 0);
-            char *err_msg = "EFile not found";
-            int msg_len = strlen(err_msg);
-            send(client_sock, &msg_len, sizeof(int), 0);
-            send(client_sock, err_msg, msg_len, 0);
-            return;
-        }
-       
-        // Get file size
-        fseek(file, 0, SEEK_END);
-        long file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
 
-        
-        long status = 1;
-        // Send status to client to proceed for download
-        send(client_sock, &status, sizeof(long), 0); 
-        // Send file size to client   
-        send(client_sock, &file_size, sizeof(long), 0);
+/**
+ * @brief Streaming state of SHA-256 (FIPS 180-4), used to sign tickets and prove content
+ */
+typedef struct {
+    unsigned int h[8];              /**< Chaining value */
+    unsigned char block[64];        /**< Partial block carried between updates */
+    unsigned long long total_len;   /**< Bytes hashed so far */
+} Sha256State;
+
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static unsigned int sha256_rotr(unsigned int x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
 
-        // Send file content to client
-        char buffer[BUFFER_SIZE];
-        while (file_size > 0) {
-            int chunk_size = file_size > BUFFER_SIZE ? BUFFER_SIZE : file_size;
-            fread(buffer, 1, chunk_size, file);
-            send(client_sock, buffer, chunk_size, 0);
-            printf("File content sent to client : %s\n", buffer);
-            file_size -= chunk_size;
-        }
+static void sha256_block(unsigned int *h, const unsigned char *p) {
+    unsigned int w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (unsigned int)p[4 * i] << 24 | (unsigned int)p[4 * i + 1] << 16 |
+               (unsigned int)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        unsigned int s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
 
-        fclose(file);   // Close the file
-        printf("File sent successfully to client.\n");
-        return;
+    unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        unsigned int t1 = k + (sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25)) +
+                          ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        unsigned int t2 = (sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
     }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
 
-    // If the received file has an extension other than ".c", send it to another server
-    // Select appropriate target server for non-.c files
-    int target_port;
-    char server_prefix[10];
-    
-    // If the received file has a ".pdf" extension
-    if (strcmp(ext, "pdf") == 0) {
-        target_port = PORT_S2;
-    } 
-    // If the received file has a ".txt" extension
-    else if (strcmp(ext, "txt") == 0) {
-        target_port = PORT_S3;
+void sha256_init(Sha256State *state) {
+    static const unsigned int iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(state->h, iv, sizeof(iv));
+    state->total_len = 0;
+}
+
+void sha256_update(Sha256State *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t used = state->total_len % 64;
+    state->total_len += len;
+    if (used > 0) {
+        size_t fill = 64 - used < len ? 64 - used : len;
+        memcpy(state->block + used, p, fill);
+        p += fill;
+        len -= fill;
+        if (used + fill < 64) return;
+        sha256_block(state->h, state->block);
     }
-    // If the received file has a ".zip" extension
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(state->h, p);
+    memcpy(state->block, p, len);
+}
+
+void sha256_final(Sha256State *state, unsigned char *digest) {
+    unsigned long long bits = state->total_len * 8;
+    unsigned char pad[72] = {0x80};
+    size_t used = state->total_len % 64;
+    size_t pad_len = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    sha256_update(state, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = state->h[i] >> 24;
+        digest[4 * i + 1] = state->h[i] >> 16;
+        digest[4 * i + 2] = state->h[i] >> 8;
+        digest[4 * i + 3] = state->h[i];
+    }
+}
+
+/**
+ * @brief HMAC-SHA256 (RFC 2104) of a message
+ * @param key Secret key (at most 64 bytes)
+ * @param key_len Length of key
+ * @param msg Message
+ * @param msg_len Length of msg
+ * @param mac Receives the 32-byte tag
+ */
+void hmac_sha256(const unsigned char *key, size_t key_len, const void *msg, size_t msg_len, unsigned char *mac) {
+    unsigned char pad[64], inner[32];
+    Sha256State state;
+
+    memset(pad, 0x36, sizeof(pad));
+    for (size_t i = 0; i < key_len && i < sizeof(pad); i++) pad[i] ^= key[i];
+    sha256_init(&state);
+    sha256_update(&state, pad, sizeof(pad));
+    sha256_update(&state, msg, msg_len);
+    sha256_final(&state, inner);
+
+    for (size_t i = 0; i < sizeof(pad); i++) pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&state);
+    sha256_update(&state, pad, sizeof(pad));
+    sha256_update(&state, inner, sizeof(inner));
+    sha256_final(&state, mac);
+}
+
+/**
+ * @brief Content hash cached on a file, with the state it was computed for
+ *
+ * Stored in the HASH_XATTR extended attribute. The hash is only trusted
+ * while size and mtime still match, so a file changed behind the server's
+ * back simply reports no hash instead of a stale one.
+ */
+typedef struct {
+    long size;                  /**< File size when hashed */
+    long mtime_sec;             /**< Modification time when hashed */
+    long mtime_nsec;
+    unsigned long long hash;    /**< XXH64 of the contents */
+} HashRecord;
+
+/**
+ * @brief SHA-256 of a stored file, with the state it was computed for
+ *
+ * Stored in the CONTENT_XATTR extended attribute next to the HashRecord.
+ * Unlike the XXH64 it cannot be forged, so it is what lets an upload skip
+ * its data (see preflight_upload). Trusted only while size and mtime
+ * still match.
+ */
+typedef struct {
+    long size;                                  /**< File size when hashed */
+    long mtime_sec;                             /**< Modification time when hashed */
+    long mtime_nsec;
+    unsigned char digest[CONTENT_PROOF_LEN];    /**< SHA-256 of the contents */
+} ContentProof;
+
+/**
+ * @brief Hashes a freshly written file and caches the result on it
+ * @param fd Descriptor of the file, open for reading
+ * @param buffer Transfer buffer (TRANSFER_CHUNK bytes) to read through
+ *
+ * Uploads are spliced straight into the file, so the data is read back
+ * once here; it was just written and comes from the page cache. Both
+ * the XXH64 and the SHA-256 proof are recorded.
+ */
+void cache_file_hash(int fd, char *buffer) {
+    HashState hs;
+    hash_init(&hs);
+    Sha256State proof_state;
+    sha256_init(&proof_state);
+    ssize_t n;
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buffer, TRANSFER_CHUNK)) > 0) {
+        hash_update(&hs, buffer, n);
+        sha256_update(&proof_state, buffer, n);
+    }
+    if (n < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) return;
+    HashRecord rec = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, hash_final(&hs)};
+    if (fsetxattr(fd, HASH_XATTR, &rec, sizeof(rec), 0) < 0)
+        perror("Failed to cache content hash");
+    ContentProof proof = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, {0}};
+    sha256_final(&proof_state, proof.digest);
+    if (fsetxattr(fd, CONTENT_XATTR, &proof, sizeof(proof), 0) < 0)
+        perror("Failed to record content proof");
+}
+
+/**
+ * @brief Checks an open file against a SHA-256
+ * @param fd Open descriptor of the file
+ * @param st Current stat of the file
+ * @param digest SHA-256 the file should have
+ * @return 1 if the file has a current proof with that digest, else 0
+ */
+int content_proven(int fd, const struct stat *st, const unsigned char *digest) {
+    ContentProof rec;
+    return fgetxattr(fd, CONTENT_XATTR, &rec, sizeof(rec)) == sizeof(rec) && rec.size == st->st_size &&
+           rec.mtime_sec == st->st_mtim.tv_sec && rec.mtime_nsec == st->st_mtim.tv_nsec &&
+           memcmp(rec.digest, digest, CONTENT_PROOF_LEN) == 0;
+}
+
+/**
+ * @brief Looks up the cached content hash of a file
+ * @param path File path
+ * @param st Current stat of the file
+ * @param hash Receives the hash when valid
+ * @return 1 if a hash matching the current size and mtime was found, else 0
+ */
+int load_cached_hash(const char *path, const struct stat *st, unsigned long long *hash) {
+    HashRecord rec;
+    if (getxattr(path, HASH_XATTR, &rec, sizeof(rec)) != sizeof(rec)) return 0;
+    if (rec.size != st->st_size || rec.mtime_sec != st->st_mtim.tv_sec ||
+        rec.mtime_nsec != st->st_mtim.tv_nsec)
+        return 0;
+    *hash = rec.hash;
+    return 1;
+}
+
+/**
+ * @brief Integrity scrubber results, as reported by the stats interface
+ */
+typedef struct {
+    long passes;                        /**< Completed passes over the store */
+    long files_checked;                 /**< Files re-hashed (all passes) */
+    long bytes_checked;                 /**< Bytes re-read (all passes) */
+    long unverified;                    /**< Files without a valid cached hash in the last pass */
+    long mismatches;                    /**< Files whose contents no longer match their hash */
+    long last_pass_end;                 /**< Time the last pass finished, 0 if none yet */
+    char last_mismatch[MAX_PATH_LEN];   /**< Most recent mismatching file (~S1/...) */
+} ScrubReport;
+
+/**
+ * @brief Scrubber results guarded for concurrent access
+ *
+ * Lives in a shared mapping (process-shared mutex) so the
+ * session processes forked by S1 can read what the scrubber thread of
+ * the parent process records.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    ScrubReport report;
+} ScrubStats;
+
+ScrubStats *scrub_stats = NULL;
+
+// Scrubber thread state
+static char scrub_buf[TRANSFER_CHUNK];
+static size_t scrub_root_len;
+static long scrub_pass_unverified;
+static double scrub_tokens;
+static struct timespec scrub_last;
+
+/**
+ * @brief Token bucket limiting scrubber reads to SCRUB_RATE bytes per second
+ * @param bytes Bytes just read
+ *
+ * Tokens may go negative; the thread then sleeps off the debt, so the
+ * long-run read rate never exceeds the budget whatever the file sizes.
+ */
+static void scrub_throttle(long bytes) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    scrub_tokens += ((now.tv_sec - scrub_last.tv_sec) + (now.tv_nsec - scrub_last.tv_nsec) / 1e9) * SCRUB_RATE;
+    scrub_last = now;
+    if (scrub_tokens > TRANSFER_CHUNK) scrub_tokens = TRANSFER_CHUNK;
+
+    scrub_tokens -= bytes;
+    if (scrub_tokens < 0) {
+        double wait = -scrub_tokens / SCRUB_RATE;
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * @brief nftw() callback verifying one stored file against its cached hash
+ *
+ * The hash record is read from the open descriptor, so a file replaced
+ * during the walk is never compared with another file's hash. Files
+ * modified while being read are skipped and checked on the next pass.
+ */
+static int scrub_file(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)sb;
+    (void)ftw;
+    const char *ext = strrchr(path, '.');
+    if (type != FTW_F || !ext || strcmp(ext, ".c") != 0) return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    HashRecord rec;
+    if (fstat(fd, &st) < 0 || fgetxattr(fd, HASH_XATTR, &rec, sizeof(rec)) != sizeof(rec) ||
+        rec.size != st.st_size || rec.mtime_sec != st.st_mtim.tv_sec || rec.mtime_nsec != st.st_mtim.tv_nsec) {
+        scrub_pass_unverified++;
+        close(fd);
+        return 0;
+    }
+
+    // Scrub reads should not displace the files clients are using
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+
+    HashState hs;
+    hash_init(&hs);
+    ssize_t n;
+    long total = 0;
+    while ((n = read(fd, scrub_buf, sizeof(scrub_buf))) > 0) {
+        hash_update(&hs, scrub_buf, n);
+        total += n;
+        scrub_throttle(n);
+    }
+
+    struct stat after;
+    int changed = fstat(fd, &after) < 0 || after.st_size != st.st_size ||
+                  after.st_mtim.tv_sec != st.st_mtim.tv_sec || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec;
+    close(fd);
+    if (n < 0 || changed) return 0;
+
+    int mismatch = hash_final(&hs) != rec.hash;
+    pthread_mutex_lock(&scrub_stats->lock);
+    scrub_stats->report.files_checked++;
+    scrub_stats->report.bytes_checked += total;
+    if (mismatch) {
+        scrub_stats->report.mismatches++;
+        snprintf(scrub_stats->report.last_mismatch, MAX_PATH_LEN, "~S1%s", path + scrub_root_len);
+    }
+    pthread_mutex_unlock(&scrub_stats->lock);
+
+    if (mismatch)
+        printf("Scrub: contents of %s do not match the recorded hash\n", path);
+    return 0;
+}
+
+/**
+ * @brief Background integrity scrubber
+ *
+ * Walks ~/S1 forever, re-hashing every .c file that has a cached hash,
+ * then rests SCRUB_PAUSE_SECS between passes. Reads are throttled to
+ * SCRUB_RATE and the thread runs at the lowest CPU priority, so foreground
+ * requests keep their latency.
+ */
+void *scrub_thread(void *arg) {
+    (void)arg;
+
+    // Signals are handled by the main thread; nice applies per thread on Linux
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    char root[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+    scrub_root_len = strlen(root);
+    clock_gettime(CLOCK_MONOTONIC, &scrub_last);
+
+    while (1) {
+        scrub_pass_unverified = 0;
+        nftw(root, scrub_file, 16, FTW_PHYS);
+
+        pthread_mutex_lock(&scrub_stats->lock);
+        scrub_stats->report.passes++;
+        scrub_stats->report.unverified = scrub_pass_unverified;
+        scrub_stats->report.last_pass_end = time(NULL);
+        pthread_mutex_unlock(&scrub_stats->lock);
+
+        sleep(SCRUB_PAUSE_SECS);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Maps the shared scrubber statistics and starts the scrubber
+ * @return 0 on success, -1 on failure
+ *
+ * Must run before the accept loop: the statistics mapping has to exist
+ * before any session process is forked.
+ */
+int init_scrubber(void) {
+    int created;
+    scrub_stats = map_shared_region(REGION_SCRUB, "S1 scrubber stats", sizeof(ScrubStats), 0, &created);
+    if (scrub_stats == MAP_FAILED) {
+        perror("scrubber stats mmap");
+        scrub_stats = NULL;
+        return -1;
+    }
+
+    // Statistics handed over by the previous S1 carry on from its passes
+    if (created) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&scrub_stats->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    pthread_t scrubber;
+    if (pthread_create(&scrubber, NULL, scrub_thread, NULL) != 0) {
+        perror("scrubber thread");
+        return -1;
+    }
+    pthread_detach(scrubber);
+    return 0;
+}
+
+/**
+ * @brief One entry of a version listing
+ */
+typedef struct {
+    long version;               /**< Generation number (1 = first upload) */
+    long size;                  /**< Size in bytes */
+    long mtime;                 /**< Time this version was written */
+    long current;               /**< 1 for the live file, 0 for a prior version */
+} VersionInfo;
+
+/**
+ * @brief Reads the generation number of a stored file
+ * @param path Stored file
+ * @return Its generation (1 for files stored before versioning), 0 if it does not exist
+ */
+long file_generation(const char *path) {
+    long gen;
+    if (getxattr(path, GEN_XATTR, &gen, sizeof(gen)) == sizeof(gen)) return gen;
+    return access(path, F_OK) == 0 ? 1 : 0;
+}
+
+/**
+ * @brief Builds the path of a prior version: $HOME/VERSIONS_DIR/<rel_path>/<gen>
+ */
+void version_path(char *out, size_t len, const char *rel_path, long gen) {
+    snprintf(out, len, "%s/%s%s/%ld", getenv("HOME"), VERSIONS_DIR, rel_path, gen);
+}
+
+/**
+ * @brief Highest generation already used at a path (kept versions and removed copies)
+ * @param rel_path Path below the server root ("/dir/file")
+ * @return That generation, 0 if the path has no history
+ *
+ * A file stored after a removal continues from here, so its versions
+ * never collide with those kept from the removed file.
+ */
+long last_generation(const char *rel_path) {
+    const char *dirs[] = {VERSIONS_DIR, TRASH_DIR};
+    long last = 0;
+    for (int d = 0; d < 2; d++) {
+        char dir_path[MAX_PATH_LEN];
+        snprintf(dir_path, sizeof(dir_path), "%s/%s%s", getenv("HOME"), dirs[d], rel_path);
+        DIR *dir = opendir(dir_path);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') continue;
+            long gen = strtol(entry->d_name, NULL, 10);
+            if (d > 0) {
+                // Removed copies are named by deletion time; they carry their generation
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+                gen = file_generation(path);
+            }
+            if (gen > last) last = gen;
+        }
+        if (dir) closedir(dir);
+    }
+    return last;
+}
+
+/**
+ * @brief Keeps the file about to be overwritten as a prior version
+ * @param fullpath Stored file that is being replaced
+ * @param rel_path Its path below the server root ("/dir/file")
+ * @return Generation number for the replacing file, -1 if the old
+ *         contents could not be kept
+ *
+ * The old contents are cloned with FICLONE where the filesystem supports
+ * reflinks, so the version shares blocks with nothing copied. Otherwise
+ * the old inode itself is hardlinked: uploads always replace files by
+ * rename, so once unlinked from the store it is an immutable blob.
+ */
+long preserve_version(const char *fullpath, const char *rel_path) {
+    long gen = file_generation(fullpath);
+    if (gen == 0) return last_generation(rel_path) + 1;
+
+    char vpath[MAX_PATH_LEN];
+    version_path(vpath, sizeof(vpath), rel_path, gen);
+    char vdir[MAX_PATH_LEN], mkdir_cmd[MAX_PATH_LEN + 16];
+    strcpy(vdir, vpath);
+    snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(vdir));
+    system(mkdir_cmd);
+
+    int src = open(fullpath, O_RDONLY);
+    int dst = src >= 0 ? open(vpath, O_WRONLY | O_CREAT | O_EXCL, 0444) : -1;
+    if (dst < 0 && src >= 0 && errno == EEXIST) {
+        // Number taken by the history of a removed file: keep this one after it
+        gen = last_generation(rel_path) + 1;
+        version_path(vpath, sizeof(vpath), rel_path, gen);
+        dst = open(vpath, O_WRONLY | O_CREAT | O_EXCL, 0444);
+    }
+    if (dst < 0) {
+        perror("Failed to keep previous version");
+        if (src >= 0) close(src);
+        return -1;
+    }
+
+    int cloned = ioctl(dst, FICLONE, src) == 0;
+    if (cloned) {
+        // A clone is a new inode: carry over mtime, hash and generation
+        struct stat st;
+        HashRecord rec;
+        if (fgetxattr(src, HASH_XATTR, &rec, sizeof(rec)) == sizeof(rec))
+            fsetxattr(dst, HASH_XATTR, &rec, sizeof(rec), 0);
+        fsetxattr(dst, GEN_XATTR, &gen, sizeof(gen), 0);
+        if (fstat(src, &st) == 0) {
+            struct timespec times[2] = {st.st_atim, st.st_mtim};
+            futimens(dst, times);
+        }
+    }
+    close(dst);
+    close(src);
+
+    if (!cloned) {
+        unlink(vpath);
+        if (link(fullpath, vpath) < 0) {
+            perror("Failed to keep previous version");
+            return -1;
+        }
+        chmod(vpath, 0444);
+    }
+    printf("Version %ld of %s kept (%s)\n", gen, rel_path, cloned ? "reflink" : "hardlink");
+    return gen + 1;
+}
+
+/**
+ * @brief Resolves which file serves a given version
+ * @param local_path Live file
+ * @param rel_path Its path below the server root
+ * @param version Requested generation, 0 for the live file
+ * @param out Receives the file to read
+ */
+void resolve_version(const char *local_path, const char *rel_path, long version, char *out, size_t len) {
+    if (version <= 0 || version == file_generation(local_path))
+        snprintf(out, len, "%s", local_path);
+    else
+        version_path(out, len, rel_path, version);
+}
+
+int compare_versions(const void *a, const void *b) {
+    long va = ((const VersionInfo *)a)->version, vb = ((const VersionInfo *)b)->version;
+    return (va < vb) - (va > vb);   // Newest first
+}
+
+/**
+ * @brief Lists the live file and its prior versions, newest first
+ * @param local_path Live file
+ * @param rel_path Its path below the server root
+ * @param out Receives up to VERSION_LIST_MAX entries
+ * @return Number of entries (0 if the file never existed)
+ */
+int list_versions(const char *local_path, const char *rel_path, VersionInfo *out) {
+    int count = 0;
+    struct stat st;
+    if (stat(local_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        out[count++] = (VersionInfo){file_generation(local_path), st.st_size, st.st_mtime, 1};
+    }
+
+    char vdir[MAX_PATH_LEN];
+    snprintf(vdir, sizeof(vdir), "%s/%s%s", getenv("HOME"), VERSIONS_DIR, rel_path);
+    DIR *dir = opendir(vdir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) && count < VERSION_LIST_MAX) {
+        char *end;
+        long gen = strtol(entry->d_name, &end, 10);
+        char vpath[MAX_PATH_LEN];
+        if (snprintf(vpath, sizeof(vpath), "%s/%s", vdir, entry->d_name) >= (int)sizeof(vpath)) continue;
+        if (*end || gen <= 0 || stat(vpath, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        out[count++] = (VersionInfo){gen, st.st_size, st.st_mtime, 0};
+    }
+    if (dir) closedir(dir);
+
+    qsort(out, count, sizeof(VersionInfo), compare_versions);
+    return count;
+}
+
+/**
+ * @brief Applies the retention policy below one versions directory
+ * @param path Directory under $HOME/VERSIONS_DIR
+ *
+ * Regular files with numeric names are the versions of one stored file:
+ * only the newest VERSION_KEEP are kept, and none superseded more than
+ * VERSION_MAX_DAYS ago (the version's ctime is when it was preserved).
+ * Subdirectories are pruned recursively and removed once empty.
+ */
+void prune_versions(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct { long gen; time_t preserved; } found[VERSION_LIST_MAX];
+    int count = 0;
+    time_t cutoff = time(NULL) - (time_t)VERSION_MAX_DAYS * 24 * 3600;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (lstat(child, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            prune_versions(child);
+            rmdir(child);   // Only succeeds once empty
+            continue;
+        }
+
+        char *end;
+        long gen = strtol(entry->d_name, &end, 10);
+        if (*end || gen <= 0 || !S_ISREG(st.st_mode)) continue;
+        if (st.st_ctime < cutoff || count == VERSION_LIST_MAX) {
+            unlink(child);
+            continue;
+        }
+        found[count].gen = gen;
+        found[count].preserved = st.st_ctime;
+        count++;
+    }
+    closedir(dir);
+
+    // Drop everything but the newest VERSION_KEEP
+    while (count > VERSION_KEEP) {
+        int oldest = 0;
+        for (int i = 1; i < count; i++)
+            if (found[i].gen < found[oldest].gen) oldest = i;
+        char victim[MAX_PATH_LEN];
+        snprintf(victim, sizeof(victim), "%s/%ld", path, found[oldest].gen);
+        unlink(victim);
+        found[oldest] = found[--count];
+    }
+}
+
+/**
+ * @brief Background pruner enforcing the version retention policy
+ *
+ * Runs a pass every VERSION_PRUNE_SECS at the lowest CPU priority.
+ */
+void *prune_thread(void *arg) {
+    (void)arg;
+
+    // Signals are handled by the main thread; nice applies per thread on Linux
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    char root[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), VERSIONS_DIR);
+    while (1) {
+        prune_versions(root);
+        sleep(VERSION_PRUNE_SECS);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Moves a removed file into the trash instead of deleting it
+ * @param local_path Stored file
+ * @param rel_path Its path below the server root ("/dir/file")
+ * @return 0 on success, -1 with errno set on failure
+ *
+ * A rename to $HOME/TRASH_DIR/<rel_path>/<deletion time>, so removal costs
+ * the same whatever the file size; the reaper thread frees the space
+ * later. Anything that is not a regular file is removed directly, and so
+ * is a file whose trash would be on another filesystem.
+ */
+int move_to_trash(const char *local_path, const char *rel_path) {
+    struct stat st;
+    if (lstat(local_path, &st) < 0) return -1;
+    if (!S_ISREG(st.st_mode)) return remove(local_path);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char tpath[MAX_PATH_LEN], tdir[MAX_PATH_LEN], mkdir_cmd[MAX_PATH_LEN + 16];
+    snprintf(tpath, sizeof(tpath), "%s/%s%s/%ld.%09ld", getenv("HOME"), TRASH_DIR, rel_path,
+             (long)now.tv_sec, now.tv_nsec);
+    strcpy(tdir, tpath);
+    snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(tdir));
+    system(mkdir_cmd);
+
+    if (rename(local_path, tpath) == 0) return 0;
+    return errno == EXDEV ? remove(local_path) : -1;
+}
+
+/**
+ * @brief Restores the most recently removed copy of a file
+ * @param local_path Where the file lived
+ * @param rel_path Its path below the server root
+ * @param size Receives the restored file's size
+ * @return 0 on success, -1 with errno ENOENT (nothing in the trash) or
+ *         EEXIST (a live file is in the way)
+ */
+int restore_from_trash(const char *local_path, const char *rel_path, long *size) {
+    char tdir[MAX_PATH_LEN];
+    snprintf(tdir, sizeof(tdir), "%s/%s%s", getenv("HOME"), TRASH_DIR, rel_path);
+
+    // Entry names are "<seconds>.<nanoseconds>": the newest sorts last
+    char newest[NAME_MAX + 1] = "";
+    DIR *dir = opendir(tdir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        size_t len = strlen(entry->d_name), best = strlen(newest);
+        if (len > best || (len == best && strcmp(entry->d_name, newest) > 0))
+            strcpy(newest, entry->d_name);
+    }
+    if (dir) closedir(dir);
+    if (!newest[0]) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (access(local_path, F_OK) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    char tpath[MAX_PATH_LEN], ldir[MAX_PATH_LEN], mkdir_cmd[MAX_PATH_LEN + 16];
+    if (snprintf(tpath, sizeof(tpath), "%s/%s", tdir, newest) >= (int)sizeof(tpath)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(ldir, local_path);
+    if (snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(ldir)) >= (int)sizeof(mkdir_cmd)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    system(mkdir_cmd);
+
+    struct stat st;
+    if (stat(tpath, &st) < 0 || rename(tpath, local_path) < 0) return -1;
+    rmdir(tdir);    // Only succeeds once empty
+    *size = st.st_size;
+    return 0;
+}
+
+// Files purged by the reaper since its last pause
+static int reap_batch;
+
+/**
+ * @brief Purges trash entries older than the retention window
+ * @param path Directory under $HOME/TRASH_DIR
+ * @param cutoff Entries removed before this time are purged
+ *
+ * Pauses after every TRASH_PURGE_BATCH unlinks so that purging a large
+ * trash does not monopolise the disk.
+ */
+void reap_trash(const char *path, time_t cutoff) {
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (lstat(child, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            reap_trash(child, cutoff);
+            rmdir(child);   // Only succeeds once empty
+            continue;
+        }
+        if (strtol(entry->d_name, NULL, 10) >= cutoff) continue;
+
+        unlink(child);
+        if (++reap_batch >= TRASH_PURGE_BATCH) {
+            reap_batch = 0;
+            sleep(1);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Background reaper emptying the trash after TRASH_RETENTION_HOURS
+ *
+ * Runs a pass every TRASH_REAP_SECS at the lowest CPU priority.
+ */
+void *reap_thread(void *arg) {
+    (void)arg;
+
+    // Signals are handled by the main thread; nice applies per thread on Linux
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    char root[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), TRASH_DIR);
+    while (1) {
+        reap_trash(root, time(NULL) - (time_t)TRASH_RETENTION_HOURS * 3600);
+        sleep(TRASH_REAP_SECS);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sends an error status in the size-prefixed protocol
+ * @param sock Peer socket
+ * @param err_msg Message starting with 'E'
+ *
+ * Writes status -1, message length and message, which is how S1 and the
+ * client signal a request that will not proceed.
+ */
+void send_error_status(int sock, const char *err_msg) {
+    long error = -1;
+    int msg_len = strlen(err_msg);
+    send(sock, &error, sizeof(long), 0);
+    send(sock, &msg_len, sizeof(int), 0);
+    send(sock, err_msg, msg_len, 0);
+}
+
+/**
+ * @brief Streams exactly size bytes from one descriptor to another
+ * @param from Socket the data arrives on
+ * @param to File or socket descriptor the data is written to
+ * @param buffer Transfer buffer of TRANSFER_CHUNK bytes
+ * @param size Number of bytes to move
+ * @return Number of bytes moved (short on peer disconnect or write error)
+ *
+ * Moves the data in-kernel with splice() through a pipe; the pooled
+ * buffer is only touched when splice is unsupported for the descriptors.
+ * Memory use is one pooled buffer regardless of the file size.
+ */
+long relay_bytes(int from, int to, char *buffer, long size) {
+    long moved = 0;
+
+    // Zero-copy path: socket → pipe → socket/file
+    int pipefd[2];
+    if (pipe(pipefd) == 0) {
+        while (moved < size) {
+            long want = size - moved > TRANSFER_CHUNK ? TRANSFER_CHUNK : size - moved;
+            ssize_t in = splice(from, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in <= 0) break;
+
+            ssize_t out = 0;
+            while (out < in) {
+                ssize_t w = splice(pipefd[0], NULL, to, NULL, in - out, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (w <= 0) {
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                    return moved + out;
+                }
+                out += w;
+            }
+            moved += in;
+        }
+        int unsupported = moved == 0 && (errno == EINVAL || errno == ENOSYS);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (moved == size || !unsupported) return moved;
+    }
+
+    // Fallback: copy through the pooled buffer
+    while (moved < size) {
+        long want = size - moved > TRANSFER_CHUNK ? TRANSFER_CHUNK : size - moved;
+        ssize_t chunk = read(from, buffer, want);
+        if (chunk <= 0) break;
+
+        ssize_t written = 0;
+        while (written < chunk) {
+            ssize_t w = write(to, buffer + written, chunk - written);
+            if (w <= 0) return moved + written;
+            written += w;
+        }
+        moved += chunk;
+    }
+    return moved;
+}
+
+/**
+ * @brief Sends size bytes of an open file to a socket
+ * @param sock Destination socket
+ * @param fd Open file, positioned at the first byte to send
+ * @param size Number of bytes to send
+ * @return Number of bytes sent
+ *
+ * Uses sendfile() so file data never enters user space; a pooled buffer
+ * is taken only if sendfile stops early and the rest must be copied.
+ * With the pool exhausted a small stack buffer is used instead, since the
+ * receiver has already been told the size.
+ */
+long send_file_data(int sock, int fd, long size) {
+    long sent = 0;
+    while (sent < size) {
+        ssize_t n = sendfile(sock, fd, NULL, size - sent);
+        if (n <= 0) break;
+        sent += n;
+    }
+    if (sent == size) return sent;
+
+    // Fallback: copy the remainder through a pooled buffer
+    char small[BUFFER_SIZE * 4];
+    char *pooled = acquire_transfer_buffer();
+    char *buffer = pooled ? pooled : small;
+    long capacity = pooled ? TRANSFER_CHUNK : (long)sizeof(small);
+    while (sent < size) {
+        long want = size - sent > capacity ? capacity : size - sent;
+        ssize_t chunk = read(fd, buffer, want);
+        if (chunk <= 0) break;
+        ssize_t written = 0;
+        while (written < chunk) {
+            ssize_t w = write(sock, buffer + written, chunk - written);
+            if (w <= 0) break;
+            written += w;
+        }
+        sent += written;
+        if (written < chunk) break;
+    }
+    release_transfer_buffer(pooled);
+    return sent;
+}
+
+// Gateway mode (--gateway): .c files are kept by S5 instead of ~/S1, so
+// the process holds no files and any number of gateways can run side by side
+int listen_port = PORT_S1;
+int c_store_port = 0;                           // PORT_S5 in gateway mode, 0 while .c files are local
+char storage_host[INET_ADDRSTRLEN] = "127.0.0.1";   // Host running S2-S5 (--storage)
+
+unsigned char ticket_key[TICKET_KEY_LEN];       // Signs redirect tickets and storage preambles
+int ticket_key_loaded = 0;
+
+/**
+ * @brief Preamble opening every S1 connection to a storage server ('K')
+ */
+typedef struct {
+    long issued;                            /**< Epoch seconds when sent */
+    unsigned char nonce[TICKET_NONCE_LEN];  /**< Random, accepted once */
+} AuthHeader;
+
+/**
+ * @brief Proves to a storage server that a new connection comes from S1
+ * @param sock Connected socket, before the command is sent
+ * @return 0 on success, -1 on failure
+ *
+ * The storage ports are reachable by clients so that they can present
+ * redirect tickets, and only take other commands after this preamble.
+ *
+ * @details Sends 'K' + AuthHeader + HMAC-SHA256 of the header with the
+ * ticket key; no reply, the command follows. The preamble is held back
+ * (MSG_MORE) to leave in one segment with the command.
+ */
+int authenticate_to_storage(int sock) {
+    AuthHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));   // Padding is signed too
+    hdr.issued = time(NULL);
+    if (!ticket_key_loaded || getrandom(hdr.nonce, sizeof(hdr.nonce), 0) != sizeof(hdr.nonce))
+        return -1;
+
+    unsigned char msg[1 + sizeof(hdr) + TICKET_MAC_LEN];
+    msg[0] = 'K';
+    memcpy(msg + 1, &hdr, sizeof(hdr));
+    hmac_sha256(ticket_key, TICKET_KEY_LEN, &hdr, sizeof(hdr), msg + 1 + sizeof(hdr));
+    return send(sock, msg, sizeof(msg), MSG_NOSIGNAL | MSG_MORE) == (ssize_t)sizeof(msg) ? 0 : -1;
+}
+
+/**
+ * @brief Establishes connection to a target storage server
+ * @param target_port Port number of the target server
+ * @param client_sock The client socket descriptor to associate with logging
+ * @return Socket descriptor on success, -1 on failure
+ *
+ * Creates TCP socket and connects to specified storage server
+ * Logs connection errors to stderr
+ * Attempts connection to storage_host:[target_port]
+ * Used for all inter-server communications (S2/S3/S4/S5)
+ */
+int connect_to_target_server(int target_port, int client_sock) {
+    // Connect to target server
+    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("Socket creation failed");
+        send(client_sock, "EInternal server error", 22, 0);
+        return -1;
+    }
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));   // Initialize serv_addr to zero
+    serv_addr.sin_family = AF_INET;             // Set address family to IPv4
+    serv_addr.sin_port = htons(target_port);    // Set the target port, converting to network byte order
+
+    // Convert IP address from text to binary form and store in serv_addr
+    inet_pton(AF_INET, storage_host, &serv_addr.sin_addr);   
+
+    // Attempt to connect to the target storage server
+    if (connect(server_sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || authenticate_to_storage(server_sock) < 0) {
+        perror("Connection failed");
+        close(server_sock);
+        long status = -1;
+        send(client_sock, &status, sizeof(long), 0);
+        // Close the socket and notify the client about the failure
+        const char *msg = "EConnection is not reliable";
+        int msg_len = strlen(msg);
+        send(client_sock, &msg_len, sizeof(int), 0);
+        send(client_sock, msg, msg_len, 0);
+        return -1;
+    }
+
+    return server_sock;  // Success
+}
+
+/**
+ * @brief Opens an upload to a target server and sends the request header
+ * 
+ * @param ip Target server IP address (S2/S3/S4)
+ * @param port Target server port number
+ * @param filesize Size of file data in bytes
+ * @param expires Expiry time of a TTL upload, 0 for none
+ * @param relative_dest_path Destination path on server (relative)
+ * @return int Connected socket ready for file data, -1 on failure
+ * 
+ * @details Implements protocol:
+ * 'U' - Upload File
+ *   1. S1 → Storage: 'U' + path_len + path + file_size + expires
+ *   2. Storage → S1: status (1 send the data, -1 refused)
+ *   3. S1 → Storage: file_data
+ *   4. Storage → S1: status (1 stored, -1 failed)
+ *
+ * Returns only once the server has accepted the header, so the client is
+ * never told to stream into an upload that cannot be stored.
+ */
+int open_upload_to_server(const char *ip, int port, long filesize, long expires, const char *relative_dest_path) {
+    int sock;
+    struct sockaddr_in server;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = inet_addr(ip);
+
+    if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0 || authenticate_to_storage(sock) < 0) {
+        perror("Connection failed");
+        close(sock);
+        return -1;
+    }
+
+    printf("Server connected\n");
+
+    // Send upload command ('U'), path length, relative destination path,
+    // file size and expiry time to target server in one request
+    char request[1 + sizeof(int) + MAX_PATH_LEN + 2 * sizeof(long)];
+    int path_len = strlen(relative_dest_path);
+    if (path_len >= MAX_PATH_LEN) {
+        close(sock);
+        return -1;
+    }
+    request[0] = 'U';
+    memcpy(request + 1, &path_len, sizeof(int));
+    memcpy(request + 1 + sizeof(int), relative_dest_path, path_len);
+    memcpy(request + 1 + sizeof(int) + path_len, &filesize, sizeof(long));
+    memcpy(request + 1 + sizeof(int) + path_len + sizeof(long), &expires, sizeof(long));
+    long request_len = 1 + sizeof(int) + path_len + 2 * sizeof(long);
+    printf("Relative path is: %s\n", relative_dest_path);
+
+    // The server accepts the upload before any data is relayed
+    long accepted = -1;
+    if (send(sock, request, request_len, MSG_NOSIGNAL) != request_len ||
+        recv(sock, &accepted, sizeof(long), MSG_WAITALL) != sizeof(long) || accepted != 1) {
+        printf("Upload refused by server on port %d\n", port);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * @brief One entry of a statf reply (same layout as the storage servers' 'S' reply)
+ */
+typedef struct {
+    long exists;                /**< 1 if the file exists, -1 otherwise */
+    long size;                  /**< Size in bytes */
+    long mtime;                 /**< Modification time (seconds since the epoch) */
+    unsigned long long hash;    /**< Cached XXH64 of the contents, 0 if unknown */
+} StatReply;
+
+/**
+ * @brief Fetches metadata for a batch of paths from one storage server
+ * @param port Storage server port
+ * @param paths Client paths (~S1/...)
+ * @param batch Indexes into paths/replies handled by this server
+ * @param n Number of entries in batch
+ * @param replies Reply array filled at the batch indexes
+ * @return 0 on success, -1 if the server could not be reached or a path
+ *         is empty or MAX_PATH_LEN long
+ *
+ * @details Protocol 'S' - Stat (no file data is transferred):
+ *   1. S1 → Storage: 'S' + count + count x (path_len + path)
+ *   2. Storage → S1: count x StatReply, in request order
+ */
+int stat_on_server(int port, char **paths, const int *batch, int n, StatReply *replies) {
+    // Size the request from the paths: tenant paths are longer than what the client typed
+    if (n <= 0 || n > STAT_MAX_PATHS) return -1;
+    size_t total = 1 + sizeof(int);
+    for (int k = 0; k < n; k++) {
+        size_t path_len = strlen(paths[batch[k]]);
+        if (path_len == 0 || path_len >= MAX_PATH_LEN) return -1;
+        total += sizeof(int) + path_len;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    serv_addr.sin_addr.s_addr = inet_addr(storage_host);
+
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || authenticate_to_storage(sock) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    // Build the whole request so it leaves in one segment
+    char *request = malloc(total);
+    if (!request) {
+        close(sock);
+        return -1;
+    }
+    size_t off = 0;
+    request[off++] = 'S';
+    memcpy(request + off, &n, sizeof(int));
+    off += sizeof(int);
+    for (int k = 0; k < n; k++) {
+        int path_len = strlen(paths[batch[k]]);
+        memcpy(request + off, &path_len, sizeof(int));
+        off += sizeof(int);
+        memcpy(request + off, paths[batch[k]], path_len);
+        off += path_len;
+    }
+    ssize_t sent = send(sock, request, off, MSG_NOSIGNAL);
+    free(request);
+    if (sent != (ssize_t)off) {
+        close(sock);
+        return -1;
+    }
+
+    StatReply remote[STAT_MAX_PATHS];
+    long want = n * sizeof(StatReply);
+    if (recv(sock, remote, want, MSG_WAITALL) != want) {
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    for (int k = 0; k < n; k++)
+        replies[batch[k]] = remote[k];
+    return 0;
+}
+
+/**
+ * @brief Usage counters of one namespace (first path component under ~S1/)
+ */
+typedef struct {
+    int state;                      /**< USAGE_FREE, USAGE_CLAIMING or USAGE_READY */
+    char prefix[USAGE_PREFIX_LEN];  /**< Namespace name, "" for files directly under ~S1/ */
+    long bytes;                     /**< Bytes stored across all servers */
+    long files;                     /**< Files stored across all servers */
+    long limit_bytes;               /**< Byte quota, 0 = unlimited */
+    long limit_files;               /**< File quota, 0 = unlimited */
+    long seen_bytes[4];             /**< Bytes last known on S2, S3, S4, S5 */
+    long seen_files[4];             /**< Files last known on S2, S3, S4, S5 */
+} UsageEntry;
+
+enum { USAGE_FREE, USAGE_CLAIMING, USAGE_READY };
+
+#define USAGE_MAGIC 0x57325533      // "W2U3"
+
+/**
+ * @brief Open-addressed table of namespace usage, shared by all sessions
+ *
+ * Mapped MAP_SHARED from $HOME/USAGE_FILE, so every prcclient process
+ * updates the same counters and they survive restarts. Counters change
+ * with atomic operations only; a quota check is one hash probe and a
+ * compare-and-swap, no matter how many files a namespace holds.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int slot_count;
+    UsageEntry slots[USAGE_SLOTS];
+} UsageTable;
+
+UsageTable *usage_table = NULL;
+
+/**
+ * @brief Extracts the namespace of a server-relative path
+ * @param path Path below ~S1 (e.g. "/team/docs/a.c")
+ * @param prefix Receives the namespace (e.g. "team", ".tenants/acme"), "" for top-level files
+ */
+void usage_prefix(const char *path, char *prefix) {
+    while (*path == '/') path++;
+
+    // A tenant's whole root is one namespace (".tenants/<name>")
+    size_t skip = strncmp(path, TENANT_DIR "/", strlen(TENANT_DIR) + 1) == 0 ? strlen(TENANT_DIR) + 1 : 0;
+    const char *slash = strchr(path + skip, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    if (len >= USAGE_PREFIX_LEN) len = USAGE_PREFIX_LEN - 1;
+    memcpy(prefix, path, len);
+    prefix[len] = '\0';
+}
+
+/**
+ * @brief Finds or creates the usage entry of a namespace
+ * @param prefix Namespace name
+ * @return The entry, or NULL when the table is unavailable or full
+ */
+UsageEntry *usage_entry(const char *prefix) {
+    if (!usage_table) return NULL;
+
+    unsigned int h = 2166136261u;   // FNV-1a
+    for (const char *p = prefix; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+
+    for (int probe = 0; probe < USAGE_SLOTS; probe++) {
+        UsageEntry *e = &usage_table->slots[(h + probe) % USAGE_SLOTS];
+        int state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        if (state == USAGE_FREE) {
+            if (__atomic_compare_exchange_n(&e->state, &state, USAGE_CLAIMING, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                strcpy(e->prefix, prefix);
+                __atomic_store_n(&e->state, USAGE_READY, __ATOMIC_RELEASE);
+                return e;
+            }
+        }
+        // Another session is naming this slot; its name is visible once READY
+        while (state == USAGE_CLAIMING) {
+            sched_yield();
+            state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        }
+        if (strcmp(e->prefix, prefix) == 0) return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adjusts namespace counters unconditionally
+ * @param e Usage entry (may be NULL)
+ * @param bytes Byte delta
+ * @param files File count delta
+ */
+void usage_add(UsageEntry *e, long bytes, long files) {
+    if (!e) return;
+    __atomic_add_fetch(&e->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&e->files, files, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Records a change S1 made on a storage server
+ * @param e Usage entry (may be NULL)
+ * @param port Storage server port
+ * @param bytes Byte delta
+ * @param files File count delta
+ *
+ * Keeps the per-server figures in step with the totals, so the next
+ * reconciliation only picks up changes the server made on its own.
+ */
+void usage_seen(UsageEntry *e, int port, long bytes, long files) {
+    if (!e) return;
+    __atomic_add_fetch(&e->seen_bytes[port - PORT_S2], bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&e->seen_files[port - PORT_S2], files, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Charges an upload against its namespace quota
+ * @param e Usage entry (NULL means unaccounted, always allowed)
+ * @param bytes Byte delta the upload causes
+ * @param files File count delta the upload causes (0 or 1)
+ * @return 1 if charged, 0 if it would exceed a limit (nothing charged)
+ *
+ * The charge is taken before any data moves, so concurrent uploads into
+ * one namespace cannot overshoot the quota together. Failed uploads give
+ * it back with usage_add().
+ */
+int usage_charge(UsageEntry *e, long bytes, long files) {
+    if (!e) return 1;
+
+    long cur = __atomic_load_n(&e->bytes, __ATOMIC_RELAXED);
+    do {
+        long limit = __atomic_load_n(&e->limit_bytes, __ATOMIC_RELAXED);
+        if (bytes > 0 && limit > 0 && cur + bytes > limit) return 0;
+    } while (!__atomic_compare_exchange_n(&e->bytes, &cur, cur + bytes, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    cur = __atomic_load_n(&e->files, __ATOMIC_RELAXED);
+    do {
+        long limit = __atomic_load_n(&e->limit_files, __ATOMIC_RELAXED);
+        if (files > 0 && limit > 0 && cur + files > limit) {
+            __atomic_sub_fetch(&e->bytes, bytes, __ATOMIC_RELAXED);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&e->files, &cur, cur + files, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/**
+ * @brief Reconciles the table with the usage reported by a storage server
+ * @param port Storage server port
+ * @return 0 on success, -1 if the server could not be queried
+ *
+ * Each namespace's totals move by the difference between the reported
+ * figures and those last seen from this server, which picks up files the
+ * server deleted by itself (expired TTL uploads).
+ *
+ * @details Protocol 'Q' - Usage (no file data is transferred):
+ *   1. S1 → Storage: 'Q'
+ *   2. Storage → S1: status (1) + count + count x (prefix_len + prefix + bytes + files)
+ */
+int request_usage_from_server(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    serv_addr.sin_addr.s_addr = inet_addr(storage_host);
+
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || authenticate_to_storage(sock) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    char command = 'Q';
+    send(sock, &command, 1, 0);
+
+    long status;
+    int count;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long) || status != 1 ||
+        recv(sock, &count, sizeof(int), MSG_WAITALL) != sizeof(int)) {
+        close(sock);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int len;
+        char prefix[USAGE_PREFIX_LEN];
+        long counters[2];
+        if (recv(sock, &len, sizeof(int), MSG_WAITALL) != sizeof(int) || len < 0 || len >= USAGE_PREFIX_LEN ||
+            recv(sock, prefix, len, MSG_WAITALL) != len ||
+            recv(sock, counters, sizeof(counters), MSG_WAITALL) != sizeof(counters)) {
+            close(sock);
+            return -1;
+        }
+        prefix[len] = '\0';
+
+        UsageEntry *e = usage_entry(prefix);
+        if (!e) continue;
+        long seen_bytes = __atomic_exchange_n(&e->seen_bytes[port - PORT_S2], counters[0], __ATOMIC_RELAXED);
+        long seen_files = __atomic_exchange_n(&e->seen_files[port - PORT_S2], counters[1], __ATOMIC_RELAXED);
+        usage_add(e, counters[0] - seen_bytes, counters[1] - seen_files);
+    }
+
+    close(sock);
+    return 0;
+}
+
+// Length of "$HOME/S1" while the local tree is being counted
+static size_t usage_walk_root_len;
+
+/**
+ * @brief nftw() callback counting local .c files into the usage table
+ */
+static int usage_walk_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    const char *ext = strrchr(path, '.');
+    if (type == FTW_F && ext && strcmp(ext, ".c") == 0) {
+        char prefix[USAGE_PREFIX_LEN];
+        usage_prefix(path + usage_walk_root_len, prefix);
+        usage_add(usage_entry(prefix), st->st_size, 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Applies the limits from $HOME/QUOTA_FILE
+ *
+ * One namespace per line: "<namespace> <max_bytes>[K|M|G] [max_files]".
+ * Blank lines and lines starting with '#' are ignored; namespaces not
+ * listed are unlimited.
+ */
+void load_quota_config(void) {
+    char configured[USAGE_SLOTS] = {0};
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), QUOTA_FILE);
+    FILE *fp = fopen(path, "r");
+    char line[BUFFER_SIZE];
+    while (fp && fgets(line, sizeof(line), fp)) {
+        char name[USAGE_PREFIX_LEN], size_field[32];
+        long limit_files = 0;
+        if (line[0] == '#' || sscanf(line, "%63s %31s %ld", name, size_field, &limit_files) < 2)
+            continue;
+
+        char *unit;
+        long limit_bytes = strtol(size_field, &unit, 10);
+        if (*unit == 'K' || *unit == 'k') limit_bytes <<= 10;
+        else if (*unit == 'M' || *unit == 'm') limit_bytes <<= 20;
+        else if (*unit == 'G' || *unit == 'g') limit_bytes <<= 30;
+
+        UsageEntry *e = usage_entry(name);
+        if (!e) continue;
+        e->limit_bytes = limit_bytes;
+        e->limit_files = limit_files;
+        configured[e - usage_table->slots] = 1;
+        printf("Quota for ~S1/%s: %ld bytes, %ld files (0 = unlimited)\n", name, limit_bytes, limit_files);
+    }
+    if (fp) fclose(fp);
+
+    // Namespaces no longer listed become unlimited
+    for (int i = 0; i < USAGE_SLOTS; i++) {
+        if (!configured[i]) {
+            usage_table->slots[i].limit_bytes = 0;
+            usage_table->slots[i].limit_files = 0;
+        }
+    }
+}
+
+/**
+ * @brief Maps the namespace usage table; must run before the accept loop
+ * @return 0 on success, -1 on failure
+ *
+ * On first start (or if the file is not a valid table) the counters are
+ * built once by walking ~/S1 and asking each storage server for its own
+ * usage ('Q'); a gateway asks S5 instead of walking ~/S1. From then on
+ * they are maintained incrementally by uploads and removals.
+ */
+int init_usage_table(void) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), USAGE_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("usage table open");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(UsageTable)) < 0) {
+        perror("usage table resize");
+        close(fd);
+        return -1;
+    }
+    usage_table = mmap(NULL, sizeof(UsageTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (usage_table == MAP_FAILED) {
+        perror("usage table mmap");
+        usage_table = NULL;
+        return -1;
+    }
+
+    if (usage_table->magic != USAGE_MAGIC || usage_table->slot_count != USAGE_SLOTS) {
+        printf("Building namespace usage table...\n");
+        memset(usage_table, 0, sizeof(UsageTable));
+
+        if (!c_store_port) {
+            char root[MAX_PATH_LEN];
+            snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+            usage_walk_root_len = strlen(root);
+            nftw(root, usage_walk_file, 16, FTW_PHYS);
+        }
+
+        int ports[] = {PORT_S2, PORT_S3, PORT_S4, c_store_port};
+        for (int i = 0; i < 4; i++)
+            if (ports[i] && request_usage_from_server(ports[i]) < 0)
+                printf("Storage server on port %d unreachable, its usage is not counted\n", ports[i]);
+
+        usage_table->slot_count = USAGE_SLOTS;
+        usage_table->magic = USAGE_MAGIC;
+    }
+
+    load_quota_config();
+    return 0;
+}
+
+/**
+ * @brief One change to a stored file
+ */
+typedef struct {
+    long seq;                   /**< Sequence number, 0 while being written */
+    long time;                  /**< When the change happened */
+    char type;                  /**< 'A' added, 'M' modified, 'D' deleted */
+    char path[MAX_PATH_LEN];    /**< Path below ~S1 (e.g. "/docs/a.pdf") */
+} ChangeEvent;
+
+#define EVENT_MAGIC 0x57324531      // "W2E1"
+
+/**
+ * @brief Ring of the last EVENT_SLOTS changes, read by watchers
+ *
+ * Mapped MAP_SHARED from $HOME/EVENT_FILE so sequence numbers survive
+ * restarts and a watcher can resume where it left off. Every session process appends to
+ * the same ring. Event
+ * seq lives in slot seq % EVENT_SLOTS; a slot whose seq has moved past
+ * the one asked for was overwritten.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int slot_count;
+    long next_seq;              /**< Sequence number of the next event (first is 1) */
+    ChangeEvent slots[EVENT_SLOTS];
+} EventLog;
+
+EventLog *event_log = NULL;
+
+/**
+ * @brief Maps the change event ring
+ * @return 0 on success, -1 on failure
+ */
+int init_event_log(void) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), EVENT_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(EventLog)) < 0) {
+        perror("event log open");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    event_log = mmap(NULL, sizeof(EventLog), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (event_log == MAP_FAILED) {
+        perror("event log mmap");
+        event_log = NULL;
+        return -1;
+    }
+    if (event_log->magic != EVENT_MAGIC || event_log->slot_count != EVENT_SLOTS) {
+        memset(event_log, 0, sizeof(EventLog));
+        event_log->next_seq = 1;
+        event_log->slot_count = EVENT_SLOTS;
+        event_log->magic = EVENT_MAGIC;
+    }
+    return 0;
+}
+
+/**
+ * @brief Records a change for watchers
+ * @param type 'A' added, 'M' modified, 'D' deleted
+ * @param path Path below ~S1
+ */
+void log_event(char type, const char *path) {
+    if (!event_log) return;
+    long seq = __atomic_fetch_add(&event_log->next_seq, 1, __ATOMIC_ACQ_REL);
+    ChangeEvent *ev = &event_log->slots[seq % EVENT_SLOTS];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->time = time(NULL);
+    ev->type = type;
+
+    // Store the path with repeated slashes collapsed ("/docs//a.c")
+    size_t len = 0;
+    for (const char *p = path; *p && len < sizeof(ev->path) - 1; p++)
+        if (*p != '/' || len == 0 || ev->path[len - 1] != '/')
+            ev->path[len++] = *p;
+    ev->path[len] = '\0';
+    __atomic_store_n(&ev->seq, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Reads one event from the ring
+ * @param seq Sequence number wanted
+ * @param out Receives the event
+ * @return 1 if copied, 0 if not written yet, -1 if already overwritten
+ */
+int read_event(long seq, ChangeEvent *out) {
+    if (!event_log || seq >= __atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE)) return 0;
+    if (__atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE) - seq > EVENT_SLOTS) return -1;
+
+    ChangeEvent *ev = &event_log->slots[seq % EVENT_SLOTS];
+    long found = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+    if (found > seq) return -1;
+    if (found < seq) return 0;
+    memcpy(out, ev, sizeof(ChangeEvent));
+
+    // A writer may have reused the slot while it was being copied
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    found = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+    return found == seq ? 1 : -1;
+}
+
+/**
+ * @brief Oldest sequence number still held by the ring
+ */
+long oldest_event(void) {
+    long next = __atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE);
+    return next > EVENT_SLOTS ? next - EVENT_SLOTS + 1 : 1;
+}
+
+/**
+ * @brief Tells whether a path lies inside a watched one
+ * @param path Path below ~S1
+ * @param watched Watched path below ~S1, "" for everything
+ */
+int path_is_watched(const char *path, const char *watched) {
+    size_t len = strlen(watched);
+    while (len > 0 && watched[len - 1] == '/') len--;
+    return strncmp(path, watched, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * @brief Reads the tenants and reserves their transfer buffers; must run before the accept loop
+ * @return 0 on success, -1 on failure
+ *
+ * Each line of $HOME/TENANTS_FILE is "name secret [sessions] [buffers]"
+ * ('#' starts a comment line). Without the file every session works in
+ * the default namespace, as before.
+ *
+ * After a hot restart the table of the previous S1 is kept as it is, so
+ * the draining sessions still count against their tenants' limits; the
+ * file is read again on the next cold start.
+ */
+int init_tenants(void) {
+    // The reservations were taken from the pool the table came with
+    if (!transfer_pool_inherited && region_fd[REGION_TENANTS] >= 0) {
+        close(region_fd[REGION_TENANTS]);
+        region_fd[REGION_TENANTS] = -1;
+    }
+    int created;
+    tenant_table = map_shared_region(REGION_TENANTS, "S1 tenant table", sizeof(TenantTable), 0, &created);
+    if (tenant_table == MAP_FAILED) {
+        perror("mmap tenant table");
+        tenant_table = NULL;
+        return -1;
+    }
+    if (!created) {
+        printf("Tenants: %d shared with the previous S1\n", tenant_table->count);
+        return 0;
+    }
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), TENANTS_FILE);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && (st.st_mode & 077))
+        printf("Warning: %s can be read by other users\n", path);
+
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), fp) && tenant_table->count < TENANT_MAX) {
+        char name[TENANT_NAME_LEN], secret[TENANT_SECRET_LEN];
+        int sessions = TENANT_DEFAULT_SESSIONS, buffers = TENANT_DEFAULT_BUFFERS;
+        if (line[0] == '#' || sscanf(line, "%31s %127s %d %d", name, secret, &sessions, &buffers) < 2)
+            continue;
+
+        int valid = 1;
+        for (const char *c = name; *c; c++)
+            if (!isalnum((unsigned char)*c) && *c != '-' && *c != '_') valid = 0;
+        for (int i = 0; i < tenant_table->count; i++)
+            if (strcmp(tenant_table->tenants[i].name, name) == 0) valid = 0;
+        if (!valid) {
+            printf("Skipping tenant %s: invalid or duplicate name\n", name);
+            continue;
+        }
+        if (sessions < 1) sessions = 1;
+        if (sessions > TENANT_MAX_SESSIONS) sessions = TENANT_MAX_SESSIONS;
+
+        // Take the reservation out of the common pool for good
+        int reserved = 0;
+        while (reserved < buffers && sem_trywait(&transfer_pool->free_slots) == 0) reserved++;
+        if (reserved < buffers)
+            printf("Tenant %s: only %d of %d transfer buffers left to reserve\n", name, reserved, buffers);
+
+        Tenant *t = &tenant_table->tenants[tenant_table->count];
+        strcpy(t->name, name);
+        strcpy(t->secret, secret);
+        t->max_sessions = sessions;
+        t->buffers = reserved;
+        if (sem_init(&t->free_buffers, 1, reserved) < 0) {
+            perror("sem_init tenant buffers");
+            fclose(fp);
+            return -1;
+        }
+        tenant_table->count++;
+        printf("Tenant %s: up to %d sessions, %d transfer buffers\n", name, sessions, reserved);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * @brief Counts the calling process as one session of a tenant
+ * @param tenant Tenant index
+ * @return 0 on success, -1 if the tenant is at its session limit
+ */
+int tenant_claim_session(int tenant) {
+    Tenant *t = &tenant_table->tenants[tenant];
+    pid_t self = getpid();
+    for (int i = 0; i < t->max_sessions; i++) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&t->sessions[i], &expected, self, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Ends the tenant session of an exited process
+ * @param pid Process id returned by waitpid()
+ *
+ * Async-signal-safe (only atomics), called from SIGCHLD.
+ */
+void reclaim_tenant_sessions(pid_t pid) {
+    if (!tenant_table) return;
+    for (int t = 0; t < tenant_table->count; t++)
+        for (int i = 0; i < TENANT_MAX_SESSIONS; i++) {
+            pid_t expected = pid;
+            __atomic_compare_exchange_n(&tenant_table->tenants[t].sessions[i], &expected, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        }
+}
+
+/**
+ * @brief Processes login requests: moves the session into a tenant
+ * @param client_sock The client socket descriptor
+ * @param name Tenant name
+ * @param secret Tenant secret
+ *
+ * From then on every ~S1 path of the session resolves below the
+ * tenant's storage root, and its transfers use the tenant's buffers.
+ *
+ * @details Replies status 1, or status -1 + msg_len + msg for unknown
+ * credentials, a tenant at its session limit or a second login.
+ */
+void handle_login_request(int client_sock, const char *name, const char *secret) {
+    if (session_tenant >= 0) {
+        send_error_status(client_sock, "EAlready logged in");
+        return;
+    }
+
+    int found = -1;
+    for (int i = 0; tenant_table && i < tenant_table->count; i++)
+        if (strcmp(tenant_table->tenants[i].name, name) == 0) found = i;
+
+    // Compare every byte, so the time taken says nothing about the secret
+    char given[TENANT_SECRET_LEN] = {0};
+    strncpy(given, secret, sizeof(given) - 1);
+    const char *expected = found >= 0 ? tenant_table->tenants[found].secret : given;
+    unsigned char diff = found < 0 || strlen(secret) >= sizeof(given);
+    for (size_t i = 0; i < sizeof(given); i++)
+        diff |= given[i] ^ expected[i];
+    if (diff) {
+        sleep(1);   // Slows down guessing
+        send_error_status(client_sock, "EUnknown tenant or wrong secret");
+        printf("Failed login as %s\n", name);
+        return;
+    }
+
+    if (tenant_claim_session(found) < 0) {
+        send_error_status(client_sock, "ETenant has reached its session limit");
+        printf("Tenant %s at its session limit\n", name);
+        return;
+    }
+    session_tenant = found;
+    snprintf(tenant_root, sizeof(tenant_root), "/%s/%s", TENANT_DIR, name);
+
+    long status = 1;
+    send(client_sock, &status, sizeof(long), 0);
+    printf("Session logged in as tenant %s\n", name);
+}
+
+/**
+ * @brief Tells whether the rest of a ~S1 path token may be mapped
+ * @param rest Token past "~S1"
+ * @param len Length of rest
+ * @return 1 if no component is "." or ".." and the first is not TENANT_DIR
+ */
+int tenant_path_ok(const char *rest, size_t len) {
+    size_t dir_len = strlen(TENANT_DIR);
+    int first = 1;
+    for (size_t i = 0; i < len; ) {
+        if (rest[i] == '/') {
+            i++;
+            continue;
+        }
+        size_t n = 0;
+        while (i + n < len && rest[i + n] != '/') n++;
+        if ((n == 1 && rest[i] == '.') || (n == 2 && rest[i] == '.' && rest[i + 1] == '.'))
+            return 0;
+        if (first && n == dir_len && strncmp(rest + i, TENANT_DIR, dir_len) == 0) return 0;
+        first = 0;
+        i += n;
+    }
+    return 1;
+}
+
+/**
+ * @brief Resolves the ~S1 paths of a command line in the session's namespace
+ * @param in Command line from the client
+ * @param out Receives the command line with every "~S1" path token
+ *            moved below tenant_root
+ * @param len Size of out
+ * @return 0 on success, -1 if a path is not allowed or the line gets too long
+ *
+ * TENANT_DIR is reserved: no session can reach a tenant's files by name,
+ * its own included, other than through its root. Path tokens may not
+ * contain "." or ".." components, and once tenants are enabled a token
+ * naming a path any other way than "~S1" or "~S1/..." (e.g. "XS1/...",
+ * which the storage servers would still resolve) is refused, as it
+ * would escape the mapping.
+ */
+int tenant_map_paths(const char *in, char *out, size_t len) {
+    size_t o = 0;
+    for (const char *p = in; *p; ) {
+        size_t tok_len = strcspn(p, " ");
+        if (strncmp(p, "~S1", 3) == 0 && (tok_len == 3 || p[3] == '/')) {
+            if (!tenant_path_ok(p + 3, tok_len - 3)) return -1;
+            int n = snprintf(out + o, len - o, "~S1%s", tenant_root);
+            if (n < 0 || (size_t)n >= len - o) return -1;
+            o += n;
+            p += 3;
+            tok_len -= 3;
+        } else if (tenant_table && tenant_table->count > 0 && memmem(p, tok_len, "S1/", 3)) {
+            return -1;
+        }
+
+        // The rest of the token and the spaces after it
+        size_t copy = tok_len + strspn(p + tok_len, " ");
+        if (o + copy >= len) return -1;
+        memcpy(out + o, p, copy);
+        o += copy;
+        p += copy;
+    }
+    out[o] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Tells whether a stored path belongs to the session's namespace
+ * @param path Path below ~S1
+ *
+ * Tenants see their own root; untenanted sessions see everything but
+ * the tenants' roots.
+ */
+int tenant_visible(const char *path) {
+    if (tenant_root[0]) return path_is_watched(path, tenant_root);
+    return !path_is_watched(path, "/" TENANT_DIR);
+}
+
+/**
+ * @brief Path as the session's client knows it
+ * @param path Path below ~S1 that is visible to the session
+ * @return The same path without the tenant's root
+ */
+const char *tenant_display(const char *path) {
+    return path + strlen(tenant_root);
+}
+
+/**
+ * @brief A stored file due to expire
+ */
+typedef struct {
+    long expires;               /**< Expiry time (seconds since the epoch) */
+    char *path;                 /**< Absolute path of the stored file */
+} ExpiryEntry;
+
+/**
+ * @brief Min-heap of pending expiries, earliest first
+ *
+ * Rebuilt at startup from the EXPIRES_XATTR of stored files, then fed by
+ * uploads that carry a TTL (reported by the session processes through
+ * the EXPIRY_JOURNAL file). Entries are only hints: the expirer
+ * re-reads the attribute before deleting, so a file overwritten without a
+ * TTL or removed in the meantime simply drops out.
+ */
+ExpiryEntry *expiry_heap = NULL;
+int expiry_count = 0, expiry_capacity = 0;
+pthread_mutex_t expiry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Adds a file to the expiry heap
+ * @param expires Expiry time
+ * @param path Absolute path of the stored file
+ */
+void expiry_push(long expires, const char *path) {
+    pthread_mutex_lock(&expiry_lock);
+    if (expiry_count == expiry_capacity) {
+        int capacity = expiry_capacity ? expiry_capacity * 2 : 256;
+        ExpiryEntry *grown = realloc(expiry_heap, capacity * sizeof(ExpiryEntry));
+        if (!grown) {
+            pthread_mutex_unlock(&expiry_lock);
+            return;
+        }
+        expiry_heap = grown;
+        expiry_capacity = capacity;
+    }
+
+    // Sift up from the new leaf
+    int i = expiry_count++;
+    while (i > 0 && expiry_heap[(i - 1) / 2].expires > expires) {
+        expiry_heap[i] = expiry_heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    expiry_heap[i] = (ExpiryEntry){expires, strdup(path)};
+    pthread_mutex_unlock(&expiry_lock);
+}
+
+/**
+ * @brief Removes the earliest entry if it is due
+ * @param now Current time
+ * @param out Receives the entry (caller frees out->path)
+ * @return 1 if an entry was due, 0 otherwise
+ */
+int expiry_pop_due(long now, ExpiryEntry *out) {
+    pthread_mutex_lock(&expiry_lock);
+    if (expiry_count == 0 || expiry_heap[0].expires > now) {
+        pthread_mutex_unlock(&expiry_lock);
+        return 0;
+    }
+    *out = expiry_heap[0];
+
+    // Sift the last leaf down from the root
+    ExpiryEntry last = expiry_heap[--expiry_count];
+    int i = 0;
+    while (2 * i + 1 < expiry_count) {
+        int child = 2 * i + 1;
+        if (child + 1 < expiry_count && expiry_heap[child + 1].expires < expiry_heap[child].expires)
+            child++;
+        if (expiry_heap[child].expires >= last.expires) break;
+        expiry_heap[i] = expiry_heap[child];
+        i = child;
+    }
+    if (expiry_count > 0) expiry_heap[i] = last;
+    pthread_mutex_unlock(&expiry_lock);
+    return 1;
+}
+
+/**
+ * @brief Records a TTL upload for the expirer (called by session processes)
+ * @param expires Expiry time
+ * @param path Absolute path of the stored file
+ *
+ * Sessions run in forked processes and cannot reach the expirer's heap,
+ * so they append "<expires> <path>" lines to $HOME/EXPIRY_JOURNAL. Each
+ * line is one O_APPEND write, so concurrent sessions never interleave.
+ */
+void expiry_journal_add(long expires, const char *path) {
+    char jpath[MAX_PATH_LEN], line[MAX_PATH_LEN + 32];
+    snprintf(jpath, sizeof(jpath), "%s/%s", getenv("HOME"), EXPIRY_JOURNAL);
+    int fd = open(jpath, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("expiry journal");
+        return;
+    }
+    int len = snprintf(line, sizeof(line), "%ld %s\n", expires, path);
+    if (write(fd, line, len) != len)
+        perror("expiry journal");
+    close(fd);
+}
+
+/**
+ * @brief Moves complete journal lines past *offset into the heap
+ */
+static void expiry_journal_read(const char *jpath, off_t *offset) {
+    FILE *fp = fopen(jpath, "r");
+    if (!fp) return;
+    fseeko(fp, *offset, SEEK_SET);
+
+    char line[MAX_PATH_LEN + 32], path[MAX_PATH_LEN];
+    long expires;
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+        if (line[len - 1] != '\n') break;   // Being written; read it next time
+        *offset += len;
+        if (sscanf(line, "%ld %1023[^\n]", &expires, path) == 2)
+            expiry_push(expires, path);
+    }
+    fclose(fp);
+}
+
+/**
+ * @brief Feeds new journal entries to the heap, rotating a large journal
+ *
+ * Sessions open the journal for every entry, so once it is renamed new
+ * entries go to a fresh file; the old one is read to the end a second
+ * later and removed.
+ */
+void expiry_journal_drain(void) {
+    static off_t offset = 0;
+    char jpath[MAX_PATH_LEN], old_path[MAX_PATH_LEN + 8];
+    snprintf(jpath, sizeof(jpath), "%s/%s", getenv("HOME"), EXPIRY_JOURNAL);
+    expiry_journal_read(jpath, &offset);
+
+    if (offset > EXPIRY_JOURNAL_MAX) {
+        snprintf(old_path, sizeof(old_path), "%s.old", jpath);
+        if (rename(jpath, old_path) == 0) {
+            sleep(1);
+            expiry_journal_read(old_path, &offset);
+            unlink(old_path);
+        }
+        offset = 0;
+    }
+}
+
+// Length of "$HOME/S1" for the expirer
+static size_t expiry_root_len;
+
+/**
+ * @brief nftw() callback adding stored files with an expiry to the heap
+ */
+static int expiry_scan_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    long expires;
+    const char *ext = strrchr(path, '.');
+    if (type == FTW_F && ext && strcmp(ext, ".c") == 0 &&
+        getxattr(path, EXPIRES_XATTR, &expires, sizeof(expires)) == sizeof(expires))
+        expiry_push(expires, path);
+    return 0;
+}
+
+/**
+ * @brief Deletes an expired file if it still carries the same expiry
+ * @param entry Heap entry (its path is freed)
+ */
+void expire_file(ExpiryEntry *entry) {
+    long expires;
+    struct stat st;
+    if (getxattr(entry->path, EXPIRES_XATTR, &expires, sizeof(expires)) == sizeof(expires) &&
+        expires == entry->expires && stat(entry->path, &st) == 0 && unlink(entry->path) == 0) {
+        char prefix[USAGE_PREFIX_LEN];
+        usage_prefix(entry->path + expiry_root_len, prefix);
+        usage_add(usage_entry(prefix), -st.st_size, -1);
+        log_event('D', entry->path + expiry_root_len);
+        printf("Expired %s\n", entry->path);
+    }
+    free(entry->path);
+}
+
+/**
+ * @brief Background expirer deleting files whose TTL has passed
+ *
+ * Scans the store once for files with an expiry, then every
+ * EXPIRY_TICK_SECS deletes at most EXPIRY_BATCH due files, at the lowest
+ * CPU priority.
+ */
+void *expire_thread(void *arg) {
+    (void)arg;
+
+    // Signals are handled by the main thread; nice applies per thread on Linux
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    // Entries journaled before this start are found by the scan below
+    char jpath[MAX_PATH_LEN];
+    snprintf(jpath, sizeof(jpath), "%s/%s", getenv("HOME"), EXPIRY_JOURNAL);
+    unlink(jpath);
+
+    char root[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+    expiry_root_len = strlen(root);
+    nftw(root, expiry_scan_file, 16, FTW_PHYS);
+
+    while (1) {
+        expiry_journal_drain();
+        ExpiryEntry entry;
+        for (int done = 0; done < EXPIRY_BATCH && expiry_pop_due(time(NULL), &entry); done++)
+            expire_file(&entry);
+        sleep(EXPIRY_TICK_SECS);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Background thread reconciling usage with the storage servers
+ *
+ * Every USAGE_RECONCILE_SECS asks S2-S4 (and S5 in gateway mode) for
+ * their usage, so files they expired on their own are taken off the
+ * namespace totals. Gateways sharing the storage servers also pick up
+ * each other's changes this way.
+ */
+void *reconcile_thread(void *arg) {
+    (void)arg;
+
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    int ports[] = {PORT_S2, PORT_S3, PORT_S4, c_store_port};
+    while (1) {
+        sleep(USAGE_RECONCILE_SECS);
+        for (int i = 0; i < 4; i++)
+            if (ports[i]) request_usage_from_server(ports[i]);
+    }
+    return NULL;
+}
+
+/**
+ * @brief One definition found in a stored .c file
+ */
+typedef struct SymbolDef {
+    char *name;
+    char kind;                      /**< 'f' function, 'p' prototype, 's' struct, 'u' union, 'e' enum, 't' typedef, 'm' macro */
+    int line;
+    struct SymbolFile *file;
+    struct SymbolDef *next_name;    /**< Next definition in the same hash bucket */
+    struct SymbolDef *next_file;    /**< Next definition of the same file */
+} SymbolDef;
+
+/**
+ * @brief An indexed .c file and its definitions
+ */
+typedef struct SymbolFile {
+    char *path;                     /**< Path below ~S1 (e.g. "/src/main.c") */
+    SymbolDef *defs;
+    struct SymbolFile *next;        /**< Next file in the same hash bucket */
+} SymbolFile;
+
+// Only the symbol thread touches the index, so it needs no lock
+static SymbolDef *symbol_names[SYMBOL_BUCKETS];
+static SymbolFile *symbol_files[SYMBOL_BUCKETS];
+static char symbol_root[MAX_PATH_LEN];
+static size_t symbol_root_len = 0;
+
+unsigned int symbol_hash(const char *s) {
+    unsigned int h = 2166136261u;   // FNV-1a
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h % SYMBOL_BUCKETS;
+}
+
+/**
+ * @brief Drops a file and its definitions from the symbol index
+ * @param path Path below ~S1
+ */
+void symbol_forget(const char *path) {
+    SymbolFile **fp = &symbol_files[symbol_hash(path)];
+    while (*fp && strcmp((*fp)->path, path) != 0) fp = &(*fp)->next;
+    SymbolFile *file = *fp;
+    if (!file) return;
+    *fp = file->next;
+
+    for (SymbolDef *def = file->defs, *next; def; def = next) {
+        next = def->next_file;
+        SymbolDef **dp = &symbol_names[symbol_hash(def->name)];
+        while (*dp != def) dp = &(*dp)->next_name;
+        *dp = def->next_name;
+        free(def->name);
+        free(def);
+    }
+    free(file->path);
+    free(file);
+}
+
+/**
+ * @brief Adds one definition of a file to the symbol index
+ */
+void symbol_add(SymbolFile *file, const char *name, char kind, int line) {
+    SymbolDef *def = malloc(sizeof(SymbolDef));
+    if (!def || !(def->name = strdup(name))) {
+        free(def);
+        return;
+    }
+    def->kind = kind;
+    def->line = line;
+    def->file = file;
+    unsigned int h = symbol_hash(name);
+    def->next_name = symbol_names[h];
+    symbol_names[h] = def;
+    def->next_file = file->defs;
+    file->defs = def;
+}
+
+/**
+ * @brief Tells whether a word is a C keyword (never a symbol name)
+ */
+int symbol_is_keyword(const char *word) {
+    static const char *keywords[] = {
+        "auto", "break", "case", "char", "const", "continue", "default", "do", "double",
+        "else", "enum", "extern", "float", "for", "goto", "if", "inline", "int", "long",
+        "register", "restrict", "return", "short", "signed", "sizeof", "static", "struct",
+        "switch", "typedef", "union", "unsigned", "void", "volatile", "while", "_Bool",
+        "_Atomic", "_Noreturn", "_Static_assert", "_Alignas", "_Alignof", "_Thread_local",
+        "__attribute__", "__extension__", "__inline__", "__restrict", "__asm__", "asm", NULL
+    };
+    for (int i = 0; keywords[i]; i++)
+        if (strcmp(word, keywords[i]) == 0) return 1;
+    return 0;
+}
+
+/**
+ * @brief Extracts the top-level definitions of a C source
+ * @param file Receives the definitions
+ * @param src Source text
+ * @param len Length of src
+ *
+ * A tokenizer, not a parser: comments, string and character literals are
+ * skipped and only declarations outside any braces are looked at.
+ * Reports function definitions (name and parameter list followed by a
+ * body), prototypes, named struct/union/enum definitions, typedef names
+ * (function pointer typedefs included) and #define'd macros.
+ */
+void symbol_parse(SymbolFile *file, const char *src, size_t len) {
+    int line = 1, depth = 0, parens = 0, line_start = 1;
+    char prev = 0;          // Last token: 'i' identifier, 'k' keyword, 'v' literal, else the punctuator
+    char body = 0;          // Block being skipped at depth 1: 'f' function body, 'a' anything else
+
+    // The top-level declaration being read (idents counts its words outside parentheses)
+    int is_typedef = 0, has_assign = 0, group = 0, idents = 0;
+    char tag = 0, tag_ready = 0;
+    char tag_name[SYMBOL_MAX_NAME], call[SYMBOL_MAX_NAME], last[SYMBOL_MAX_NAME], fnptr[SYMBOL_MAX_NAME];
+    int tag_line = 0, call_line = 0, call_idents = 0, last_line = 0, fnptr_line = 0;
+    tag_name[0] = call[0] = last[0] = fnptr[0] = '\0';
+
+    size_t i = 0;
+    while (i < len) {
+        char c = src[i];
+        if (c == '\n') {
+            line++;
+            line_start = 1;
+            i++;
+            continue;
+        }
+        if (isspace((unsigned char)c)) {
+            i++;
+            continue;
+        }
+        if (c == '/' && i + 1 < len && src[i + 1] == '/') {
+            while (i < len && src[i] != '\n') i++;
+            continue;
+        }
+        if (c == '/' && i + 1 < len && src[i + 1] == '*') {
+            for (i += 2; i < len && !(src[i] == '*' && i + 1 < len && src[i + 1] == '/'); i++)
+                if (src[i] == '\n') line++;
+            i += 2;
+            continue;
+        }
+
+        // Preprocessor line (with its continuations); only #define names are kept
+        if (c == '#' && line_start) {
+            for (i++; i < len && (src[i] == ' ' || src[i] == '\t'); i++);
+            if (len - i > 6 && strncmp(src + i, "define", 6) == 0 && (src[i + 6] == ' ' || src[i + 6] == '\t')) {
+                for (i += 6; i < len && (src[i] == ' ' || src[i] == '\t'); i++);
+                size_t start = i;
+                while (i < len && (isalnum((unsigned char)src[i]) || src[i] == '_')) i++;
+                if (i > start && i - start < SYMBOL_MAX_NAME) {
+                    char name[SYMBOL_MAX_NAME];
+                    memcpy(name, src + start, i - start);
+                    name[i - start] = '\0';
+                    symbol_add(file, name, 'm', line);
+                }
+            }
+            for (; i < len && src[i] != '\n'; i++)
+                if (src[i] == '\\' && i + 1 < len && src[i + 1] == '\n') {
+                    line++;
+                    i++;
+                }
+            continue;
+        }
+        line_start = 0;
+
+        if (c == '"' || c == '\'') {
+            for (i++; i < len && src[i] != c && src[i] != '\n'; i++)
+                if (src[i] == '\\' && i + 1 < len) {
+                    if (src[i + 1] == '\n') line++;
+                    i++;
+                }
+            if (i < len && src[i] == c) i++;
+            prev = 'v';
+            continue;
+        }
+        if (isdigit((unsigned char)c)) {
+            while (i < len && (isalnum((unsigned char)src[i]) || src[i] == '_' || src[i] == '.')) i++;
+            prev = 'v';
+            continue;
+        }
+
+        if (isalpha((unsigned char)c) || c == '_') {
+            size_t start = i;
+            while (i < len && (isalnum((unsigned char)src[i]) || src[i] == '_')) i++;
+            if (depth > 0) continue;
+            char word[SYMBOL_MAX_NAME];
+            if (i - start >= SYMBOL_MAX_NAME) {
+                prev = 'v';
+                tag_ready = 0;
+                continue;
+            }
+            memcpy(word, src + start, i - start);
+            word[i - start] = '\0';
+
+            if (symbol_is_keyword(word)) {
+                if (parens == 0 && strcmp(word, "typedef") == 0) is_typedef = 1;
+                if (parens == 0 && (strcmp(word, "struct") == 0 || strcmp(word, "union") == 0 ||
+                                    strcmp(word, "enum") == 0)) {
+                    tag = word[0];
+                    tag_name[0] = '\0';
+                }
+                if (parens == 0) idents++;
+                tag_ready = 0;
+                prev = 'k';
+                continue;
+            }
+
+            // Name right after struct/union/enum: a definition if '{' follows
+            tag_ready = tag && !tag_name[0] && prev == 'k' && parens == 0;
+            if (tag_ready) {
+                strcpy(tag_name, word);
+                tag_line = line;
+            }
+            if (parens == 0) {
+                strcpy(last, word);
+                last_line = line;
+                idents++;
+            } else if (parens == 1 && group && prev == '*' && !fnptr[0]) {
+                strcpy(fnptr, word);
+                fnptr_line = line;
+            }
+            prev = 'i';
+            continue;
+        }
+
+        // Punctuation
+        i++;
+        if (c == '{') {
+            if (depth++ == 0) {
+                if (tag_ready) {
+                    symbol_add(file, tag_name, tag, tag_line);
+                    body = 'a';
+                } else if (call[0] && !has_assign && !is_typedef && parens == 0 && prev == ')') {
+                    symbol_add(file, call, 'f', call_line);
+                    body = 'f';
+                } else {
+                    body = 'a';
+                }
+            }
+            tag = tag_ready = 0;
+            prev = c;
+            continue;
+        }
+        if (c == '}') {
+            if (depth > 0 && --depth == 0 && body == 'f') {
+                // A function body ends the declaration
+                is_typedef = has_assign = group = idents = 0;
+                tag = tag_ready = 0;
+                call[0] = last[0] = fnptr[0] = '\0';
+            }
+            prev = c;
+            continue;
+        }
+        if (depth > 0) continue;
+        tag_ready = 0;
+
+        if (c == '(') {
+            if (parens == 0 && !call[0] && !group && prev == 'i') {
+                strcpy(call, last);
+                call_line = last_line;
+                call_idents = idents;
+            }
+            parens++;
+        } else if (c == ')') {
+            if (parens > 0) parens--;
+        } else if (c == '*' && parens == 1 && prev == '(') {
+            // "(*name)" declares a pointer: the word before '(' was a type
+            group = 1;
+            call[0] = last[0] = '\0';
+        } else if (c == '=' && parens == 0) {
+            has_assign = 1;
+        } else if ((c == ',' || c == ';') && parens == 0) {
+            if (is_typedef) {
+                if (last[0])
+                    symbol_add(file, last, 't', last_line);
+                else if (fnptr[0])
+                    symbol_add(file, fnptr, 't', fnptr_line);
+            } else if (c == ';' && call[0] && !has_assign && call_idents > 1) {
+                // A return type before the name tells it from a macro call
+                symbol_add(file, call, 'p', call_line);
+            }
+            last[0] = fnptr[0] = '\0';
+            group = 0;
+            if (c == ';') {
+                is_typedef = has_assign = idents = 0;
+                tag = 0;
+                call[0] = '\0';
+            }
+        }
+        prev = c;
+    }
+}
+
+/**
+ * @brief Re-reads one stored .c file into the symbol index
+ * @param path Path below ~S1
+ *
+ * Drops whatever was indexed for the path first, so a deleted file just
+ * disappears from the index.
+ */
+void symbol_refresh(const char *path) {
+    symbol_forget(path);
+
+    const char *ext = strrchr(path, '.');
+    if (!ext || strcmp(ext, ".c") != 0) return;
+
+    char fullpath[MAX_PATH_LEN * 2];
+    snprintf(fullpath, sizeof(fullpath), "%s%s", symbol_root, path);
+    int fd = open(fullpath, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    char *src = NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > SYMBOL_MAX_FILE ||
+        !(src = malloc(st.st_size + 1))) {
+        close(fd);
+        return;
+    }
+    size_t got = 0;
+    ssize_t n;
+    while (got < (size_t)st.st_size && (n = read(fd, src + got, st.st_size - got)) > 0) got += n;
+    close(fd);
+
+    SymbolFile *file = calloc(1, sizeof(SymbolFile));
+    if (file && (file->path = strdup(path))) {
+        unsigned int h = symbol_hash(path);
+        file->next = symbol_files[h];
+        symbol_files[h] = file;
+        symbol_parse(file, src, got);
+    } else {
+        free(file);
+    }
+    free(src);
+}
+
+/**
+ * @brief nftw callback indexing every stored .c file
+ */
+int symbol_scan_file(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)sb;
+    (void)ftwbuf;
+    if (typeflag == FTW_F) symbol_refresh(fpath + symbol_root_len);
+    return 0;
+}
+
+/**
+ * @brief Empties the symbol index and indexes the whole store again
+ */
+void symbol_rebuild(void) {
+    for (int b = 0; b < SYMBOL_BUCKETS; b++)
+        while (symbol_files[b])
+            symbol_forget(symbol_files[b]->path);
+    nftw(symbol_root, symbol_scan_file, 16, FTW_PHYS);
+}
+
+/**
+ * @brief Orders symf results: definitions before prototypes, then by path and line
+ */
+int symbol_compare(const void *a, const void *b) {
+    const SymbolDef *x = *(SymbolDef *const *)a, *y = *(SymbolDef *const *)b;
+    int px = x->kind == 'p', py = y->kind == 'p';
+    if (px != py) return px - py;
+    int c = strcmp(x->file->path, y->file->path);
+    if (c != 0) return c;
+    return x->line - y->line;
+}
+
+/**
+ * @brief Answers one symf query from a session process
+ * @param fd Connection accepted on the symbol socket
+ *
+ * @details
+ *   1. Session → thread: name_len + name + scope_len + scope (path below
+ *      ~S1, "" for everything) + root_len + root (the session's tenant
+ *      root, "" for the default namespace); a name ending in '*' matches
+ *      as a prefix
+ *   2. Thread → session: status (1) + total (long) + count (int) + per
+ *      definition: kind (char) + line (int) + name_len + name + path_len +
+ *      path (~S1/..., below the root), at most SYMBOL_MAX_RESULTS,
+ *      definitions first
+ */
+void symbol_answer(int fd) {
+    char name[SYMBOL_MAX_NAME + 1], scope[MAX_PATH_LEN], root[MAX_PATH_LEN];
+    int name_len, scope_len, root_len;
+    if (recv(fd, &name_len, sizeof(int), MSG_WAITALL) != sizeof(int) || name_len <= 0 ||
+        name_len > SYMBOL_MAX_NAME || recv(fd, name, name_len, MSG_WAITALL) != name_len ||
+        recv(fd, &scope_len, sizeof(int), MSG_WAITALL) != sizeof(int) || scope_len < 0 ||
+        scope_len >= MAX_PATH_LEN || (scope_len > 0 && recv(fd, scope, scope_len, MSG_WAITALL) != scope_len) ||
+        recv(fd, &root_len, sizeof(int), MSG_WAITALL) != sizeof(int) || root_len < 0 ||
+        root_len >= MAX_PATH_LEN || (root_len > 0 && recv(fd, root, root_len, MSG_WAITALL) != root_len))
+        return;
+    name[name_len] = '\0';
+    scope[scope_len] = '\0';
+    root[root_len] = '\0';
+
+    size_t prefix = strlen(name);
+    int is_prefix = name[prefix - 1] == '*';
+    if (is_prefix) name[--prefix] = '\0';
+
+    // A prefix can live in any bucket; an exact name only in its own
+    SymbolDef **found = NULL;
+    long total = 0, cap = 0;
+    int first = is_prefix ? 0 : (int)symbol_hash(name);
+    int end = is_prefix ? SYMBOL_BUCKETS : first + 1;
+    for (int b = first; b < end; b++)
+        for (SymbolDef *def = symbol_names[b]; def; def = def->next_name) {
+            if (is_prefix ? strncmp(def->name, name, prefix) != 0 : strcmp(def->name, name) != 0) continue;
+            if (!path_is_watched(def->file->path, scope)) continue;
+            if (!root[0] && path_is_watched(def->file->path, "/" TENANT_DIR)) continue;
+            if (total == cap) {
+                SymbolDef **grown = realloc(found, (cap ? cap * 2 : 64) * sizeof(SymbolDef *));
+                if (!grown) break;
+                found = grown;
+                cap = cap ? cap * 2 : 64;
+            }
+            found[total++] = def;
+        }
+    if (total > 0) qsort(found, total, sizeof(SymbolDef *), symbol_compare);
+
+    long status = 1;
+    int count = total < SYMBOL_MAX_RESULTS ? total : SYMBOL_MAX_RESULTS;
+    send(fd, &status, sizeof(long), 0);
+    send(fd, &total, sizeof(long), 0);
+    send(fd, &count, sizeof(int), 0);
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH_LEN + 4];
+        int len = strlen(found[i]->name);
+        int path_len = snprintf(path, sizeof(path), "~S1%s", found[i]->file->path + root_len);
+        if (path_len >= (int)sizeof(path)) path_len = sizeof(path) - 1;
+        send(fd, &found[i]->kind, 1, 0);
+        send(fd, &found[i]->line, sizeof(int), 0);
+        send(fd, &len, sizeof(int), 0);
+        send(fd, found[i]->name, len, 0);
+        send(fd, &path_len, sizeof(int), 0);
+        send(fd, path, path_len, 0);
+    }
+    free(found);
+}
+
+/**
+ * @brief Background thread owning the symbol index of the stored .c files
+ *
+ * Indexes the store once, then follows the change event ring so every
+ * upload, write, removal, restore or expiry of a .c file is re-read,
+ * and answers symf queries from the session processes on
+ * $HOME/SYMBOL_SOCK_NAME. If the ring wrapped before the thread caught
+ * up, the whole store is indexed again.
+ */
+void *symbol_thread(void *arg) {
+    (void)arg;
+
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    // Listen first: queries wait in the backlog while the store is indexed
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", getenv("HOME"), SYMBOL_SOCK_NAME);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("symbol socket");
+        return NULL;
+    }
+    unlink(addr.sun_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        perror("symbol bind/listen");
+        close(listen_fd);
+        return NULL;
+    }
+
+    // Changes made during the scan are replayed after it
+    long cursor = event_log ? __atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE) : 0;
+    snprintf(symbol_root, sizeof(symbol_root), "%s/S1", getenv("HOME"));
+    symbol_root_len = strlen(symbol_root);
+    symbol_rebuild();
+
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    while (1) {
+        // Catch up before answering, so a query sees the session's own uploads
+        int ready = poll(&pfd, 1, WATCH_POLL_MS);
+        ChangeEvent ev;
+        int r;
+        while ((r = read_event(cursor, &ev)) != 0) {
+            if (r < 0) {
+                cursor = __atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE);
+                symbol_rebuild();
+            } else {
+                cursor++;
+                symbol_refresh(ev.path);
+            }
+        }
+        if (ready <= 0) continue;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+
+        // A stuck session must not hold up the index
+        struct timeval tv = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        symbol_answer(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fixed part of a redirect ticket, followed by the path and the MAC
+ *
+ * Same layout as on the storage servers, which verify what S1 signs here.
+ */
+typedef struct {
+    char op;                /**< 'U' upload or 'D' download */
+    int port;               /**< Storage server the ticket is valid for */
+    long not_after;         /**< Epoch seconds after which the ticket is refused */
+    long size;              /**< Upload size in bytes, 0 for downloads */
+    long arg;               /**< Expiry time of a TTL upload, or generation to download */
+    int path_len;           /**< Length of the path that follows */
+    unsigned char nonce[TICKET_NONCE_LEN];  /**< Random; the ticket is good for one transfer */
+} TicketHeader;
+
+/**
+ * @brief Loads the ticket key, creating it on first start
+ * @return 0 on success, -1 if S1 cannot talk to the storage servers
+ *
+ * A new key is written to a private file and linked into place, so
+ * S1 instances starting together end up sharing whichever key won.
+ */
+int init_ticket_key(void) {
+    char path[MAX_PATH_LEN], temppath[MAX_PATH_LEN + 16];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), TICKET_KEY_FILE);
+    snprintf(temppath, sizeof(temppath), "%s.%d", path, getpid());
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 && errno == ENOENT) {
+        unsigned char key[TICKET_KEY_LEN];
+        int rnd = open("/dev/urandom", O_RDONLY);
+        int tmp = open(temppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        int written = rnd >= 0 && tmp >= 0 &&
+                      read(rnd, key, sizeof(key)) == sizeof(key) &&
+                      write(tmp, key, sizeof(key)) == sizeof(key);
+        if (rnd >= 0) close(rnd);
+        if (tmp >= 0) close(tmp);
+        if (written) link(temppath, path);
+        unlink(temppath);
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) {
+        perror("Ticket key");
+        return -1;
+    }
+    ticket_key_loaded = read(fd, ticket_key, TICKET_KEY_LEN) == TICKET_KEY_LEN;
+    close(fd);
+    return ticket_key_loaded ? 0 : -1;
+}
+
+/**
+ * @brief Sends the client a signed ticket for a transfer S1 has approved
+ * @param client_sock Client socket
+ * @param op 'U' (upload) or 'D' (download)
+ * @param port Storage server that carries out the transfer
+ * @param path Upload destination below the storage root, or download path (~S1/...)
+ * @param size Upload size in bytes, 0 for downloads
+ * @param arg Expiry time of a TTL upload, or generation to download
+ * @return 0 when the ticket was sent, -1 if none could be issued (nothing sent)
+ *
+ * Replies status 2 + port + host_len + host + ticket_len + ticket. The
+ * host is where the storage servers run; a loopback address tells the
+ * client to use the host it reached S1 on.
+ */
+int send_redirect_ticket(int client_sock, char op, int port, const char *path, long size, long arg) {
+    TicketHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));   // Padding is signed too
+    hdr.op = op;
+    hdr.port = port;
+    hdr.not_after = time(NULL) + TICKET_TTL_SECS;
+    hdr.size = size;
+    hdr.arg = arg;
+    hdr.path_len = strlen(path);
+    if (!ticket_key_loaded || hdr.path_len <= 0 || hdr.path_len >= MAX_PATH_LEN ||
+        getrandom(hdr.nonce, sizeof(hdr.nonce), 0) != sizeof(hdr.nonce))
+        return -1;
+
+    unsigned char ticket[sizeof(hdr) + MAX_PATH_LEN + TICKET_MAC_LEN];
+    int ticket_len = sizeof(hdr) + hdr.path_len;
+    memcpy(ticket, &hdr, sizeof(hdr));
+    memcpy(ticket + sizeof(hdr), path, hdr.path_len);
+    hmac_sha256(ticket_key, TICKET_KEY_LEN, ticket, ticket_len, ticket + ticket_len);
+    ticket_len += TICKET_MAC_LEN;
+
+    long status = 2;
+    int host_len = strlen(storage_host);
+    send(client_sock, &status, sizeof(long), 0);
+    send(client_sock, &port, sizeof(int), 0);
+    send(client_sock, &host_len, sizeof(int), 0);
+    send(client_sock, storage_host, host_len, 0);
+    send(client_sock, &ticket_len, sizeof(int), 0);
+    send(client_sock, ticket, ticket_len, 0);
+    printf("Redirected %s of %s to port %d\n", op == 'U' ? "upload" : "download", path, port);
+    return 0;
+}
+
+/**
+ * @brief Checks whether an upload can complete without its data
+ * @param target_port Storage server holding the file, 0 for a local .c file
+ * @param moddest Destination below the storage root
+ * @param size Size of the upload
+ * @param expires Expiry time of a TTL upload, 0 for none
+ * @param proof SHA-256 of the upload, computed by the client
+ * @return 3 if the destination already holds the content, 1 if the storage
+ *         server stored it from a file with the same content, 0 otherwise
+ *
+ * @details Implements protocol:
+ * 'H' - Upload preflight
+ *   1. S1 → Storage: 'H' + path_len + path + file_size + expires + proof
+ *   2. Storage → S1: status (3 up to date, 1 stored, 0 send the data, -1 failed)
+ *
+ * S1 only compares its own .c files with the destination; the content
+ * store is kept by the storage servers, one per namespace. Either way
+ * the proof must match a SHA-256 the server computed itself.
+ */
+long preflight_upload(int target_port, const char *moddest, long size, long expires, const unsigned char *proof) {
+    if (!target_port) {
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, sizeof(local_path), "%s/S1%s", getenv("HOME"), moddest);
+        int fd = expires == 0 ? open(local_path, O_RDONLY) : -1;
+        struct stat st;
+        long status = fd >= 0 && fstat(fd, &st) == 0 && st.st_size == size && content_proven(fd, &st, proof) &&
+                      fgetxattr(fd, EXPIRES_XATTR, NULL, 0) < 0 ? 3 : 0;
+        if (fd >= 0) close(fd);
+        return status;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return 0;
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(target_port),
+    };
+    serv_addr.sin_addr.s_addr = inet_addr(storage_host);
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || authenticate_to_storage(sock) < 0) {
+        close(sock);
+        return 0;
+    }
+
+    // Build the whole request so it leaves in one segment
+    char request[1 + sizeof(int) + MAX_PATH_LEN + 2 * sizeof(long) + CONTENT_PROOF_LEN];
+    int path_len = strlen(moddest);
+    size_t off = 0;
+    request[off++] = 'H';
+    memcpy(request + off, &path_len, sizeof(int));
+    off += sizeof(int);
+    memcpy(request + off, moddest, path_len);
+    off += path_len;
+    memcpy(request + off, &size, sizeof(long));
+    off += sizeof(long);
+    memcpy(request + off, &expires, sizeof(long));
+    off += sizeof(long);
+    memcpy(request + off, proof, CONTENT_PROOF_LEN);
+    off += CONTENT_PROOF_LEN;
+    send(sock, request, off, 0);
+
+    long status = 0;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long) || (status != 3 && status != 1))
+        status = 0;
+    close(sock);
+    return status;
+}
+
+/**
+ * @brief One entry of a chunked upload's recipe (same layout on the client and S2-S5)
+ */
+typedef struct {
+    unsigned long long hash;    /**< XXH64 of the chunk */
+    long len;                   /**< Chunk length in bytes */
+} ChunkRef;
+
+/**
+ * @brief Opens a chunked upload to a storage server and sends the request header
+ * @param port Storage server port
+ * @param moddest Destination below the storage root
+ * @param size Size of the file
+ * @param expires Expiry time of a TTL upload, 0 for none
+ * @param hash XXH64 of the whole file
+ * @param chunks Number of chunks in the recipe
+ * @return Connected socket ready for the recipe, -1 on failure
+ *
+ * @details Implements protocol:
+ * 'C' - Chunked upload
+ *   1. S1 → Storage: 'C' + path_len + path + file_size + expires + hash + count
+ *   2. S1 → Storage: count x ChunkRef (the recipe, in file order)
+ *   3. Storage → S1: missing_bytes + count need flags (1 = send this chunk),
+ *      or -1 alone if the upload is refused
+ *   4. S1 → Storage: the flagged chunks, in recipe order (missing_bytes)
+ *   5. Storage → S1: status (1 stored, -1 failed)
+ */
+int open_chunked_upload_to_server(int port, const char *moddest, long size, long expires,
+                                  unsigned long long hash, int chunks) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    serv_addr.sin_addr.s_addr = inet_addr(storage_host);
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || authenticate_to_storage(sock) < 0) {
+        perror("Connection failed");
+        close(sock);
+        return -1;
+    }
+
+    char request[1 + sizeof(int) + MAX_PATH_LEN + 2 * sizeof(long) + sizeof(hash) + sizeof(int)];
+    int path_len = strlen(moddest);
+    size_t off = 0;
+    request[off++] = 'C';
+    memcpy(request + off, &path_len, sizeof(int));
+    off += sizeof(int);
+    memcpy(request + off, moddest, path_len);
+    off += path_len;
+    memcpy(request + off, &size, sizeof(long));
+    off += sizeof(long);
+    memcpy(request + off, &expires, sizeof(long));
+    off += sizeof(long);
+    memcpy(request + off, &hash, sizeof(hash));
+    off += sizeof(hash);
+    memcpy(request + off, &chunks, sizeof(int));
+    off += sizeof(int);
+    send(sock, request, off, 0);
+    return sock;
+}
+
+/**
+ * @brief Relays a chunked upload between the client and a storage server
+ * @param client_sock Client socket
+ * @param server_sock Socket from open_chunked_upload_to_server
+ * @param buffer Transfer buffer of TRANSFER_CHUNK bytes
+ * @param chunks Number of chunks in the recipe
+ * @return 1 when the storage server stored the file, -1 otherwise
+ *
+ * Every step has a size S1 knows, so the exchange is relayed one
+ * direction at a time: status 4, the recipe to the server, missing_bytes
+ * and the need flags back to the client, then only the missing chunks.
+ * The client sees -1 instead of missing_bytes when the server refuses.
+ */
+long relay_chunked_upload(int client_sock, int server_sock, char *buffer, int chunks) {
+    long status = 4, missing = -1, stored = -1;
+    long recipe_len = (long)chunks * sizeof(ChunkRef);
+    send(client_sock, &status, sizeof(long), 0);
+    if (relay_bytes(client_sock, server_sock, buffer, recipe_len) != recipe_len ||
+        recv(server_sock, &missing, sizeof(long), MSG_WAITALL) != sizeof(long))
+        missing = -1;
+    send(client_sock, &missing, sizeof(long), MSG_NOSIGNAL);
+    if (missing < 0) return -1;
+
+    if (relay_bytes(server_sock, client_sock, buffer, chunks) == chunks &&
+        relay_bytes(client_sock, server_sock, buffer, missing) == missing)
+        recv(server_sock, &stored, sizeof(long), MSG_WAITALL);
+    printf("Chunked upload: %ld bytes of new chunks relayed\n", missing);
+    return stored == 1 ? 1 : -1;
+}
+
+/**
+ * @brief Processes file upload requests from clients
+ * @param client_sock Client socket descriptor
+ * @param filename Name of file being uploaded
+ * @param dest_path Destination path on server (~S1/...)
+ *
+ * Handles all file types (.c, .pdf, .txt, .zip)
+ * Stores .c files locally (on S5 in gateway mode), routes others to appropriate servers
+ * Creates necessary directory structure
+ * Validates file extensions and path formats
+ * Implements atomic write operation (temporary file + rename)
+ *
+ * @param size File size announced in the command line
+ * @param ttl Seconds until the file expires, 0 to keep it indefinitely
+ *
+ * @details The file is streamed through one buffer from the shared
+ * transfer pool, so memory use does not depend on the claimed size.
+ * After the command the client waits for a status: 1 to send the data,
+ * or -1 + msg_len + msg when the size is invalid, the destination is
+ * unreachable, the namespace quota would be exceeded, or no transfer
+ * buffer freed up within TRANSFER_WAIT_SECS.
+ *
+ * Namespace usage is charged before the transfer (size minus the size of
+ * the file being replaced, if any) and given back if the upload fails.
+ *
+ * A TTL upload stores its expiry time in EXPIRES_XATTR; the expirer of
+ * the server holding the file deletes it once that time has passed.
+ * Overwriting the file without a TTL keeps it indefinitely.
+ *
+ * @param redirect Set when the client asked to send the data to the
+ * storage server itself: once the upload is charged it gets a ticket
+ * (status 2, see send_redirect_ticket) instead of status 1. Files S1
+ * stores itself are still accepted with status 1.
+ *
+ * @param hash XXH64 of the file as computed by the client, 0 if not sent;
+ * a chunked upload is checked against it once assembled.
+ *
+ * @param proof SHA-256 of the file as computed by the client, NULL if not
+ * sent. When the destination or the content store of its namespace
+ * already has that content (see preflight_upload), the client gets
+ * status 3 and the final response straight away, and sends no data. The
+ * response is the same as for an upload that sent its data.
+ *
+ * @param chunks Number of chunks in the client's recipe, 0 for a plain
+ * upload. A chunked upload to a storage server gets status 4 and only
+ * sends the chunks that server does not hold (see relay_chunked_upload);
+ * files S1 stores itself are still accepted with status 1.
+ */
+void handle_upload_request(int client_sock, const char *filename, const char *dest_path, long size, long ttl,
+                           unsigned long long hash, const unsigned char *proof, int redirect, int chunks){
+        printf("Size of file received: %ld\n", size);
+
+        // Reject impossible or oversized claims before reserving anything
+        if (size < 0 || size > MAX_UPLOAD_SIZE) {
+            send_error_status(client_sock, "EInvalid file size");
+            return;
+        }
+        if (ttl < 0) {
+            send_error_status(client_sock, "EInvalid TTL");
+            return;
+        }
+        if (chunks < 0 || chunks > CHUNK_MAX_COUNT || chunks > size || (chunks && !hash)) {
+            send_error_status(client_sock, "EInvalid chunk count");
+            return;
+        }
+        long expires = ttl > 0 ? time(NULL) + ttl : 0;
+
+        // Only destinations below ~S1, and a plain file name
+        if (strncmp(dest_path, "~S1", 3) != 0 || (dest_path[3] != '\0' && dest_path[3] != '/') ||
+            strstr(dest_path, "..") || strchr(filename, '/') || strcmp(filename, "..") == 0) {
+            send_error_status(client_sock, "EPath must be in format: ~S1/...");
+            return;
+        }
+
+        // Handle file type and destination
+        char *ext = strrchr(filename, '.');
+        char moddest[1024];
+        snprintf(moddest, sizeof(moddest), "%s/%s", dest_path + 3, filename);
+
+        // Determine where to send the file based on its extension
+        int target_port = 0;
+        if (ext && strcmp(ext, ".pdf") == 0) {
+            target_port = PORT_S2;  // Send to S2 server
+        } else if (ext && strcmp(ext, ".txt") == 0) {
+            target_port = PORT_S3;  // Send to S3 server
+        } else if (ext && strcmp(ext, ".zip") == 0) {
+            target_port = PORT_S4;  // Send to S4 server
+        } else if (ext && strcmp(ext, ".c") == 0) {
+            target_port = c_store_port;  // Send to S5 in gateway mode, else keep locally
+        } else {
+            send_error_status(client_sock, "EUnsupported file type");
+            return;
+        }
+
+        // Size of the file being replaced, if any, decides the usage delta
+        char stat_path[PATH_MAX];
+        snprintf(stat_path, sizeof(stat_path), "~S1%s", moddest);
+        StatReply old = {.exists = -1};
+        if (target_port) {
+            char *paths[] = {stat_path};
+            int batch[] = {0};
+            stat_on_server(target_port, paths, batch, 1, &old);
+        } else {
+            char local_path[PATH_MAX];
+            struct stat st;
+            snprintf(local_path, sizeof(local_path), "%s/S1%s", getenv("HOME"), moddest);
+            if (stat(local_path, &st) == 0) {
+                old.exists = 1;
+                old.size = st.st_size;
+            }
+        }
+        long delta_bytes = size - (old.exists == 1 ? old.size : 0);
+        long delta_files = old.exists == 1 ? 0 : 1;
+
+        // Charge the namespace quota before any data is transferred
+        char prefix[USAGE_PREFIX_LEN];
+        usage_prefix(moddest, prefix);
+        UsageEntry *usage = usage_entry(prefix);
+        if (!usage_charge(usage, delta_bytes, delta_files)) {
+            char err_msg[BUFFER_SIZE];
+            snprintf(err_msg, sizeof(err_msg), "EQuota exceeded for ~S1/%s (%ld of %ld bytes, %ld of %ld files used)",
+                     prefix, usage->bytes, usage->limit_bytes, usage->files, usage->limit_files);
+            send_error_status(client_sock, err_msg);
+            printf("Upload rejected: %s\n", err_msg + 1);
+            return;
+        }
+
+        // Content the server already has needs no transfer
+        long preflight = proof ? preflight_upload(target_port, moddest, size, expires, proof) : 0;
+        if (preflight) {
+            if (preflight == 3)
+                usage_add(usage, -delta_bytes, -delta_files);
+            else
+                usage_seen(usage, target_port, delta_bytes, delta_files);
+            const char *response = "File uploaded successfully.";
+            long status = 3;
+            send(client_sock, &status, sizeof(long), 0);
+            write(client_sock, response, strlen(response) + 1);
+            printf("%s (%s, no data sent)\n", response, preflight == 3 ? "already up to date" : "content already stored");
+            return;
+        }
+
+        // Redirected: the data bypasses S1, the storage server confirms it to the
+        // client and its usage report takes the charge back if it never arrives
+        if (redirect && target_port) {
+            if (send_redirect_ticket(client_sock, 'U', target_port, moddest, size, expires) < 0) {
+                usage_add(usage, -delta_bytes, -delta_files);
+                send_error_status(client_sock, "ERedirected transfers are not available");
+                return;
+            }
+            usage_seen(usage, target_port, delta_bytes, delta_files);
+            return;
+        }
+
+        // Reserve a transfer buffer; waits while the budget is exhausted
+        char *buffer = acquire_transfer_buffer();
+        if (!buffer) {
+            usage_add(usage, -delta_bytes, -delta_files);
+            send_error_status(client_sock, "EServer busy, transfer budget exhausted. Try again later");
+            printf("Upload rejected: transfer budget exhausted\n");
+            return;
+        }
+
+        int result = 0;  // Variable to store the result status (success/failure)
+        long status = 1;
+
+        if (target_port && chunks) {
+            int server_sock = open_chunked_upload_to_server(target_port, moddest, size, expires, hash, chunks);
+            if (server_sock < 0) {
+                release_transfer_buffer(buffer);
+                usage_add(usage, -delta_bytes, -delta_files);
+                send_error_status(client_sock, "EConnection is not reliable");
+                return;
+            }
+            result = relay_chunked_upload(client_sock, server_sock, buffer, chunks);
+            close(server_sock);
+            if (result == 1)
+                usage_seen(usage, target_port, delta_bytes, delta_files);
+        } else if (target_port) {
+            int server_sock = open_upload_to_server(storage_host, target_port, size, expires, moddest);
+            if (server_sock < 0) {
+                release_transfer_buffer(buffer);
+                usage_add(usage, -delta_bytes, -delta_files);
+                send_error_status(client_sock, "EConnection is not reliable");
+                return;
+            }
+
+            // Let the client start streaming, relay it to the storage server
+            send(client_sock, &status, sizeof(long), 0);
+            long moved = relay_bytes(client_sock, server_sock, buffer, size);
+
+            // Storage server confirms once the file is in place
+            long stored = -1;
+            if (moved == size)
+                recv(server_sock, &stored, sizeof(long), MSG_WAITALL);
+            close(server_sock);
+            result = stored == 1 ? 1 : 0;
+            if (result == 1)
+                usage_seen(usage, target_port, delta_bytes, delta_files);
+        } else {
+            // Save locally to ~/S1
+            char fullpath[1024];
+            snprintf(fullpath, sizeof(fullpath), "%s/S1%s/%s", getenv("HOME"), dest_path + 3, filename);
+            char mkdir_cmd[1024];
+            printf("Full path is: %s\n", fullpath);
+
+            snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(strdup(fullpath)));
+            system(mkdir_cmd);
+            printf("Command to create directory is: %s\n", mkdir_cmd);
+
+            // Write into a temporary file, publish it only when complete
+            char temppath[1100];
+            snprintf(temppath, sizeof(temppath), "%s.part%d", fullpath, getpid());
+            int fd = open(temppath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                perror("Write error on .c file");
+                release_transfer_buffer(buffer);
+                usage_add(usage, -delta_bytes, -delta_files);
+                send_error_status(client_sock, "EError processing the file.");
+                return;
+            }
+
+            send(client_sock, &status, sizeof(long), 0);
+            long moved = relay_bytes(client_sock, fd, buffer, size);
+            if (moved == size) {
+                cache_file_hash(fd, buffer);
+
+                // Keep the file being replaced as a prior version
+                long gen = preserve_version(fullpath, moddest);
+                if (gen < 0)
+                    moved = -1;     // Overwriting would lose the old contents
+                else
+                    fsetxattr(fd, GEN_XATTR, &gen, sizeof(gen), 0);
+                if (expires > 0)
+                    fsetxattr(fd, EXPIRES_XATTR, &expires, sizeof(expires), 0);
+            }
+            close(fd);
+
+            if (moved == size && rename(temppath, fullpath) == 0) {
+                result = 1;  // Success
+                if (expires > 0) expiry_journal_add(expires, fullpath);
+                log_event(old.exists == 1 ? 'M' : 'A', moddest);
+            } else {
+                perror("Write error on .c file");
+                unlink(temppath);
+                result = -1;  // Failure
+            }
+        }
+
+        release_transfer_buffer(buffer);
+        if (result != 1)
+            usage_add(usage, -delta_bytes, -delta_files);
+
+        // Send a response to the client indicating success or failure
+        if (result == 1) {
+            // Success: File processing was completed successfully
+            const char *response = "File uploaded successfully.";
+            write(client_sock, response, strlen(response) + 1);
+            printf("%s\n",response);
+        } else if (result == -1) {
+            // Failure: There was an issue with the file handling
+            const char *response = "Error processing the file.";
+            write(client_sock, response, strlen(response) + 1);
+            printf("%s\n",response);
+        } else {
+            // Failure: Could not connect to the appropriate server
+            const char *response = "Error sending file to destination server.";
+            write(client_sock, response, strlen(response) + 1);
+            printf("%s\n",response);
+        }
+}
+
+
+/**
+ * @brief Processes file download requests
+ * @param client_sock The client socket descriptor 
+ * @param filepath The full client path (~S1/...)
+ * @param version Generation to download, 0 for the live file
+ *
+ * Handles .c files locally (on S5 in gateway mode), routes others to storage servers
+ * Validates paths and file existence
+ * Streams files with size prefix protocol
+ * 
+ * @details Implements protocol:
+ * 'D' - Download File  
+ *   1. S1 → Storage: 'D' + path_len + path
+ *   2. Storage → S1: file_size + file_data OR error
+ * 'G' - Download a prior version: as 'D', with the version (long) after the path
+ *
+ * @param redirect Set when the client asked to fetch the data from the
+ * storage server itself: it gets a ticket (status 2) instead of the file.
+ * Files S1 stores itself are sent as usual.
+ */
+void handle_download_request(int client_sock, const char *filepath, long version, int redirect) {
+
+    // Validate input
+    if (!filepath || strlen(filepath) == 0) {
+        long error = -1;
+        send(client_sock, &error, sizeof(long), 0);
+        char *err_msg = "EEmpty file path";
+        int msg_len = strlen(err_msg);
+        send(client_sock, &msg_len, sizeof(int), 0);
+        send(client_sock, err_msg, msg_len, 0);
+        return;
+    }
+
+    // Only paths below ~S1 are served
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..")) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
+        return;
+    }
+
+    // Extract file extension
+    const char *ext = strrchr(filepath, '.');
+    if (!ext) {
+        long error = -1;
+        send(client_sock, &error, sizeof(long), 0);
+        char *err_msg = "EInvalid file: no extension";
+        int msg_len = strlen(err_msg);
+        send(client_sock, &msg_len, sizeof(int), 0);
+        send(client_sock, err_msg, msg_len, 0);
+        return;
+    }
+    ext++; // Move past the dot
+    printf("Extension is: %s\n", ext);
+
+    // If the received file has a ".c" extension, handle it locally (unless a gateway)
+    if (strcmp(ext, "c") == 0 && !c_store_port) {
+
+        // Handle .c file locally
+        char local_path[MAX_PATH_LEN];
+        char *home_dir = NULL;
+        const char *s1_part = filepath + 1;   // Past "~"
+
+        // Build absolute path with buffer safety
+        // Converts ~S1/.. to /home/user/S1/..
+        home_dir = getenv("HOME");
+        snprintf(local_path, MAX_PATH_LEN, "%s/S1/%s", home_dir, s1_part + 3);   // Converts ~S1/ to /home/user/S1/
+        printf("Absolute path of file in S1: %s\n",local_path);
+
+        // Open file (or the requested prior version) in S1
+        char serve_path[MAX_PATH_LEN];
+        resolve_version(local_path, s1_part + 2, version, serve_path, sizeof(serve_path));
+        int fd = open(serve_path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            //printf("EFile not found\n");
+            // File not found: send a size of -1
+            if (fd >= 0) close(fd);
+            send_error_status(client_sock, "EFile not found");
+            return;
+        }
+       
+        // Get file size
+        long file_size = st.st_size;
+
+        long status = 1;
+        // Send status to client to proceed for download
+        send(client_sock, &status, sizeof(long), 0); 
+        // Send file size to client   
+        send(client_sock, &file_size, sizeof(long), 0);
+
+        // Send file content to client
+        send_file_data(client_sock, fd, file_size);
+
+        close(fd);   // Close the file
+        printf("File sent successfully to client.\n");
+        return;
+    }
+
+    // If the received file has an extension other than ".c", send it to another server
+    // Select appropriate target server for non-.c files
+    int target_port;
+    
+    // If the received file has a ".pdf" extension
+    if (strcmp(ext, "pdf") == 0) {
+        target_port = PORT_S2;
+    } 
+    // If the received file has a ".txt" extension
+    else if (strcmp(ext, "txt") == 0) {
+        target_port = PORT_S3;
+    }
+    // If the received file has a ".zip" extension
+    else if (strcmp(ext, "zip") == 0) {
+        target_port = PORT_S4;
+    }
+    // A gateway keeps its ".c" files on S5
+    else if (strcmp(ext, "c") == 0) {
+        target_port = c_store_port;
+    }
+    // If the received file has any other extension
+    else {
+        send(client_sock, "EUnsupported file type", 22, 0);
+        return;
+    }
+
+    // Redirected: the storage server sends the file straight to the client
+    if (redirect) {
+        if (send_redirect_ticket(client_sock, 'D', target_port, filepath, 0, version) < 0)
+            send_error_status(client_sock, "ERedirected transfers are not available");
+        return;
+    }
+
+    // Take the relay buffer before the client is told a file is coming:
+    // once its size is announced the data must follow
+    char *buffer = acquire_transfer_buffer();
+    if (!buffer) {
+        send_error_status(client_sock, "EServer busy, transfer budget exhausted. Try again later");
+        return;
+    }
+
+    int server_sock = connect_to_target_server(target_port, client_sock);
+    if (server_sock < 0) {
+        release_transfer_buffer(buffer);
+        return;  // Error already handled
+    }
+    printf("Server Connected.\n");
+
+    // Send download command ('D', or 'G' for a prior version) to target server
+    char command_type = version > 0 ? 'G' : 'D';
+    send(server_sock, &command_type, 1, 0);
+
+    // If connection is successful to target server
+    // Send status to client to proceed
+    long status = 1;
+    send(client_sock, &status, sizeof(long), 0);
+
+    // Send original path (unchanged) e.g.: ~S1/1.txt
+    int path_len = strlen(filepath);
+    send(server_sock, &path_len, sizeof(int), 0);
+    send(server_sock, filepath, path_len, 0);
+    if (version > 0)
+        send(server_sock, &version, sizeof(long), 0);
+
+    // Wait for status byte from target server
+    // If file is present in target server, only then proceed
+    char status1;
+    recv(server_sock, &status1, 1, 0);
+
+    if (status1 == -1) {
+        //printf("EFile not found\n");
+        int msg_len;
+        recv(server_sock, &msg_len, sizeof(int), 0);
+        char error_msg[BUFFER_SIZE];
+        recv(server_sock, error_msg, msg_len, 0);
+        error_msg[msg_len] = '\0';
+        printf("Error: %s\n", error_msg);
+        // File not found: send a size of -1
+        long error = -1;
+        send(client_sock, &error, sizeof(long), 0);
+        //send(client_sock, msg, strlen(msg), 0);
+        send(client_sock, &msg_len, sizeof(int), 0);
+        send(client_sock, error_msg, msg_len, 0);
+        release_transfer_buffer(buffer);
+        close(server_sock);
+        return;
+    }
+
+    // Receive file size from target server
+    long file_size;
+    recv(server_sock, &file_size, sizeof(long), MSG_WAITALL);
+
+    // Send file size to client
+    send(client_sock, &file_size, sizeof(long), 0);
+
+    // Forward the response to client
+    // Receive response from target server and send it to client
+    relay_bytes(server_sock, client_sock, buffer, file_size);
+    release_transfer_buffer(buffer);
+
+    // Close the server socket
+    close(server_sock);
+    printf("File sent successfully to client.\n");
+}
+
+/**
+ * @brief Processes file deletion requests
+ * @param client_sock The client socket descriptor
+ * @param filepath The full client path (~S1/...)
+ *
+ * Directly deletes .c files on S1 (through S5 in gateway mode)
+ * For pdf/txt: Forwards delete request to appropriate storage server
+ * Validates paths and handles errors
+ * 
+ * @details Implements protocol:
+ * 'R' - Remove File
+ *   1. S1 → Storage: 'R' + path_len + path  
+ *   2. Storage → S1: Success/Failure response
+ */
+void handle_remove_request(int client_sock, const char *filepath) 
+{
+    // Validate input
+    if (!filepath || strlen(filepath) == 0) {
+        send(client_sock, "EEmpty file path", 16, 0);
+        return;
+    }
+
+    // Only paths below ~S1 can be removed
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..")) {
+        send(client_sock, "EPath must be in format: ~S1/...", 33, 0);
+        return;
+    }
+
+    // Extract file extension
+    const char *ext = strrchr(filepath, '.');
+    if (!ext) {
+        send(client_sock, "EInvalid file: no extension", 27, 0);
+        return;
+    }
+    ext++; // Move past the dot
+    printf("Extension is: %s\n", ext);
+
+    // If the received file has a ".c" extension (and S1 stores it)
+    if (strcmp(ext, "c") == 0 && !c_store_port) 
+    {
+        // Handle .c file locally
+        char local_path[MAX_PATH_LEN];
+        char *home_dir = NULL;
+        const char *s1_part = filepath + 1;   // Past "~"
+
+        // Build absolute path with buffer safety
+        // Converts ~S1/.. to /home/user/S1/..
+        home_dir = getenv("HOME");
+        snprintf(local_path, MAX_PATH_LEN, "%s/S1/%s", home_dir, s1_part + 3);
+        printf("Absolute path of file in S1:%s\n",local_path);
+
+        // Send status to client to proceed for removing
+        long status = 1;
+        send(client_sock, &status, sizeof(long), 0);
+
+        // Execute deletion
+        struct stat st;
+        int counted = stat(local_path, &st) == 0 && S_ISREG(st.st_mode);
+        if (move_to_trash(local_path, s1_part + 2) == 0) {
+            char prefix[USAGE_PREFIX_LEN];
+            usage_prefix(s1_part + 2, prefix);
+            if (counted) usage_add(usage_entry(prefix), -st.st_size, -1);
+            log_event('D', s1_part + 2);
+            send(client_sock, "SFile deleted successfully", 26, 0);
+            printf("SFile deleted successfully\n");
+        } 
+        else {
+            // Provide specific error messages
+            switch (errno) {
+                case ENOENT:
+                    printf("EFile not found\n");
+                    send(client_sock, "EFile not found", 15, 0);
+                    break;
+                case EACCES:
+                    printf("EPermission denied\n");
+                    send(client_sock, "EPermission denied", 18, 0);
+                    break;
+                default:
+                    printf("EFile deletion failed\n");
+                    send(client_sock, "EFile deletion failed", 21, 0);
+            }
+        }
+
+        return;
+    } 
+
+    // If the received file has an extension other than ".c", send it to another server
+    // Select appropriate target server for non-.c files
+    // Determine target port
+    int target_port;
+    // If the received file has a ".pdf" extension
+    if (strcmp(ext, "pdf") == 0) {
+        target_port = PORT_S2;
+    }
+    // If the received file has a ".txt" extension 
+    else if (strcmp(ext, "txt") == 0) {
+        target_port = PORT_S3;
+    }
+    // If the received file has a ".zip" extension 
     else if (strcmp(ext, "zip") == 0) {
         target_port = PORT_S4;
+    } 
+    // A gateway keeps its ".c" files on S5
+    else if (strcmp(ext, "c") == 0) {
+        target_port = c_store_port;
+    }
+    // If the received file has any other extension
+    else {
+        send(client_sock, "EUnsupported file type", 22, 0);
+        return;
+    }
+
+    // Size of the file, to give its usage back once removed
+    StatReply old = {.exists = -1};
+    char *paths[] = {(char *)filepath};
+    int batch[] = {0};
+    stat_on_server(target_port, paths, batch, 1, &old);
+
+    int server_sock = connect_to_target_server(target_port, client_sock);
+    if (server_sock < 0) {
+        return;  // Error already handled
+    }
+    printf("Server Connected.\n");
+    printf("Filepath: %s\n",filepath);
+
+    // Send remove command to storage server
+    char command_type = 'R'; // 'R' for remove
+    if (send(server_sock, &command_type, 1, 0) != 1) {
+        perror("Failed to send command type");
+        close(server_sock);
+        send(client_sock, "EInternal server error", 22, 0);
+        return;
+    }
+
+    // If connection is successful to target server
+    // Send status to client to proceed
+    long status = 1;
+    send(client_sock, &status, sizeof(long), 0);
+
+    // Send path length and path to target storage server
+    int path_len = strlen(filepath);
+    printf("Filepath length: %d\n",path_len);
+
+    if (send(server_sock, &path_len, sizeof(int), 0) != sizeof(int)) 
+    {
+        perror("Failed to send path length");
+        // Close the socket and notify the client about the failure
+        close(server_sock);
+        send(client_sock, "EInternal server error", 22, 0);
+        return;
+    }
+    if (send(server_sock, filepath, path_len, 0) != path_len) 
+    {
+        perror("Failed to send path");
+        // Close the socket and notify the client about the failure
+        close(server_sock);
+        send(client_sock, "EInternal server error", 22, 0);
+        return;
+    }
+
+    // Get response from storage server, store it in the response buffer
+    char response[BUFFER_SIZE];
+    ssize_t bytes_received = recv(server_sock, response, BUFFER_SIZE, 0);
+    response[bytes_received] = '\0';    // Update last character
+    printf("Response received from server: %s\n",response);
+    printf("Response bytes received : %zd\n",bytes_received);
+    close(server_sock); // Close the socket 
+
+    // Send response to client
+    if (bytes_received <= 0) {
+        send(client_sock, "ENo response from storage server", 31, 0);
+    } else {
+        printf("Response send to client : %s\n",response);
+        if (response[0] == 'S' && old.exists == 1 && strncmp(filepath, "~S1/", 4) == 0) {
+            char prefix[USAGE_PREFIX_LEN];
+            usage_prefix(filepath + 3, prefix);
+            UsageEntry *usage = usage_entry(prefix);
+            usage_add(usage, -old.size, -1);
+            usage_seen(usage, target_port, -old.size, -1);
+        }
+        // Forward the storage server's response to the client
+        send(client_sock, response, bytes_received, 0);
+    }
+}
+
+/**
+ * @brief One file of a tar being streamed
+ */
+typedef struct {
+    char *path;                 /**< Absolute path */
+    long size;                  /**< Size when listed; the archive records exactly this many bytes */
+    long mtime;                 /**< Modification time when listed */
+    int mode;                   /**< Permission bits */
+    int uid;                    /**< Owner */
+    int gid;                    /**< Group */
+    char *record;               /**< Header block(s), plus data and padding of a small file */
+    long record_len;            /**< Bytes in record */
+    int fd;                     /**< Open file whose data follows record (large files), else -1 */
+    int ready;                  /**< Set once record (and fd) are prepared */
+} TarEntry;
+
+/**
+ * @brief A tar being streamed, shared by its reader threads
+ *
+ * Readers prepare entries in archive order, at most TAR_WINDOW ahead of
+ * the one being sent, so many files are read at once while memory stays
+ * bounded and the output order does not depend on which read finishes first.
+ */
+typedef struct {
+    TarEntry *entries;          /**< Files in archive order (sorted by name) */
+    int count;                  /**< Number of entries */
+    int capacity;               /**< Allocated entries */
+    size_t root_len;            /**< Length of the archive root, stripped from entry names */
+    int next;                   /**< Next entry a reader claims */
+    int sent;                   /**< Entries the sender is done with */
+    int stop;                   /**< Set when the receiver hung up */
+    unsigned long long id;      /**< XXH64 of every entry's name and metadata: names the archive layout */
+    pthread_mutex_t lock;       /**< Protects next, sent, stop and ready */
+    pthread_cond_t cond;        /**< Signals prepared entries and room in the window */
+} TarJob;
+
+// Job being listed by tar_collect_file() (one listing at a time)
+static TarJob *tar_collecting;
+static const char *tar_ext;                 // Extension of the files archived
+static char tar_skip_dir[MAX_PATH_LEN];     // Tenants' roots when archiving the default namespace, else ""
+
+/**
+ * @brief Rounds a length up to whole tar blocks
+ */
+static long tar_blocks(long len) {
+    return (len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+/**
+ * @brief Bytes of header for an entry name: one block, or a GNU long-name entry before it
+ */
+static long tar_header_len(size_t name_len) {
+    return name_len < 100 ? TAR_BLOCK : 2 * TAR_BLOCK + tar_blocks(name_len + 1);
+}
+
+/**
+ * @brief nftw() callback adding the archived files to the job being listed
+ */
+static int tar_collect_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type == FTW_D && tar_skip_dir[0] && strcmp(path, tar_skip_dir) == 0) return FTW_SKIP_SUBTREE;
+    const char *ext = strrchr(path, '.');
+    if (type != FTW_F || !ext || strcmp(ext, tar_ext) != 0) return 0;
+
+    TarJob *job = tar_collecting;
+    if (job->count == job->capacity) {
+        int capacity = job->capacity ? job->capacity * 2 : 64;
+        TarEntry *grown = realloc(job->entries, capacity * sizeof(TarEntry));
+        if (!grown) return FTW_STOP;
+        job->entries = grown;
+        job->capacity = capacity;
+    }
+    TarEntry *e = &job->entries[job->count];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->mode = st->st_mode & 07777;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->fd = -1;
+    if (e->path) job->count++;
+    return 0;
+}
+
+static int tar_compare_entries(const void *a, const void *b) {
+    return strcmp(((const TarEntry *)a)->path, ((const TarEntry *)b)->path);
+}
+
+/**
+ * @brief Lists the files of a tar
+ * @param job Job to fill
+ * @param dir Archive root; entry names are relative to it
+ * @param ext Extension of the files to archive (e.g., ".pdf")
+ * @param skip_dir Directory left out (the tenants' roots), or ""
+ * @return Size of the archive in bytes
+ *
+ * Entries are sorted by name, so the same tree always gives the same
+ * archive, and the archive id changes whenever any entry's header would.
+ */
+long tar_collect(TarJob *job, const char *dir, const char *ext, const char *skip_dir) {
+    memset(job, 0, sizeof(*job));
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    job->root_len = strlen(dir);
+    tar_collecting = job;
+    tar_ext = ext;
+    snprintf(tar_skip_dir, sizeof(tar_skip_dir), "%s", skip_dir);
+    nftw(dir, tar_collect_file, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+    qsort(job->entries, job->count, sizeof(TarEntry), tar_compare_entries);
+
+    HashState hs;
+    hash_init(&hs);
+    for (int i = 0; i < job->count; i++) {
+        const TarEntry *e = &job->entries[i];
+        hash_update(&hs, e->path + job->root_len, strlen(e->path + job->root_len) + 1);
+        hash_update(&hs, &e->size, sizeof(e->size));
+        hash_update(&hs, &e->mtime, sizeof(e->mtime));
+        hash_update(&hs, &e->mode, sizeof(e->mode));
+        hash_update(&hs, &e->uid, sizeof(e->uid));
+        hash_update(&hs, &e->gid, sizeof(e->gid));
+    }
+    job->id = hash_final(&hs);
+
+    // Headers and data of every entry, then two zero blocks
+    long size = 2 * TAR_BLOCK;
+    for (int i = 0; i < job->count; i++)
+        size += tar_header_len(strlen(job->entries[i].path + job->root_len + 1)) + tar_blocks(job->entries[i].size);
+    return size;
+}
+
+/**
+ * @brief Fills one tar header block (GNU format, as written by tar -cf)
+ */
+static void tar_header(unsigned char *h, const char *name, char type, long size, const TarEntry *e) {
+    memset(h, 0, TAR_BLOCK);
+    snprintf((char *)h, 100, "%s", name);
+    snprintf((char *)h + 100, 8, "%07o", e->mode);
+    snprintf((char *)h + 108, 8, "%07o", e->uid & 07777777);
+    snprintf((char *)h + 116, 8, "%07o", e->gid & 07777777);
+    if (size <= 077777777777L) {
+        snprintf((char *)h + 124, 12, "%011lo", size);
+    } else {
+        // Too large for octal: base-256, flagged by the high bit
+        h[124] = 0x80;
+        for (int i = 11; i > 0; i--, size >>= 8)
+            h[124 + i] = size & 0xff;
+    }
+    snprintf((char *)h + 136, 12, "%011lo", e->mtime);
+    h[156] = type;
+    memcpy(h + 257, "ustar  ", 8);
+
+    // Checksum over the block with the checksum field read as spaces
+    memset(h + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+}
+
+/**
+ * @brief Writes the header block(s) of an entry
+ * @param buf tar_header_len() zeroed bytes
+ */
+static void tar_fill_headers(const TarJob *job, const TarEntry *e, char *buf) {
+    const char *name = e->path + job->root_len + 1;
+    size_t name_len = strlen(name);
+    unsigned char *h = (unsigned char *)buf;
+    if (name_len >= 100) {
+        TarEntry link = {.mode = 0644};
+        tar_header(h, "././@LongLink", 'L', name_len + 1, &link);
+        memcpy(h + TAR_BLOCK, name, name_len);
+        h += tar_header_len(name_len) - TAR_BLOCK;
+    }
+    tar_header(h, name, '0', e->size, e);
+}
+
+/**
+ * @brief Prepares an entry: its header, and the data of a small file
+ *
+ * A file of up to TAR_INLINE_MAX bytes is read into the record, padded
+ * to whole blocks. A larger one stays open for the sender to sendfile(),
+ * with the start of it prefetched. Bytes missing because the file shrank
+ * or vanished since it was listed are sent as zeros.
+ */
+static void tar_prepare(TarJob *job, TarEntry *e) {
+    long head_len = tar_header_len(strlen(e->path + job->root_len + 1));
+    int inline_data = e->size <= TAR_INLINE_MAX;
+    e->record_len = head_len + (inline_data ? tar_blocks(e->size) : 0);
+    e->record = calloc(1, e->record_len);
+    if (!e->record) return;
+    tar_fill_headers(job, e, e->record);
+
+    e->fd = open(e->path, O_RDONLY);
+    if (e->fd < 0) {
+        printf("tar: %s vanished, archived as zeros\n", e->path);
+    } else if (inline_data) {
+        char *data = e->record + head_len;
+        long got = 0;
+        while (got < e->size) {
+            ssize_t n = pread(e->fd, data + got, e->size - got, got);
+            if (n <= 0) break;
+            got += n;
+        }
+        close(e->fd);
+        e->fd = -1;
+    } else {
+        posix_fadvise(e->fd, 0, TAR_READAHEAD, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * @brief Reader thread: prepares entries in order within the window
+ */
+static void *tar_reader(void *arg) {
+    TarJob *job = arg;
+
+    // Signals are handled by the main thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->stop && job->next < job->count && job->next >= job->sent + TAR_WINDOW)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (job->stop || job->next >= job->count) break;
+        TarEntry *e = &job->entries[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        tar_prepare(job, e);
+
+        pthread_mutex_lock(&job->lock);
+        e->ready = 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/**
+ * @brief Sends len bytes, or zeros when data is NULL
+ * @return 0 on success, -1 if the receiver hung up
+ */
+static int tar_send_bytes(int sock, const char *data, long len) {
+    static const char zeros[8 * TAR_BLOCK];
+    while (len > 0) {
+        long want = data ? len : (len < (long)sizeof(zeros) ? len : (long)sizeof(zeros));
+        ssize_t n = send(sock, data ? data : zeros, want, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        if (data) data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Streams the archive listed by tar_collect()
+ * @param job Listed job
+ * @param sock Receiver of exactly the size tar_collect() returned
+ * @return 0 when the whole archive was sent, -1 otherwise
+ *
+ * Up to TAR_THREADS readers prepare entries while this thread sends them
+ * in order, so reading overlaps sending and many files are read at once.
+ */
+int tar_stream(TarJob *job, int sock) {
+    pthread_t readers[TAR_THREADS];
+    int started = 0;
+    for (; started < TAR_THREADS && started < job->count; started++)
+        if (pthread_create(&readers[started], NULL, tar_reader, job) != 0) break;
+
+    int ok = 1;
+    for (int i = 0; i < job->count && ok; i++) {
+        TarEntry *e = &job->entries[i];
+        if (started) {
+            pthread_mutex_lock(&job->lock);
+            while (!e->ready) pthread_cond_wait(&job->cond, &job->lock);
+            pthread_mutex_unlock(&job->lock);
+        } else {
+            tar_prepare(job, e);
+        }
+
+        ok = e->record && tar_send_bytes(sock, e->record, e->record_len) == 0;
+        if (ok && e->size > TAR_INLINE_MAX) {
+            long moved = e->fd >= 0 ? send_file_data(sock, e->fd, e->size) : 0;
+            ok = tar_send_bytes(sock, NULL, tar_blocks(e->size) - moved) == 0;
+        }
+        free(e->record);
+        e->record = NULL;
+        if (e->fd >= 0) close(e->fd);
+        e->fd = -1;
+
+        pthread_mutex_lock(&job->lock);
+        job->sent = i + 1;
+        if (!ok) job->stop = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    if (ok) ok = tar_send_bytes(sock, NULL, 2 * TAR_BLOCK) == 0;
+
+    for (int i = 0; i < started; i++)
+        pthread_join(readers[i], NULL);
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Builds the member index of a listed archive
+ * @param job Listed job
+ * @param tar_size Archive size returned by tar_collect()
+ * @param len Receives the index length
+ * @return The index (malloc'd), or NULL if out of memory
+ *
+ * Text, one line per member after a header line:
+ *   w25tar <archive id> <archive size> <members>
+ *   <data offset> <size> <name>
+ * With it a client fetches single members as byte ranges ('B').
+ */
+char *tar_index(const TarJob *job, long tar_size, long *len) {
+    size_t cap = 64;
+    for (int i = 0; i < job->count; i++)
+        cap += strlen(job->entries[i].path + job->root_len + 1) + 48;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+
+    size_t n = snprintf(out, cap, "w25tar %016llx %ld %d\n", job->id, tar_size, job->count);
+    long pos = 0;
+    for (int i = 0; i < job->count; i++) {
+        const TarEntry *e = &job->entries[i];
+        const char *name = e->path + job->root_len + 1;
+        long head_len = tar_header_len(strlen(name));
+        n += snprintf(out + n, cap - n, "%ld %ld %s\n", pos + head_len, e->size, name);
+        pos += head_len + tar_blocks(e->size);
+    }
+    *len = n;
+    return out;
+}
+
+/**
+ * @brief Sends a byte range of a listed archive without producing the rest
+ * @param job Listed job
+ * @param sock Receiver of exactly length bytes
+ * @param offset First archive byte to send
+ * @param length Number of bytes (within the archive)
+ * @return 0 when the range was sent, -1 otherwise
+ *
+ * Only the files overlapping the range are opened, so fetching one
+ * member reads one file.
+ */
+int tar_send_range(TarJob *job, int sock, long offset, long length) {
+    long pos = 0, end = offset + length;
+    for (int i = 0; i < job->count && pos < end; i++) {
+        TarEntry *e = &job->entries[i];
+        long head_len = tar_header_len(strlen(e->path + job->root_len + 1));
+        long data_len = tar_blocks(e->size);
+        if (pos + head_len + data_len <= offset) {
+            pos += head_len + data_len;
+            continue;
+        }
+
+        // The header block(s) of the entry
+        if (pos + head_len > offset) {
+            char *head = calloc(1, head_len);
+            if (!head) return -1;
+            tar_fill_headers(job, e, head);
+            long from = offset > pos ? offset - pos : 0;
+            long to = end < pos + head_len ? end - pos : head_len;
+            int ok = tar_send_bytes(sock, head + from, to - from) == 0;
+            free(head);
+            if (!ok) return -1;
+        }
+        pos += head_len;
+
+        // Its data, zeros past the end of the file
+        if (pos < end && pos + data_len > offset) {
+            long from = offset > pos ? offset - pos : 0;
+            long to = end < pos + data_len ? end - pos : data_len;
+            long moved = 0;
+            if (from < e->size) {
+                int fd = open(e->path, O_RDONLY);
+                if (fd >= 0 && lseek(fd, from, SEEK_SET) == from)
+                    moved = send_file_data(sock, fd, (to < e->size ? to : e->size) - from);
+                if (fd >= 0) close(fd);
+            }
+            if (tar_send_bytes(sock, NULL, to - from - moved) < 0) return -1;
+        }
+        pos += data_len;
+    }
+
+    // The two zero blocks closing the archive
+    if (end > pos) return tar_send_bytes(sock, NULL, end - (offset > pos ? offset : pos));
+    return 0;
+}
+
+/**
+ * @brief Answers a tar request from a listed archive
+ * @param sock Requester (S1, or the client when S1 holds the files)
+ * @param job Listed job
+ * @param tar_size Archive size returned by tar_collect()
+ * @param mode 'T' the archive, 'E' its member index, 'B' a byte range of it
+ * @param id Archive id the range was taken from ('B')
+ * @param offset First byte of the range ('B')
+ * @param length Length of the range ('B')
+ * @return 0 when everything was sent, -1 otherwise
+ *
+ * Replies status 1 + length + bytes, or -1 + msg_len + msg when the
+ * archive changed since its index was made or the range is outside it.
+ */
+int tar_reply(int sock, TarJob *job, long tar_size, char mode, unsigned long long id, long offset, long length) {
+    const char *err_msg = NULL;
+    char *index = NULL;
+    long index_len = 0;
+    if (mode == 'B' && id != job->id)
+        err_msg = "EArchive changed since its index was made";
+    else if (mode == 'B' && (offset < 0 || length < 0 || offset > tar_size || length > tar_size - offset))
+        err_msg = "ERange outside the archive";
+    else if (mode == 'E' && !(index = tar_index(job, tar_size, &index_len)))
+        err_msg = "EOut of memory";
+    if (err_msg) {
+        long error = -1;
+        int msg_len = strlen(err_msg);
+        send(sock, &error, sizeof(long), 0);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        printf("%s\n", err_msg);
+        return -1;
+    }
+
+    long status = 1;
+    long len = mode == 'E' ? index_len : mode == 'B' ? length : tar_size;
+    send(sock, &status, sizeof(long), 0);
+    send(sock, &len, sizeof(long), 0);
+    int sent = mode == 'E' ? tar_send_bytes(sock, index, index_len)
+             : mode == 'B' ? tar_send_range(job, sock, offset, length)
+             : tar_stream(job, sock);
+    free(index);
+    return sent;
+}
+
+/**
+ * @brief Frees a tar job, including entries left unsent
+ */
+void tar_job_free(TarJob *job) {
+    for (int i = 0; i < job->count; i++) {
+        free(job->entries[i].path);
+        free(job->entries[i].record);
+        if (job->entries[i].fd >= 0) close(job->entries[i].fd);
+    }
+    free(job->entries);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+}
+
+/**
+ * @brief Processes download tar archive requests
+ * @param client_sock The client socket descriptor
+ * @param filetype The file extension to tar (c/pdf/txt)
+ * @param mode 'T' the archive, 'E' its member index, 'B' a byte range of it
+ * @param id Archive id from the index ('B')
+ * @param offset First byte of the range ('B')
+ * @param length Length of the range ('B')
+ * 
+ * For .c files: Writes the tar locally from S1 storage (or asks S5 in gateway mode);
+ * files are read by a pool of threads and sent in name order (see tar_stream)
+ * For pdf/txt: Forwards request to appropriate storage server
+ * Streams the tar directly to client, with no temporary file
+ * 
+ * @details Implements protocol:
+ * 'T' - Tar Files
+ *   1. S1 → Storage: 'T' + filetype_len + filetype (.pdf/.txt) + root_len +
+ *      root (tenant storage root, "" for the default namespace)
+ *   2. Storage → S1: tar_size + tar_data
+ * 'E' - Member index of the same archive (see tar_index)
+ *   1. S1 → Storage: 'E' + filetype_len + filetype + root_len + root
+ *   2. Storage → S1: index_len + index
+ * 'B' - Byte range of the same archive
+ *   1. S1 → Storage: 'B' + filetype_len + filetype + root_len + root +
+ *      archive id + offset + length
+ *   2. Storage → S1: length + data, or -1 + msg if the archive changed
+ */
+void handle_downloadtar_request(int client_sock, const char *filetype, char mode,
+                                unsigned long long id, long offset, long length) {
+    // Validate filetype
+    if (!filetype || strlen(filetype) == 0|| (strcmp(filetype, "c") != 0 && 
+                    strcmp(filetype, "pdf") != 0 && 
+                    strcmp(filetype, "txt") != 0)){
+        send(client_sock, "EInvalid filetype (use: c, pdf, txt)", 35, 0);
+        return;
+    }
+
+    // Determine target server
+    int target_port;
+
+    // If the received file type is "c" and S1 stores it
+    if (strcmp(filetype, "c") == 0 && !c_store_port) {
+        // Handle .c files locally
+  
+        // First check if S1 directory exists (the tenant's root for a tenant session)
+        struct stat st;
+        char s1_dir[MAX_PATH_LEN];
+        snprintf(s1_dir, sizeof(s1_dir), "%s/S1%s", getenv("HOME"), tenant_root);
+
+        // The tenants' roots are not part of the default namespace
+        char skip_dir[MAX_PATH_LEN + 16] = "";
+        if (!tenant_root[0])
+            snprintf(skip_dir, sizeof(skip_dir), "%s/%s", s1_dir, TENANT_DIR);
+        if (stat(s1_dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+            long error = -1;
+            send(client_sock, &error, sizeof(long), 0);
+            char *err_msg = "ES1 directory not found";
+            int msg_len = strlen(err_msg);
+            send(client_sock, &msg_len, sizeof(int), 0);
+            send(client_sock, err_msg, msg_len, 0);
+            printf("ES1 directory not found\n");
+            return;
+        }
+
+        // List the .c files, sorted by name
+        TarJob job;
+        long tar_size = tar_collect(&job, s1_dir, ".c", skip_dir);
+        if (job.count == 0) {
+            long error = -1;
+            send(client_sock, &error, sizeof(long), 0);
+            char *err_msg = "ENo .c files found in S1 directory";
+            int msg_len = strlen(err_msg);
+            send(client_sock, &msg_len, sizeof(int), 0);
+            send(client_sock, err_msg, msg_len, 0);
+            printf("ENo .c files found in S1 directory\n");
+            tar_job_free(&job);
+            return;
+        }
+
+        // Send the archive, its index or a range of it; the readers prefetch
+        // the next files while the archive streams
+        int sent = tar_reply(client_sock, &job, tar_size, mode, id, offset, length) == 0;
+        printf("Tar %c of %d file(s), %ld bytes %s\n", mode, job.count, tar_size,
+               sent ? "sent successfully to client" : "cut short, client hung up");
+        tar_job_free(&job);
+
+        return;
     }
-    // If the received file has any other extension
     else {
-        send(client_sock, "EUnsupported file type", 22, 0);
+        // Route to appropriate server
+        if (strcmp(filetype, "pdf") == 0) {
+            target_port = PORT_S2;
+        } else if (strcmp(filetype, "txt") == 0) {
+            target_port = PORT_S3;
+        } else {
+            target_port = c_store_port;
+        }
+
+        // Take the relay buffer before the server's status is passed on
+        char *buffer = acquire_transfer_buffer();
+        if (!buffer) {
+            send_error_status(client_sock, "EServer busy, transfer budget exhausted. Try again later");
+            return;
+        }
+
+        int server_sock = connect_to_target_server(target_port, client_sock);
+        if (server_sock < 0) {
+            release_transfer_buffer(buffer);
+            return;  // Error already handled
+        }
+        printf("Server Connected.\n");
+
+        // Send tar command ('T', 'E' or 'B') to target server (S2/S3/S5 : pdf/txt/c)
+        send(server_sock, &mode, 1, 0);
+
+        // Send filetype length and filetype to target server
+        int type_len = strlen(filetype);
+        send(server_sock, &type_len, sizeof(int), 0);
+        send(server_sock, filetype, type_len, 0);
+
+        // Storage root to archive ("" for the default namespace)
+        int root_len = strlen(tenant_root);
+        send(server_sock, &root_len, sizeof(int), 0);
+        send(server_sock, tenant_root, root_len, 0);
+
+        // The range and the archive it was taken from
+        if (mode == 'B') {
+            send(server_sock, &id, sizeof(id), 0);
+            send(server_sock, &offset, sizeof(long), 0);
+            send(server_sock, &length, sizeof(long), 0);
+        }
+
+        // Wait for status byte from target server
+        // If directory and file is present in target server, only then proceed
+        long status1;
+        recv(server_sock, &status1, sizeof(long), 0);
+        send(client_sock, &status1, sizeof(long), 0);
+        printf("status1: %ld\n", status1);
+
+        if (status1 == -1) {
+            //printf("ES1 directory or .pdf files not found\n");
+            int msg_len;
+            recv(server_sock, &msg_len, sizeof(int), 0);
+            printf("msg_len: %d\n", msg_len);
+            char error_msg[BUFFER_SIZE];
+            recv(server_sock, error_msg, msg_len, 0);
+            error_msg[msg_len] = '\0';
+            printf("Error: %s\n", error_msg);
+            //send(client_sock, &status1, sizeof(long), 0);
+            send(client_sock, &msg_len, sizeof(int), 0);
+            send(client_sock, error_msg, msg_len, 0);
+            release_transfer_buffer(buffer);
+            close(server_sock);
+            return;
+        }
+
+        // Receive tar file size from target server
+        long tar_size;
+        recv(server_sock, &tar_size, sizeof(long), MSG_WAITALL);
+
+        if (tar_size < 0) {
+            char error_msg[100];
+            int msg_len;
+            recv(server_sock, &msg_len, sizeof(int), 0);
+            recv(server_sock, error_msg, msg_len, 0);
+            error_msg[msg_len] = '\0';
+            send(client_sock, error_msg, msg_len, 0);
+            release_transfer_buffer(buffer);
+            close(server_sock);
+            return;
+        }
+
+        // Forward tar file size to client
+        send(client_sock, &tar_size, sizeof(long), 0);
+
+        // Receive response from target server and send it to client
+        relay_bytes(server_sock, client_sock, buffer, tar_size);
+        release_transfer_buffer(buffer);
+
+        // Close the server socket
+        close(server_sock);
+        printf("Tar file sent successfully to client\n");
+    }
+}
+
+/**
+ * @brief Extension ranks, in the order listings are sorted (.c → .pdf → .txt → .zip)
+ */
+enum { EXT_C, EXT_PDF, EXT_TXT, EXT_ZIP };
+
+/**
+ * @brief Structure representing a file entry in a listing
+ * 
+ * @var name_off Offset of the filename inside the owning FileList's name block
+ * @var ext_rank Extension rank (EXT_C, EXT_PDF, EXT_TXT, EXT_ZIP)
+ * 
+ * @note Entries own no memory; the whole listing is freed with file_list_free()
+ */
+typedef struct
+{
+    unsigned int name_off;  /**< Offset of the NUL-terminated filename */
+    unsigned int name_len;  /**< Filename length without the NUL */
+    unsigned char ext_rank; /**< Extension rank used for sorting */
+} FileEntry;
+
+/**
+ * @brief Per-request arena holding a directory listing
+ *
+ * Filenames are packed back to back into one growing block and entries
+ * refer to them by offset, so a listing of any size costs two buffers
+ * (grown geometrically) instead of two allocations per file.
+ */
+typedef struct
+{
+    FileEntry *entries;     /**< Entry array */
+    int count;              /**< Entries in use */
+    int capacity;           /**< Entries allocated */
+    char *names;            /**< Packed NUL-terminated filenames */
+    size_t names_used;      /**< Bytes of names in use */
+    size_t names_cap;       /**< Bytes of names allocated */
+} FileList;
+
+/**
+ * @brief Reserves room for one more entry with a name of len bytes
+ * @param list Listing arena
+ * @param len Filename length without the NUL
+ * @return Pointer where the name must be written, NULL on allocation failure
+ *
+ * The entry is not counted until file_list_commit() is called, so a
+ * failed receive can simply be abandoned.
+ */
+char *file_list_reserve(FileList *list, size_t len)
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        FileEntry *entries = realloc(list->entries, capacity * sizeof(FileEntry));
+        if (!entries) return NULL;
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    if (list->names_used + len + 1 > list->names_cap)
+    {
+        size_t cap = list->names_cap ? list->names_cap * 2 : 16384;
+        while (cap < list->names_used + len + 1) cap *= 2;
+        char *names = realloc(list->names, cap);
+        if (!names) return NULL;
+        list->names = names;
+        list->names_cap = cap;
+    }
+    return list->names + list->names_used;
+}
+
+/**
+ * @brief Records the entry whose name was written at file_list_reserve()
+ * @param list Listing arena
+ * @param len Filename length without the NUL
+ * @param ext_rank Extension rank of the file
+ */
+void file_list_commit(FileList *list, size_t len, unsigned char ext_rank)
+{
+    FileEntry *entry = &list->entries[list->count++];
+    entry->name_off = list->names_used;
+    entry->name_len = len;
+    entry->ext_rank = ext_rank;
+    list->names[list->names_used + len] = '\0';
+    list->names_used += len + 1;
+}
+
+/**
+ * @brief Releases a listing arena in one go
+ * @param list Listing arena
+ */
+void file_list_free(FileList *list)
+{
+    free(list->entries);
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+}
+
+// Name block of the listing being sorted (qsort passes entries only)
+static const char *sort_names;
+
+/**
+ * @brief Comparator function for sorting FileEntry structures
+ * 
+ * @param a First FileEntry to compare
+ * @param b Second FileEntry to compare
+ * @return int Negative if a < b, positive if a > b, zero if equal
+ * 
+ * @details Sorts files first by extension order (.c → .pdf → .txt → .zip),
+ *          then alphabetically by filename within each extension group.
+ *          Designed for use with qsort() after setting sort_names.
+ */
+int compare_files(const void *a, const void *b)
+{
+    const FileEntry *fa = (const FileEntry *)a;
+    const FileEntry *fb = (const FileEntry *)b;
+
+    // First sort by extension order: .c, .pdf, .txt, .zip
+    if (fa->ext_rank != fb->ext_rank)
+        return fa->ext_rank - fb->ext_rank;
+
+    // Then sort alphabetically within each extension group
+    return strcmp(sort_names + fa->name_off, sort_names + fb->name_off);
+}
+
+/**
+ * @brief Retrieves files with specific extension from a directory
+ * 
+ * @param path Directory path to search
+ * @param ext File extension to filter by (e.g. ".c")
+ * @param ext_rank Rank recorded for matching files (e.g. EXT_C)
+ * @param files Listing arena the matches are appended to
+ * 
+ * @details Scans specified directory for regular files matching given extension.
+ *          Uses the directory entry type when the filesystem provides it and
+ *          only falls back to stat() for unknown types.
+ */
+void get_files_from_dir(const char *path, const char *ext, unsigned char ext_rank, FileList *files)
+{
+    DIR *dir;
+    struct dirent *ent;
+
+    if ((dir = opendir(path)) != NULL)
+    {
+        while ((ent = readdir(dir)) != NULL)
+        {
+            int regular = ent->d_type == DT_REG;
+            if (ent->d_type == DT_UNKNOWN)
+            {
+                char fullpath[1024];
+                snprintf(fullpath, sizeof(fullpath), "%s/%s", path, ent->d_name);
+
+                struct stat st;
+                regular = stat(fullpath, &st) == 0 && S_ISREG(st.st_mode);
+            }
+
+            if (regular)
+            {
+                char *dot = strrchr(ent->d_name, '.');
+                if (dot && strcmp(dot, ext) == 0)
+                {
+                    size_t len = strlen(ent->d_name);
+                    char *name = file_list_reserve(files, len);
+                    if (!name) break;
+                    memcpy(name, ent->d_name, len);
+                    file_list_commit(files, len, ext_rank);
+                }
+            }
+        }
+        closedir(dir);
+    }
+}
+
+/**
+ * @brief Requests a list of files from a remote server based on directory and extension.
+ *
+ * This function establishes a TCP connection to a secondary server (e.g., S2, S3, S4),
+ * sends a request to list files in a specific directory (`pathname`), and retrieves 
+ * filenames matching a specific extension. The received filenames are written straight
+ * into the listing arena.
+ *
+ * @param ip        IP address of the server to connect to (e.g., "127.0.0.1").
+ * @param port      Port number of the target server (e.g., 9002, 9003, 9004).
+ * @param pathname  Directory path on the server to search for files (e.g., "~S2/folder1").
+ * @param ext_rank  Extension rank used to tag returned entries (e.g., EXT_PDF).
+ * @param files     Listing arena the filenames are appended to.
+ *
+ * @return 0 on success, -1 on failure (e.g., socket error, connection error, or no valid response).
+ */
+int request_files_from_server(const char *ip, int port, const char *pathname, unsigned char ext_rank, FileList *files) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    serv_addr.sin_addr.s_addr = inet_addr(ip);
+
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || authenticate_to_storage(sock) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    // send(sock, command, strlen(command), 0);
+    char command = 'L';
+    send(sock, &command, 1, 0);
+
+    int path_len = strlen(pathname);
+    send(sock, &path_len, sizeof(int), 0);
+    send(sock, pathname, path_len, 0);
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) <= 0 || status != 1) {
+        close(sock);
+        return -1;
+    }
+
+    // Receive file count
+    int remote_count;
+    if (recv(sock, &remote_count, sizeof(int), MSG_WAITALL) <= 0) {
+        close(sock);
+        return -1;
+    }
+
+    for (int i = 0; i < remote_count; i++) {
+        int len;
+        if (recv(sock, &len, sizeof(int), MSG_WAITALL) <= 0 || len <= 0 || len >= MAX_PATH_LEN) break;
+
+        // Receive the name directly into the arena
+        char *fname = file_list_reserve(files, len);
+        if (!fname || recv(sock, fname, len, MSG_WAITALL) != len) break;
+        file_list_commit(files, len, ext_rank);
+    }
+
+    close(sock);
+    return 0;
+}
+
+// Utility function to replace occurrences of a substring in a string
+char* str_replace(char *str, const char *old, const char *new) {
+    static char buffer[4096];
+    char *p;
+
+    if (!(p = strstr(str, old))) {
+        return str;
+    }
+
+    strncpy(buffer, str, p - str); // Copy the part before 'old'
+    buffer[p - str] = '\0';
+
+    sprintf(buffer + (p - str), "%s%s", new, p + strlen(old)); // Append new part
+
+    return buffer;
+}
+
+
+/**
+ * @brief Processes directory listing requests
+ * @param client_sock Client socket descriptor
+ * @param pathname Directory path to list (~S1/...)
+ *
+ * Aggregates file lists from all storage servers
+ * Combines .c (local), .pdf (S2), .txt (S3), .zip (S4)
+ * Sorts results alphabetically by filename
+ * Returns only filenames with extensions
+ * Handles permission errors and invalid paths
+ * 
+ * @details Implements protocol:
+ * 'L' - List Files
+ *   1. S1 → Storage: 'L' + path_len + path
+ *   2. Storage → S1: file_count + [filename1, filename2...]
+ *
+ * 'Y' - Symbol lookup (S5, gateway mode)
+ *   1. S1 → S5: 'Y' + the symf request of handle_symbol_request()
+ *   2. S5 → S1: the symf reply, then S5 closes the connection
+ */
+void handle_pathname_request(int client_sock, const char *pathname) {
+    // Validate input
+    if (!pathname || strlen(pathname) == 0) {
+        send(client_sock, "EEmpty pathname", 15, 0);
         return;
     }
 
-    int server_sock = connect_to_target_server(target_port, client_sock);
-    if (server_sock < 0) {
-        return;  // Error already handled
+    // Only directories below ~S1 are listed
+    if (strncmp(pathname, "~S1", 3) != 0 || (pathname[3] != '\0' && pathname[3] != '/') ||
+        strstr(pathname, "..")) {
+        send(client_sock, "EPath must be in format: ~S1/...", 33, 0);
+        return;
     }
-    printf("Server Connected.\n");
 
-    // Send download command ('D') to target server
-    char command_type = 'D';
-    send(server_sock, &command_type, 1, 0);
+    printf("Received pathname: %s\n", pathname);
 
-    // If connection is successful to target server
-    // Send status to client to proceed
-    long status = 1;
-    send(client_sock, &status, sizeof(long), 0);
+    FileList files = {0};
+    char base_path[MAX_PATH_LEN];
+    char *home_dir = getenv("HOME");
 
-    // Send original path (unchanged) e.g.: ~S1/1.txt
-    int path_len = strlen(filepath);
-    send(server_sock, &path_len, sizeof(int), 0);
-    send(server_sock, filepath, path_len, 0);
+    if (!home_dir) {
+        send(client_sock, "EHome directory not found", 25, 0);
+        return;
+    }
 
-    // Wait for status byte from target server
-    // If file is present in target server, only then proceed
-    char status1;
-    recv(server_sock, &status1, 1, 0);
+    // Helper macro for collecting files from a directory
+    #define COLLECT_FILES(SERVER, EXT, RANK) \
+        snprintf(base_path, sizeof(base_path), "%s/" SERVER "%s", home_dir, pathname + 3); \
+        get_files_from_dir(base_path, EXT, RANK, &files);
 
-    if (status1 == -1) {
-        //printf("EFile not found\n");
-        int msg_len;
-        recv(server_sock, &msg_len, sizeof(int), 0);
-        char error_msg[BUFFER_SIZE];
-        recv(server_sock, error_msg, msg_len, 0);
-        error_msg[msg_len] = '\0';
-        printf("Error: %s\n", error_msg);
-        // File not found: send a size of -1
-        long error = -1;
-        send(client_sock, &error, sizeof(long), 0);
-        //send(client_sock, msg, strlen(msg), 0);
-        send(client_sock, &msg_len, sizeof(int), 0);
-        send(client_sock, error_msg, msg_len, 0);
-        close(server_sock);
-        return;
+    // Request file lists from remote servers
+    // Modify the path by replacing S1 with the respective server's directory
+    char new_path[1024];
+
+    // Get .c files from the local S1 directory, or from S5 in gateway mode
+    if (c_store_port) {
+        snprintf(new_path, sizeof(new_path), "%s", pathname);
+        char *path_s5 = str_replace(new_path, "S1", "S5");
+        request_files_from_server(storage_host, c_store_port, path_s5, EXT_C, &files);
+    } else {
+        COLLECT_FILES("S1", ".c", EXT_C);
     }
 
-    // Receive file size from target server
-    long file_size;
-    recv(server_sock, &file_size, sizeof(long), 0);
+    // For S2 (.pdf files)
+    snprintf(new_path, sizeof(new_path), "%s", pathname);
+    char *path_s2 = str_replace(new_path, "S1", "S2");
+    request_files_from_server(storage_host, PORT_S2, path_s2, EXT_PDF, &files); 
 
-    // Send file size to client
-    send(client_sock, &file_size, sizeof(long), 0);
+    // For S3 (.txt files)
+    snprintf(new_path, sizeof(new_path), "%s", pathname);
+    char *path_s3 = str_replace(new_path, "S1", "S3");
+    request_files_from_server(storage_host, PORT_S3, path_s3, EXT_TXT, &files); 
 
-    // Forward the response to client
-    // Receive response from target server and send it to client
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes;
-    while ((bytes = recv(server_sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        printf("File content sent to client : %s\n", buffer);
-        send(client_sock, buffer, bytes, 0);
+    // For S4 (.zip files)
+    snprintf(new_path, sizeof(new_path), "%s", pathname);
+    char *path_s4 = str_replace(new_path, "S1", "S4");
+    request_files_from_server(storage_host, PORT_S4, path_s4, EXT_ZIP, &files);
+
+    // Sort files
+    sort_names = files.names;
+    qsort(files.entries, files.count, sizeof(FileEntry), compare_files);
+
+    // Send status first
+    long status = 1;
+    send(client_sock, &status, sizeof(long), 0);
+
+    // Send file count
+    send(client_sock, &files.count, sizeof(int), 0);
+
+    // Send filenames one by one
+    for (int i = 0; i < files.count; i++) {
+        const char *name = files.names + files.entries[i].name_off;
+        int fnlen = files.entries[i].name_len;
+        send(client_sock, &fnlen, sizeof(int), 0);
+        send(client_sock, name, fnlen, 0);
+        printf("Sent file Name: %s\n", name);
     }
 
-    // Close the server socket
-    close(server_sock);
-    printf("File sent successfully to client.\n");
+    // Free the whole listing at once
+    file_list_free(&files);
+
+    printf("Completed sending file list.\n");
 }
 
 /**
- * @brief Processes file deletion requests
+ * @brief Processes statf requests: metadata of one or more files
  * @param client_sock The client socket descriptor
- * @param filepath The full client path (~S1/...)
+ * @param paths Client paths (~S1/...)
+ * @param count Number of paths (at most STAT_MAX_PATHS)
  *
- * Directly deletes .c files on S1
- * For pdf/txt: Forwards delete request to appropriate storage server
- * Validates paths and handles errors
- * 
- * @details Implements protocol:
- * 'R' - Remove File
- *   1. S1 → Storage: 'R' + path_len + path  
- *   2. Storage → S1: Success/Failure response
+ * .c files are answered from the local filesystem (by S5 in gateway
+ * mode); other types are grouped per storage server and resolved with a
+ * single 'S' request each,
+ * so no file is opened for reading and no data is streamed.
+ *
+ * @details Replies status 1 + count + count x StatReply, in request order.
+ * Paths that are invalid, of an unsupported type, or on an unreachable
+ * server are reported as not existing.
  */
-void handle_remove_request(int client_sock, const char *filepath) 
-{
-    // Validate input
-    if (!filepath || strlen(filepath) == 0) {
-        send(client_sock, "EEmpty file path", 16, 0);
-        return;
-    }
+void handle_stat_request(int client_sock, char **paths, int count) {
+    static const char *remote_ext[] = {".pdf", ".txt", ".zip", ".c"};
+    int remote_port[] = {PORT_S2, PORT_S3, PORT_S4, c_store_port};
+    StatReply replies[STAT_MAX_PATHS];
 
-    // Extract file extension
-    const char *ext = strrchr(filepath, '.');
-    if (!ext) {
-        send(client_sock, "EInvalid file: no extension", 27, 0);
-        return;
-    }
-    ext++; // Move past the dot
-    printf("Extension is: %s\n", ext);
+    for (int i = 0; i < count; i++) {
+        memset(&replies[i], 0, sizeof(StatReply));
+        replies[i].exists = -1;
 
-    // If the received file has a ".c" extension
-    if (strcmp(ext, "c") == 0) 
-    {
-        // Handle .c file locally
-        char local_path[MAX_PATH_LEN];
-        char *home_dir = NULL;
-        const char *s1_part = strstr(filepath, "S1/");  // Pointer to S
+        // Only .c files are stored locally, and not by a gateway
+        char *ext = strrchr(paths[i], '.');
+        if (c_store_port || strncmp(paths[i], "~S1/", 4) != 0 || strstr(paths[i], "..") || !ext ||
+            strcmp(ext, ".c") != 0)
+            continue;
 
-            // Validate path format
-        if (!s1_part || s1_part - filepath !=1 || strncmp(filepath, "~S1/", 4) != 0) 
-        {
-            send(client_sock, "EPath must be in format: ~S1/...", 33, 0);
-            return;
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, sizeof(local_path), "%s/S1/%s", getenv("HOME"), paths[i] + 4);
+        struct stat st;
+        if (stat(local_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            replies[i].exists = 1;
+            replies[i].size = st.st_size;
+            replies[i].mtime = st.st_mtime;
+            load_cached_hash(local_path, &st, &replies[i].hash);
         }
+    }
 
-        // Build absolute path with buffer safety
-        // Converts ~S1/.. to /home/user/S1/..
-        home_dir = getenv("HOME");
-        snprintf(local_path, MAX_PATH_LEN, "%s/S1/%s", home_dir, s1_part + 3);
-        printf("Absolute path of file in S1:%s\n",local_path);
+    // One batched metadata request per storage server
+    for (int s = 0; s < 4; s++) {
+        if (!remote_port[s]) continue;
+        int batch[STAT_MAX_PATHS];
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            char *ext = strrchr(paths[i], '.');
+            if (strncmp(paths[i], "~S1/", 4) == 0 && ext && strcmp(ext, remote_ext[s]) == 0)
+                batch[n++] = i;
+        }
+        if (n > 0 && stat_on_server(remote_port[s], paths, batch, n, replies) < 0)
+            printf("Storage server on port %d unreachable for stat\n", remote_port[s]);
+    }
 
-        // Send status to client to proceed for removing
-        long status = 1;
-        send(client_sock, &status, sizeof(long), 0);
+    long status = 1;
+    send(client_sock, &status, sizeof(long), 0);
+    send(client_sock, &count, sizeof(int), 0);
+    send(client_sock, replies, count * sizeof(StatReply), 0);
+    printf("Stat of %d path(s) sent to client\n", count);
+}
 
-        // Execute deletion
-        if (remove(local_path) == 0) {
-            send(client_sock, "SFile deleted successfully", 26, 0);
-            printf("SFile deleted successfully\n");
-        } 
-        else {
-            // Provide specific error messages
-            switch (errno) {
-                case ENOENT:
-                    printf("EFile not found\n");
-                    send(client_sock, "EFile not found", 15, 0);
-                    break;
-                case EACCES:
-                    printf("EPermission denied\n");
-                    send(client_sock, "EPermission denied", 18, 0);
-                    break;
-                default:
-                    printf("EFile deletion failed\n");
-                    send(client_sock, "EFile deletion failed", 21, 0);
-            }
-        }
+/**
+ * @brief Fetches the scrubber report of one storage server
+ * @param port Storage server port
+ * @param report Receives the report
+ * @return 0 on success, -1 if the server could not be queried
+ *
+ * @details Protocol 'I' - Scrubber statistics:
+ *   1. S1 → Storage: 'I'
+ *   2. Storage → S1: status (1) + ScrubReport
+ */
+int request_scrub_report(int port, ScrubReport *report) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
 
-        return;
-    } 
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    serv_addr.sin_addr.s_addr = inet_addr(storage_host);
 
-    // If the received file has an extension other than ".c", send it to another server
-    // Select appropriate target server for non-.c files
-    // Determine target port
-    int target_port;
-    // If the received file has a ".pdf" extension
-    if (strcmp(ext, "pdf") == 0) {
-        target_port = PORT_S2;
-    }
-    // If the received file has a ".txt" extension 
-    else if (strcmp(ext, "txt") == 0) {
-        target_port = PORT_S3;
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || authenticate_to_storage(sock) < 0) {
+        close(sock);
+        return -1;
     }
-    // If the received file has a ".zip" extension 
-    else if (strcmp(ext, "zip") == 0) {
-        target_port = PORT_S4;
-    } 
-    // If the received file has any other extension
-    else {
-        send(client_sock, "EUnsupported file type", 22, 0);
-        return;
+
+    char command = 'I';
+    send(sock, &command, 1, 0);
+
+    long status;
+    int ok = recv(sock, &status, sizeof(long), MSG_WAITALL) == sizeof(long) && status == 1 &&
+             recv(sock, report, sizeof(*report), MSG_WAITALL) == sizeof(*report);
+    close(sock);
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Processes stats requests: integrity scrubber results of S1-S4
+ * @param client_sock The client socket descriptor
+ *
+ * @details Replies status 1 + count (4) + 4 x ScrubReport in server order
+ * S1, S2, S3, S4. An unreachable server is reported with passes = -1.
+ * A gateway reports S5, which holds its .c files, in place of S1.
+ */
+void handle_stats_request(int client_sock) {
+    int ports[] = {c_store_port, PORT_S2, PORT_S3, PORT_S4};
+    ScrubReport reports[4];
+
+    if (!c_store_port) {
+        pthread_mutex_lock(&scrub_stats->lock);
+        reports[0] = scrub_stats->report;
+        pthread_mutex_unlock(&scrub_stats->lock);
     }
 
-    int server_sock = connect_to_target_server(target_port, client_sock);
-    if (server_sock < 0) {
-        return;  // Error already handled
+    for (int i = 0; i < 4; i++) {
+        if (ports[i] && request_scrub_report(ports[i], &reports[i]) < 0) {
+            memset(&reports[i], 0, sizeof(ScrubReport));
+            reports[i].passes = -1;
+        }
     }
-    printf("Server Connected.\n");
-    printf("Filepath: %s\n",filepath);
 
-    // Send remove command to storage server
-    char command_type = 'R'; // 'R' for remove
-    if (send(server_sock, &command_type, 1, 0) != 1) {
-        perror("Failed to send command type");
-        close(server_sock);
-        send(client_sock, "EInternal server error", 22, 0);
-        return;
+    // Mismatching files are named only within the session's namespace
+    for (int i = 0; i < 4; i++) {
+        char *path = reports[i].last_mismatch + 3;   // Past "~S1"
+        if (!reports[i].last_mismatch[0])
+            continue;
+        if (!tenant_visible(path))
+            reports[i].last_mismatch[0] = '\0';
+        else
+            memmove(path, tenant_display(path), strlen(tenant_display(path)) + 1);
     }
 
-    // If connection is successful to target server
-    // Send status to client to proceed
     long status = 1;
+    int count = 4;
     send(client_sock, &status, sizeof(long), 0);
+    send(client_sock, &count, sizeof(int), 0);
+    send(client_sock, reports, sizeof(reports), 0);
+    printf("Scrubber statistics sent to client\n");
+}
 
-    // Send path length and path to target storage server
-    int path_len = strlen(filepath);
-    printf("Filepath length: %d\n",path_len);
-
-    if (send(server_sock, &path_len, sizeof(int), 0) != sizeof(int)) 
-    {
-        perror("Failed to send path length");
-        // Close the socket and notify the client about the failure
-        close(server_sock);
-        send(client_sock, "EInternal server error", 22, 0);
+/**
+ * @brief Processes versions requests: the live file and its prior versions
+ * @param client_sock The client socket descriptor
+ * @param filepath The full client path (~S1/...)
+ *
+ * .c files are listed locally (by S5 in gateway mode); other types are
+ * forwarded to their storage server.
+ *
+ * @details Replies status 1 + count + count x VersionInfo (newest first),
+ * or status -1 + msg_len + msg.
+ * 'V' - Version listing
+ *   1. S1 → Storage: 'V' + path_len + path
+ *   2. Storage → S1: the same reply
+ */
+void handle_versions_request(int client_sock, const char *filepath) {
+    const char *ext = strrchr(filepath, '.');
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..") || !ext) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
         return;
     }
-    if (send(server_sock, filepath, path_len, 0) != path_len) 
-    {
-        perror("Failed to send path");
-        // Close the socket and notify the client about the failure
+
+    VersionInfo versions[VERSION_LIST_MAX];
+    int count = 0;
+    if (strcmp(ext, ".c") == 0 && !c_store_port) {
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, sizeof(local_path), "%s/S1/%s", getenv("HOME"), filepath + 4);
+        count = list_versions(local_path, filepath + 3, versions);
+    } else {
+        int target_port;
+        if (strcmp(ext, ".pdf") == 0) target_port = PORT_S2;
+        else if (strcmp(ext, ".txt") == 0) target_port = PORT_S3;
+        else if (strcmp(ext, ".zip") == 0) target_port = PORT_S4;
+        else if (strcmp(ext, ".c") == 0) target_port = c_store_port;
+        else {
+            send_error_status(client_sock, "EUnsupported file type");
+            return;
+        }
+
+        int server_sock = connect_to_target_server(target_port, client_sock);
+        if (server_sock < 0) {
+            return;  // Error already handled
+        }
+        char command_type = 'V';
+        int path_len = strlen(filepath);
+        send(server_sock, &command_type, 1, 0);
+        send(server_sock, &path_len, sizeof(int), 0);
+        send(server_sock, filepath, path_len, 0);
+
+        long status;
+        if (recv(server_sock, &status, sizeof(long), MSG_WAITALL) == sizeof(long) && status == 1 &&
+            recv(server_sock, &count, sizeof(int), MSG_WAITALL) == sizeof(int) &&
+            count > 0 && count <= VERSION_LIST_MAX) {
+            long want = count * sizeof(VersionInfo);
+            if (recv(server_sock, versions, want, MSG_WAITALL) != want)
+                count = 0;
+        } else {
+            count = 0;
+        }
         close(server_sock);
-        send(client_sock, "EInternal server error", 22, 0);
-        return;
     }
 
-    // Get response from storage server, store it in the response buffer
-    char response[BUFFER_SIZE];
-    ssize_t bytes_received = recv(server_sock, response, BUFFER_SIZE, 0);
-    response[bytes_received] = '\0';    // Update last character
-    printf("Response received from server: %s\n",response);
-    printf("Response bytes received : %d\n",bytes_received);
-    close(server_sock); // Close the socket 
-
-    // Send response to client
-    if (bytes_received <= 0) {
-        send(client_sock, "ENo response from storage server", 31, 0);
-    } else {
-        printf("Response send to client : %s\n",response);
-        // Forward the storage server's response to the client
-        send(client_sock, response, bytes_received, 0);
+    if (count == 0) {
+        send_error_status(client_sock, "EFile not found");
+        return;
     }
+    long status = 1;
+    send(client_sock, &status, sizeof(long), 0);
+    send(client_sock, &count, sizeof(int), 0);
+    send(client_sock, versions, count * sizeof(VersionInfo), 0);
+    printf("%d version(s) of %s sent to client\n", count, filepath);
 }
 
 /**
- * @brief Processes download tar archive requests
+ * @brief Processes undelf requests: restores a removed file from the trash
  * @param client_sock The client socket descriptor
- * @param filetype The file extension to tar (c/pdf/txt)
- * 
- * For .c files: Creates tar locally from S1 storage
- * For pdf/txt: Forwards request to appropriate storage server
- * Streams the tar file directly to client
- * Cleans up temporary files after transfer
- * 
- * @details Implements protocol:
- * 'T' - Tar Files
- *   1. S1 → Storage: 'T' + filetype_len + filetype (.pdf/.txt)
- *   2. Storage → S1: tar_size + tar_data
+ * @param filepath The full client path (~S1/...)
+ *
+ * .c files are restored locally (by S5 in gateway mode); other types by
+ * their storage server.
+ * The restored size is added back to the namespace usage.
+ *
+ * @details Replies status 1 + restored size, or status -1 + msg_len + msg.
+ * 'N' - Undelete
+ *   1. S1 → Storage: 'N' + path_len + path
+ *   2. Storage → S1: the same reply
  */
-void handle_downloadtar_request(int client_sock, const char *filetype) {
-    // Validate filetype
-    if (!filetype || strlen(filetype) == 0|| (strcmp(filetype, "c") != 0 && 
-                    strcmp(filetype, "pdf") != 0 && 
-                    strcmp(filetype, "txt") != 0)){
-        send(client_sock, "EInvalid filetype (use: c, pdf, txt)", 35, 0);
+void handle_undelete_request(int client_sock, const char *filepath) {
+    const char *ext = strrchr(filepath, '.');
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..") || !ext) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
         return;
     }
 
-    // Determine target server
-    int target_port;
-
-    // If the received file type is "c"
-    if (strcmp(filetype, "c") == 0) {
-        // Handle .c files locally
-  
-        // First check if S1 directory exists
-        struct stat st;
-        char s1_dir[256];
-        snprintf(s1_dir, sizeof(s1_dir), "%s/S1", getenv("HOME"));
-        if (stat(s1_dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
-            long error = -1;
-            send(client_sock, &error, sizeof(long), 0);
-            char *err_msg = "ES1 directory not found";
-            int msg_len = strlen(err_msg);
-            send(client_sock, &msg_len, sizeof(int), 0);
-            send(client_sock, err_msg, msg_len, 0);
-            printf("ES1 directory not found\n");
+    long size = 0;
+    int target_port = 0;
+    if (strcmp(ext, ".c") == 0 && !c_store_port) {
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, sizeof(local_path), "%s/S1/%s", getenv("HOME"), filepath + 4);
+        if (restore_from_trash(local_path, filepath + 3, &size) < 0) {
+            if (errno == EEXIST)
+                send_error_status(client_sock, "EA file already exists at this path");
+            else if (errno == ENOENT)
+                send_error_status(client_sock, "ENo removed file to restore at this path");
+            else
+                send_error_status(client_sock, "EFile restore failed");
             return;
         }
-
-        // Check if there are any .c files
-        char check_cmd[512];
-        snprintf(check_cmd, sizeof(check_cmd), 
-                "find %s -type f -name '*.c' | head -n 1 | grep -q .", s1_dir);
-        
-        if (system(check_cmd) != 0) {
-            long error = -1;
-            send(client_sock, &error, sizeof(long), 0);
-            char *err_msg = "ENo .c files found in S1 directory";
-            int msg_len = strlen(err_msg);
-            send(client_sock, &msg_len, sizeof(int), 0);
-            send(client_sock, err_msg, msg_len, 0);
-            printf("ENo .c files found in S1 directory\n");
+    } else {
+        if (strcmp(ext, ".pdf") == 0) target_port = PORT_S2;
+        else if (strcmp(ext, ".txt") == 0) target_port = PORT_S3;
+        else if (strcmp(ext, ".c") == 0) target_port = c_store_port;
+        else {
+            send_error_status(client_sock, "EUnsupported file type");
             return;
         }
-            
-        // Construct tar file name
-        char tar_filename[256];     // cfiles.tar for c tar file
-        snprintf(tar_filename, sizeof(tar_filename), "%sfiles.tar", filetype);
 
-        // Create a temporary directory for server files
-        char temp_dir[] = "server_temp";
-        char dir_command[1024];
-        snprintf(dir_command, sizeof(dir_command), "mkdir %s", temp_dir);
-        if (system(dir_command)) {
-            long error = -1;
-            send(client_sock, &error, sizeof(long), 0);
-            char *err_msg = "ECould not create temp directory";
-            int msg_len = strlen(err_msg);
-            send(client_sock, &msg_len, sizeof(int), 0);
-            send(client_sock, err_msg, msg_len, 0);
-            printf("ECould not create temp directory\n");
-            return;
+        int server_sock = connect_to_target_server(target_port, client_sock);
+        if (server_sock < 0) {
+            return;  // Error already handled
         }
-
-        // Create path for tar file (relative paths)
-        char server_tar_path[512];
-        snprintf(server_tar_path, sizeof(server_tar_path), "%s/%s", temp_dir, tar_filename);
-        printf("Tar file path is: %s\n", server_tar_path);
-
-        // Create file list (relative paths)
-        char list_path[512];
-        snprintf(list_path, sizeof(list_path), "%s/c_files.list", temp_dir);
-        printf("List path is: %s\n", list_path);
-        
-        char cmd[1024];
-        snprintf(cmd, sizeof(cmd), "find ~/S1 -type f -name '*.c' | sed 's|^.*/S1/||' > %s && tar -C ~/S1 -cf %s -T %s",
-               list_path, server_tar_path, list_path);
-        printf("Tar command is: %s\n", cmd);
-        int ret = system(cmd);
-        if (ret != 0) {
-            long error = -1;
-            send(client_sock, &error, sizeof(long), 0);
-            char *err_msg = "ETar creation failed";
-            int msg_len = strlen(err_msg);
-            send(client_sock, &msg_len, sizeof(int), 0);
-            send(client_sock, err_msg, msg_len, 0);
-            printf("ETar creation failed\n");
-            // Cleanup temp files
-            remove(list_path);
-            remove(server_tar_path);
-            rmdir(temp_dir);
+        char command_type = 'N';
+        int path_len = strlen(filepath);
+        send(server_sock, &command_type, 1, 0);
+        send(server_sock, &path_len, sizeof(int), 0);
+        send(server_sock, filepath, path_len, 0);
+
+        long status;
+        if (recv(server_sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+            close(server_sock);
+            send_error_status(client_sock, "ENo response from storage server");
             return;
         }
-
-        // Open tar file
-        FILE *tar_file = fopen(server_tar_path, "rb");
-        if (!tar_file) {
-            long error = -1;
-            send(client_sock, &error, sizeof(long), 0);
-            char *err_msg = "ETar creation failed";
-            int msg_len = strlen(err_msg);
-            send(client_sock, &msg_len, sizeof(int), 0);
-            send(client_sock, err_msg, msg_len, 0);
-            printf("ETar creation failed\n");
+        if (status != 1) {
+            int msg_len;
+            char err_msg[BUFFER_SIZE];
+            if (recv(server_sock, &msg_len, sizeof(int), MSG_WAITALL) != sizeof(int) || msg_len <= 0 ||
+                msg_len >= BUFFER_SIZE || recv(server_sock, err_msg, msg_len, MSG_WAITALL) != msg_len) {
+                strcpy(err_msg, "EFile restore failed");
+            } else {
+                err_msg[msg_len] = '\0';
+            }
+            close(server_sock);
+            send_error_status(client_sock, err_msg);
             return;
         }
+        recv(server_sock, &size, sizeof(long), MSG_WAITALL);
+        close(server_sock);
+    }
 
-        // Move pointer to the end of file to get the size
-        fseek(tar_file, 0, SEEK_END);
-        long tar_size = ftell(tar_file); 
-        fseek(tar_file, 0, SEEK_SET);   // Move pointer back to start of file
+    char prefix[USAGE_PREFIX_LEN];
+    usage_prefix(filepath + 3, prefix);
+    UsageEntry *usage = usage_entry(prefix);
+    usage_add(usage, size, 1);
+    if (target_port) usage_seen(usage, target_port, size, 1);
+    else log_event('A', filepath + 3);
 
-        // Send status to client to proceed
-        long status = 1;
-        send(client_sock, &status, sizeof(long), 0);
+    long status = 1;
+    send(client_sock, &status, sizeof(long), 0);
+    send(client_sock, &size, sizeof(long), 0);
+    printf("File %s restored from trash\n", filepath);
+}
 
-        // Send tar file size to client
-        send(client_sock, &tar_size, sizeof(long), 0);
+/**
+ * @brief Gives a stored file its own inode before it is written in place
+ * @param fullpath Stored file
+ * @return 0 on success (fullpath is now a private copy), -1 on failure
+ *
+ * Versions kept without reflink support are hardlinks of an old inode,
+ * which must never change. The live file only shares its inode with one
+ * when an upload failed after keeping it, but an in-place write must not
+ * reach the version through it. The copy is a reflink where supported.
+ */
+int detach_hardlink(const char *fullpath) {
+    char temppath[MAX_PATH_LEN + 8];
+    snprintf(temppath, sizeof(temppath), "%s.part", fullpath);
+    int fd = open(fullpath, O_RDONLY);
+    int dst = fd >= 0 ? open(temppath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (dst < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    struct stat st;
+    int ok = fstat(fd, &st) == 0;
+    if (ok && ioctl(dst, FICLONE, fd) != 0) {
+        off_t offset = 0;
+        while (ok && offset < st.st_size)
+            ok = sendfile(dst, fd, &offset, st.st_size - offset) > 0;
+    }
+
+    // Carry over generation, expiry and append sequence
+    char names[BUFFER_SIZE], value[256];
+    ssize_t names_len = ok ? flistxattr(fd, names, sizeof(names)) : 0;
+    for (ssize_t i = 0; i < names_len; i += strlen(names + i) + 1) {
+        ssize_t value_len = fgetxattr(fd, names + i, value, sizeof(value));
+        if (value_len >= 0) fsetxattr(dst, names + i, value, value_len, 0);
+    }
+    close(dst);
+    close(fd);
+
+    if (!ok || rename(temppath, fullpath) < 0) {
+        unlink(temppath);
+        return -1;
+    }
+    printf("%s shared its inode, writing to a copy\n", fullpath);
+    return 0;
+}
 
-        char buffer[BUFFER_SIZE];
-        while (tar_size > 0) {
-            int chunk = tar_size > BUFFER_SIZE ? BUFFER_SIZE : tar_size;
-            fread(buffer, 1, chunk, tar_file);
-            send(client_sock, buffer, chunk, 0);
-            printf("File content sent to client : %s\n", buffer);
-            tar_size -= chunk;
+/**
+ * @brief Opens a stored file for updating in place and locks it
+ * @param fullpath Stored file
+ * @param flags Extra open flags: O_APPEND, O_CREAT (create if missing)
+ * @param created Set to 1 if the file was created
+ * @return Locked descriptor, -1 on failure
+ *
+ * The lock (flock) serialises writers per file. A file replaced or
+ * unlinked while waiting for the lock is opened again, so the lock
+ * always covers the inode currently at fullpath.
+ */
+int open_locked(const char *fullpath, int flags, int *created) {
+    for (int attempt = 0; attempt < 8; attempt++) {
+        int fd = -1;
+        *created = 0;
+        if (flags & O_CREAT) {
+            fd = open(fullpath, O_RDWR | flags | O_EXCL, 0644);
+            *created = fd >= 0;
+        }
+        if (fd < 0 && (!(flags & O_CREAT) || errno == EEXIST))
+            fd = open(fullpath, O_RDWR | (flags & ~O_CREAT));
+        if (fd < 0) {
+            if (errno == ENOENT && (flags & O_CREAT)) continue;
+            return -1;
+        }
+        if (flock(fd, LOCK_EX) < 0) {
+            close(fd);
+            return -1;
         }
 
-        // Close the tar file
-        fclose(tar_file);   
+        struct stat locked, current;
+        if (fstat(fd, &locked) == 0 && stat(fullpath, &current) == 0 &&
+            locked.st_ino == current.st_ino && locked.st_dev == current.st_dev) {
+            if (locked.st_nlink <= 1) return fd;
+            // Shared with a kept version: copy, then lock the copy
+            if (detach_hardlink(fullpath) < 0) {
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+    errno = EAGAIN;
+    return -1;
+}
 
-        // Cleanup temp files
-        remove(list_path);
-        remove(server_tar_path);
-        rmdir(temp_dir);
-        printf("Tar file sent successfully to client\n");
+/**
+ * @brief Checks that a range can be written into a stored file
+ * @param fullpath Stored file
+ * @param offset Start of the range
+ * @param expected Version the writer expects, 0 for any
+ * @param err Receives the error message ('E' prefixed)
+ * @param err_len Size of err
+ * @return 0 if the write may proceed, -1 otherwise
+ */
+int check_range(const char *fullpath, long offset, long expected, char *err, size_t err_len) {
+    struct stat st;
+    if (stat(fullpath, &st) < 0 || !S_ISREG(st.st_mode)) {
+        snprintf(err, err_len, "EFile not found");
+        return -1;
+    }
+    if (offset > st.st_size) {
+        snprintf(err, err_len, "EOffset is past the end of the file (%ld bytes)", (long)st.st_size);
+        return -1;
+    }
+    long gen = file_generation(fullpath);
+    if (expected > 0 && gen != expected) {
+        snprintf(err, err_len, "EVersion conflict: the file is at version %ld", gen);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a range of a stored file in place
+ * @param fullpath Stored file
+ * @param offset Start of the range (at most the file size)
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @param expected Version the writer expects, 0 for any
+ * @param version Receives the new version
+ * @param new_size Receives the new file size
+ * @param grown Receives how many bytes the file grew
+ * @param err Receives the error message ('E' prefixed)
+ * @param err_len Size of err
+ * @return 0 on success, -1 on failure
+ *
+ * The version check and the pwrite() happen under the file lock, so two
+ * writers expecting the same version cannot both succeed. Each write is
+ * a new generation (GEN_XATTR); the old contents are not kept as a
+ * version, as that would copy the whole file. The content hash is
+ * recomputed before the lock is released.
+ */
+int write_range(const char *fullpath, long offset, const char *data, long size, long expected,
+                long *version, long *new_size, long *grown, char *err, size_t err_len) {
+    int created;
+    int fd = open_locked(fullpath, 0, &created);
+    if (fd < 0) {
+        snprintf(err, err_len, errno == ENOENT ? "EFile not found" : "EFile could not be opened for writing");
+        return -1;
+    }
+    if (check_range(fullpath, offset, expected, err, err_len) < 0) {
+        close(fd);
+        return -1;
+    }
 
+    struct stat st;
+    fstat(fd, &st);
+    long written = 0;
+    while (written < size) {
+        ssize_t n = pwrite(fd, data + written, size - written, offset + written);
+        if (n <= 0) break;
+        written += n;
+    }
+    if (written < size) {
+        perror("In-place write failed");
+        snprintf(err, err_len, "EWrite failed after %ld of %ld bytes", written, size);
+        close(fd);
+        return -1;
+    }
+
+    *version = file_generation(fullpath) + 1;
+    fsetxattr(fd, GEN_XATTR, version, sizeof(long), 0);
+    char *buffer = malloc(TRANSFER_CHUNK);
+    if (buffer) cache_file_hash(fd, buffer);
+    free(buffer);
+    *new_size = offset + size > st.st_size ? offset + size : st.st_size;
+    *grown = *new_size - st.st_size;
+    close(fd);   // Releases the lock
+    return 0;
+}
+
+/**
+ * @brief Writes a range of a stored file in place
+ * @param client_sock The client socket descriptor
+ * @param filepath The full client path (~S1/...)
+ * @param offset Start of the range (at most the file size)
+ * @param size Number of bytes in the range
+ * @param expected Version the client expects the file to be at, 0 for any
+ *
+ * Writes .c files locally (unless a gateway), forwards other types to
+ * their storage server ('P'). Only the range is transferred, so a small patch to a large file
+ * costs its own bytes. With an expected version the write fails unless
+ * the file is still at that version, and each write moves the file to a
+ * new version, so two clients patching the same version cannot both
+ * succeed. The quota is charged for the size before any data moves and
+ * settled to the bytes the file actually grew.
+ *
+ * @details The client receives status 1 (send the data) or -1 + msg_len + msg,
+ * then after the data status 1 + new version + new file size, or -1 + msg_len + msg.
+ */
+void handle_write_request(int client_sock, const char *filepath, long offset, long size, long expected) {
+    const char *ext = strrchr(filepath, '.');
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..") || !ext) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
         return;
     }
+    int target_port;
+    if (strcmp(ext, ".c") == 0) target_port = c_store_port;
+    else if (strcmp(ext, ".pdf") == 0) target_port = PORT_S2;
+    else if (strcmp(ext, ".txt") == 0) target_port = PORT_S3;
+    else if (strcmp(ext, ".zip") == 0) target_port = PORT_S4;
     else {
-        // Route to appropriate server
-        if (strcmp(filetype, "pdf") == 0) {
-            target_port = PORT_S2;
-        } else if (strcmp(filetype, "txt") == 0) {
-            target_port = PORT_S3;
-        }
+        send_error_status(client_sock, "EUnsupported file type");
+        return;
+    }
+    if (offset < 0 || size <= 0 || size > WRITE_MAX || expected < 0) {
+        send_error_status(client_sock, "EInvalid offset, size (1 byte to 1 MB) or version");
+        return;
+    }
+
+    // Charge the namespace quota before any data is transferred
+    char prefix[USAGE_PREFIX_LEN];
+    usage_prefix(filepath + 3, prefix);
+    UsageEntry *usage = usage_entry(prefix);
+    if (!usage_charge(usage, size, 0)) {
+        char err_msg[BUFFER_SIZE];
+        snprintf(err_msg, sizeof(err_msg), "EQuota exceeded for ~S1/%s (%ld of %ld bytes used)",
+                 prefix, usage->bytes, usage->limit_bytes);
+        send_error_status(client_sock, err_msg);
+        return;
+    }
 
+    long status = -1, reply[3] = {0, 0, 0};
+    char err_msg[BUFFER_SIZE] = "EWrite failed";
+    if (!target_port) {
+        // Write the .c file in ~/S1 directly
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, sizeof(local_path), "%s/S1/%s", getenv("HOME"), filepath + 4);
+        char *data = NULL;
+        if (check_range(local_path, offset, expected, err_msg, sizeof(err_msg)) == 0) {
+            data = malloc(size);
+            if (!data) snprintf(err_msg, sizeof(err_msg), "EOut of memory");
+        }
+        if (!data) {
+            usage_add(usage, -size, 0);
+            send_error_status(client_sock, err_msg);
+            return;
+        }
+        status = 1;
+        send(client_sock, &status, sizeof(long), 0);
+        if (recv(client_sock, data, size, MSG_WAITALL) != size) {
+            usage_add(usage, -size, 0);
+            free(data);
+            return;
+        }
+        if (write_range(local_path, offset, data, size, expected, &reply[0], &reply[1], &reply[2],
+                        err_msg, sizeof(err_msg)) < 0)
+            status = -1;
+        else
+            log_event('M', filepath + 3);
+        free(data);
+    } else {
+        char *buffer = acquire_transfer_buffer();
+        if (!buffer) {
+            usage_add(usage, -size, 0);
+            send_error_status(client_sock, "EServer busy, transfer budget exhausted. Try again later");
+            return;
+        }
         int server_sock = connect_to_target_server(target_port, client_sock);
         if (server_sock < 0) {
+            release_transfer_buffer(buffer);
+            usage_add(usage, -size, 0);
             return;  // Error already handled
         }
-        printf("Server Connected.\n");
-
-        // Send tar command ('T') to target server (S2/S3 : pdf/txt)
-        char command = 'T';
-        send(server_sock, &command, 1, 0);
+        char command_type = 'P';
+        int path_len = strlen(filepath);
+        send(server_sock, &command_type, 1, 0);
+        send(server_sock, &path_len, sizeof(int), 0);
+        send(server_sock, filepath, path_len, 0);
+        send(server_sock, &offset, sizeof(long), 0);
+        send(server_sock, &size, sizeof(long), 0);
+        send(server_sock, &expected, sizeof(long), 0);
+
+        // First reply decides whether the data is sent, the second reports the result
+        for (int step = 0; step < 2; step++) {
+            if (recv(server_sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+                status = -1;
+                snprintf(err_msg, sizeof(err_msg), "ENo response from storage server");
+                break;
+            }
+            if (status == -1) {
+                int msg_len;
+                if (recv(server_sock, &msg_len, sizeof(int), MSG_WAITALL) == sizeof(int) && msg_len > 0 &&
+                    msg_len < BUFFER_SIZE && recv(server_sock, err_msg, msg_len, MSG_WAITALL) == msg_len)
+                    err_msg[msg_len] = '\0';
+                break;
+            }
+            if (step == 1) {
+                if (recv(server_sock, reply, sizeof(reply), MSG_WAITALL) != sizeof(reply))
+                    status = -1;
+                break;
+            }
 
-        // Send filetype length and filetype to target server
-        int type_len = strlen(filetype);
-        send(server_sock, &type_len, sizeof(int), 0);
-        send(server_sock, filetype, type_len, 0);
+            // Let the client send the range, relay it to the storage server
+            send(client_sock, &status, sizeof(long), 0);
+            if (relay_bytes(client_sock, server_sock, buffer, size) != size) {
+                status = 0;   // Client gone, nothing more to report
+                break;
+            }
+        }
+        close(server_sock);
+        release_transfer_buffer(buffer);
+        if (status == 1) usage_seen(usage, target_port, reply[2], 0);
+    }
 
-        // Wait for status byte from target server
-        // If directory and file is present in target server, only then proceed
-        long status1;
-        recv(server_sock, &status1, sizeof(long), 0);
-        send(client_sock, &status1, sizeof(long), 0);
-        printf("status1: %d\n", status1);
+    if (status == 1) {
+        usage_add(usage, reply[2] - size, 0);
+        send(client_sock, &status, sizeof(long), 0);
+        send(client_sock, reply, 2 * sizeof(long), 0);
+        printf("Wrote %ld bytes at offset %ld of %s (version %ld)\n", size, offset, filepath, reply[0]);
+    } else {
+        usage_add(usage, -size, 0);
+        if (status == -1) send_error_status(client_sock, err_msg);
+    }
+}
 
-        if (status1 == -1) {
-            //printf("ES1 directory or .pdf files not found\n");
-            int msg_len;
-            recv(server_sock, &msg_len, sizeof(int), 0);
-            printf("msg_len: %d\n", msg_len);
-            char error_msg[BUFFER_SIZE];
-            recv(server_sock, error_msg, msg_len, 0);
-            error_msg[msg_len] = '\0';
-            printf("Error: %s\n", error_msg);
-            //send(client_sock, &status1, sizeof(long), 0);
-            send(client_sock, &msg_len, sizeof(int), 0);
-            send(client_sock, error_msg, msg_len, 0);
-            close(server_sock);
-            return;
-        }
+/**
+ * @brief Appends the client's bytes to a stored .txt file on S3
+ * @param client_sock The client socket descriptor
+ * @param filepath The full client path (~S1/...)
+ * @param size Number of bytes to append
+ * @param seq Sequence number of the append, 0 for none
+ *
+ * Only the new bytes are transferred; S3 appends them atomically and
+ * skips an append whose sequence it has already applied, so a client
+ * can safely retry. The namespace quota is charged for the bytes before
+ * any data moves and given back if nothing was appended.
+ *
+ * @details The client receives the status of each step from S3:
+ *   1. status 1 (send the data), 2 + seq + 0 (already applied), or -1 + msg_len + msg
+ *   2. after the data: status 1 + seq + new file size, 2 + seq + 0, or -1 + msg_len + msg
+ */
+void handle_append_request(int client_sock, const char *filepath, long size, long seq) {
+    const char *ext = strrchr(filepath, '.');
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..") || !ext) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
+        return;
+    }
+    if (strcmp(ext, ".txt") != 0) {
+        send_error_status(client_sock, "EAppend is only supported for .txt files");
+        return;
+    }
+    if (size <= 0 || size > APPEND_MAX || seq < 0) {
+        send_error_status(client_sock, "EInvalid append size (1 byte to 1 MB) or sequence");
+        return;
+    }
 
-        // Receive tar file size from target server
-        long tar_size;
-        recv(server_sock, &tar_size, sizeof(long), 0);
+    // Charge the namespace quota before any data is transferred
+    char prefix[USAGE_PREFIX_LEN];
+    usage_prefix(filepath + 3, prefix);
+    UsageEntry *usage = usage_entry(prefix);
+    if (!usage_charge(usage, size, 0)) {
+        char err_msg[BUFFER_SIZE];
+        snprintf(err_msg, sizeof(err_msg), "EQuota exceeded for ~S1/%s (%ld of %ld bytes used)",
+                 prefix, usage->bytes, usage->limit_bytes);
+        send_error_status(client_sock, err_msg);
+        return;
+    }
 
-        if (tar_size < 0) {
-            char error_msg[100];
-            int msg_len;
-            recv(server_sock, &msg_len, sizeof(int), 0);
-            recv(server_sock, error_msg, msg_len, 0);
-            error_msg[msg_len] = '\0';
-            send(client_sock, error_msg, msg_len, 0);
-            close(server_sock);
-            return;
+    char *buffer = acquire_transfer_buffer();
+    if (!buffer) {
+        usage_add(usage, -size, 0);
+        send_error_status(client_sock, "EServer busy, transfer budget exhausted. Try again later");
+        return;
+    }
+    int server_sock = connect_to_target_server(PORT_S3, client_sock);
+    if (server_sock < 0) {
+        release_transfer_buffer(buffer);
+        usage_add(usage, -size, 0);
+        return;  // Error already handled
+    }
+    char command_type = 'A';
+    int path_len = strlen(filepath);
+    send(server_sock, &command_type, 1, 0);
+    send(server_sock, &path_len, sizeof(int), 0);
+    send(server_sock, filepath, path_len, 0);
+    send(server_sock, &seq, sizeof(long), 0);
+    send(server_sock, &size, sizeof(long), 0);
+
+    // First reply decides whether the data is sent, the second reports the result
+    long status = -1, created = 0;
+    for (int step = 0; step < 2; step++) {
+        if (recv(server_sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+            status = -1;
+            send_error_status(client_sock, "ENo response from storage server");
+            break;
+        }
+        if (status == -1) {
+            int msg_len;
+            char err_msg[BUFFER_SIZE];
+            if (recv(server_sock, &msg_len, sizeof(int), MSG_WAITALL) != sizeof(int) || msg_len <= 0 ||
+                msg_len >= BUFFER_SIZE || recv(server_sock, err_msg, msg_len, MSG_WAITALL) != msg_len) {
+                strcpy(err_msg, "EAppend failed");
+            } else {
+                err_msg[msg_len] = '\0';
+            }
+            send_error_status(client_sock, err_msg);
+            break;
         }
 
-        // Forward tar file size to client
-        send(client_sock, &tar_size, sizeof(long), 0);
+        send(client_sock, &status, sizeof(long), 0);
+        if (status == 2 || step == 1) {
+            // Applied sequence, and for a fresh append the new size
+            long reply[3] = {0, 0, 0};
+            int reply_len = status == 1 ? 3 : 1;
+            recv(server_sock, reply, reply_len * sizeof(long), MSG_WAITALL);
+            send(client_sock, reply, 2 * sizeof(long), 0);
+            created = status == 1 ? reply[2] : 0;
+            break;
+        }
 
-        // Receive response from target server and send it to client
-        char buffer[BUFFER_SIZE];
-        long bytes_remaining = tar_size;
-        while (bytes_remaining > 0) {
-            int chunk = bytes_remaining > BUFFER_SIZE ? BUFFER_SIZE : bytes_remaining;
-            int bytes_received = recv(server_sock, buffer, chunk, 0);
-            send(client_sock, buffer, bytes_received, 0);
-            printf("File content sent to client : %s\n", buffer);
-            bytes_remaining -= bytes_received;
+        // Relay the new bytes to S3
+        if (relay_bytes(client_sock, server_sock, buffer, size) != size) {
+            status = -1;
+            break;
         }
+    }
+    close(server_sock);
+    release_transfer_buffer(buffer);
 
-        // Close the server socket
-        close(server_sock);
-        printf("Tar file sent successfully to client\n");
+    if (status == 1) {
+        usage_add(usage, 0, created);
+        usage_seen(usage, PORT_S3, size, created);
+        printf("Appended %ld bytes to %s\n", size, filepath);
+    } else {
+        usage_add(usage, -size, 0);
     }
 }
 
 /**
- * @brief Structure representing a file entry with name and extension
- * 
- * @var filename The name of the file (including extension)
- * @var ext The file extension (e.g. ".c", ".txt")
- * 
- * @note Both strings are dynamically allocated and must be freed by the caller
+ * @brief Passes a storage server's reply to the client until it hangs up
+ * @param server_sock Connection to the storage server
+ * @param client_sock The client socket descriptor
+ *
+ * For replies whose end the client recognises on its own (end markers),
+ * so S1 does not need to parse them.
  */
-typedef struct
-{
-    char *filename; /**< Full filename string (allocated) */
-    char *ext;      /**< File extension string (allocated) */
-} FileEntry;
+void forward_until_closed(int server_sock, int client_sock) {
+    char buffer[BUFFER_SIZE * 8];
+    ssize_t n;
+    while ((n = recv(server_sock, buffer, sizeof(buffer), 0)) > 0)
+        if (send(client_sock, buffer, n, MSG_NOSIGNAL) != n) break;
+}
 
 /**
- * @brief Comparator function for sorting FileEntry structures
- * 
- * @param a First FileEntry to compare
- * @param b Second FileEntry to compare
- * @return int Negative if a < b, positive if a > b, zero if equal
- * 
- * @details Sorts files first by extension order (.c → .pdf → .txt → .zip),
- *          then alphabetically by filename within each extension group.
- *          Designed for use with qsort().
+ * @brief Processes grepf requests: searches the stored .txt files on S3
+ * @param client_sock The client socket descriptor
+ * @param use_regex 1 if pattern is a POSIX extended regex, 0 for a literal
+ * @param filepath Directory or file to search (~S1 or ~S1/...)
+ * @param pattern Text to search for
+ *
+ * S3 scans its files in parallel and only the matching lines come back,
+ * passed to the client unchanged. S3 gives paths relative to the
+ * session's tenant root.
+ *
+ * @details 'F' - Find
+ *   1. S1 → S3: 'F' + path_len + path + regex (char) + pattern_len + pattern +
+ *      root_len + root (tenant storage root, "" for the default namespace)
+ *   2. S3 → S1 → client: status (1), per matching line path_len + path +
+ *      line_no + text_len + text, then end marker (int: -1 done, -2 cut
+ *      short) + files scanned + bytes scanned;
+ *      or status (-1) + msg_len + msg
  */
-int compare_files(const void *a, const void *b)
-{
-    const FileEntry *fa = (const FileEntry *)a;
-    const FileEntry *fb = (const FileEntry *)b;
-
-    // First sort by extension order: .c, .pdf, .txt, .zip
-    static const char *ext_order[] = {".c", ".pdf", ".txt", ".zip"};
-    int ext_a = 0, ext_b = 0;
-
-    for (int i = 0; i < 4; i++)
-    {
-        if (strcmp(fa->ext, ext_order[i]) == 0)
-            ext_a = i;
-        if (strcmp(fb->ext, ext_order[i]) == 0)
-            ext_b = i;
+void handle_grep_request(int client_sock, int use_regex, const char *filepath, const char *pattern) {
+    if (strncmp(filepath, "~S1", 3) != 0 || (filepath[3] != '\0' && filepath[3] != '/') || strstr(filepath, "..")) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
+        return;
     }
 
-    if (ext_a != ext_b)
-        return ext_a - ext_b;
-
-    // Then sort alphabetically within each extension group
-    return strcmp(fa->filename, fb->filename);
+    int server_sock = connect_to_target_server(PORT_S3, client_sock);
+    if (server_sock < 0) {
+        return;  // Error already handled
+    }
+    char command_type = 'F', regex_flag = use_regex ? 1 : 0;
+    int path_len = strlen(filepath), pattern_len = strlen(pattern);
+    send(server_sock, &command_type, 1, 0);
+    send(server_sock, &path_len, sizeof(int), 0);
+    send(server_sock, filepath, path_len, 0);
+    send(server_sock, &regex_flag, 1, 0);
+    send(server_sock, &pattern_len, sizeof(int), 0);
+    send(server_sock, pattern, pattern_len, 0);
+    int root_len = strlen(tenant_root);
+    send(server_sock, &root_len, sizeof(int), 0);
+    send(server_sock, tenant_root, root_len, 0);
+
+    // S3 closes the connection after the end marker
+    forward_until_closed(server_sock, client_sock);
+    close(server_sock);
+    printf("Search results for %s sent to client\n", filepath);
 }
 
 /**
- * @brief Retrieves files with specific extension from a directory
- * 
- * @param path Directory path to search
- * @param ext File extension to filter by (e.g. ".c")
- * @param files Pointer to array of FileEntry structures (allocated/reallocated)
- * @param count Pointer to count of found files (updated)
- * 
- * @details Scans specified directory for regular files matching given extension.
- *          Allocates/reallocates FileEntry array and populates with filename/ext.
- *          Caller must free allocated memory for both array and string fields.
+ * @brief Processes searchf requests: keyword search over the .txt files on S3
+ * @param client_sock The client socket descriptor
+ * @param filepath Directory or file to search (~S1 or ~S1/...)
+ * @param query Words that must all appear in a file
+ *
+ * S3 answers from its inverted index, without reading the files; the
+ * reply is passed to the client unchanged. S3 gives paths relative to the
+ * session's tenant root.
+ *
+ * @details 'K' - Keyword search
+ *   1. S1 → S3: 'K' + path_len + path + query_len + query + root_len + root
+ *   2. S3 → S1 → client: status (1) + total matches + search time
+ *      (microseconds) + count + count x (path_len + path);
+ *      or status (-1) + msg_len + msg
  */
-void get_files_from_dir(const char *path, const char *ext, FileEntry **files, int *count)
-{
-    DIR *dir;
-    struct dirent *ent;
-
-    if ((dir = opendir(path)) != NULL)
-    {
-        while ((ent = readdir(dir)) != NULL)
-        {
-            char fullpath[1024];
-            snprintf(fullpath, sizeof(fullpath), "%s/%s", path, ent->d_name);
+void handle_search_request(int client_sock, const char *filepath, const char *query) {
+    if (strncmp(filepath, "~S1", 3) != 0 || (filepath[3] != '\0' && filepath[3] != '/') || strstr(filepath, "..")) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
+        return;
+    }
 
-            struct stat st;
-            if (stat(fullpath, &st) == 0 && S_ISREG(st.st_mode))
-            {
-                char *dot = strrchr(ent->d_name, '.');
-                if (dot && strcmp(dot, ext) == 0)
-                {
-                    *files = realloc(*files, (*count + 1) * sizeof(FileEntry));
-                    (*files)[*count].filename = strdup(ent->d_name);
-                    (*files)[*count].ext = strdup(ext);
-                    (*count)++;
-                }
-            }
-        }
-        closedir(dir);
+    int server_sock = connect_to_target_server(PORT_S3, client_sock);
+    if (server_sock < 0) {
+        return;  // Error already handled
     }
+    char command_type = 'K';
+    int path_len = strlen(filepath), query_len = strlen(query);
+    send(server_sock, &command_type, 1, 0);
+    send(server_sock, &path_len, sizeof(int), 0);
+    send(server_sock, filepath, path_len, 0);
+    send(server_sock, &query_len, sizeof(int), 0);
+    send(server_sock, query, query_len, 0);
+    int root_len = strlen(tenant_root);
+    send(server_sock, &root_len, sizeof(int), 0);
+    send(server_sock, tenant_root, root_len, 0);
+
+    // S3 closes the connection after the reply
+    forward_until_closed(server_sock, client_sock);
+    close(server_sock);
+    printf("Keyword search results for %s sent to client\n", filepath);
 }
 
 /**
- * @brief Requests a list of files from a remote server based on directory and extension.
- *
- * This function establishes a TCP connection to a secondary server (e.g., S2, S3, S4),
- * sends a request to list files in a specific directory (`pathname`), and retrieves 
- * filenames matching a specific extension. The received filenames are stored in a dynamically 
- * allocated array of `FileEntry` structures.
- *
- * @param ip        IP address of the server to connect to (e.g., "127.0.0.1").
- * @param port      Port number of the target server (e.g., 9002, 9003, 9004).
- * @param pathname  Directory path on the server to search for files (e.g., "~S2/folder1").
- * @param ext       File extension used to tag returned entries (e.g., ".pdf", ".txt").
- * @param files     Pointer to a dynamically allocated array of FileEntry structures (output).
- * @param count     Pointer to an integer tracking the number of files found (incremented).
+ * @brief Processes symf requests: where a C symbol is defined
+ * @param client_sock The client socket descriptor
+ * @param name Symbol name, or a prefix ending in '*'
+ * @param filepath Directory to search below (~S1/...), NULL for all of ~S1
  *
- * @return 0 on success, -1 on failure (e.g., socket error, connection error, or no valid response).
+ * The symbol index is kept by a thread of the main S1 process; the
+ * session asks it over $HOME/SYMBOL_SOCK_NAME and passes the reply on.
+ * A gateway asks S5 instead, which indexes the .c files it stores ('Y'
+ * followed by the same request).
  *
- * @note Memory allocated for filenames and extensions must be freed by the caller.
+ * @details Client receives status (1) + total (long) + count (int) + per
+ * definition: kind (char) + line (int) + name_len + name + path_len +
+ * path; or status (-1) + msg_len + msg
  */
-int request_files_from_server(const char *ip, int port, const char *pathname, const char *ext, FileEntry **files, int *count) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return -1;
-
-    struct sockaddr_in serv_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(port),
-    };
-    serv_addr.sin_addr.s_addr = inet_addr(ip);
-
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        close(sock);
-        return -1;
-    }
-
-    // send(sock, command, strlen(command), 0);
-    char command = 'L';
-    send(sock, &command, 1, 0);
-
-    int path_len = strlen(pathname);
-    send(sock, &path_len, sizeof(int), 0);
-    send(sock, pathname, path_len, 0);
-
-    // Receive status
-    long status;
-    if (recv(sock, &status, sizeof(long), 0) <= 0 || status != 1) {
-        close(sock);
-        return -1;
+void handle_symbol_request(int client_sock, const char *name, const char *filepath) {
+    // Without a path: the whole of the session's namespace
+    char root_path[sizeof(tenant_root) + 4];
+    snprintf(root_path, sizeof(root_path), "~S1%s", tenant_root);
+    if (!filepath) filepath = root_path;
+    if (strncmp(filepath, "~S1", 3) != 0 || (filepath[3] != '\0' && filepath[3] != '/') || strstr(filepath, "..")) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
+        return;
     }
-
-    // Receive file count
-    int remote_count;
-    if (recv(sock, &remote_count, sizeof(int), 0) <= 0) {
-        close(sock);
-        return -1;
+    size_t len = strlen(name), valid = 0;
+    while (valid < len && (isalnum((unsigned char)name[valid]) || name[valid] == '_')) valid++;
+    if (valid == 0 || isdigit((unsigned char)name[0]) || len > SYMBOL_MAX_NAME || (valid < len && !(valid == len - 1 && name[valid] == '*'))) {
+        send_error_status(client_sock, "EName must be a C identifier (optionally ending in *)");
+        return;
     }
 
-    for (int i = 0; i < remote_count; i++) {
-        int len;
-        if (recv(sock, &len, sizeof(int), 0) <= 0) break;
-
-        char *fname = malloc(len + 1);
-        if (recv(sock, fname, len, 0) <= 0) {
-            free(fname);
-            break;
+    int index_sock;
+    if (c_store_port) {
+        index_sock = connect_to_target_server(c_store_port, client_sock);
+        if (index_sock < 0) {
+            return;  // Error already handled
+        }
+        char command_type = 'Y';
+        send(index_sock, &command_type, 1, 0);
+    } else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", getenv("HOME"), SYMBOL_SOCK_NAME);
+        index_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (index_sock < 0 || connect(index_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            if (index_sock >= 0) close(index_sock);
+            send_error_status(client_sock, "ESymbol index unavailable");
+            return;
         }
-        fname[len] = '\0';
-
-        *files = realloc(*files, (*count + 1) * sizeof(FileEntry));
-        (*files)[*count].filename = fname;
-        (*files)[*count].ext = strdup(ext);
-        (*count)++;
     }
-
-    close(sock);
-    return 0;
+    int name_len = len, scope_len = strlen(filepath + 3);
+    send(index_sock, &name_len, sizeof(int), 0);
+    send(index_sock, name, name_len, 0);
+    send(index_sock, &scope_len, sizeof(int), 0);
+    send(index_sock, filepath + 3, scope_len, 0);
+    int root_len = strlen(tenant_root);
+    send(index_sock, &root_len, sizeof(int), 0);
+    send(index_sock, tenant_root, root_len, 0);
+
+    // The index thread closes the connection after the reply
+    forward_until_closed(index_sock, client_sock);
+    close(index_sock);
+    printf("Symbol lookup for %s sent to client\n", name);
 }
 
-// Utility function to replace occurrences of a substring in a string
-char* str_replace(char *str, const char *old, const char *new) {
-    static char buffer[4096];
-    char *p;
-
-    if (!(p = strstr(str, old))) {
-        return str;
+/**
+ * @brief Processes zipls requests: lists the members of a stored zip
+ * @param client_sock The client socket descriptor
+ * @param filepath The full client path (~S1/....zip)
+ *
+ * S4 reads only the archive's central directory; its reply is passed to
+ * the client unchanged.
+ *
+ * @details 'Z' - Zip listing
+ *   1. S1 → S4: 'Z' + path_len + path
+ *   2. S4 → S1 → client: status (1) + per member: name_len + name +
+ *      usize + csize + method (int) + mtime, then name_len -1 (end) or
+ *      -2 (listing cut short by a corrupt central directory);
+ *      or status (-1) + msg_len + msg
+ */
+void handle_zip_list_request(int client_sock, const char *filepath) {
+    const char *ext = strrchr(filepath, '.');
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..") || !ext || strcmp(ext, ".zip") != 0) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/....zip");
+        return;
     }
 
-    strncpy(buffer, str, p - str); // Copy the part before 'old'
-    buffer[p - str] = '\0';
-
-    sprintf(buffer + (p - str), "%s%s", new, p + strlen(old)); // Append new part
+    int server_sock = connect_to_target_server(PORT_S4, client_sock);
+    if (server_sock < 0) {
+        return;  // Error already handled
+    }
+    char command_type = 'Z';
+    int path_len = strlen(filepath);
+    send(server_sock, &command_type, 1, 0);
+    send(server_sock, &path_len, sizeof(int), 0);
+    send(server_sock, filepath, path_len, 0);
 
-    return buffer;
+    // S4 closes the connection after the last member
+    forward_until_closed(server_sock, client_sock);
+    close(server_sock);
+    printf("Zip listing of %s sent to client\n", filepath);
 }
 
-
 /**
- * @brief Processes directory listing requests
- * @param client_sock Client socket descriptor
- * @param pathname Directory path to list (~S1/...)
+ * @brief Processes zip member downloads (downlf --member)
+ * @param client_sock The client socket descriptor
+ * @param filepath The full client path (~S1/....zip)
+ * @param member Name of the member inside the archive
+ * @param raw 1 to send the member as stored (still compressed), 0 to inflate it
  *
- * Aggregates file lists from all storage servers
- * Combines .c (local), .pdf (S2), .txt (S3), .zip (S4)
- * Sorts results alphabetically by filename
- * Returns only filenames with extensions
- * Handles permission errors and invalid paths
- * 
- * @details Implements protocol:
- * 'L' - List Files
- *   1. S1 → Storage: 'L' + path_len + path
- *   2. Storage → S1: file_count + [filename1, filename2...]
+ * Only the member's bytes leave S4, whatever the size of the archive.
+ * The client receives the same reply as for downlf.
+ *
+ * @details 'X' - Zip member
+ *   1. S1 → S4: 'X' + path_len + path + name_len + name + inflate (char)
+ *   2. S4 → S1: status (1) + size + data, or status (-1) + msg_len + msg
  */
-void handle_pathname_request(int client_sock, const char *pathname) {
-    // Validate input
-    if (!pathname || strlen(pathname) == 0) {
-        send(client_sock, "EEmpty pathname", 15, 0);
+void handle_zip_member_request(int client_sock, const char *filepath, const char *member, int raw) {
+    const char *ext = strrchr(filepath, '.');
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..") || !ext || strcmp(ext, ".zip") != 0) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/....zip");
         return;
     }
 
-    printf("Received pathname: %s\n", pathname);
-
-    FileEntry *files = NULL;
-    int count = 0;
-    char base_path[MAX_PATH_LEN];
-    char *home_dir = getenv("HOME");
+    int server_sock = connect_to_target_server(PORT_S4, client_sock);
+    if (server_sock < 0) {
+        return;  // Error already handled
+    }
+    char command_type = 'X';
+    int path_len = strlen(filepath), name_len = strlen(member);
+    char inflate = !raw;
+    send(server_sock, &command_type, 1, 0);
+    send(server_sock, &path_len, sizeof(int), 0);
+    send(server_sock, filepath, path_len, 0);
+    send(server_sock, &name_len, sizeof(int), 0);
+    send(server_sock, member, name_len, 0);
+    send(server_sock, &inflate, 1, 0);
 
-    if (!home_dir) {
-        send(client_sock, "EHome directory not found", 25, 0);
+    long status, size;
+    if (recv(server_sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        close(server_sock);
+        send_error_status(client_sock, "ENo response from storage server");
+        return;
+    }
+    if (status != 1) {
+        int msg_len;
+        char err_msg[BUFFER_SIZE];
+        if (recv(server_sock, &msg_len, sizeof(int), MSG_WAITALL) != sizeof(int) || msg_len <= 0 ||
+            msg_len >= BUFFER_SIZE || recv(server_sock, err_msg, msg_len, MSG_WAITALL) != msg_len) {
+            strcpy(err_msg, "EMember download failed");
+        } else {
+            err_msg[msg_len] = '\0';
+        }
+        close(server_sock);
+        send_error_status(client_sock, err_msg);
+        return;
+    }
+    if (recv(server_sock, &size, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        close(server_sock);
+        send_error_status(client_sock, "ENo response from storage server");
         return;
     }
 
-    // Helper macro for collecting files from a directory
-    #define COLLECT_FILES(SERVER, EXT) \
-        snprintf(base_path, sizeof(base_path), "%s/" SERVER "%s", home_dir, pathname + 3); \
-        get_files_from_dir(base_path, EXT, &files, &count);
-
-    // Get local .c files from S1 directory
-    COLLECT_FILES("S1", ".c");
+    char *buffer = acquire_transfer_buffer();
+    if (!buffer) {
+        close(server_sock);
+        send_error_status(client_sock, "EServer busy, transfer budget exhausted. Try again later");
+        return;
+    }
+    send(client_sock, &status, sizeof(long), 0);
+    send(client_sock, &size, sizeof(long), 0);
+    relay_bytes(server_sock, client_sock, buffer, size);
+    release_transfer_buffer(buffer);
+    close(server_sock);
+    printf("Member %s of %s sent to client (%ld bytes)\n", member, filepath, size);
+}
 
-    // Request file lists from remote servers
-    // Modify the path by replacing S1 with the respective server's directory
-    char new_path[1024];
+/**
+ * @brief Opens a change stream on a storage server
+ * @param port Storage server port
+ * @param watched Watched path below ~S1
+ * @param cursor Next change to send (0 = from now); updated to the
+ *        server's starting point
+ * @return Connected socket streaming event frames, -1 if unreachable
+ *
+ * @details Protocol 'W' - Watch:
+ *   1. S1 → Storage: 'W' + path_len + path + cursor
+ *   2. Storage → S1: status (1) + starting cursor
+ *   3. Storage → S1: event frames (type + seq + time + path_len + path),
+ *      until S1 closes the connection
+ */
+int open_watch_on_server(int port, const char *watched, long *cursor) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
 
-    // For S2 (.pdf files)
-    snprintf(new_path, sizeof(new_path), "%s", pathname);
-    char *path_s2 = str_replace(new_path, "S1", "S2");
-    request_files_from_server("127.0.0.1", PORT_S2, path_s2, ".pdf", &files, &count); 
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    serv_addr.sin_addr.s_addr = inet_addr(storage_host);
 
-    // For S3 (.txt files)
-    snprintf(new_path, sizeof(new_path), "%s", pathname);
-    char *path_s3 = str_replace(new_path, "S1", "S3");
-    request_files_from_server("127.0.0.1", PORT_S3, path_s3, ".txt", &files, &count); 
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || authenticate_to_storage(sock) < 0) {
+        close(sock);
+        return -1;
+    }
 
-    // For S4 (.zip files)
-    snprintf(new_path, sizeof(new_path), "%s", pathname);
-    char *path_s4 = str_replace(new_path, "S1", "S4");
-    request_files_from_server("127.0.0.1", PORT_S4, path_s4, ".zip", &files, &count);
+    char command = 'W';
+    int path_len = strlen(watched);
+    send(sock, &command, 1, 0);
+    send(sock, &path_len, sizeof(int), 0);
+    send(sock, watched, path_len, 0);
+    send(sock, cursor, sizeof(long), 0);
 
-    // Sort files
-    qsort(files, count, sizeof(FileEntry), compare_files);
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long) || status != 1 ||
+        recv(sock, cursor, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
-    // Send status first
-    long status = 1;
-    send(client_sock, &status, sizeof(long), 0);
+/**
+ * @brief Sends one event to a watching client
+ * @param client_sock The client socket descriptor
+ * @param type 'A', 'M', 'D', 'G' (changes missed) or 'U' (server unreachable)
+ * @param server 0 for S1, 1-3 for S2-S4
+ * @param seq Sequence number on that server
+ * @param when Time of the change
+ * @param path Path below ~S1 ("" for 'G' and 'U')
+ * @return 0 on success, -1 if the client is gone
+ */
+int send_watch_frame(int client_sock, char type, int server, long seq, long when, const char *path) {
+    char frame[1 + sizeof(int) + 2 * sizeof(long) + sizeof(int) + MAX_PATH_LEN];
+    int path_len = strlen(path);
+    size_t off = 0;
+    frame[off++] = type;
+    memcpy(frame + off, &server, sizeof(int));
+    off += sizeof(int);
+    memcpy(frame + off, &seq, sizeof(long));
+    off += sizeof(long);
+    memcpy(frame + off, &when, sizeof(long));
+    off += sizeof(long);
+    memcpy(frame + off, &path_len, sizeof(int));
+    off += sizeof(int);
+    memcpy(frame + off, path, path_len);
+    off += path_len;
+    return send(client_sock, frame, off, MSG_NOSIGNAL) == (ssize_t)off ? 0 : -1;
+}
 
-    // Send file count
-    send(client_sock, &count, sizeof(int), 0);
+/**
+ * @brief Processes watchf requests: streams changes below a path
+ * @param client_sock The client socket descriptor
+ * @param filepath Watched path (~S1 or ~S1/...), a directory or a file
+ * @param cursor_str Cursor "s1:s2:s3:s4" to resume from, NULL for now
+ *
+ * Merges the local change ring with the change streams of S2-S4 and
+ * forwards every add, modify and delete below the path until the client
+ * disconnects. A gateway has no ring; S5's stream takes its place as
+ * server 0. Each event carries its server and sequence number, so the
+ * client can build the cursor to resume from after a reconnect.
+ *
+ * @details Replies status 1 + the starting cursor (4 longs), then frames
+ * of type + server + seq + time + path_len + path. Replies status -1 +
+ * msg_len + msg for a bad path or cursor.
+ */
+void handle_watch_request(int client_sock, const char *filepath, const char *cursor_str) {
+    if (strncmp(filepath, "~S1", 3) != 0 || (filepath[3] != '\0' && filepath[3] != '/') ||
+        strstr(filepath, "..")) {
+        send_error_status(client_sock, "EPath must be in format: ~S1/...");
+        return;
+    }
+    const char *watched = filepath + 3;
 
-    // Send filenames one by one
-    for (int i = 0; i < count; i++) {
-        int fnlen = strlen(files[i].filename);
-        send(client_sock, &fnlen, sizeof(int), 0);
-        send(client_sock, files[i].filename, fnlen, 0);
-        printf("Sent file Name: %s\n", files[i].filename);
+    long cursor[4] = {0};
+    if (cursor_str && sscanf(cursor_str, "%ld:%ld:%ld:%ld", &cursor[0], &cursor[1], &cursor[2], &cursor[3]) != 4) {
+        send_error_status(client_sock, "ECursor must be in format: s1:s2:s3:s4");
+        return;
+    }
+    if (!event_log && !c_store_port) {
+        send_error_status(client_sock, "EChange events unavailable");
+        return;
+    }
+    if (!c_store_port) {
+        long next = __atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE);
+        if (cursor[0] <= 0 || cursor[0] > next) cursor[0] = next;
+    }
 
-        // Free memory for each entry
-        free(files[i].filename);
-        free(files[i].ext);
+    // fds[0] is the client, fds[1..3] the streams of S2-S4 and fds[4] that
+    // of S5 in gateway mode (-1 if down or unused); stream i is server i % 4
+    int ports[] = {PORT_S2, PORT_S3, PORT_S4, c_store_port};
+    struct pollfd fds[5] = {{client_sock, POLLIN, 0}};
+    for (int i = 1; i < 5; i++) {
+        fds[i].fd = ports[i - 1] ? open_watch_on_server(ports[i - 1], watched, &cursor[i % 4]) : -1;
+        fds[i].events = POLLIN;
     }
 
-    // Free the file list
-    free(files);
+    long status = 1;
+    send(client_sock, &status, sizeof(long), 0);
+    send(client_sock, cursor, sizeof(cursor), 0);
+    printf("Watching %s from %ld:%ld:%ld:%ld\n", filepath, cursor[0], cursor[1], cursor[2], cursor[3]);
+
+    int failed = 0;
+    for (int i = 1; i < 5 && !failed; i++)
+        if (fds[i].fd < 0 && ports[i - 1])
+            failed = send_watch_frame(client_sock, 'U', i % 4, 0, time(NULL), "") < 0;
+
+    char path[MAX_PATH_LEN + 4];
+    while (!failed) {
+        // Local changes
+        ChangeEvent ev;
+        int r;
+        while (!failed && !c_store_port && (r = read_event(cursor[0], &ev)) != 0) {
+            if (r < 0) {
+                cursor[0] = oldest_event();
+                failed = send_watch_frame(client_sock, 'G', 0, cursor[0], time(NULL), "") < 0;
+            } else {
+                cursor[0]++;
+                snprintf(path, sizeof(path), "~S1%s", tenant_display(ev.path));
+                if (path_is_watched(ev.path, watched) && tenant_visible(ev.path))
+                    failed = send_watch_frame(client_sock, ev.type, 0, ev.seq, ev.time, path) < 0;
+            }
+        }
+        if (failed || poll(fds, 5, WATCH_POLL_MS) < 0) break;
+
+        // The client never writes during a watch; readable means it left
+        if (fds[0].revents) break;
+
+        // Changes on the storage servers
+        for (int i = 1; i < 5 && !failed; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+            char type;
+            long seq, when;
+            int path_len;
+            if (recv(fds[i].fd, &type, 1, MSG_WAITALL) != 1 ||
+                recv(fds[i].fd, &seq, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+                recv(fds[i].fd, &when, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+                recv(fds[i].fd, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+                path_len < 0 || path_len >= MAX_PATH_LEN ||
+                (path_len > 0 && recv(fds[i].fd, ev.path, path_len, MSG_WAITALL) != path_len)) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                failed = send_watch_frame(client_sock, 'U', i % 4, 0, time(NULL), "") < 0;
+                continue;
+            }
+            ev.path[path_len] = '\0';
+            if (path_len > 0 && !tenant_visible(ev.path)) continue;
+            if (path_len > 0)
+                snprintf(path, sizeof(path), "~S1%s", tenant_display(ev.path));
+            else
+                path[0] = '\0';
+            failed = send_watch_frame(client_sock, type, i % 4, seq, when, path) < 0;
+        }
+    }
 
-    printf("Completed sending file list.\n");
+    for (int i = 1; i < 5; i++)
+        if (fds[i].fd >= 0) close(fds[i].fd);
+    printf("Watch on %s ended\n", filepath);
 }
 
+void handle_mux_session(int client_sock);
+
+// Set in session processes serving a multiplexed stream (no nested mux)
+int in_mux_stream = 0;
+
 /**
  * @brief Handles a client connection in a dedicated process
  * @param client_sock The client socket descriptor
  * 
  * Processes all client commands in an infinite loop:
  * - uploadf: Receives and routes files to appropriate servers
- * - downlf: Retrieves files from storage servers
+ * - downlf: Retrieves files (or prior versions) from storage servers
  * - removef: Deletes files across the system
  * - downltar: Creates and sends tar archives
  * - dispfnames: Lists directory contents
+ * - statf: Reports metadata of one or more files
+ * - stats: Reports integrity scrubber results
+ * - versions: Lists the versions of a file
+ * - undelf: Restores a removed file
+ * - mux: Hands the connection to the stream multiplexer
+ * - login: Moves the session into a tenant's namespace
+ * - redirect: Issues a ticket for uploadf/downlf instead of relaying the data
  * - exit: Terminates connection
  */
 void prcclient(int client_sock) {
@@ -1159,12 +6292,31 @@ void prcclient(int client_sock) {
         buffer[bytes_received] = '\0'; //Add \0 at the end
         printf("Bytes received from client:%s\n",buffer);
 
+        // Paths name files in the session's namespace (its tenant root once logged in)
+        char line[BUFFER_SIZE * 16];
+        if (tenant_map_paths(buffer, line, sizeof(line)) < 0) {
+            send_error_status(client_sock, "EPaths must be ~S1/... without . or .., outside ~S1/" TENANT_DIR);
+            continue;
+        }
+
         // Parse command
         // Get the first token (i.e; command)
         // Command = uploadf, downlf, removef, downltar and dispfnames
-        char *command = strtok(buffer, " ");    
+        char *command = strtok(line, " ");    
         if (!command) continue;
 
+        // "redirect uploadf ..." and "redirect downlf ..." ask for a ticket to
+        // transfer the data with the storage server directly
+        int redirect = 0;
+        if (strcmp(command, "redirect") == 0) {
+            command = strtok(NULL, " ");
+            if (!command || (strcmp(command, "uploadf") != 0 && strcmp(command, "downlf") != 0)) {
+                send_error_status(client_sock, "EUsage: redirect uploadf|downlf <arguments>");
+                continue;
+            }
+            redirect = 1;
+        }
+
         // If the command is equal to "uploadf"
         if (strcmp(command, "uploadf") == 0) {
             printf("\n======Command uploadf received======\n");
@@ -1172,15 +6324,64 @@ void prcclient(int client_sock) {
             char *filename = strtok(NULL, " ");
             // Get the third token (i.e; destination path)
             char *dest_path = strtok(NULL, " ");
-            if (!filename || !dest_path) {
-                send(client_sock, "EUsage: uploadf <filename> <destination_path>", 44, 0);
+            // Get the fourth token (i.e; file size in bytes)
+            char *size_str = strtok(NULL, " ");
+            // Optional fifth token (i.e; TTL in seconds)
+            char *ttl_str = strtok(NULL, " ");
+            // Optional sixth token (i.e; XXH64 of the file in hex)
+            char *hash_str = strtok(NULL, " ");
+            // Optional seventh token (i.e; number of chunks of a chunked upload, 0 for none)
+            char *chunks_str = strtok(NULL, " ");
+            // Optional eighth token (i.e; SHA-256 of the file in hex)
+            char *proof_str = strtok(NULL, " ");
+            if (!filename || !dest_path || !size_str) {
+                send_error_status(client_sock, "EUsage: uploadf <filename> <destination_path> <size> [ttl_seconds [hash [chunks [sha256]]]]");
                 continue;
             }
             printf("Filename:%s\n",filename);
             printf("Destination path:%s\n",dest_path);
 
+            // A malformed proof is ignored: the data is then simply sent
+            unsigned char proof[CONTENT_PROOF_LEN];
+            int proven = proof_str && strlen(proof_str) == 2 * CONTENT_PROOF_LEN &&
+                         strspn(proof_str, "0123456789abcdefABCDEF") == 2 * CONTENT_PROOF_LEN;
+            for (int i = 0; proven && i < CONTENT_PROOF_LEN; i++)
+                proven = sscanf(proof_str + 2 * i, "%2hhx", &proof[i]) == 1;
+
             // For all file types
-            handle_upload_request(client_sock, filename, dest_path);
+            handle_upload_request(client_sock, filename, dest_path, strtol(size_str, NULL, 10),
+                                  ttl_str ? strtol(ttl_str, NULL, 10) : 0,
+                                  hash_str ? strtoull(hash_str, NULL, 16) : 0, proven ? proof : NULL, redirect,
+                                  chunks_str ? strtol(chunks_str, NULL, 10) : 0);
+        }
+        // If the command is equal to "writef"
+        else if (strcmp(command, "writef") == 0) {
+            printf("\n======Command writef received======\n");
+            // Target file, offset, number of bytes, optional expected version
+            char *filepath = strtok(NULL, " ");
+            char *offset_str = strtok(NULL, " ");
+            char *size_str = strtok(NULL, " ");
+            char *expected_str = strtok(NULL, " ");
+            if (!filepath || !offset_str || !size_str) {
+                send_error_status(client_sock, "EUsage: writef <filepath> <offset> <size> [version]");
+                continue;
+            }
+            handle_write_request(client_sock, filepath, strtol(offset_str, NULL, 10), strtol(size_str, NULL, 10),
+                                 expected_str ? strtol(expected_str, NULL, 10) : 0);
+        }
+        // If the command is equal to "appendf"
+        else if (strcmp(command, "appendf") == 0) {
+            printf("\n======Command appendf received======\n");
+            // Target file, number of bytes, optional sequence number
+            char *filepath = strtok(NULL, " ");
+            char *size_str = strtok(NULL, " ");
+            char *seq_str = strtok(NULL, " ");
+            if (!filepath || !size_str) {
+                send_error_status(client_sock, "EUsage: appendf <filepath> <size> [seq]");
+                continue;
+            }
+            handle_append_request(client_sock, filepath, strtol(size_str, NULL, 10),
+                                  seq_str ? strtol(seq_str, NULL, 10) : 0);
         }
         // If the command is equal to "downlf"
         else if (strcmp(command, "downlf") == 0) {
@@ -1195,8 +6396,12 @@ void prcclient(int client_sock) {
             }
             printf("Filepath:%s\n",filepath);
 
+            // Optional third token: version to download
+            char *version_str = strtok(NULL, " ");
+            long version = version_str ? strtol(version_str, NULL, 10) : 0;
+
             // For all file types
-            handle_download_request(client_sock, filepath);
+            handle_download_request(client_sock, filepath, version, redirect);
         }
         // If the command is equal to "removef"
         else if (strcmp(command, "removef") == 0) {
@@ -1228,8 +6433,33 @@ void prcclient(int client_sock) {
             filetype++;     // After dot content
             printf("Filetype:%s\n",filetype);
 
+            // Optional: "index" for the member index, or
+            // "range <archive id> <offset> <length>" for a part of the archive
+            char mode = 'T';
+            unsigned long long id = 0;
+            long offset = 0, length = 0;
+            char *what = strtok(NULL, " ");
+            if (what && strcmp(what, "index") == 0) {
+                mode = 'E';
+            } else if (what && strcmp(what, "range") == 0) {
+                char *id_str = strtok(NULL, " ");
+                char *offset_str = strtok(NULL, " ");
+                char *length_str = strtok(NULL, " ");
+                if (!length_str) {
+                    send_error_status(client_sock, "EUsage: downltar <filetype> range <archive id> <offset> <length>");
+                    continue;
+                }
+                mode = 'B';
+                id = strtoull(id_str, NULL, 16);
+                offset = atol(offset_str);
+                length = atol(length_str);
+            } else if (what) {
+                send_error_status(client_sock, "EUsage: downltar <filetype> [index | range <archive id> <offset> <length>]");
+                continue;
+            }
+
             // For all file types
-            handle_downloadtar_request(client_sock, filetype);
+            handle_downloadtar_request(client_sock, filetype, mode, id, offset, length);
         }
         // If the command is equal to "dispfnames"
         else if (strcmp(command, "dispfnames") == 0) {
@@ -1246,6 +6476,134 @@ void prcclient(int client_sock) {
             // For all file types
             handle_pathname_request(client_sock, pathname);
         }
+        // If the command is equal to "statf"
+        else if (strcmp(command, "statf") == 0) {
+            printf("\n======Command statf received======\n");
+
+            // Every remaining token is a filepath
+            char *paths[STAT_MAX_PATHS];
+            int count = 0;
+            char *filepath;
+            while ((filepath = strtok(NULL, " ")) && count < STAT_MAX_PATHS)
+                paths[count++] = filepath;
+            if (count == 0 || filepath) {
+                send_error_status(client_sock, "EUsage: statf <filepath> [filepath ...] (at most 64)");
+                continue;
+            }
+
+            handle_stat_request(client_sock, paths, count);
+        }
+        // If the command is equal to "stats"
+        else if (strcmp(command, "stats") == 0) {
+            printf("\n======Command stats received======\n");
+            handle_stats_request(client_sock);
+        }
+        // If the command is equal to "versions"
+        else if (strcmp(command, "versions") == 0) {
+            printf("\n======Command versions received======\n");
+            char *filepath = strtok(NULL, " ");
+            if (!filepath) {
+                send_error_status(client_sock, "EUsage: versions <filepath>");
+                continue;
+            }
+            handle_versions_request(client_sock, filepath);
+        }
+        // If the command is equal to "undelf"
+        else if (strcmp(command, "undelf") == 0) {
+            printf("\n======Command undelf received======\n");
+            char *filepath = strtok(NULL, " ");
+            if (!filepath) {
+                send_error_status(client_sock, "EUsage: undelf <filepath>");
+                continue;
+            }
+            handle_undelete_request(client_sock, filepath);
+        }
+        else if (strcmp(command, "zipls") == 0) {
+            printf("\n======Command zipls received======\n");
+            char *filepath = strtok(NULL, " ");
+            if (!filepath) {
+                send_error_status(client_sock, "EUsage: zipls <filepath>");
+                continue;
+            }
+            handle_zip_list_request(client_sock, filepath);
+        }
+        else if (strcmp(command, "downlm") == 0) {
+            printf("\n======Command downlm received======\n");
+            char *filepath = strtok(NULL, " ");
+            char *raw_str = strtok(NULL, " ");
+            // The member name is the rest of the line and may contain spaces
+            char *member = strtok(NULL, "");
+            if (!filepath || !raw_str || !member) {
+                send_error_status(client_sock, "EUsage: downlm <filepath> <raw 0|1> <member>");
+                continue;
+            }
+            handle_zip_member_request(client_sock, filepath, member, atoi(raw_str));
+        }
+        else if (strcmp(command, "grepf") == 0) {
+            printf("\n======Command grepf received======\n");
+            char *regex_str = strtok(NULL, " ");
+            char *filepath = strtok(NULL, " ");
+            // The pattern is the rest of the line and may contain spaces
+            char *pattern = strtok(NULL, "");
+            if (!regex_str || !filepath || !pattern) {
+                send_error_status(client_sock, "EUsage: grepf <regex 0|1> <path> <pattern>");
+                continue;
+            }
+            handle_grep_request(client_sock, atoi(regex_str), filepath, pattern);
+        }
+        else if (strcmp(command, "searchf") == 0) {
+            printf("\n======Command searchf received======\n");
+            char *filepath = strtok(NULL, " ");
+            // The words are the rest of the line
+            char *query = strtok(NULL, "");
+            if (!filepath || !query) {
+                send_error_status(client_sock, "EUsage: searchf <path> <words>");
+                continue;
+            }
+            handle_search_request(client_sock, filepath, query);
+        }
+        else if (strcmp(command, "login") == 0) {
+            printf("\n======Command login received======\n");
+            char *name = strtok(NULL, " ");
+            char *secret = strtok(NULL, " ");
+            if (!name || !secret) {
+                send_error_status(client_sock, "EUsage: login <tenant> <secret>");
+                continue;
+            }
+            handle_login_request(client_sock, name, secret);
+        }
+        else if (strcmp(command, "symf") == 0) {
+            printf("\n======Command symf received======\n");
+            char *name = strtok(NULL, " ");
+            // Optional third token (i.e; directory to search below)
+            char *filepath = strtok(NULL, " ");
+            if (!name) {
+                send_error_status(client_sock, "EUsage: symf <name> [path]");
+                continue;
+            }
+            handle_symbol_request(client_sock, name, filepath);
+        }
+        else if (strcmp(command, "watchf") == 0) {
+            printf("\n======Command watchf received======\n");
+            char *filepath = strtok(NULL, " ");
+            // Optional third token (i.e; cursor to resume from)
+            char *cursor_str = strtok(NULL, " ");
+            if (!filepath) {
+                send_error_status(client_sock, "EUsage: watchf <path> [cursor]");
+                continue;
+            }
+            handle_watch_request(client_sock, filepath, cursor_str);
+        }
+        // If the command is equal to "mux"
+        else if (strcmp(command, "mux") == 0 && !in_mux_stream) {
+            printf("\n======Command mux received======\n");
+
+            // Acknowledge, then the connection only carries frames
+            long status = 1;
+            send(client_sock, &status, sizeof(long), 0);
+            handle_mux_session(client_sock);
+            break;
+        }
         else if (strcmp(command, "exit") == 0) {
             break;
         }
@@ -1256,6 +6614,278 @@ void prcclient(int client_sock) {
     close(client_sock);
 }
 
+/**
+ * @brief State of one logical session carried by a multiplexed connection
+ */
+typedef struct {
+    int fd;             /**< Socketpair end to the session process, -1 when unused */
+    long send_window;   /**< Bytes S1 may still send to the peer on this stream */
+    char *inbound;      /**< Peer data not yet delivered to the session */
+    int in_off;         /**< Start of undelivered data in inbound */
+    int in_len;         /**< Bytes of undelivered data */
+} MuxStream;
+
+/**
+ * @brief Writes one frame to the multiplexed connection
+ * @param sock Multiplexed client connection
+ * @param stream_id Logical stream the frame belongs to
+ * @param type Frame type ('D', 'W', 'C')
+ * @param payload Frame payload (may be NULL when len is 0)
+ * @param len Payload length
+ * @return 0 on success, -1 if the connection failed
+ */
+int mux_send_frame(int sock, int stream_id, char type, const void *payload, int len) {
+    char header[MUX_HEADER_LEN];
+    memcpy(header, &stream_id, sizeof(int));
+    header[4] = type;
+    memcpy(header + 5, &len, sizeof(int));
+    if (send(sock, header, sizeof(header), MSG_NOSIGNAL | (len ? MSG_MORE : 0)) != sizeof(header)) return -1;
+    if (len && send(sock, payload, len, MSG_NOSIGNAL) != len) return -1;
+    return 0;
+}
+
+/**
+ * @brief Closes a logical stream and tells the peer
+ * @param sock Multiplexed client connection
+ * @param streams Stream table
+ * @param id Stream to close
+ * @return 0 on success, -1 if the connection failed
+ *
+ * Closing the socketpair makes the session process see EOF and exit.
+ */
+int mux_close_stream(int sock, MuxStream *streams, int id) {
+    if (streams[id].fd < 0) return 0;
+    close(streams[id].fd);
+    free(streams[id].inbound);
+    memset(&streams[id], 0, sizeof(MuxStream));
+    streams[id].fd = -1;
+    printf("Mux stream %d closed\n", id);
+    return mux_send_frame(sock, id, 'C', NULL, 0);
+}
+
+/**
+ * @brief Starts a session process for a new logical stream
+ * @param client_sock Multiplexed client connection
+ * @param streams Stream table
+ * @param id Stream id chosen by the peer
+ * @return 0 on success, -1 on failure
+ *
+ * The session process runs the ordinary prcclient() loop over one end
+ * of a socketpair, so every command works unchanged inside a stream.
+ */
+int mux_open_stream(int client_sock, MuxStream *streams, int id) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (pid == 0) { // Session process for this stream
+        close(client_sock);
+        close(sv[0]);
+        for (int i = 1; i < MUX_MAX_STREAMS; i++)
+            if (streams[i].fd >= 0) close(streams[i].fd);
+        in_mux_stream = 1;
+
+        // Streams of a logged-in connection are sessions of its tenant too
+        if (session_tenant >= 0 && tenant_claim_session(session_tenant) < 0) {
+            send_error_status(sv[1], "ETenant has reached its session limit");
+            exit(0);
+        }
+        prcclient(sv[1]);
+        exit(0);
+    }
+
+    close(sv[1]);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    streams[id].fd = sv[0];
+    streams[id].send_window = MUX_WINDOW;
+    streams[id].inbound = malloc(MUX_WINDOW);
+    streams[id].in_off = 0;
+    streams[id].in_len = 0;
+    printf("Mux stream %d opened\n", id);
+    return 0;
+}
+
+/**
+ * @brief Serves many logical client sessions over one connection
+ * @param client_sock Client socket that sent the "mux" command
+ *
+ * @details Frame format, both directions:
+ *   stream_id (int) + type (char) + length (int) + payload
+ *
+ * Frame types:
+ *   'O' - Peer → S1: open stream stream_id (1..MUX_MAX_STREAMS-1)
+ *   'D' - Data for the stream; inside a stream the usual command protocol applies
+ *   'W' - Window update, payload is an int: the sender consumed that many bytes
+ *   'C' - Close the stream (either direction)
+ *
+ * Flow control: each stream starts with MUX_WINDOW bytes of credit per
+ * direction. The peer may have at most that much unacknowledged data in
+ * flight towards S1; S1 acknowledges with 'W' as the session consumes it.
+ * S1 likewise stops reading a session's output once the peer's window is
+ * used up, until the peer grants more credit with 'W'; a grant beyond
+ * what S1 has outstanding on the stream closes it. A slow stream
+ * therefore never blocks the others sharing the connection.
+ *
+ * Frames are read without blocking into a per-connection buffer and
+ * handled once complete, so a peer that stops mid-frame holds up nothing.
+ */
+void handle_mux_session(int client_sock) {
+    MuxStream *streams = calloc(MUX_MAX_STREAMS, sizeof(MuxStream));
+    struct pollfd *fds = malloc(MUX_MAX_STREAMS * sizeof(struct pollfd));
+    int *fd_stream = malloc(MUX_MAX_STREAMS * sizeof(int));
+    char *frame = malloc(MUX_MAX_FRAME);
+    size_t rx_cap = MUX_HEADER_LEN + MUX_MAX_FRAME;
+    char *rx = malloc(rx_cap);      // Frames received from the peer, the last one maybe partial
+    size_t rx_len = 0;
+    if (!streams || !fds || !fd_stream || !frame || !rx) {
+        free(streams);
+        free(fds);
+        free(fd_stream);
+        free(frame);
+        free(rx);
+        return;
+    }
+    for (int i = 0; i < MUX_MAX_STREAMS; i++) streams[i].fd = -1;
+
+    // Set by any failed send: the peer is gone, so is every stream it carried
+    int peer_gone = 0;
+    while (!peer_gone) {
+        // Watch the connection plus every stream that can make progress
+        int nfds = 0;
+        fds[nfds].fd = client_sock;
+        fds[nfds].events = POLLIN;
+        fd_stream[nfds++] = 0;
+        for (int i = 1; i < MUX_MAX_STREAMS; i++) {
+            if (streams[i].fd < 0) continue;
+            fds[nfds].fd = streams[i].fd;
+            fds[nfds].events = (streams[i].send_window > 0 ? POLLIN : 0) |
+                               (streams[i].in_len > 0 ? POLLOUT : 0);
+            fd_stream[nfds++] = i;
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        // Frames from the peer
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t got = recv(client_sock, rx + rx_len, rx_cap - rx_len, MSG_DONTWAIT);
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) break;
+            if (got > 0) rx_len += got;
+        }
+        size_t rx_off = 0;
+        while (!peer_gone && rx_len - rx_off >= MUX_HEADER_LEN) {
+            const char *header = rx + rx_off;
+            int id, len;
+            memcpy(&id, header, sizeof(int));
+            memcpy(&len, header + 5, sizeof(int));
+            char type = header[4];
+            if (len < 0 || len > MUX_MAX_FRAME) {
+                peer_gone = 1;   // Protocol violation: drop the connection
+                break;
+            }
+            if (rx_len - rx_off < MUX_HEADER_LEN + (size_t)len) break;   // Rest still to come
+            const char *payload = header + MUX_HEADER_LEN;
+            rx_off += MUX_HEADER_LEN + len;
+
+            if (id <= 0 || id >= MUX_MAX_STREAMS) {
+                peer_gone = mux_send_frame(client_sock, id, 'C', NULL, 0) < 0;
+                continue;
+            }
+
+            MuxStream *st = &streams[id];
+            if (type == 'O') {
+                if (st->fd >= 0 || mux_open_stream(client_sock, streams, id) < 0)
+                    peer_gone = mux_send_frame(client_sock, id, 'C', NULL, 0) < 0;
+            } else if (type == 'D' && st->fd >= 0) {
+                if (st->in_len + len > MUX_WINDOW) {
+                    peer_gone = mux_close_stream(client_sock, streams, id) < 0;  // Peer ignored the window
+                    continue;
+                }
+                if (st->in_off + st->in_len + len > MUX_WINDOW) {
+                    memmove(st->inbound, st->inbound + st->in_off, st->in_len);
+                    st->in_off = 0;
+                }
+                memcpy(st->inbound + st->in_off + st->in_len, payload, len);
+                st->in_len += len;
+            } else if (type == 'W' && st->fd >= 0 && len == sizeof(int)) {
+                int credit;
+                memcpy(&credit, payload, sizeof(int));
+                // Credit only returns what S1 has outstanding on the stream
+                if (credit <= 0 || credit > MUX_WINDOW - st->send_window)
+                    peer_gone = mux_close_stream(client_sock, streams, id) < 0;
+                else
+                    st->send_window += credit;
+            } else if (type == 'C') {
+                peer_gone = mux_close_stream(client_sock, streams, id) < 0;
+            }
+        }
+        memmove(rx, rx + rx_off, rx_len - rx_off);
+        rx_len -= rx_off;
+
+        // Progress on the streams
+        for (int f = 1; f < nfds && !peer_gone; f++) {
+            int id = fd_stream[f];
+            MuxStream *st = &streams[id];
+            if (st->fd != fds[f].fd) continue;   // Closed or reopened above
+
+            // Deliver buffered peer data to the session, return credit
+            if ((fds[f].revents & POLLOUT) && st->in_len > 0) {
+                ssize_t n = write(st->fd, st->inbound + st->in_off, st->in_len);
+                if (n > 0) {
+                    st->in_off += n;
+                    st->in_len -= n;
+                    if (st->in_len == 0) st->in_off = 0;
+                    int credit = n;
+                    peer_gone = mux_send_frame(client_sock, id, 'W', &credit, sizeof(int)) < 0;
+                }
+            }
+
+            // Forward session output within the peer's window
+            if (fds[f].revents & (POLLIN | POLLHUP | POLLERR)) {
+                long room = st->send_window < MUX_MAX_FRAME ? st->send_window : MUX_MAX_FRAME;
+                ssize_t n = room > 0 ? read(st->fd, frame, room) : 0;
+                if (n > 0) {
+                    st->send_window -= n;
+                    peer_gone = mux_send_frame(client_sock, id, 'D', frame, n) < 0;
+                } else if (n == 0 && room > 0) {
+                    peer_gone = mux_close_stream(client_sock, streams, id) < 0;  // Session ended
+                } else if (n < 0 && errno != EAGAIN) {
+                    peer_gone = mux_close_stream(client_sock, streams, id) < 0;
+                } else if (room == 0 && (fds[f].revents & (POLLHUP | POLLERR)) && !(fds[f].revents & POLLIN)) {
+                    peer_gone = mux_close_stream(client_sock, streams, id) < 0;
+                }
+            }
+        }
+    }
+
+    // Connection gone: end every session it carried
+    for (int i = 1; i < MUX_MAX_STREAMS; i++) {
+        if (streams[i].fd >= 0) {
+            close(streams[i].fd);
+            free(streams[i].inbound);
+        }
+    }
+    free(streams);
+    free(fds);
+    free(fd_stream);
+    free(frame);
+    free(rx);
+    printf("Mux connection closed\n");
+}
+
 /*
  * Signal handler for SIGCHLD
  *
@@ -1264,10 +6894,197 @@ void prcclient(int client_sock) {
  * child processes and prevent zombie processes from accumulating.
  *
  * This ensures that the server remains clean and does not leave defunct
- * (zombie) child processes in the process table.
+ * (zombie) child processes in the process table. Transfer buffers still
+ * owned by a reaped child are returned to the shared pool, and the
+ * child no longer counts against its tenant's session limit.
  * */
 void handle_sigchld(int sig) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    (void)sig;
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        reclaim_transfer_buffers(pid);   // Session may have died holding buffers
+        reclaim_tenant_sessions(pid);
+    }
+}
+
+/**
+ * @brief Builds the path of the hot-restart Unix socket ($HOME/.S1.handoff)
+ * @param path Output buffer
+ * @param len Size of output buffer
+ *
+ * An instance on another port uses $HOME/.S1.handoff.<port>, so gateways
+ * sharing a host are restarted independently.
+ */
+void handoff_socket_path(char *path, size_t len) {
+    if (listen_port == PORT_S1)
+        snprintf(path, len, "%s/%s", getenv("HOME"), HANDOFF_SOCK_NAME);
+    else
+        snprintf(path, len, "%s/%s.%d", getenv("HOME"), HANDOFF_SOCK_NAME, listen_port);
+}
+
+/**
+ * @brief Creates the Unix socket on which a newer S1 can request the listener
+ * @return Listening Unix socket descriptor, -1 on failure
+ *
+ * Any stale socket file left by a previous instance is replaced, so the
+ * most recently started S1 always owns the handoff path.
+ */
+int create_handoff_listener(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    handoff_socket_path(addr.sun_path, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("handoff socket");
+        return -1;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("handoff bind/listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Asks the running S1 for its listening socket (hot restart)
+ * @return Inherited listening socket on success, -1 if no S1 handed it over
+ *
+ * The shared regions that come along are left in region_fd[] for the
+ * init_* functions to map.
+ *
+ * @details Handoff protocol over $HOME/.S1.handoff:
+ *   1. New S1 → Old S1: 'H'
+ *   2. Old S1 → New S1: 'F' + region mask, with the listening fd and then
+ *      one fd per region whose bit (1 << REGION_*) is set as SCM_RIGHTS
+ *      ancillary data
+ *   3. New S1 → Old S1: 'A' once the descriptors are installed
+ */
+int request_listener_handoff(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    handoff_socket_path(addr.sun_path, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("No running S1 to take over from");
+        close(fd);
+        return -1;
+    }
+
+    char request = 'H';
+    send(fd, &request, 1, 0);
+
+    // Receive the listening descriptor and the regions as ancillary data
+    unsigned char reply[2] = {0, 0};
+    struct iovec iov = { .iov_base = reply, .iov_len = sizeof(reply) };
+    char control[CMSG_SPACE((1 + SHARED_REGIONS) * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int listen_fd = -1;
+    if (recvmsg(fd, &msg, MSG_WAITALL) == sizeof(reply) && reply[0] == 'F') {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int fds[1 + SHARED_REGIONS];
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+            if (count > 0) listen_fd = fds[0];
+            for (int r = 0, next = 1; r < SHARED_REGIONS; r++)
+                if ((reply[1] & (1 << r)) && next < count) region_fd[r] = fds[next++];
+        }
+    }
+
+    if (listen_fd >= 0) {
+        char ack = 'A';
+        send(fd, &ack, 1, 0);
+    }
+    close(fd);
+    return listen_fd;
+}
+
+/**
+ * @brief Serves one handoff request by passing the listening socket on
+ * @param handoff_fd Listening Unix socket
+ * @param server_fd TCP listening socket to hand over
+ * @return 1 if the new S1 acknowledged the descriptors, 0 otherwise
+ *
+ * The shared regions (transfer pool, tenant table, scrubber statistics)
+ * go along, so the new S1 keeps counting the sessions this one drains.
+ */
+int send_listener_handoff(int handoff_fd, int server_fd) {
+    int conn = accept(handoff_fd, NULL, NULL);
+    if (conn < 0) return 0;
+
+    char request;
+    if (recv(conn, &request, 1, 0) != 1 || request != 'H') {
+        close(conn);
+        return 0;
+    }
+
+    int fds[1 + SHARED_REGIONS] = {server_fd};
+    int count = 1;
+    unsigned char reply[2] = {'F', 0};
+    for (int r = 0; r < SHARED_REGIONS; r++) {
+        if (region_fd[r] < 0) continue;
+        reply[1] |= 1 << r;
+        fds[count++] = region_fd[r];
+    }
+
+    struct iovec iov = { .iov_base = reply, .iov_len = sizeof(reply) };
+    char control[CMSG_SPACE((1 + SHARED_REGIONS) * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+    char ack = 0;
+    int ok = sendmsg(conn, &msg, MSG_NOSIGNAL) == sizeof(reply) && recv(conn, &ack, 1, 0) == 1 && ack == 'A';
+    close(conn);
+    return ok;
+}
+
+/**
+ * @brief Waits for all running prcclient sessions to finish, then exits
+ *
+ * Called by the old S1 after handing its listener over. No new clients
+ * reach this process any more, so once every child has exited the
+ * process can terminate without cutting off an in-flight session.
+ */
+void drain_sessions_and_exit(void) {
+    printf("Listener handed over, draining active sessions...\n");
+
+    // Reap children synchronously from now on; the pool and the tenant
+    // table are shared with the new S1, so give back what they held
+    signal(SIGCHLD, SIG_DFL);
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, 0)) > 0 || errno == EINTR) {
+        if (pid <= 0) continue;
+        reclaim_transfer_buffers(pid);
+        reclaim_tenant_sessions(pid);
+    }
+
+    printf("All sessions finished, old S1 exiting.\n");
+    exit(0);
 }
 
 /**
@@ -1280,17 +7097,28 @@ void handle_sigchld(int sig) {
  *    - Local processing for .c files
  *    - Forwarding to S2 (PDF), S3 (TXT), S4 (ZIP) servers
  * 4. Maintains system resources and cleans up on termination
+ * 5. Supports hot restart: started with --takeover, it receives the
+ *    listening socket from the running S1, which then drains and exits
+ * 6. With --gateway [port] it only routes: .c files go to S5 like the
+ *    other types go to S2-S4, so the instance stores nothing and several
+ *    gateways can serve behind a TCP load balancer. --storage <ip> names
+ *    the host running the storage servers (default 127.0.0.1).
  *
- *
+ * @param argc Argument count
+ * @param argv Optional "--takeover", "--gateway [port]" and "--storage <ip>" flags
  * @return int Returns EXIT_SUCCESS (0) on normal shutdown, 
  *             EXIT_FAILURE (1) on critical errors
  * 
  * Server-to-Server Command Protocol (S1 ↔ S2/S3/S4):
- * Single-character commands followed by path/data:
+ * Single-character commands followed by path/data. Every connection opens
+ * with 'K' + AuthHeader + MAC (see authenticate_to_storage); without it
+ * the storage servers only accept redirected transfers ('J') from clients.
  * 
  * 'U' - Upload File
- *   1. S1 → Storage: 'U' + path_len + path + file_size + file_data
- *   2. Storage → S1: Success/Failure response
+ *   1. S1 → Storage: 'U' + path_len + path + file_size + expires
+ *   2. Storage → S1: status (1 send the data, -1 refused)
+ *   3. S1 → Storage: file_data
+ *   4. Storage → S1: status (1 stored, -1 failed)
  * 
  * 'D' - Download File  
  *   1. S1 → Storage: 'D' + path_len + path
@@ -1301,56 +7129,203 @@ void handle_sigchld(int sig) {
  *   2. Storage → S1: Success/Failure response
  * 
  * 'T' - Tar Files
- *   1. S1 → Storage: 'T' + filetype_len + filetype (.pdf/.txt)
+ *   1. S1 → Storage: 'T' + filetype_len + filetype (.pdf/.txt) + root_len +
+ *      root (tenant storage root, "" for the default namespace)
  *   2. Storage → S1: tar_size + tar_data
  * 
  * 'L' - List Files
  *   1. S1 → Storage: 'L' + path_len + path
  *   2. Storage → S1: file_count + [filename1, filename2...]
+ *
+ * 'Y' - Symbol lookup (S5, gateway mode)
+ *   1. S1 → S5: 'Y' + the symf request of handle_symbol_request()
+ *   2. S5 → S1: the symf reply, then S5 closes the connection
+ *
+ * 'H' - Upload preflight
+ *   1. S1 → Storage: 'H' + path_len + path + file_size + expires + hash
+ *   2. Storage → S1: 3 (up to date), 1 (stored from the content store),
+ *      0 (send the data) or -1
+ *
+ * 'C' - Chunked upload
+ *   1. S1 → Storage: 'C' + path_len + path + file_size + expires + hash + count,
+ *      then count x ChunkRef
+ *   2. Storage → S1: missing_bytes + count need flags (or -1)
+ *   3. S1 → Storage: the flagged chunks; Storage → S1: status (1 stored, -1 failed)
+ *
+ * 'J' - Redirected transfer (client → S2-S5, with a ticket from S1)
+ *   1. Client → Storage: 'J' + ticket_len + ticket
+ *   2. Storage → Client: status 1, or -1 + msg_len + msg
+ *   3. Download: file_size + file_data; upload: the client sends the
+ *      file_data and gets status (1 stored, -1 failed)
  */
-int main() {
+int main(int argc, char *argv[]) {
 
     // Read children automatically
     signal(SIGCHLD, handle_sigchld); 
 
-    int server_fd, new_socket;
+    // A peer that hangs up ends its transfer, not the session: splice()
+    // and sendfile() cannot be given MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+
+    int server_fd = -1, new_socket;
     struct sockaddr_in address;
     int opt = 1;
     int addrlen = sizeof(address);
 
-    // Create socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
+    int takeover = 0;
+    for (int i = 1; i < argc; i++) {
+        struct in_addr host;
+        if (strcmp(argv[i], "--takeover") == 0) {
+            takeover = 1;
+        } else if (strcmp(argv[i], "--gateway") == 0) {
+            c_store_port = PORT_S5;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+                listen_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc &&
+                   inet_pton(AF_INET, argv[i + 1], &host) == 1) {
+            snprintf(storage_host, sizeof(storage_host), "%s", argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--takeover] [--gateway [port]] [--storage <ip>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (listen_port <= 0 || listen_port > 65535) {
+        fprintf(stderr, "Invalid gateway port\n");
         exit(EXIT_FAILURE);
     }
 
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
+    // Hot restart: inherit the listening socket from the running S1
+    if (takeover) {
+        server_fd = request_listener_handoff();
+        if (server_fd >= 0)
+            printf("Took over listening socket from running S1.\n");
+        else
+            printf("Takeover failed, binding a fresh listening socket.\n");
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT_S1);
+    if (server_fd < 0) {
+        // Create socket
+        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+            perror("socket failed");
+            exit(EXIT_FAILURE);
+        }
+
+        // Set socket options
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+            perror("setsockopt");
+            exit(EXIT_FAILURE);
+        }
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(listen_port);
+
+        // Bind socket
+        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("bind failed");
+            exit(EXIT_FAILURE);
+        }
+
+        // Listen
+        if (listen(server_fd, SOMAXCONN) < 0) {
+            perror("listen");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    // Bind socket
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
+    // Shared transfer budget must exist before the first fork()
+    if (init_transfer_pool() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (init_tenants() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (init_usage_table() < 0) {
         exit(EXIT_FAILURE);
     }
 
-    // Listen
-    if (listen(server_fd, 3) < 0) {
-        perror("listen");
+    // The key also proves to the storage servers that a connection is S1's
+    if (init_ticket_key() < 0) {
         exit(EXIT_FAILURE);
     }
 
+    // Pick up usage changes the storage servers make on their own
+    pthread_t reconciler;
+    if (pthread_create(&reconciler, NULL, reconcile_thread, NULL) == 0)
+        pthread_detach(reconciler);
+    else
+        perror("reconciler thread");
+
+    // The rest looks after the local .c files, which a gateway does not have
+    if (!c_store_port) {
+        if (init_event_log() < 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (init_scrubber() < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        // Enforce the version retention policy in the background
+        pthread_t pruner;
+        if (pthread_create(&pruner, NULL, prune_thread, NULL) == 0)
+            pthread_detach(pruner);
+        else
+            perror("pruner thread");
+
+        // Purge the trash once the retention window has passed
+        pthread_t reaper;
+        if (pthread_create(&reaper, NULL, reap_thread, NULL) == 0)
+            pthread_detach(reaper);
+        else
+            perror("reaper thread");
+
+        // Delete TTL uploads once they expire
+        pthread_t expirer;
+        if (pthread_create(&expirer, NULL, expire_thread, NULL) == 0)
+            pthread_detach(expirer);
+        else
+            perror("expirer thread");
+
+        // Index the stored .c sources for symf
+        pthread_t symbols;
+        if (pthread_create(&symbols, NULL, symbol_thread, NULL) == 0)
+            pthread_detach(symbols);
+        else
+            perror("symbol thread");
+    }
+
+    // Be ready to hand the listener to the next S1 instance
+    int handoff_fd = create_handoff_listener();
+
     printf("\n==============================================\n");
-    printf("🚀  S1 Server is UP and listening on port %d\n", PORT_S1);
+    printf("🚀  S1 %s is UP and listening on port %d\n", c_store_port ? "Gateway" : "Server", listen_port);
     printf("==============================================\n\n");
 
+    struct pollfd fds[2];
+    fds[0].fd = server_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = handoff_fd;
+    fds[1].events = POLLIN;
+
     while (1) {
+        // Wait for a client or a restart request (SIGCHLD may interrupt)
+        if (poll(fds, handoff_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno != EINTR) perror("poll");
+            continue;
+        }
+
+        // A new S1 wants the listener: hand it over and retire
+        if (handoff_fd >= 0 && (fds[1].revents & POLLIN)) {
+            if (send_listener_handoff(handoff_fd, server_fd)) {
+                close(server_fd);
+                close(handoff_fd);  // Path now belongs to the new S1
+                drain_sessions_and_exit();
+            }
+            continue;
+        }
+
+        if (!(fds[0].revents & POLLIN)) continue;
+
         // Accept connection
         if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
             perror("accept");
@@ -1369,11 +7344,12 @@ int main() {
 
         if (pid == 0) { // Child process
             close(server_fd); // Close listening socket in child
+            if (handoff_fd >= 0) close(handoff_fd);
             prcclient(new_socket);
             exit(0);
         } else { // Parent process
             close(new_socket); // Close connected socket in parent
-            waitpid(-1, NULL, WNOHANG); // Clean up zombie processes
+            handle_sigchld(SIGCHLD); // Clean up zombie processes
         }
     }
 
@@ -12,20 +12,34 @@
  *
  * Key Behaviors:
  * --------------
- * - Listens for connections from S1 only.
+ * - Listens for connections from S1, and from clients holding a transfer
+ *   ticket issued by S1.
  * - Stores files in a local path mirroring the one sent by the client via S1.
  * - Supports upload, download, remove, list and tar archive generation operations.
  * - Maintains identical directory structure as S1
  * - Services file requests from S1:
- *    - Upload (U)
- *    - Download (D)
- *    - Delete (R)
- *    - Download tar (T)
+ *    - Upload (U), optionally with an expiry time
+ *    - Download (D), or a prior version of a file (G)
+ *    - Delete (R), into a trash purged after a retention window
+ *    - Download tar (T), its member index (E) or a byte range of it (B)
  *    - Directory listing (L)
+ *    - Metadata lookup (S)
+ *    - Namespace usage (Q)
+ *    - Scrubber statistics (I)
+ *    - Version listing (V)
+ *    - Undelete from the trash (N)
+ *    - Change stream for watchers (W)
+ *    - Text search across stored files (F)
+ *    - Append to a stored file (A)
+ *    - Write a range of a stored file in place (P)
+ *    - Transfers redirected by S1 straight from a client (J)
+ *    - Upload preflight by content hash (H)
+ *    - Chunked upload, receiving only chunks it does not hold (C)
+ *    - Keyword search through an inverted index (K)
  *
  * Usage:
  * ------
- * Compile: gcc S3.c -o S3
+ * Compile: gcc S3.c -o S3 -pthread
  * Run:     ./S3
  *
  * Port: Default is 6073 (can be changed via macro)
@@ -40,6 +54,7 @@
  * Course: COMP-8567
  * Institution: University of Windsor
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -52,488 +67,5129 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <libgen.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <limits.h>
+#include <regex.h>
+#include <ctype.h>
 #include <asm-generic/socket.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 #define PORT_S3 6073
 #define BUFFER_SIZE 1024
 #define MAX_PATH_LEN 1024
+#define TRANSFER_CHUNK (64 * 1024)                  // Size of the transfer buffer used for uploads
+#define MAX_UPLOAD_SIZE (16L * 1024 * 1024 * 1024)  // Largest file size accepted from S1
+#define HASH_XATTR "user.w25.hash"                  // Extended attribute caching the content hash
+#define STAT_MAX_PATHS 64                           // Paths answered by one metadata request
+#define USAGE_FILE ".S3.usage"                      // Namespace usage counters under $HOME (memory mapped)
+#define USAGE_SLOTS 1024                            // Namespaces tracked in the usage table
+#define USAGE_PREFIX_LEN 64                         // Longest tracked namespace name (longer ones are truncated)
+#define SCRUB_RATE (4 * 1024 * 1024)                // Scrubber read budget in bytes per second
+#define SCRUB_PAUSE_SECS 600                        // Rest between two scrub passes
+#define GEN_XATTR "user.w25.gen"                    // Extended attribute holding the file generation
+#define VERSIONS_DIR ".S3.versions"                 // Prior versions under $HOME: <path>/<generation>
+#define VERSION_KEEP 10                             // Prior versions kept per file
+#define VERSION_MAX_DAYS 30                         // Prior versions older than this are pruned
+#define VERSION_PRUNE_SECS 3600                     // Interval between pruner passes
+#define VERSION_LIST_MAX 64                         // Entries returned by one version listing
+#define TRASH_DIR ".S3.trash"                       // Removed files under $HOME: <path>/<deletion time>
+#define TRASH_RETENTION_HOURS 72                    // How long removed files can be restored
+#define TRASH_REAP_SECS 300                         // Interval between reaper passes
+#define TRASH_PURGE_BATCH 64                        // Files purged before the reaper pauses
+#define EXPIRES_XATTR "user.w25.expires"            // Extended attribute holding the expiry time of a TTL upload
+#define EXPIRY_TICK_SECS 1                          // Interval between expirer passes
+#define EXPIRY_BATCH 64                             // Files deleted per expirer pass
+#define EVENT_FILE ".S3.events"                  // Change event ring under $HOME (memory mapped)
+#define EVENT_SLOTS 4096                            // Changes kept for resuming watchers
+#define WATCH_POLL_MS 100                           // How often a watch checks for new changes
+#define GREP_THREADS 4                              // Files scanned in parallel by one text search
+#define GREP_MAX_PATTERN 256                        // Longest search pattern
+#define GREP_MAX_LINE 512                           // Matching lines are cut to this many bytes
+#define GREP_MAX_MATCHES 10000                      // Lines returned by one search before it stops
+#define GREP_BATCH (64 * 1024)                      // Reply bytes a search worker gathers per send
+#define APPEND_MAX (1024 * 1024)                    // Largest append accepted in one request
+#define APPEND_SEQ_XATTR "user.w25.appendseq"       // Extended attribute holding the last applied append sequence
+#define WRITE_MAX (1024 * 1024)                     // Largest range accepted by one in-place write
+#define INDEX_FILE ".S3.index"                      // Inverted index snapshot under $HOME
+#define INDEX_JOURNAL ".S3.index.journal"           // Index changes made since the snapshot
+#define INDEX_JOURNAL_MAX (4 * 1024 * 1024)         // Journal size at which the index is compacted
+#define INDEX_SNAPSHOT_SECS 10                      // Interval between journal size checks
+#define INDEX_SKIP 128                              // Postings between two skip entries
+#define INDEX_PENDING_MAX 64                        // Out-of-order postings kept before a list is merged
+#define INDEX_MAX_TERM 32                           // Longer words are indexed by their first 32 bytes
+#define INDEX_MAX_QUERY_TERMS 8                     // Words in one search
+#define INDEX_MAX_RESULTS 1000                      // Paths returned by one search
+#define TENANT_DIR ".tenants"                       // Tenant storage roots: <root>/.tenants/<name>
+#define TICKET_KEY_FILE ".w25.ticket.key"           // Key shared with S1 for redirect tickets, under $HOME
+#define TICKET_KEY_LEN 32                           // Bytes of key material
+#define TICKET_MAC_LEN 32                           // HMAC-SHA256 tag closing every ticket
+#define TICKET_MAX_LEN (MAX_PATH_LEN + 128)         // Longest ticket accepted
+#define TICKET_IO_SECS 30                           // Idle timeout on a redirected client connection
+#define TICKET_NONCE_LEN 16                         // Random bytes making every ticket and S1 connection unique
+#define NONCE_CACHE_SIZE 4096                       // Ticket and S1 nonces remembered until they expire
+#define AUTH_WINDOW_SECS 30                         // How far the time in an S1 preamble may be off
+#define CONTENT_DIR ".S3.content"                   // Content store under $HOME: [<tenant root>/]<SHA-256> -> a stored file
+#define CONTENT_XATTR "user.w25.sha256"             // Extended attribute proving the content of a stored file
+#define CONTENT_PROOF_LEN 32                        // SHA-256 an upload proves its content with
+#define CHUNK_INDEX_FILE ".S3.chunks"               // Chunk index of chunked uploads under $HOME (memory mapped)
+#define CHUNK_SLOTS (1 << 20)                       // Chunks tracked by the index (a power of two)
+#define CHUNK_HOLDERS 4096                          // Stored files the indexed chunks point into
+#define CHUNK_PROBE 8                               // Index slots searched for one chunk
+#define CHUNK_MAX_COUNT (1 << 20)                   // Chunks accepted in one chunked upload
+#define CHUNK_MAX_SIZE TRANSFER_CHUNK               // Largest chunk accepted (one transfer buffer)
+#define CHUNK_OPEN_MAX 16                           // Stored files one chunked upload copies chunks from
+#define TAR_BLOCK 512                               // Tar block size
+#define TAR_THREADS 8                               // Files read in parallel while a tar is streamed
+#define TAR_WINDOW 32                               // Files prepared ahead of the one being sent
+#define TAR_INLINE_MAX (256 * 1024)                 // Larger files are sent from disk instead of being read ahead
+#define TAR_READAHEAD (4 * 1024 * 1024)             // Bytes of a larger file prefetched before it is sent
+
+// Requests are served one at a time, so one page-aligned buffer is reused
+// by every transfer (uploads, and the copy fallback of downloads)
+char transfer_buf[TRANSFER_CHUNK] __attribute__((aligned(4096)));
+
+/**
+ * @brief Streaming state of the XXH64 content hash
+ *
+ * XXH64 processes 32-byte stripes in four independent lanes, so it hashes
+ * at memory speed while the data streams through the transfer buffer.
+ */
+typedef struct {
+    unsigned long long total_len;   /**< Bytes hashed so far */
+    unsigned long long v[4];        /**< Lane accumulators */
+    unsigned char mem[32];          /**< Partial stripe carried between updates */
+    unsigned int memsize;           /**< Bytes in mem */
+} HashState;
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static unsigned long long xxh_rotl(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long xxh_read64(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned long long xxh_round(unsigned long long acc, unsigned long long input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static unsigned long long xxh_merge(unsigned long long acc, unsigned long long val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * @brief Starts a new hash computation (seed 0)
+ * @param state Hash state to initialise
+ */
+void hash_init(HashState *state) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME64_1;
+}
+
+/**
+ * @brief Feeds data into a running hash
+ * @param state Hash state
+ * @param data Bytes to hash
+ * @param len Number of bytes
+ */
+void hash_update(HashState *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    state->total_len += len;
+
+    if (state->memsize + len < 32) {
+        memcpy(state->mem + state->memsize, p, len);
+        state->memsize += len;
+        return;
+    }
+
+    // Complete the stripe left over from the previous update
+    if (state->memsize) {
+        size_t fill = 32 - state->memsize;
+        memcpy(state->mem + state->memsize, p, fill);
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh_round(state->v[i], xxh_read64(state->mem + 8 * i));
+        p += fill;
+        state->memsize = 0;
+    }
+
+    while (p + 32 <= end) {
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh_round(state->v[i], xxh_read64(p + 8 * i));
+        p += 32;
+    }
+
+    if (p < end) {
+        memcpy(state->mem, p, end - p);
+        state->memsize = end - p;
+    }
+}
+
+/**
+ * @brief Returns the digest of everything fed so far
+ * @param state Hash state (not modified)
+ * @return 64-bit XXH64 digest
+ */
+unsigned long long hash_final(const HashState *state) {
+    unsigned long long h;
+    if (state->total_len >= 32) {
+        h = xxh_rotl(state->v[0], 1) + xxh_rotl(state->v[1], 7) +
+            xxh_rotl(state->v[2], 12) + xxh_rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh_merge(h, state->v[i]);
+    } else {
+        h = state->v[2] + XXH_PRIME64_5;
+    }
+    h += state->total_len;
+
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->memsize;
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        unsigned int k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (unsigned long long)k * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * @brief Streaming state of SHA-256 (FIPS 180-4), used to sign tickets and prove content
+ */
+typedef struct {
+    unsigned int h[8];              /**< Chaining value */
+    unsigned char block[64];        /**< Partial block carried between updates */
+    unsigned long long total_len;   /**< Bytes hashed so far */
+} Sha256State;
+
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static unsigned int sha256_rotr(unsigned int x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(unsigned int *h, const unsigned char *p) {
+    unsigned int w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (unsigned int)p[4 * i] << 24 | (unsigned int)p[4 * i + 1] << 16 |
+               (unsigned int)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        unsigned int s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        unsigned int t1 = k + (sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25)) +
+                          ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        unsigned int t2 = (sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+void sha256_init(Sha256State *state) {
+    static const unsigned int iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(state->h, iv, sizeof(iv));
+    state->total_len = 0;
+}
+
+void sha256_update(Sha256State *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t used = state->total_len % 64;
+    state->total_len += len;
+    if (used > 0) {
+        size_t fill = 64 - used < len ? 64 - used : len;
+        memcpy(state->block + used, p, fill);
+        p += fill;
+        len -= fill;
+        if (used + fill < 64) return;
+        sha256_block(state->h, state->block);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(state->h, p);
+    memcpy(state->block, p, len);
+}
+
+void sha256_final(Sha256State *state, unsigned char *digest) {
+    unsigned long long bits = state->total_len * 8;
+    unsigned char pad[72] = {0x80};
+    size_t used = state->total_len % 64;
+    size_t pad_len = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    sha256_update(state, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = state->h[i] >> 24;
+        digest[4 * i + 1] = state->h[i] >> 16;
+        digest[4 * i + 2] = state->h[i] >> 8;
+        digest[4 * i + 3] = state->h[i];
+    }
+}
+
+/**
+ * @brief HMAC-SHA256 (RFC 2104) of a message
+ * @param key Secret key (at most 64 bytes)
+ * @param key_len Length of key
+ * @param msg Message
+ * @param msg_len Length of msg
+ * @param mac Receives the 32-byte tag
+ */
+void hmac_sha256(const unsigned char *key, size_t key_len, const void *msg, size_t msg_len, unsigned char *mac) {
+    unsigned char pad[64], inner[32];
+    Sha256State state;
+
+    memset(pad, 0x36, sizeof(pad));
+    for (size_t i = 0; i < key_len && i < sizeof(pad); i++) pad[i] ^= key[i];
+    sha256_init(&state);
+    sha256_update(&state, pad, sizeof(pad));
+    sha256_update(&state, msg, msg_len);
+    sha256_final(&state, inner);
+
+    for (size_t i = 0; i < sizeof(pad); i++) pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&state);
+    sha256_update(&state, pad, sizeof(pad));
+    sha256_update(&state, inner, sizeof(inner));
+    sha256_final(&state, mac);
+}
+
+/**
+ * @brief Content hash cached on a file, with the state it was computed for
+ *
+ * Stored in the HASH_XATTR extended attribute. The hash is only trusted
+ * while size and mtime still match, so a file changed behind the server's
+ * back simply reports no hash instead of a stale one.
+ */
+typedef struct {
+    long size;                  /**< File size when hashed */
+    long mtime_sec;             /**< Modification time when hashed */
+    long mtime_nsec;
+    unsigned long long hash;    /**< XXH64 of the contents */
+} HashRecord;
+
+/**
+ * @brief Records the content hash of a freshly written file
+ * @param fd Open descriptor of the file (all data written)
+ * @param hash XXH64 of the contents
+ */
+void store_cached_hash(int fd, unsigned long long hash) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return;
+    HashRecord rec = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, hash};
+    if (fsetxattr(fd, HASH_XATTR, &rec, sizeof(rec), 0) < 0)
+        perror("Failed to cache content hash");
+}
+
+/**
+ * @brief Hashes a file changed in place and caches the new hash
+ * @param fd Descriptor of the file, open for reading and still locked
+ *
+ * Appends and range writes keep the file, so its hash is recomputed
+ * before the lock is released and statf, the scrubber and the upload
+ * preflight keep covering it.
+ */
+void rehash_file(int fd) {
+    HashState hs;
+    hash_init(&hs);
+    ssize_t n;
+    off_t offset = 0;
+    while ((n = pread(fd, transfer_buf, TRANSFER_CHUNK, offset)) > 0) {
+        hash_update(&hs, transfer_buf, n);
+        offset += n;
+    }
+    if (n == 0) store_cached_hash(fd, hash_final(&hs));
+}
+
+/**
+ * @brief Looks up the cached content hash of a file
+ * @param path File path
+ * @param st Current stat of the file
+ * @param hash Receives the hash when valid
+ * @return 1 if a hash matching the current size and mtime was found, else 0
+ */
+int load_cached_hash(const char *path, const struct stat *st, unsigned long long *hash) {
+    HashRecord rec;
+    if (getxattr(path, HASH_XATTR, &rec, sizeof(rec)) != sizeof(rec)) return 0;
+    if (rec.size != st->st_size || rec.mtime_sec != st->st_mtim.tv_sec ||
+        rec.mtime_nsec != st->st_mtim.tv_nsec)
+        return 0;
+    *hash = rec.hash;
+    return 1;
+}
+
+/**
+ * @brief SHA-256 of a stored file, with the state it was computed for
+ *
+ * Stored in the CONTENT_XATTR extended attribute when an upload is
+ * stored. Unlike the XXH64 of HashRecord it cannot be forged, so it is
+ * what lets an upload skip its data (see handle_preflight). Trusted only
+ * while size and mtime still match.
+ */
+typedef struct {
+    long size;                                  /**< File size when hashed */
+    long mtime_sec;                             /**< Modification time when hashed */
+    long mtime_nsec;
+    unsigned char digest[CONTENT_PROOF_LEN];    /**< SHA-256 of the contents */
+} ContentProof;
+
+/**
+ * @brief Records the SHA-256 of a freshly written file
+ * @param fd Open descriptor of the file (all data written)
+ * @param digest SHA-256 of the contents
+ */
+void store_content_proof(int fd, const unsigned char *digest) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return;
+    ContentProof rec = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, {0}};
+    memcpy(rec.digest, digest, CONTENT_PROOF_LEN);
+    if (fsetxattr(fd, CONTENT_XATTR, &rec, sizeof(rec), 0) < 0)
+        perror("Failed to record content proof");
+}
+
+/**
+ * @brief Checks an open file against a SHA-256
+ * @param fd Open descriptor of the file
+ * @param st Current stat of the file
+ * @param digest SHA-256 the file should have
+ * @return 1 if the file has a current proof with that digest, else 0
+ */
+int content_proven(int fd, const struct stat *st, const unsigned char *digest) {
+    ContentProof rec;
+    return fgetxattr(fd, CONTENT_XATTR, &rec, sizeof(rec)) == sizeof(rec) && rec.size == st->st_size &&
+           rec.mtime_sec == st->st_mtim.tv_sec && rec.mtime_nsec == st->st_mtim.tv_nsec &&
+           memcmp(rec.digest, digest, CONTENT_PROOF_LEN) == 0;
+}
+
+/**
+ * @brief Usage counters of one namespace (first path component under ~S1/)
+ */
+typedef struct {
+    int used;                       /**< Slot holds a namespace */
+    char prefix[USAGE_PREFIX_LEN];  /**< Namespace name, "" for top-level files */
+    long bytes;                     /**< Bytes stored on this server */
+    long files;                     /**< Files stored on this server */
+} UsageEntry;
+
+#define USAGE_MAGIC 0x57325531      // "W2U1"
+
+/**
+ * @brief Open-addressed table of namespace usage, mapped from $HOME/USAGE_FILE
+ *
+ * Kept up to date by uploads and removals so S1 can fetch this server's
+ * share of every namespace ('Q') without walking the tree.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int slot_count;
+    UsageEntry slots[USAGE_SLOTS];
+} UsageTable;
+
+UsageTable *usage_table = NULL;
+
+/**
+ * @brief Extracts the namespace of a server-relative path
+ * @param path Path below the server root (e.g. "/team/docs/a.txt")
+ * @param prefix Receives the namespace (e.g. "team", ".tenants/acme"), "" for top-level files
+ */
+void usage_prefix(const char *path, char *prefix) {
+    while (*path == '/') path++;
+
+    // A tenant's whole root is one namespace (".tenants/<name>")
+    size_t skip = strncmp(path, TENANT_DIR "/", strlen(TENANT_DIR) + 1) == 0 ? strlen(TENANT_DIR) + 1 : 0;
+    const char *slash = strchr(path + skip, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    if (len >= USAGE_PREFIX_LEN) len = USAGE_PREFIX_LEN - 1;
+    memcpy(prefix, path, len);
+    prefix[len] = '\0';
+}
+
+/**
+ * @brief Adjusts the counters of the namespace a path belongs to
+ * @param path Path below the server root
+ * @param bytes Byte delta
+ * @param files File count delta
+ */
+void usage_add(const char *path, long bytes, long files) {
+    if (!usage_table) return;
+    char prefix[USAGE_PREFIX_LEN];
+    usage_prefix(path, prefix);
+
+    unsigned int h = 2166136261u;   // FNV-1a
+    for (const char *p = prefix; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+
+    for (int probe = 0; probe < USAGE_SLOTS; probe++) {
+        UsageEntry *e = &usage_table->slots[(h + probe) % USAGE_SLOTS];
+        if (!e->used) {
+            e->used = 1;
+            strcpy(e->prefix, prefix);
+        }
+        if (strcmp(e->prefix, prefix) == 0) {
+            e->bytes += bytes;
+            e->files += files;
+            return;
+        }
+    }
+}
+
+// Length of "$HOME/S3" while the local tree is being counted
+static size_t usage_walk_root_len;
+
+/**
+ * @brief nftw() callback counting stored .txt files into the usage table
+ */
+static int usage_walk_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    const char *ext = strrchr(path, '.');
+    if (type == FTW_F && ext && strcmp(ext, ".txt") == 0)
+        usage_add(path + usage_walk_root_len, st->st_size, 1);
+    return 0;
+}
+
+/**
+ * @brief Maps the namespace usage table, building it on first start
+ * @return 0 on success, -1 on failure
+ */
+int init_usage_table(void) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), USAGE_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(UsageTable)) < 0) {
+        perror("usage table open");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    usage_table = mmap(NULL, sizeof(UsageTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (usage_table == MAP_FAILED) {
+        perror("usage table mmap");
+        usage_table = NULL;
+        return -1;
+    }
+
+    if (usage_table->magic != USAGE_MAGIC || usage_table->slot_count != USAGE_SLOTS) {
+        printf("Building namespace usage table...\n");
+        memset(usage_table, 0, sizeof(UsageTable));
+        char root[MAX_PATH_LEN];
+        snprintf(root, sizeof(root), "%s/S3", getenv("HOME"));
+        usage_walk_root_len = strlen(root);
+        nftw(root, usage_walk_file, 16, FTW_PHYS);
+        usage_table->slot_count = USAGE_SLOTS;
+        usage_table->magic = USAGE_MAGIC;
+    }
+    return 0;
+}
+
+/**
+ * @brief Integrity scrubber results, as reported by the stats interface
+ */
+typedef struct {
+    long passes;                        /**< Completed passes over the store */
+    long files_checked;                 /**< Files re-hashed (all passes) */
+    long bytes_checked;                 /**< Bytes re-read (all passes) */
+    long unverified;                    /**< Files without a valid cached hash in the last pass */
+    long mismatches;                    /**< Files whose contents no longer match their hash */
+    long last_pass_end;                 /**< Time the last pass finished, 0 if none yet */
+    char last_mismatch[MAX_PATH_LEN];   /**< Most recent mismatching file (~S1/...) */
+} ScrubReport;
+
+/**
+ * @brief Scrubber results guarded for concurrent access
+ *
+ * Written by the scrubber thread, read by the request loop.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    ScrubReport report;
+} ScrubStats;
+
+ScrubStats scrub_state = {.lock = PTHREAD_MUTEX_INITIALIZER};
+ScrubStats *scrub_stats = &scrub_state;
+
+// Scrubber thread state
+static char scrub_buf[TRANSFER_CHUNK];
+static size_t scrub_root_len;
+static long scrub_pass_unverified;
+static double scrub_tokens;
+static struct timespec scrub_last;
+
+/**
+ * @brief Token bucket limiting scrubber reads to SCRUB_RATE bytes per second
+ * @param bytes Bytes just read
+ *
+ * Tokens may go negative; the thread then sleeps off the debt, so the
+ * long-run read rate never exceeds the budget whatever the file sizes.
+ */
+static void scrub_throttle(long bytes) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    scrub_tokens += ((now.tv_sec - scrub_last.tv_sec) + (now.tv_nsec - scrub_last.tv_nsec) / 1e9) * SCRUB_RATE;
+    scrub_last = now;
+    if (scrub_tokens > TRANSFER_CHUNK) scrub_tokens = TRANSFER_CHUNK;
+
+    scrub_tokens -= bytes;
+    if (scrub_tokens < 0) {
+        double wait = -scrub_tokens / SCRUB_RATE;
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * @brief nftw() callback verifying one stored file against its cached hash
+ *
+ * The hash record is read from the open descriptor, so a file replaced
+ * during the walk is never compared with another file's hash. Files
+ * modified while being read are skipped and checked on the next pass.
+ */
+static int scrub_file(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)sb;
+    (void)ftw;
+    const char *ext = strrchr(path, '.');
+    if (type != FTW_F || !ext || strcmp(ext, ".txt") != 0) return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    HashRecord rec;
+    if (fstat(fd, &st) < 0 || fgetxattr(fd, HASH_XATTR, &rec, sizeof(rec)) != sizeof(rec) ||
+        rec.size != st.st_size || rec.mtime_sec != st.st_mtim.tv_sec || rec.mtime_nsec != st.st_mtim.tv_nsec) {
+        scrub_pass_unverified++;
+        close(fd);
+        return 0;
+    }
+
+    // Scrub reads should not displace the files clients are using
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+
+    HashState hs;
+    hash_init(&hs);
+    ssize_t n;
+    long total = 0;
+    while ((n = read(fd, scrub_buf, sizeof(scrub_buf))) > 0) {
+        hash_update(&hs, scrub_buf, n);
+        total += n;
+        scrub_throttle(n);
+    }
+
+    struct stat after;
+    int changed = fstat(fd, &after) < 0 || after.st_size != st.st_size ||
+                  after.st_mtim.tv_sec != st.st_mtim.tv_sec || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec;
+    close(fd);
+    if (n < 0 || changed) return 0;
+
+    int mismatch = hash_final(&hs) != rec.hash;
+    pthread_mutex_lock(&scrub_stats->lock);
+    scrub_stats->report.files_checked++;
+    scrub_stats->report.bytes_checked += total;
+    if (mismatch) {
+        scrub_stats->report.mismatches++;
+        snprintf(scrub_stats->report.last_mismatch, MAX_PATH_LEN, "~S1%s", path + scrub_root_len);
+    }
+    pthread_mutex_unlock(&scrub_stats->lock);
+
+    if (mismatch)
+        printf("Scrub: contents of %s do not match the recorded hash\n", path);
+    return 0;
+}
+
+/**
+ * @brief Background integrity scrubber
+ *
+ * Walks ~/S3 forever, re-hashing every .txt file that has a cached hash,
+ * then rests SCRUB_PAUSE_SECS between passes. Reads are throttled to
+ * SCRUB_RATE and the thread runs at the lowest CPU priority, so foreground
+ * requests keep their latency.
+ */
+void *scrub_thread(void *arg) {
+    (void)arg;
+
+    // Signals are handled by the main thread; nice applies per thread on Linux
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    char root[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/S3", getenv("HOME"));
+    scrub_root_len = strlen(root);
+    clock_gettime(CLOCK_MONOTONIC, &scrub_last);
+
+    while (1) {
+        scrub_pass_unverified = 0;
+        nftw(root, scrub_file, 16, FTW_PHYS);
+
+        pthread_mutex_lock(&scrub_stats->lock);
+        scrub_stats->report.passes++;
+        scrub_stats->report.unverified = scrub_pass_unverified;
+        scrub_stats->report.last_pass_end = time(NULL);
+        pthread_mutex_unlock(&scrub_stats->lock);
+
+        sleep(SCRUB_PAUSE_SECS);
+    }
+    return NULL;
+}
+
+/**
+ * @brief One entry of a version listing
+ */
+typedef struct {
+    long version;               /**< Generation number (1 = first upload) */
+    long size;                  /**< Size in bytes */
+    long mtime;                 /**< Time this version was written */
+    long current;               /**< 1 for the live file, 0 for a prior version */
+} VersionInfo;
+
+/**
+ * @brief Reads the generation number of a stored file
+ * @param path Stored file
+ * @return Its generation (1 for files stored before versioning), 0 if it does not exist
+ */
+long file_generation(const char *path) {
+    long gen;
+    if (getxattr(path, GEN_XATTR, &gen, sizeof(gen)) == sizeof(gen)) return gen;
+    return access(path, F_OK) == 0 ? 1 : 0;
+}
+
+/**
+ * @brief Builds the path of a prior version: $HOME/VERSIONS_DIR/<rel_path>/<gen>
+ */
+void version_path(char *out, size_t len, const char *rel_path, long gen) {
+    snprintf(out, len, "%s/%s%s/%ld", getenv("HOME"), VERSIONS_DIR, rel_path, gen);
+}
+
+/**
+ * @brief Highest generation already used at a path (kept versions and removed copies)
+ * @param rel_path Path below the server root ("/dir/file")
+ * @return That generation, 0 if the path has no history
+ *
+ * A file stored after a removal continues from here, so its versions
+ * never collide with those kept from the removed file.
+ */
+long last_generation(const char *rel_path) {
+    const char *dirs[] = {VERSIONS_DIR, TRASH_DIR};
+    long last = 0;
+    for (int d = 0; d < 2; d++) {
+        char dir_path[MAX_PATH_LEN];
+        snprintf(dir_path, sizeof(dir_path), "%s/%s%s", getenv("HOME"), dirs[d], rel_path);
+        DIR *dir = opendir(dir_path);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') continue;
+            long gen = strtol(entry->d_name, NULL, 10);
+            if (d > 0) {
+                // Removed copies are named by deletion time; they carry their generation
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+                gen = file_generation(path);
+            }
+            if (gen > last) last = gen;
+        }
+        if (dir) closedir(dir);
+    }
+    return last;
+}
+
+/**
+ * @brief Keeps the file about to be overwritten as a prior version
+ * @param fullpath Stored file that is being replaced
+ * @param rel_path Its path below the server root ("/dir/file")
+ * @return Generation number for the replacing file, -1 if the old
+ *         contents could not be kept
+ *
+ * The old contents are cloned with FICLONE where the filesystem supports
+ * reflinks, so the version shares blocks with nothing copied. Otherwise
+ * the old inode itself is hardlinked: uploads always replace files by
+ * rename, so once unlinked from the store it is an immutable blob.
+ */
+long preserve_version(const char *fullpath, const char *rel_path) {
+    long gen = file_generation(fullpath);
+    if (gen == 0) return last_generation(rel_path) + 1;
+
+    char vpath[MAX_PATH_LEN];
+    version_path(vpath, sizeof(vpath), rel_path, gen);
+    char vdir[MAX_PATH_LEN], mkdir_cmd[MAX_PATH_LEN + 16];
+    strcpy(vdir, vpath);
+    snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(vdir));
+    system(mkdir_cmd);
+
+    int src = open(fullpath, O_RDONLY);
+    int dst = src >= 0 ? open(vpath, O_WRONLY | O_CREAT | O_EXCL, 0444) : -1;
+    if (dst < 0 && src >= 0 && errno == EEXIST) {
+        // Number taken by the history of a removed file: keep this one after it
+        gen = last_generation(rel_path) + 1;
+        version_path(vpath, sizeof(vpath), rel_path, gen);
+        dst = open(vpath, O_WRONLY | O_CREAT | O_EXCL, 0444);
+    }
+    if (dst < 0) {
+        perror("Failed to keep previous version");
+        if (src >= 0) close(src);
+        return -1;
+    }
+
+    int cloned = ioctl(dst, FICLONE, src) == 0;
+    if (cloned) {
+        // A clone is a new inode: carry over mtime, hash and generation
+        struct stat st;
+        HashRecord rec;
+        if (fgetxattr(src, HASH_XATTR, &rec, sizeof(rec)) == sizeof(rec))
+            fsetxattr(dst, HASH_XATTR, &rec, sizeof(rec), 0);
+        fsetxattr(dst, GEN_XATTR, &gen, sizeof(gen), 0);
+        if (fstat(src, &st) == 0) {
+            struct timespec times[2] = {st.st_atim, st.st_mtim};
+            futimens(dst, times);
+        }
+    }
+    close(dst);
+    close(src);
+
+    if (!cloned) {
+        unlink(vpath);
+        if (link(fullpath, vpath) < 0) {
+            perror("Failed to keep previous version");
+            return -1;
+        }
+        chmod(vpath, 0444);
+    }
+    printf("Version %ld of %s kept (%s)\n", gen, rel_path, cloned ? "reflink" : "hardlink");
+    return gen + 1;
+}
+
+/**
+ * @brief Resolves which file serves a given version
+ * @param local_path Live file
+ * @param rel_path Its path below the server root
+ * @param version Requested generation, 0 for the live file
+ * @param out Receives the file to read
+ */
+void resolve_version(const char *local_path, const char *rel_path, long version, char *out, size_t len) {
+    if (version <= 0 || version == file_generation(local_path))
+        snprintf(out, len, "%s", local_path);
+    else
+        version_path(out, len, rel_path, version);
+}
+
+int compare_versions(const void *a, const void *b) {
+    long va = ((const VersionInfo *)a)->version, vb = ((const VersionInfo *)b)->version;
+    return (va < vb) - (va > vb);   // Newest first
+}
+
+/**
+ * @brief Lists the live file and its prior versions, newest first
+ * @param local_path Live file
+ * @param rel_path Its path below the server root
+ * @param out Receives up to VERSION_LIST_MAX entries
+ * @return Number of entries (0 if the file never existed)
+ */
+int list_versions(const char *local_path, const char *rel_path, VersionInfo *out) {
+    int count = 0;
+    struct stat st;
+    if (stat(local_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        out[count++] = (VersionInfo){file_generation(local_path), st.st_size, st.st_mtime, 1};
+    }
+
+    char vdir[MAX_PATH_LEN];
+    snprintf(vdir, sizeof(vdir), "%s/%s%s", getenv("HOME"), VERSIONS_DIR, rel_path);
+    DIR *dir = opendir(vdir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) && count < VERSION_LIST_MAX) {
+        char *end;
+        long gen = strtol(entry->d_name, &end, 10);
+        char vpath[MAX_PATH_LEN];
+        if (snprintf(vpath, sizeof(vpath), "%s/%s", vdir, entry->d_name) >= (int)sizeof(vpath)) continue;
+        if (*end || gen <= 0 || stat(vpath, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        out[count++] = (VersionInfo){gen, st.st_size, st.st_mtime, 0};
+    }
+    if (dir) closedir(dir);
+
+    qsort(out, count, sizeof(VersionInfo), compare_versions);
+    return count;
+}
+
+/**
+ * @brief Applies the retention policy below one versions directory
+ * @param path Directory under $HOME/VERSIONS_DIR
+ *
+ * Regular files with numeric names are the versions of one stored file:
+ * only the newest VERSION_KEEP are kept, and none superseded more than
+ * VERSION_MAX_DAYS ago (the version's ctime is when it was preserved).
+ * Subdirectories are pruned recursively and removed once empty.
+ */
+void prune_versions(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct { long gen; time_t preserved; } found[VERSION_LIST_MAX];
+    int count = 0;
+    time_t cutoff = time(NULL) - (time_t)VERSION_MAX_DAYS * 24 * 3600;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (lstat(child, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            prune_versions(child);
+            rmdir(child);   // Only succeeds once empty
+            continue;
+        }
+
+        char *end;
+        long gen = strtol(entry->d_name, &end, 10);
+        if (*end || gen <= 0 || !S_ISREG(st.st_mode)) continue;
+        if (st.st_ctime < cutoff || count == VERSION_LIST_MAX) {
+            unlink(child);
+            continue;
+        }
+        found[count].gen = gen;
+        found[count].preserved = st.st_ctime;
+        count++;
+    }
+    closedir(dir);
+
+    // Drop everything but the newest VERSION_KEEP
+    while (count > VERSION_KEEP) {
+        int oldest = 0;
+        for (int i = 1; i < count; i++)
+            if (found[i].gen < found[oldest].gen) oldest = i;
+        char victim[MAX_PATH_LEN];
+        snprintf(victim, sizeof(victim), "%s/%ld", path, found[oldest].gen);
+        unlink(victim);
+        found[oldest] = found[--count];
+    }
+}
+
+/**
+ * @brief Background pruner enforcing the version retention policy
+ *
+ * Runs a pass every VERSION_PRUNE_SECS at the lowest CPU priority.
+ */
+void *prune_thread(void *arg) {
+    (void)arg;
+
+    // Signals are handled by the main thread; nice applies per thread on Linux
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    char root[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), VERSIONS_DIR);
+    while (1) {
+        prune_versions(root);
+        sleep(VERSION_PRUNE_SECS);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Moves a removed file into the trash instead of deleting it
+ * @param local_path Stored file
+ * @param rel_path Its path below the server root ("/dir/file")
+ * @return 0 on success, -1 with errno set on failure
+ *
+ * A rename to $HOME/TRASH_DIR/<rel_path>/<deletion time>, so removal costs
+ * the same whatever the file size; the reaper thread frees the space
+ * later. Anything that is not a regular file is removed directly, and so
+ * is a file whose trash would be on another filesystem.
+ */
+int move_to_trash(const char *local_path, const char *rel_path) {
+    struct stat st;
+    if (lstat(local_path, &st) < 0) return -1;
+    if (!S_ISREG(st.st_mode)) return remove(local_path);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char tpath[MAX_PATH_LEN], tdir[MAX_PATH_LEN], mkdir_cmd[MAX_PATH_LEN + 16];
+    snprintf(tpath, sizeof(tpath), "%s/%s%s/%ld.%09ld", getenv("HOME"), TRASH_DIR, rel_path,
+             (long)now.tv_sec, now.tv_nsec);
+    strcpy(tdir, tpath);
+    snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(tdir));
+    system(mkdir_cmd);
+
+    if (rename(local_path, tpath) == 0) return 0;
+    return errno == EXDEV ? remove(local_path) : -1;
+}
+
+/**
+ * @brief Restores the most recently removed copy of a file
+ * @param local_path Where the file lived
+ * @param rel_path Its path below the server root
+ * @param size Receives the restored file's size
+ * @return 0 on success, -1 with errno ENOENT (nothing in the trash) or
+ *         EEXIST (a live file is in the way)
+ */
+int restore_from_trash(const char *local_path, const char *rel_path, long *size) {
+    char tdir[MAX_PATH_LEN];
+    snprintf(tdir, sizeof(tdir), "%s/%s%s", getenv("HOME"), TRASH_DIR, rel_path);
+
+    // Entry names are "<seconds>.<nanoseconds>": the newest sorts last
+    char newest[NAME_MAX + 1] = "";
+    DIR *dir = opendir(tdir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        size_t len = strlen(entry->d_name), best = strlen(newest);
+        if (len > best || (len == best && strcmp(entry->d_name, newest) > 0))
+            strcpy(newest, entry->d_name);
+    }
+    if (dir) closedir(dir);
+    if (!newest[0]) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (access(local_path, F_OK) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    char tpath[MAX_PATH_LEN], ldir[MAX_PATH_LEN], mkdir_cmd[MAX_PATH_LEN + 16];
+    if (snprintf(tpath, sizeof(tpath), "%s/%s", tdir, newest) >= (int)sizeof(tpath)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(ldir, local_path);
+    if (snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(ldir)) >= (int)sizeof(mkdir_cmd)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    system(mkdir_cmd);
+
+    struct stat st;
+    if (stat(tpath, &st) < 0 || rename(tpath, local_path) < 0) return -1;
+    rmdir(tdir);    // Only succeeds once empty
+    *size = st.st_size;
+    return 0;
+}
+
+// Files purged by the reaper since its last pause
+static int reap_batch;
+
+/**
+ * @brief Purges trash entries older than the retention window
+ * @param path Directory under $HOME/TRASH_DIR
+ * @param cutoff Entries removed before this time are purged
+ *
+ * Pauses after every TRASH_PURGE_BATCH unlinks so that purging a large
+ * trash does not monopolise the disk.
+ */
+void reap_trash(const char *path, time_t cutoff) {
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (lstat(child, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            reap_trash(child, cutoff);
+            rmdir(child);   // Only succeeds once empty
+            continue;
+        }
+        if (strtol(entry->d_name, NULL, 10) >= cutoff) continue;
+
+        unlink(child);
+        if (++reap_batch >= TRASH_PURGE_BATCH) {
+            reap_batch = 0;
+            sleep(1);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Extracts the tenant root a server-relative path lies in
+ * @param rel_path Path below the storage root (e.g. "/.tenants/acme/docs/a.pdf")
+ * @param root Receives the tenant root ("/.tenants/acme"), "" in the default namespace
+ */
+void tenant_root_of(const char *rel_path, char *root) {
+    while (*rel_path == '/') rel_path++;
+    root[0] = '\0';
+    size_t dir_len = strlen(TENANT_DIR) + 1;
+    if (strncmp(rel_path, TENANT_DIR "/", dir_len) != 0) return;
+    const char *slash = strchr(rel_path + dir_len, '/');
+    int len = slash ? (int)(slash - rel_path) : (int)strlen(rel_path);
+    snprintf(root, MAX_PATH_LEN, "/%.*s", len, rel_path);
+}
+
+/**
+ * @brief Path of the content store entry for a SHA-256
+ * @param rel_path Destination of the upload, whose namespace has a store of its own
+ */
+void content_path(char *out, size_t len, const char *rel_path, const unsigned char *digest) {
+    char root[MAX_PATH_LEN], hex[2 * CONTENT_PROOF_LEN + 1];
+    tenant_root_of(rel_path, root);
+    for (int i = 0; i < CONTENT_PROOF_LEN; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    snprintf(out, len, "%s/%s%s/%s", getenv("HOME"), CONTENT_DIR, root, hex);
+}
+
+/**
+ * @brief Points the content store at a freshly stored file
+ * @param rel_path The file below the storage root
+ * @param fullpath The stored file
+ * @param digest SHA-256 of its contents
+ *
+ * The entry is a symlink named after the digest, in the store of the
+ * file's namespace, so an upload can only take content from a file of
+ * the same tenant. It is only a hint: a lookup checks that the file
+ * still has that proof before use.
+ */
+void content_remember(const char *rel_path, const char *fullpath, const unsigned char *digest) {
+    char path[MAX_PATH_LEN], temppath[MAX_PATH_LEN + 8];
+    content_path(path, sizeof(path), rel_path, digest);
+    snprintf(temppath, sizeof(temppath), "%s.new", path);
+    unlink(temppath);
+
+    int linked = symlink(fullpath, temppath) == 0;
+    if (!linked && errno == ENOENT) {
+        // Create the store and the namespace's directory in it
+        char dir[MAX_PATH_LEN];
+        snprintf(dir, sizeof(dir), "%s", path);
+        *strrchr(dir, '/') = '\0';
+        for (char *p = dir + strlen(getenv("HOME")) + 1; (p = strchr(p, '/')); *p++ = '/') {
+            *p = '\0';
+            mkdir(dir, 0700);
+        }
+        mkdir(dir, 0700);
+        linked = symlink(fullpath, temppath) == 0;
+    }
+    if (linked && rename(temppath, path) < 0) unlink(temppath);
+}
+
+/**
+ * @brief Opens a stored file with the given content, if its namespace has one
+ * @param rel_path Destination of the upload
+ * @param proof SHA-256 of the wanted content
+ * @param size Size of the wanted content
+ * @param hash Receives the cached XXH64 of the file
+ * @return Descriptor holding a shared lock, so in-place writers wait until
+ *         it is closed, or -1 if no stored file is known to have the content
+ */
+int content_open(const char *rel_path, const unsigned char *proof, long size, unsigned long long *hash) {
+    char path[MAX_PATH_LEN], holder[MAX_PATH_LEN];
+    content_path(path, sizeof(path), rel_path, proof);
+    ssize_t n = readlink(path, holder, sizeof(holder) - 1);
+    if (n <= 0) return -1;
+    holder[n] = '\0';
+
+    int fd = open(holder, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && flock(fd, LOCK_SH) == 0 && fstat(fd, &st) == 0 && st.st_size == size &&
+        content_proven(fd, &st, proof) && load_cached_hash(holder, &st, hash))
+        return fd;
+
+    // The file changed or is gone
+    if (fd >= 0) close(fd);
+    unlink(path);
+    return -1;
+}
+
+/**
+ * @brief Drops content store entries whose file is gone
+ * @param dir_path A store directory; the tenants' stores below it are pruned too
+ */
+void content_prune(const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) return;
+
+    struct dirent *entry;
+    char path[MAX_PATH_LEN + 256];
+    struct stat st;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            content_prune(path);
+        else if (stat(path, &st) < 0)
+            unlink(path);
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief One entry of a chunked upload's recipe (same layout on the client and S1)
+ */
+typedef struct {
+    unsigned long long hash;    /**< XXH64 of the chunk */
+    long len;                   /**< Chunk length in bytes */
+} ChunkRef;
+
+/**
+ * @brief Where an indexed chunk can be read from
+ */
+typedef struct {
+    unsigned long long hash;    /**< XXH64 of the chunk, 0 for a free slot */
+    int len;                    /**< Chunk length in bytes */
+    int holder;                 /**< Holder slot of the stored file containing it */
+    unsigned int holder_gen;    /**< Generation of that slot when the chunk was indexed */
+    long offset;                /**< Offset of the chunk in the stored file */
+} ChunkEntry;
+
+/**
+ * @brief A stored file whose chunks are indexed
+ */
+typedef struct {
+    unsigned int gen;           /**< Bumped when the slot is reused or the file changed */
+    long size;                  /**< File size when indexed */
+    unsigned long long hash;    /**< XXH64 of the whole file when indexed */
+    char path[MAX_PATH_LEN];    /**< Full path of the stored file */
+} ChunkHolder;
+
+#define CHUNK_MAGIC 0x57334331      // "W3C1"
+
+/**
+ * @brief Chunk index: chunk hash -> a stored file and offset holding it
+ *
+ * Mapped MAP_SHARED from $HOME/CHUNK_INDEX_FILE so it survives restarts.
+ * Chunks are hashed into CHUNK_SLOTS open-addressed slots; each names a
+ * holder slot, and an entry only counts while the holder's generation is
+ * the one it was indexed under. Holder slots are reused round robin, and
+ * a holder whose file no longer has the recorded size and cached hash is
+ * retired on first use, so the index is a hint that never serves stale
+ * data. One index serves every namespace, but a chunk is only taken from
+ * a file in the namespace of the upload (see chunk_entry_in). Only the
+ * main thread touches it.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int slot_count;
+    unsigned int holder_count;
+    unsigned int next_holder;   /**< Holder slot reused next */
+    ChunkHolder holders[CHUNK_HOLDERS];
+    ChunkEntry slots[CHUNK_SLOTS];
+} ChunkIndex;
+
+ChunkIndex *chunk_index = NULL;
+
+/**
+ * @brief Maps the chunk index
+ * @return 0 on success, -1 on failure
+ *
+ * Called on the first chunked upload, so a server that never gets one
+ * does not create the file. An index of another layout is discarded by
+ * truncating the file, which keeps it sparse.
+ */
+int init_chunk_index(void) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), CHUNK_INDEX_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    unsigned int header[3] = {0, 0, 0};
+    if (fd >= 0 && pread(fd, header, sizeof(header), 0) != sizeof(header))
+        header[0] = 0;
+    int current = header[0] == CHUNK_MAGIC && header[1] == CHUNK_SLOTS && header[2] == CHUNK_HOLDERS;
+    if (fd < 0 || (!current && ftruncate(fd, 0) < 0) || ftruncate(fd, sizeof(ChunkIndex)) < 0) {
+        perror("chunk index open");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    chunk_index = mmap(NULL, sizeof(ChunkIndex), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (chunk_index == MAP_FAILED) {
+        perror("chunk index mmap");
+        chunk_index = NULL;
+        return -1;
+    }
+    if (!current) {
+        chunk_index->slot_count = CHUNK_SLOTS;
+        chunk_index->holder_count = CHUNK_HOLDERS;
+        chunk_index->magic = CHUNK_MAGIC;
+    }
+    return 0;
+}
+
+/**
+ * @brief Whether an index entry still points into its holder's current file
+ */
+static int chunk_entry_live(const ChunkEntry *e) {
+    return e->hash && e->holder >= 0 && e->holder < CHUNK_HOLDERS &&
+           e->holder_gen == chunk_index->holders[e->holder].gen;
+}
+
+/**
+ * @brief Whether an index entry points into a file of the given namespace
+ * @param e Index entry
+ * @param root Tenant root of the upload, "" for the default namespace
+ *
+ * Chunk hashes are no secret, so without this check a tenant could copy
+ * chunks out of another tenant's files just by naming them.
+ */
+static int chunk_entry_in(const ChunkEntry *e, const char *root) {
+    ChunkHolder *h = &chunk_index->holders[e->holder];
+    char storage_root[MAX_PATH_LEN], holder_root[MAX_PATH_LEN];
+    int n = snprintf(storage_root, sizeof(storage_root), "%s/S3", getenv("HOME"));
+    h->path[MAX_PATH_LEN - 1] = '\0';
+    if (strncmp(h->path, storage_root, n) != 0 || h->path[n] != '/') return 0;
+    tenant_root_of(h->path + n, holder_root);
+    return strcmp(holder_root, root) == 0;
+}
+
+/**
+ * @brief Looks a chunk up in the index
+ * @param hash XXH64 of the chunk
+ * @param len Chunk length
+ * @param root Tenant root of the upload, "" for the default namespace
+ * @return The live entry for the chunk in that namespace, or NULL
+ */
+ChunkEntry *chunk_find(unsigned long long hash, long len, const char *root) {
+    for (int i = 0; i < CHUNK_PROBE; i++) {
+        ChunkEntry *e = &chunk_index->slots[(hash + i) & (CHUNK_SLOTS - 1)];
+        if (e->hash == hash && e->len == len && chunk_entry_live(e) && chunk_entry_in(e, root))
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Recipe of a chunked upload and where its known chunks come from
+ */
+typedef struct {
+    int count;                      /**< Chunks in the recipe */
+    ChunkRef *refs;                 /**< The recipe, in file order */
+    int *source;                    /**< Per chunk: index into fds, -1 if it arrives on the socket */
+    long *offset;                   /**< Per chunk: its offset in that stored file */
+    int fds[CHUNK_OPEN_MAX];        /**< Stored files chunks are copied from, -1 if unusable */
+    int holders[CHUNK_OPEN_MAX];    /**< Holder slot of each of those files */
+    int open_count;                 /**< Entries used in fds and holders */
+    unsigned long long hash;        /**< XXH64 of the whole file, checked once assembled */
+} ChunkPlan;
+
+/**
+ * @brief Opens the stored file of a holder slot for a chunked upload
+ * @param plan Upload being planned
+ * @param holder Holder slot named by an index entry
+ * @return Index into plan->fds, or -1 if the file cannot be used
+ *
+ * The file is opened once per upload and kept under a shared lock, so
+ * in-place writers wait until the upload is done. A file that changed
+ * since it was indexed retires its holder slot.
+ */
+int plan_source(ChunkPlan *plan, int holder) {
+    for (int i = 0; i < plan->open_count; i++)
+        if (plan->holders[i] == holder) return plan->fds[i] < 0 ? -1 : i;
+    if (plan->open_count == CHUNK_OPEN_MAX) return -1;
+
+    ChunkHolder *h = &chunk_index->holders[holder];
+    h->path[MAX_PATH_LEN - 1] = '\0';
+    int fd = open(h->path, O_RDONLY);
+    struct stat st;
+    unsigned long long cached;
+    if (fd >= 0 && !(flock(fd, LOCK_SH) == 0 && fstat(fd, &st) == 0 && st.st_size == h->size &&
+                     load_cached_hash(h->path, &st, &cached) && cached == h->hash)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) h->gen++;
+
+    int i = plan->open_count++;
+    plan->holders[i] = holder;
+    plan->fds[i] = fd;
+    return fd < 0 ? -1 : i;
+}
+
+/**
+ * @brief Closes the files and frees the arrays of a chunk plan
+ */
+void plan_release(ChunkPlan *plan) {
+    for (int i = 0; i < plan->open_count; i++)
+        if (plan->fds[i] >= 0) close(plan->fds[i]);
+    free(plan->refs);
+    free(plan->source);
+    free(plan->offset);
+}
+
+/**
+ * @brief Indexes the chunks of a file stored by a chunked upload
+ * @param rel_path The file below the storage root
+ * @param fullpath The stored file
+ * @param size Its size
+ * @param hash XXH64 of its contents
+ * @param plan The recipe it was assembled from
+ *
+ * A chunk already indexed in the file's namespace is pointed at this
+ * file, the newest copy. Otherwise it takes a free or dead slot among
+ * the CHUNK_PROBE it may use, or evicts the first of them, so copies in
+ * other namespaces keep their entries while there is room.
+ */
+void chunk_index_add(const char *rel_path, const char *fullpath, long size, unsigned long long hash,
+                     const ChunkPlan *plan) {
+    if (!chunk_index) return;
+    char root[MAX_PATH_LEN];
+    tenant_root_of(rel_path, root);
+    int holder = chunk_index->next_holder % CHUNK_HOLDERS;
+    chunk_index->next_holder = (holder + 1) % CHUNK_HOLDERS;
+    ChunkHolder *h = &chunk_index->holders[holder];
+    h->gen++;
+    h->size = size;
+    h->hash = hash;
+    snprintf(h->path, sizeof(h->path), "%s", fullpath);
+
+    long offset = 0;
+    for (int i = 0; i < plan->count; i++) {
+        const ChunkRef *ref = &plan->refs[i];
+        ChunkEntry *slot = NULL;
+        for (int p = 0; ref->hash && p < CHUNK_PROBE; p++) {
+            ChunkEntry *e = &chunk_index->slots[(ref->hash + p) & (CHUNK_SLOTS - 1)];
+            if (e->hash == ref->hash && e->len == ref->len && chunk_entry_live(e) && chunk_entry_in(e, root)) {
+                slot = e;
+                break;
+            }
+            if (!slot && !chunk_entry_live(e)) slot = e;
+        }
+        if (ref->hash && !slot) slot = &chunk_index->slots[ref->hash & (CHUNK_SLOTS - 1)];
+        if (slot) {
+            slot->hash = ref->hash;
+            slot->len = ref->len;
+            slot->holder = holder;
+            slot->holder_gen = h->gen;
+            slot->offset = offset;
+        }
+        offset += ref->len;
+    }
+}
+
+/**
+ * @brief Writes the chunks of a chunked upload to the file being stored
+ * @param sock Socket the missing chunks arrive on, in recipe order
+ * @param fd File being stored
+ * @param plan Recipe and chunk sources
+ * @param hs Hash of the whole file, updated with every chunk written
+ * @param proof SHA-256 of the whole file, updated alike
+ * @return Bytes written, or -1 on failure
+ *
+ * Every chunk, read from a stored file or the socket, must have the hash
+ * the recipe gives it. After a failure the remaining chunks are still
+ * read off the socket so S1 sees the final status.
+ */
+long receive_chunks(int sock, int fd, const ChunkPlan *plan, HashState *hs, Sha256State *proof) {
+    long written = 0;
+    int ok = 1;
+    for (int i = 0; i < plan->count; i++) {
+        const ChunkRef *ref = &plan->refs[i];
+        int src = plan->source[i];
+        ssize_t n = src < 0 ? recv(sock, transfer_buf, ref->len, MSG_WAITALL)
+                            : pread(plan->fds[src], transfer_buf, ref->len, plan->offset[i]);
+        if (src < 0 && n != ref->len) return -1;
+        if (!ok) continue;
+
+        HashState chunk_hs;
+        hash_init(&chunk_hs);
+        if (n == ref->len) hash_update(&chunk_hs, transfer_buf, n);
+        if (n != ref->len || hash_final(&chunk_hs) != ref->hash || write(fd, transfer_buf, n) != n) {
+            printf("Chunk %d of the upload is not what its recipe says\n", i);
+            ok = 0;
+            continue;
+        }
+        hash_update(hs, transfer_buf, n);
+        sha256_update(proof, transfer_buf, n);
+        written += n;
+    }
+    return ok ? written : -1;
+}
+
+
+/**
+ * @brief Background reaper emptying the trash after TRASH_RETENTION_HOURS
+ *
+ * Runs a pass every TRASH_REAP_SECS at the lowest CPU priority, which also
+ * drops content store entries whose file is gone.
+ */
+void *reap_thread(void *arg) {
+    (void)arg;
+
+    // Signals are handled by the main thread; nice applies per thread on Linux
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    char root[MAX_PATH_LEN], content_root[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), TRASH_DIR);
+    snprintf(content_root, sizeof(content_root), "%s/%s", getenv("HOME"), CONTENT_DIR);
+    while (1) {
+        reap_trash(root, time(NULL) - (time_t)TRASH_RETENTION_HOURS * 3600);
+        content_prune(content_root);
+        sleep(TRASH_REAP_SECS);
+    }
+    return NULL;
+}
+
+/**
+ * @brief One change to a stored file
+ */
+typedef struct {
+    long seq;                   /**< Sequence number, 0 while being written */
+    long time;                  /**< When the change happened */
+    char type;                  /**< 'A' added, 'M' modified, 'D' deleted */
+    char path[MAX_PATH_LEN];    /**< Path below ~S3 (e.g. "/docs/a.pdf") */
+} ChangeEvent;
+
+#define EVENT_MAGIC 0x57324531      // "W2E1"
+
+/**
+ * @brief Ring of the last EVENT_SLOTS changes, read by watchers
+ *
+ * Mapped MAP_SHARED from $HOME/EVENT_FILE so sequence numbers survive
+ * restarts and a watcher can resume where it left off. Event
+ * seq lives in slot seq % EVENT_SLOTS; a slot whose seq has moved past
+ * the one asked for was overwritten.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int slot_count;
+    long next_seq;              /**< Sequence number of the next event (first is 1) */
+    ChangeEvent slots[EVENT_SLOTS];
+} EventLog;
+
+EventLog *event_log = NULL;
+
+/**
+ * @brief Maps the change event ring
+ * @return 0 on success, -1 on failure
+ */
+int init_event_log(void) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), EVENT_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(EventLog)) < 0) {
+        perror("event log open");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    event_log = mmap(NULL, sizeof(EventLog), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (event_log == MAP_FAILED) {
+        perror("event log mmap");
+        event_log = NULL;
+        return -1;
+    }
+    if (event_log->magic != EVENT_MAGIC || event_log->slot_count != EVENT_SLOTS) {
+        memset(event_log, 0, sizeof(EventLog));
+        event_log->next_seq = 1;
+        event_log->slot_count = EVENT_SLOTS;
+        event_log->magic = EVENT_MAGIC;
+    }
+    return 0;
+}
+
+/**
+ * @brief Records a change for watchers
+ * @param type 'A' added, 'M' modified, 'D' deleted
+ * @param path Path below ~S3
+ */
+void log_event(char type, const char *path) {
+    if (!event_log) return;
+    long seq = __atomic_fetch_add(&event_log->next_seq, 1, __ATOMIC_ACQ_REL);
+    ChangeEvent *ev = &event_log->slots[seq % EVENT_SLOTS];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->time = time(NULL);
+    ev->type = type;
+
+    // Store the path with repeated slashes collapsed ("/docs//a.c")
+    size_t len = 0;
+    for (const char *p = path; *p && len < sizeof(ev->path) - 1; p++)
+        if (*p != '/' || len == 0 || ev->path[len - 1] != '/')
+            ev->path[len++] = *p;
+    ev->path[len] = '\0';
+    __atomic_store_n(&ev->seq, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Reads one event from the ring
+ * @param seq Sequence number wanted
+ * @param out Receives the event
+ * @return 1 if copied, 0 if not written yet, -1 if already overwritten
+ */
+int read_event(long seq, ChangeEvent *out) {
+    if (!event_log || seq >= __atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE)) return 0;
+    if (__atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE) - seq > EVENT_SLOTS) return -1;
+
+    ChangeEvent *ev = &event_log->slots[seq % EVENT_SLOTS];
+    long found = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+    if (found > seq) return -1;
+    if (found < seq) return 0;
+    memcpy(out, ev, sizeof(ChangeEvent));
+
+    // A writer may have reused the slot while it was being copied
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    found = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+    return found == seq ? 1 : -1;
+}
+
+/**
+ * @brief Oldest sequence number still held by the ring
+ */
+long oldest_event(void) {
+    long next = __atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE);
+    return next > EVENT_SLOTS ? next - EVENT_SLOTS + 1 : 1;
+}
+
+/**
+ * @brief Tells whether a path lies inside a watched one
+ * @param path Path below ~S3
+ * @param watched Watched path below ~S3, "" for everything
+ */
+int path_is_watched(const char *path, const char *watched) {
+    size_t len = strlen(watched);
+    while (len > 0 && watched[len - 1] == '/') len--;
+    return strncmp(path, watched, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * @brief A watch connection from S1
+ */
+typedef struct {
+    int sock;                   /**< Connection from S1 */
+    long cursor;                /**< Next sequence number to send */
+    char watched[MAX_PATH_LEN]; /**< Watched path below ~S3 */
+} Watcher;
+
+/**
+ * @brief Sends one event frame: type + seq + time + path_len + path
+ * @return 0 on success, -1 if the connection is gone
+ */
+int send_event_frame(int sock, char type, long seq, long when, const char *path) {
+    char frame[1 + 2 * sizeof(long) + sizeof(int) + MAX_PATH_LEN];
+    int path_len = strlen(path);
+    size_t off = 0;
+    frame[off++] = type;
+    memcpy(frame + off, &seq, sizeof(long));
+    off += sizeof(long);
+    memcpy(frame + off, &when, sizeof(long));
+    off += sizeof(long);
+    memcpy(frame + off, &path_len, sizeof(int));
+    off += sizeof(int);
+    memcpy(frame + off, path, path_len);
+    off += path_len;
+    return send(sock, frame, off, MSG_NOSIGNAL) == (ssize_t)off ? 0 : -1;
+}
+
+/**
+ * @brief Streams changes below the watched path to S1 until it hangs up
+ *
+ * Checks the event ring every WATCH_POLL_MS. If the cursor fell out of
+ * the ring, a 'G' frame carrying the oldest sequence number still held
+ * tells S1 that changes were missed.
+ */
+void *watch_thread(void *arg) {
+    Watcher *w = arg;
+
+    // Signals are handled by the main thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    int failed = 0;
+    while (!failed) {
+        ChangeEvent ev;
+        int r;
+        while (!failed && (r = read_event(w->cursor, &ev)) != 0) {
+            if (r < 0) {
+                w->cursor = oldest_event();
+                failed = send_event_frame(w->sock, 'G', w->cursor, time(NULL), "") < 0;
+            } else {
+                w->cursor++;
+                if (path_is_watched(ev.path, w->watched))
+                    failed = send_event_frame(w->sock, ev.type, ev.seq, ev.time, ev.path) < 0;
+            }
+        }
+
+        // S1 never writes on a watch connection; readable means it closed
+        struct pollfd pfd = {w->sock, POLLIN, 0};
+        if (!failed && poll(&pfd, 1, WATCH_POLL_MS) != 0) failed = 1;
+    }
+    close(w->sock);
+    free(w);
+    return NULL;
+}
+
+/**
+ * @brief Starts streaming changes to S1 ('W')
+ * @param sock The connection socket from S1
+ * @return 0 if a watcher thread took over the socket, -1 otherwise
+ *
+ * @details Protocol 'W' - Watch:
+ *   1. S1 → Storage: 'W' + path_len + path + cursor (0 = from now)
+ *   2. Storage → S1: status (1) + starting cursor
+ *   3. Storage → S1: event frames (type + seq + time + path_len + path),
+ *      until S1 closes the connection
+ */
+int handle_watch(int sock) {
+    // Request receive from server S1
+    printf("======Processing watch request======\n");
+
+    long status = -1;
+    int path_len;
+    char watched[MAX_PATH_LEN];
+    long cursor;
+    if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len < 0 || path_len >= MAX_PATH_LEN ||
+        (path_len > 0 && recv(sock, watched, path_len, MSG_WAITALL) != path_len) ||
+        recv(sock, &cursor, sizeof(long), MSG_WAITALL) != sizeof(long) || !event_log) {
+        send(sock, &status, sizeof(long), 0);
+        return -1;
+    }
+    watched[path_len] = '\0';
+
+    long next = __atomic_load_n(&event_log->next_seq, __ATOMIC_ACQUIRE);
+    if (cursor <= 0 || cursor > next) cursor = next;
+
+    Watcher *w = malloc(sizeof(Watcher));
+    if (!w) {
+        send(sock, &status, sizeof(long), 0);
+        return -1;
+    }
+    w->sock = sock;
+    w->cursor = cursor;
+    strcpy(w->watched, watched);
+
+    status = 1;
+    send(sock, &status, sizeof(long), 0);
+    send(sock, &cursor, sizeof(long), 0);
+
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, watch_thread, w) != 0) {
+        perror("watcher thread");
+        free(w);
+        return -1;
+    }
+    pthread_detach(watcher);
+    printf("Watching ~S1%s from change %ld\n", watched, cursor);
+    return 0;
+}
+
+/**
+ * @brief Posting list of one index term
+ *
+ * Doc ids are kept in ascending order as varint-encoded gaps, one or two
+ * bytes per file on a large corpus. A skip entry every INDEX_SKIP
+ * postings lets a lookup decode one block instead of the whole list.
+ * Ids that arrive out of order (a word first seen in an append to an
+ * older file) wait in pending until the list is merged.
+ */
+typedef struct {
+    char *word;                 /**< The term, lower case */
+    unsigned char *postings;    /**< Gaps between ascending doc ids, varint-encoded */
+    unsigned int len, cap;      /**< Bytes used and allocated in postings */
+    unsigned int count;         /**< Doc ids in postings */
+    unsigned int last;          /**< Largest doc id in postings */
+    unsigned int *skips;        /**< Per block: doc id before it, byte offset of it */
+    unsigned int nskips, skip_cap;
+    unsigned int *pending;      /**< Doc ids below last, not merged yet */
+    unsigned int npending, pending_cap;
+} IndexTerm;
+
+/**
+ * @brief Open-addressing hash table from a string key to an entry number
+ */
+typedef struct {
+    unsigned int *slots;    /**< Entry number + 1, 0 when empty */
+    unsigned int size;      /**< Slot count, a power of two */
+    unsigned int used;      /**< Occupied slots */
+} IndexMap;
+
+/**
+ * @brief Journal record being built: type + path_len + path + count + count x (len + term)
+ */
+typedef struct {
+    char *data;
+    unsigned int len, cap;
+    unsigned int nterms;
+} IndexRecord;
+
+#define INDEX_MAGIC 0x57325831      // "W2X1"
+
+// The index: terms and files, guarded by index_lock
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static IndexTerm *index_terms;
+static unsigned int index_term_count, index_term_cap;
+static IndexMap index_term_map;
+static char **index_docs;       // Doc id -> path below ~/S3, NULL once removed (id 0 unused)
+static unsigned int index_doc_count = 1, index_doc_cap;
+static IndexMap index_doc_map;
+static int index_journal_fd = -1;
+
+static int index_reserve(void **array, unsigned int *cap, unsigned int need, size_t elem) {
+    if (need <= *cap) return 0;
+    unsigned int new_cap = *cap ? *cap : 16;
+    while (new_cap < need) new_cap *= 2;
+    void *grown = realloc(*array, (size_t)new_cap * elem);
+    if (!grown) return -1;
+    *array = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+static unsigned int index_hash(const char *key, size_t n) {
+    unsigned int h = 2166136261u;   // FNV-1a
+    for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char)key[i]) * 16777619u;
+    return h;
+}
+
+static const char *index_key(const IndexMap *map, unsigned int entry) {
+    return map == &index_term_map ? index_terms[entry].word : index_docs[entry];
+}
+
+/**
+ * @brief Finds the slot holding a key, or the empty slot where it belongs
+ *
+ * Removed files keep their slot (their key reads NULL) until the table
+ * is rebuilt, so probing passes over them.
+ */
+static unsigned int *index_map_slot(IndexMap *map, const char *key, size_t n) {
+    unsigned int mask = map->size - 1;
+    for (unsigned int i = index_hash(key, n) & mask;; i = (i + 1) & mask) {
+        unsigned int *slot = &map->slots[i];
+        if (*slot == 0) return slot;
+        const char *k = index_key(map, *slot - 1);
+        if (k && strncmp(k, key, n) == 0 && k[n] == '\0') return slot;
+    }
+}
+
+static unsigned int index_map_find(IndexMap *map, const char *key, size_t n) {
+    return map->size ? *index_map_slot(map, key, n) : 0;
+}
+
+static int index_map_insert(IndexMap *map, unsigned int entry) {
+    if ((map->used + 1) * 4 > map->size * 3) {
+        // Grow, dropping the slots of removed files
+        unsigned int old_size = map->size, *old = map->slots;
+        unsigned int size = old_size ? old_size * 2 : 1024;
+        unsigned int *slots = calloc(size, sizeof(unsigned int));
+        if (!slots) return -1;
+        map->slots = slots;
+        map->size = size;
+        map->used = 0;
+        for (unsigned int i = 0; i < old_size; i++) {
+            const char *k = old[i] ? index_key(map, old[i] - 1) : NULL;
+            if (!k) continue;
+            *index_map_slot(map, k, strlen(k)) = old[i];
+            map->used++;
+        }
+        free(old);
+    }
+    const char *k = index_key(map, entry);
+    *index_map_slot(map, k, strlen(k)) = entry + 1;
+    map->used++;
+    return 0;
+}
+
+/**
+ * @brief Appends a doc id above every id in the list
+ */
+static void posting_append(IndexTerm *t, unsigned int doc) {
+    if (index_reserve((void **)&t->postings, &t->cap, t->len + 5, 1) < 0) return;
+    if (t->count % INDEX_SKIP == 0) {
+        if (index_reserve((void **)&t->skips, &t->skip_cap, t->nskips * 2 + 2, sizeof(unsigned int)) < 0) return;
+        t->skips[t->nskips * 2] = t->last;
+        t->skips[t->nskips * 2 + 1] = t->len;
+        t->nskips++;
+    }
+    unsigned int gap = doc - t->last;
+    while (gap >= 0x80) {
+        t->postings[t->len++] = (gap & 0x7F) | 0x80;
+        gap >>= 7;
+    }
+    t->postings[t->len++] = gap;
+    t->last = doc;
+    t->count++;
+}
+
+static unsigned int posting_next(const unsigned char **p) {
+    unsigned int gap = 0;
+    int shift = 0;
+    while (**p & 0x80) {
+        gap |= (unsigned int)(**p & 0x7F) << shift;
+        shift += 7;
+        (*p)++;
+    }
+    gap |= (unsigned int)**p << shift;
+    (*p)++;
+    return gap;
+}
+
+/**
+ * @brief Tells whether a list holds a doc id, decoding at most one block
+ */
+static int posting_contains(const IndexTerm *t, unsigned int doc) {
+    for (unsigned int i = 0; i < t->npending; i++)
+        if (t->pending[i] == doc) return 1;
+    if (t->count == 0 || doc > t->last) return 0;
+
+    // Last block starting after an id below doc
+    unsigned int lo = 0, hi = t->nskips;
+    while (hi - lo > 1) {
+        unsigned int mid = (lo + hi) / 2;
+        if (t->skips[mid * 2] < doc) lo = mid;
+        else hi = mid;
+    }
+    unsigned int cur = t->skips[lo * 2];
+    const unsigned char *p = t->postings + t->skips[lo * 2 + 1], *end = t->postings + t->len;
+    for (int i = 0; i < INDEX_SKIP && p < end; i++) {
+        cur += posting_next(&p);
+        if (cur >= doc) return cur == doc;
+    }
+    return 0;
+}
+
+static int compare_doc_ids(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Decodes a whole list, pending ids included, in ascending order
+ * @param out Room for count + npending ids
+ * @return Number of ids
+ */
+static unsigned int posting_decode(const IndexTerm *t, unsigned int *out) {
+    const unsigned char *p = t->postings;
+    unsigned int cur = 0, n = 0;
+    for (unsigned int i = 0; i < t->count; i++)
+        out[n++] = cur += posting_next(&p);
+    if (t->npending) {
+        memcpy(out + n, t->pending, t->npending * sizeof(unsigned int));
+        n += t->npending;
+        qsort(out, n, sizeof(unsigned int), compare_doc_ids);
+    }
+    return n;
+}
+
+static void posting_merge(IndexTerm *t) {
+    unsigned int *ids = malloc((size_t)(t->count + t->npending) * sizeof(unsigned int));
+    if (!ids) return;
+    unsigned int n = posting_decode(t, ids);
+    t->len = t->count = t->last = t->nskips = t->npending = 0;
+    for (unsigned int i = 0; i < n; i++) posting_append(t, ids[i]);
+    free(ids);
+}
+
+/**
+ * @brief Adds a doc id to a list
+ * @return 1 if added, 0 if it was already there
+ */
+static int posting_add(IndexTerm *t, unsigned int doc) {
+    if (doc > t->last) {
+        posting_append(t, doc);
+        return 1;
+    }
+    if (posting_contains(t, doc) ||
+        index_reserve((void **)&t->pending, &t->pending_cap, t->npending + 1, sizeof(unsigned int)) < 0)
+        return 0;
+    t->pending[t->npending++] = doc;
+    if (t->npending >= INDEX_PENDING_MAX) posting_merge(t);
+    return 1;
+}
+
+static IndexTerm *index_term(const char *word, size_t n, int create) {
+    unsigned int entry = index_map_find(&index_term_map, word, n);
+    if (entry) return &index_terms[entry - 1];
+    if (!create ||
+        index_reserve((void **)&index_terms, &index_term_cap, index_term_count + 1, sizeof(IndexTerm)) < 0)
+        return NULL;
+
+    IndexTerm *t = &index_terms[index_term_count];
+    memset(t, 0, sizeof(*t));
+    t->word = strndup(word, n);
+    if (!t->word || index_map_insert(&index_term_map, index_term_count) < 0) {
+        free(t->word);
+        return NULL;
+    }
+    index_term_count++;
+    return t;
+}
+
+/**
+ * @brief Picks the doc id a change applies to
+ * @param type 'U' (new contents), 'A' (appended text) or 'R' (removed)
+ * @param path File path below ~/S3
+ * @return Doc id to add terms to, 0 for a removal
+ *
+ * New contents get a new id, so their postings stay in order; the old id
+ * is dropped and filtered out of results until the next compaction.
+ */
+static unsigned int index_prepare(char type, const char *path) {
+    unsigned int doc = index_map_find(&index_doc_map, path, strlen(path));
+    if (doc && type != 'A') {
+        free(index_docs[doc - 1]);
+        index_docs[doc - 1] = NULL;
+        doc = 0;
+    }
+    if (doc || type == 'R') return doc ? doc - 1 : 0;
+
+    if (index_reserve((void **)&index_docs, &index_doc_cap, index_doc_count + 1, sizeof(char *)) < 0)
+        return 0;
+    index_docs[0] = NULL;
+    doc = index_doc_count;
+    index_docs[doc] = strdup(path);
+    if (!index_docs[doc] || index_map_insert(&index_doc_map, doc) < 0) {
+        free(index_docs[doc]);
+        return 0;
+    }
+    index_doc_count++;
+    return doc;
+}
+
+/**
+ * @brief Splits text into index terms and passes each to fn
+ *
+ * Terms are runs of letters, digits, '_' and non-ASCII bytes (so UTF-8
+ * words stay whole), lower-cased, at least two bytes long. Longer than
+ * INDEX_MAX_TERM bytes, only the start is kept.
+ */
+static int index_word_byte(unsigned char c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+static void index_words(const char *text, size_t len, void (*fn)(const char *, size_t, void *), void *arg) {
+    char word[INDEX_MAX_TERM];
+    size_t n = 0;
+    for (size_t i = 0; i <= len; i++) {
+        unsigned char c = i < len ? (unsigned char)text[i] : ' ';
+        if (index_word_byte(c)) {
+            if (n < INDEX_MAX_TERM) word[n++] = tolower(c);
+        } else {
+            if (n >= 2) fn(word, n, arg);
+            n = 0;
+        }
+    }
+}
+
+static void record_put(IndexRecord *r, const void *data, unsigned int len) {
+    if (index_reserve((void **)&r->data, &r->cap, r->len + len, 1) < 0) return;
+    memcpy(r->data + r->len, data, len);
+    r->len += len;
+}
+
+/**
+ * @brief Adds the terms of one file to the index, and to its journal record
+ */
+typedef struct {
+    unsigned int doc;
+    IndexRecord *record;
+} IndexAdd;
+
+static void index_add_word(const char *word, size_t n, void *arg) {
+    IndexAdd *add = arg;
+    IndexTerm *t = index_term(word, n, 1);
+    if (!t || !posting_add(t, add->doc) || !add->record) return;
+    unsigned char word_len = n;
+    record_put(add->record, &word_len, 1);
+    record_put(add->record, word, n);
+    add->record->nterms++;
+}
+
+/**
+ * @brief Applies one change and journals it (index_lock held)
+ * @param type 'U', 'A' or 'R' (see index_prepare)
+ * @param path File path below ~/S3
+ * @param text New contents or appended text (NULL for a removal)
+ * @param len Length of text
+ */
+static void index_change(char type, const char *path, const char *text, size_t len) {
+    IndexRecord record = {0};
+    unsigned short path_len = strlen(path);
+    unsigned int zero = 0;
+    record_put(&record, &type, 1);
+    record_put(&record, &path_len, sizeof(path_len));
+    record_put(&record, path, path_len);
+    record_put(&record, &zero, sizeof(zero));
+
+    IndexAdd add = {index_prepare(type, path), &record};
+    if (add.doc && text) index_words(text, len, index_add_word, &add);
+
+    // One write per change, so a crash leaves at most a torn last record
+    if (index_journal_fd >= 0 && record.data) {
+        memcpy(record.data + 3 + path_len, &record.nterms, sizeof(record.nterms));
+        if (write(index_journal_fd, record.data, record.len) != (ssize_t)record.len)
+            perror("Index journal write failed");
+    }
+    free(record.data);
+}
+
+/**
+ * @brief Indexes the current contents of a stored file
+ * @param rel_path Path below ~/S3 ("/dir/file.txt")
+ * @param fullpath The file
+ */
+void index_update(const char *rel_path, const char *fullpath) {
+    int fd = open(fullpath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    char *text = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (text == MAP_FAILED) return;
+    if (text) madvise(text, st.st_size, MADV_SEQUENTIAL);
+
+    pthread_mutex_lock(&index_lock);
+    index_change('U', rel_path, text ? text : "", text ? st.st_size : 0);
+    pthread_mutex_unlock(&index_lock);
+    if (text) munmap(text, st.st_size);
+}
+
+/**
+ * @brief Indexes text appended to a stored file (or a new file)
+ * @param rel_path Path below ~/S3 ("/dir/file.txt")
+ * @param fd The file, open for reading (under the append lock)
+ * @param old_size File size before the append
+ * @param text Appended bytes
+ * @param len Number of appended bytes
+ *
+ * A word may start in the old contents and go on in the appended bytes
+ * ("hel" + "lo"). The old end of the file is read back, up to
+ * INDEX_MAX_TERM bytes, and indexed together with the new bytes, so the
+ * whole word is found. A word that already had INDEX_MAX_TERM bytes is
+ * indexed by its start, which does not change; its continuation is skipped.
+ */
+void index_append(const char *rel_path, int fd, long old_size, const char *text, size_t len) {
+    char tail[INDEX_MAX_TERM];
+    long from = old_size > INDEX_MAX_TERM ? old_size - INDEX_MAX_TERM : 0;
+    ssize_t tail_len = old_size > 0 ? pread(fd, tail, old_size - from, from) : 0;
+    if (tail_len < 0) tail_len = 0;
+    size_t word = tail_len;
+    while (word > 0 && index_word_byte(tail[word - 1])) word--;
+
+    char *joined = NULL;
+    if (word == 0 && tail_len > 0 && from > 0) {
+        // Too long to lie in the tail: only its start counts
+        while (len > 0 && index_word_byte(*text)) {
+            text++;
+            len--;
+        }
+    } else if (word < (size_t)tail_len && (joined = malloc(tail_len - word + len))) {
+        memcpy(joined, tail + word, tail_len - word);
+        memcpy(joined + tail_len - word, text, len);
+        text = joined;
+        len += tail_len - word;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    index_change('A', rel_path, text, len);
+    pthread_mutex_unlock(&index_lock);
+    free(joined);
+}
+
+/**
+ * @brief Drops a removed file from the index
+ */
+void index_remove(const char *rel_path) {
+    pthread_mutex_lock(&index_lock);
+    index_change('R', rel_path, NULL, 0);
+    pthread_mutex_unlock(&index_lock);
+}
+
+static void index_reset(void) {
+    for (unsigned int i = 0; i < index_term_count; i++) {
+        free(index_terms[i].word);
+        free(index_terms[i].postings);
+        free(index_terms[i].skips);
+        free(index_terms[i].pending);
+    }
+    for (unsigned int i = 1; i < index_doc_count; i++) free(index_docs[i]);
+    free(index_terms);
+    free(index_docs);
+    free(index_term_map.slots);
+    free(index_doc_map.slots);
+    index_terms = NULL;
+    index_docs = NULL;
+    index_term_count = index_term_cap = index_doc_cap = 0;
+    index_doc_count = 1;
+    memset(&index_term_map, 0, sizeof(index_term_map));
+    memset(&index_doc_map, 0, sizeof(index_doc_map));
+}
+
+static void index_path(char *out, size_t len, const char *name) {
+    snprintf(out, len, "%s/%s", getenv("HOME"), name);
+}
+
+/**
+ * @brief Writes the index to INDEX_FILE, leaving removed files out (index_lock held)
+ * @return 0 on success, -1 on failure
+ *
+ * Live files are numbered afresh from 1 and every list is re-encoded with
+ * the new ids, so removed files and pending ids are compacted away.
+ *
+ * Layout: magic, file count, per file (path_len + path), term count, per
+ * term (len + term + count + last + bytes + postings).
+ */
+static int index_write_snapshot(void) {
+    char path[MAX_PATH_LEN], temppath[MAX_PATH_LEN + 8];
+    index_path(path, sizeof(path), INDEX_FILE);
+    snprintf(temppath, sizeof(temppath), "%s.part", path);
+    FILE *f = fopen(temppath, "wb");
+    unsigned int *remap = calloc(index_doc_count, sizeof(unsigned int));
+    if (!f || !remap) {
+        if (f) fclose(f);
+        free(remap);
+        return -1;
+    }
+
+    unsigned int magic = INDEX_MAGIC, live = 0, written = 0;
+    for (unsigned int doc = 1; doc < index_doc_count; doc++)
+        if (index_docs[doc]) remap[doc] = ++live;
+    fwrite(&magic, sizeof(magic), 1, f);
+    fwrite(&live, sizeof(live), 1, f);
+    for (unsigned int doc = 1; doc < index_doc_count; doc++) {
+        if (!index_docs[doc]) continue;
+        unsigned short path_len = strlen(index_docs[doc]);
+        fwrite(&path_len, sizeof(path_len), 1, f);
+        fwrite(index_docs[doc], 1, path_len, f);
+    }
+    long count_pos = ftell(f);
+    fwrite(&written, sizeof(written), 1, f);
+
+    unsigned int *ids = NULL, ids_cap = 0;
+    IndexTerm packed = {0};
+    for (unsigned int i = 0; i < index_term_count; i++) {
+        IndexTerm *t = &index_terms[i];
+        if (index_reserve((void **)&ids, &ids_cap, t->count + t->npending, sizeof(unsigned int)) < 0) break;
+        unsigned int n = posting_decode(t, ids);
+        packed.len = packed.count = packed.last = packed.nskips = 0;
+        for (unsigned int k = 0; k < n; k++)
+            if (remap[ids[k]]) posting_append(&packed, remap[ids[k]]);
+        if (packed.count == 0) continue;
+
+        unsigned char word_len = strlen(t->word);
+        fwrite(&word_len, 1, 1, f);
+        fwrite(t->word, 1, word_len, f);
+        fwrite(&packed.count, sizeof(unsigned int), 1, f);
+        fwrite(&packed.last, sizeof(unsigned int), 1, f);
+        fwrite(&packed.len, sizeof(unsigned int), 1, f);
+        fwrite(packed.postings, 1, packed.len, f);
+        written++;
+    }
+    free(ids);
+    free(packed.postings);
+    free(packed.skips);
+    free(remap);
+
+    fseek(f, count_pos, SEEK_SET);
+    fwrite(&written, sizeof(written), 1, f);
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0 || ferror(f)) {
+        fclose(f);
+        unlink(temppath);
+        return -1;
+    }
+    fclose(f);
+    return rename(temppath, path);
+}
+
+/**
+ * @brief Loads INDEX_FILE into the (empty) index
+ * @return 0 on success, -1 if missing or unreadable (the index is left empty)
+ */
+static int index_load_snapshot(void) {
+    char path[MAX_PATH_LEN];
+    index_path(path, sizeof(path), INDEX_FILE);
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    unsigned int magic = 0, docs = 0, terms = 0;
+    int ok = fread(&magic, sizeof(magic), 1, f) == 1 && magic == INDEX_MAGIC &&
+             fread(&docs, sizeof(docs), 1, f) == 1;
+    char buf[MAX_PATH_LEN];
+    for (unsigned int i = 0; ok && i < docs; i++) {
+        unsigned short path_len;
+        ok = fread(&path_len, sizeof(path_len), 1, f) == 1 && path_len < sizeof(buf) &&
+             fread(buf, 1, path_len, f) == path_len;
+        buf[ok ? path_len : 0] = '\0';
+        ok = ok && index_prepare('U', buf) == i + 1;
+    }
+    ok = ok && fread(&terms, sizeof(terms), 1, f) == 1;
+    for (unsigned int i = 0; ok && i < terms; i++) {
+        unsigned char word_len;
+        unsigned int count, last, len;
+        ok = fread(&word_len, 1, 1, f) == 1 && fread(buf, 1, word_len, f) == word_len &&
+             fread(&count, sizeof(count), 1, f) == 1 && fread(&last, sizeof(last), 1, f) == 1 &&
+             fread(&len, sizeof(len), 1, f) == 1;
+        IndexTerm *t = ok ? index_term(buf, word_len, 1) : NULL;
+        ok = t && index_reserve((void **)&t->postings, &t->cap, len, 1) == 0 &&
+             fread(t->postings, 1, len, f) == len;
+        if (!ok) break;
+
+        // Rebuild the skip entries
+        const unsigned char *p = t->postings;
+        unsigned int cur = 0;
+        for (unsigned int k = 0; k < count && ok; k++) {
+            if (k % INDEX_SKIP == 0) {
+                ok = index_reserve((void **)&t->skips, &t->skip_cap, t->nskips * 2 + 2, sizeof(unsigned int)) == 0;
+                if (!ok) break;
+                t->skips[t->nskips * 2] = cur;
+                t->skips[t->nskips * 2 + 1] = p - t->postings;
+                t->nskips++;
+            }
+            cur += posting_next(&p);
+        }
+        t->len = len;
+        t->count = count;
+        t->last = last;
+        ok = ok && cur == last && p == t->postings + len;
+    }
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "Index snapshot %s is damaged\n", path);
+        index_reset();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Applies the journalled changes made since the snapshot
+ *
+ * A torn last record (crash mid-write) is cut off the journal.
+ */
+static void index_replay_journal(void) {
+    char path[MAX_PATH_LEN];
+    index_path(path, sizeof(path), INDEX_JOURNAL);
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    size_t pos = 0, size = st.st_size, changes = 0;
+    char rel_path[MAX_PATH_LEN];
+    while (pos + 7 <= size) {
+        char type = data[pos];
+        unsigned short path_len;
+        unsigned int nterms;
+        memcpy(&path_len, data + pos + 1, sizeof(path_len));
+        if (path_len >= sizeof(rel_path) || pos + 7 + path_len > size) break;
+        memcpy(rel_path, data + pos + 3, path_len);
+        rel_path[path_len] = '\0';
+        memcpy(&nterms, data + pos + 3 + path_len, sizeof(nterms));
+
+        // Check the whole record is there before applying it
+        size_t end = pos + 7 + path_len;
+        unsigned int i = 0;
+        for (; i < nterms && end < size; i++)
+            end += 1 + (unsigned char)data[end];
+        if (i < nterms || end > size) break;
+
+        IndexAdd add = {index_prepare(type, rel_path), NULL};
+        for (size_t p = pos + 7 + path_len; add.doc && p < end; p += 1 + (unsigned char)data[p])
+            index_add_word(data + p + 1, (unsigned char)data[p], &add);
+        pos = end;
+        changes++;
+    }
+    munmap(data, size);
+    if (pos < size) {
+        fprintf(stderr, "Index journal: dropping %zu bytes of a torn record\n", size - pos);
+        if (ftruncate(fd, pos) < 0) perror("ftruncate");
+    }
+    close(fd);
+    printf("Index journal: %zu change(s) replayed\n", changes);
+}
+
+static size_t index_root_len;
+
+static int index_scan_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    size_t len = strlen(path);
+    if (type == FTW_F && len > 4 && strcmp(path + len - 4, ".txt") == 0)
+        index_update(path + index_root_len, path);
+    return 0;
+}
+
+/**
+ * @brief Loads the index, or builds it from the store on first start
+ * @return 0 on success, -1 if the journal cannot be opened
+ */
+int init_index(void) {
+    char root[MAX_PATH_LEN], journal[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/S3", getenv("HOME"));
+    index_path(journal, sizeof(journal), INDEX_JOURNAL);
+
+    if (index_load_snapshot() == 0) {
+        index_replay_journal();
+    } else {
+        // No usable snapshot: index every stored file, then save the result
+        index_reset();
+        index_root_len = strlen(root);
+        nftw(root, index_scan_file, 16, FTW_PHYS);
+        if (index_write_snapshot() == 0) unlink(journal);
+    }
+
+    index_journal_fd = open(journal, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (index_journal_fd < 0) {
+        perror("Index journal");
+        return -1;
+    }
+    unsigned int live = 0;
+    for (unsigned int doc = 1; doc < index_doc_count; doc++) live += index_docs[doc] != NULL;
+    printf("Index: %u file(s), %u term(s)\n", live, index_term_count);
+    return 0;
+}
+
+/**
+ * @brief Background compaction of the index
+ *
+ * Every INDEX_SNAPSHOT_SECS, once the journal has grown past
+ * INDEX_JOURNAL_MAX, writes a compacted snapshot, reloads it and empties
+ * the journal. Not niced, unlike the other background threads: it holds
+ * index_lock while it works, and uploads wait for that lock.
+ */
+void *index_thread(void *arg) {
+    (void)arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    while (1) {
+        sleep(INDEX_SNAPSHOT_SECS);
+        struct stat st;
+        if (fstat(index_journal_fd, &st) < 0 || st.st_size < INDEX_JOURNAL_MAX) continue;
+
+        pthread_mutex_lock(&index_lock);
+        if (index_write_snapshot() == 0) {
+            index_reset();
+            if (index_load_snapshot() == 0 && ftruncate(index_journal_fd, 0) == 0)
+                printf("Index compacted: %u file(s), %u term(s)\n", index_doc_count - 1, index_term_count);
+            else
+                fprintf(stderr, "Index reload failed, restart S3 to rebuild it\n");
+        } else {
+            perror("Index snapshot failed");
+        }
+        pthread_mutex_unlock(&index_lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief A stored file due to expire
+ */
+typedef struct {
+    long expires;               /**< Expiry time (seconds since the epoch) */
+    char *path;                 /**< Absolute path of the stored file */
+} ExpiryEntry;
+
+/**
+ * @brief Min-heap of pending expiries, earliest first
+ *
+ * Rebuilt at startup from the EXPIRES_XATTR of stored files, then fed by
+ * uploads that carry a TTL. Entries are only hints: the expirer
+ * re-reads the attribute before deleting, so a file overwritten without a
+ * TTL or removed in the meantime simply drops out.
+ */
+ExpiryEntry *expiry_heap = NULL;
+int expiry_count = 0, expiry_capacity = 0;
+pthread_mutex_t expiry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Adds a file to the expiry heap
+ * @param expires Expiry time
+ * @param path Absolute path of the stored file
+ */
+void expiry_push(long expires, const char *path) {
+    pthread_mutex_lock(&expiry_lock);
+    if (expiry_count == expiry_capacity) {
+        int capacity = expiry_capacity ? expiry_capacity * 2 : 256;
+        ExpiryEntry *grown = realloc(expiry_heap, capacity * sizeof(ExpiryEntry));
+        if (!grown) {
+            pthread_mutex_unlock(&expiry_lock);
+            return;
+        }
+        expiry_heap = grown;
+        expiry_capacity = capacity;
+    }
+
+    // Sift up from the new leaf
+    int i = expiry_count++;
+    while (i > 0 && expiry_heap[(i - 1) / 2].expires > expires) {
+        expiry_heap[i] = expiry_heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    expiry_heap[i] = (ExpiryEntry){expires, strdup(path)};
+    pthread_mutex_unlock(&expiry_lock);
+}
+
+/**
+ * @brief Removes the earliest entry if it is due
+ * @param now Current time
+ * @param out Receives the entry (caller frees out->path)
+ * @return 1 if an entry was due, 0 otherwise
+ */
+int expiry_pop_due(long now, ExpiryEntry *out) {
+    pthread_mutex_lock(&expiry_lock);
+    if (expiry_count == 0 || expiry_heap[0].expires > now) {
+        pthread_mutex_unlock(&expiry_lock);
+        return 0;
+    }
+    *out = expiry_heap[0];
+
+    // Sift the last leaf down from the root
+    ExpiryEntry last = expiry_heap[--expiry_count];
+    int i = 0;
+    while (2 * i + 1 < expiry_count) {
+        int child = 2 * i + 1;
+        if (child + 1 < expiry_count && expiry_heap[child + 1].expires < expiry_heap[child].expires)
+            child++;
+        if (expiry_heap[child].expires >= last.expires) break;
+        expiry_heap[i] = expiry_heap[child];
+        i = child;
+    }
+    if (expiry_count > 0) expiry_heap[i] = last;
+    pthread_mutex_unlock(&expiry_lock);
+    return 1;
+}
+
+// Length of "$HOME/S3" for the expirer
+static size_t expiry_root_len;
+
+/**
+ * @brief nftw() callback adding stored files with an expiry to the heap
+ */
+static int expiry_scan_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    long expires;
+    const char *ext = strrchr(path, '.');
+    if (type == FTW_F && ext && strcmp(ext, ".txt") == 0 &&
+        getxattr(path, EXPIRES_XATTR, &expires, sizeof(expires)) == sizeof(expires))
+        expiry_push(expires, path);
+    return 0;
+}
+
+/**
+ * @brief Deletes an expired file if it still carries the same expiry
+ * @param entry Heap entry (its path is freed)
+ */
+void expire_file(ExpiryEntry *entry) {
+    long expires;
+    struct stat st;
+    if (getxattr(entry->path, EXPIRES_XATTR, &expires, sizeof(expires)) == sizeof(expires) &&
+        expires == entry->expires && stat(entry->path, &st) == 0 && unlink(entry->path) == 0) {
+        usage_add(entry->path + expiry_root_len, -st.st_size, -1);
+        log_event('D', entry->path + expiry_root_len);
+        index_remove(entry->path + expiry_root_len);
+        printf("Expired %s\n", entry->path);
+    }
+    free(entry->path);
+}
+
+/**
+ * @brief Background expirer deleting files whose TTL has passed
+ *
+ * Scans the store once for files with an expiry, then every
+ * EXPIRY_TICK_SECS deletes at most EXPIRY_BATCH due files, at the lowest
+ * CPU priority.
+ */
+void *expire_thread(void *arg) {
+    (void)arg;
+
+    // Signals are handled by the main thread; nice applies per thread on Linux
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    char root[MAX_PATH_LEN];
+    snprintf(root, sizeof(root), "%s/S3", getenv("HOME"));
+    expiry_root_len = strlen(root);
+    nftw(root, expiry_scan_file, 16, FTW_PHYS);
+
+    while (1) {
+        ExpiryEntry entry;
+        for (int done = 0; done < EXPIRY_BATCH && expiry_pop_due(time(NULL), &entry); done++)
+            expire_file(&entry);
+        sleep(EXPIRY_TICK_SECS);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sends size bytes of an open file to a socket
+ * @param sock Destination socket
+ * @param fd Open file, positioned at the first byte to send
+ * @param size Number of bytes to send
+ * @return Number of bytes sent
+ *
+ * Uses sendfile() so file data never enters user space; the shared
+ * transfer buffer is used only if sendfile stops early.
+ */
+long send_file_data(int sock, int fd, long size) {
+    long sent = 0;
+    while (sent < size) {
+        ssize_t n = sendfile(sock, fd, NULL, size - sent);
+        if (n <= 0) break;
+        sent += n;
+    }
+
+    // Fallback: copy the remainder through the transfer buffer
+    while (sent < size) {
+        long want = size - sent > TRANSFER_CHUNK ? TRANSFER_CHUNK : size - sent;
+        ssize_t chunk = read(fd, transfer_buf, want);
+        if (chunk <= 0) break;
+        if (send(sock, transfer_buf, chunk, 0) != chunk) break;
+        sent += chunk;
+    }
+    return sent;
+}
+
+/**
+ * @brief Stores a file of known size streamed on a socket
+ * @param sock Socket the file data arrives on
+ * @param rel_path Destination below the storage root (e.g., "/docs/x")
+ * @param filesize Number of bytes to receive
+ * @param expires Expiry time of a TTL upload, 0 to keep the file indefinitely
+ * @param src_fd Stored file to take the data from instead of sock, or -1
+ * @param src_hash XXH64 of src_fd's contents
+ * @param src_proof SHA-256 of src_fd's contents
+ * @param plan Recipe of a chunked upload, assembled from sock and stored
+ *        files (see handle_chunked_upload), or NULL
+ * @return 1 when stored, -1 on failure
+ *
+ * Shared by uploads relayed by S1, uploads redirected to this server and
+ * uploads whose content the server already holds (see handle_preflight),
+ * and chunked uploads, whose chunks are indexed once the file is stored.
+ */
+long store_upload(int sock, const char *rel_path, long filesize, long expires, int src_fd,
+                  unsigned long long src_hash, const unsigned char *src_proof, const ChunkPlan *plan) {
+    long status = -1;
+
+    // Create full path for S3
+    char fullpath[1024];
+    snprintf(fullpath, sizeof(fullpath), "%s/S3%s", getenv("HOME"), rel_path);
+    printf("Full path is: %s\n", fullpath);
+
+    // Create directory tree ~/S3/..
+    char mkdir_cmd[1024];
+    snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(strdup(fullpath)));
+    system(mkdir_cmd);
+    printf("Command to create directory is: %s\n", mkdir_cmd);
+
+    // Size of the file being replaced decides the usage delta
+    struct stat old;
+    int existed = stat(fullpath, &old) == 0;
+
+    // Receive file data into a temporary file
+    char temppath[1100];
+    snprintf(temppath, sizeof(temppath), "%s.part", fullpath);
+    int fd = open(temppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("S3 write failed");
+        return status;
+    }
+
+    // Both hashes are computed as the data arrives: XXH64 for statf and the
+    // scrubber, SHA-256 as the proof later uploads of the content must match
+    HashState hs;
+    hash_init(&hs);
+    Sha256State proof_state;
+    sha256_init(&proof_state);
+    long received = 0;
+    if (src_fd >= 0) {
+        // Content already on this server: clone it where supported, else copy in the kernel
+        off_t offset = 0;
+        if (ioctl(fd, FICLONE, src_fd) == 0)
+            offset = filesize;
+        while (offset < filesize && sendfile(fd, src_fd, &offset, filesize - offset) > 0)
+            ;
+        received = offset;
+    }
+    if (plan)
+        received = receive_chunks(sock, fd, plan, &hs, &proof_state);
+    while (src_fd < 0 && !plan && received < filesize) {
+        long want = filesize - received > TRANSFER_CHUNK ? TRANSFER_CHUNK : filesize - received;
+        int chunk = read(sock, transfer_buf, want);
+        if (chunk <= 0) break;
+        if (write(fd, transfer_buf, chunk) != chunk) break;
+        hash_update(&hs, transfer_buf, chunk);
+        sha256_update(&proof_state, transfer_buf, chunk);
+        received += chunk;
+    }
+    unsigned long long hash = src_fd >= 0 ? src_hash : hash_final(&hs);
+    unsigned char proof[CONTENT_PROOF_LEN];
+    if (src_fd >= 0)
+        memcpy(proof, src_proof, CONTENT_PROOF_LEN);
+    else
+        sha256_final(&proof_state, proof);
+    if (plan && hash != plan->hash) {
+        printf("Assembled file does not match the hash of the upload\n");
+        received = -1;
+    }
+    if (received == filesize) {
+        store_cached_hash(fd, hash);
+        store_content_proof(fd, proof);
+
+        // Keep the file being replaced as a prior version
+        long gen = preserve_version(fullpath, rel_path);
+        if (gen < 0)
+            received = -1;  // Overwriting would lose the old contents
+        else
+            fsetxattr(fd, GEN_XATTR, &gen, sizeof(gen), 0);
+        if (expires > 0)
+            fsetxattr(fd, EXPIRES_XATTR, &expires, sizeof(expires), 0);
+    }
+    close(fd);
+
+    // Publish the file only if every byte arrived
+    if (received == filesize && rename(temppath, fullpath) == 0) {
+        status = 1;
+        if (expires > 0) expiry_push(expires, fullpath);
+        content_remember(rel_path, fullpath, proof);
+        if (plan) chunk_index_add(rel_path, fullpath, filesize, hash, plan);
+        usage_add(rel_path, filesize - (existed ? old.st_size : 0), existed ? 0 : 1);
+        log_event(existed ? 'M' : 'A', rel_path);
+        index_update(rel_path, fullpath);
+        printf("File uploaded successfully.\n\n");
+    } else {
+        perror("S3 write failed");
+        unlink(temppath);
+    }
+    return status;
+}
+
+/**
+ * @brief Handles file uploads from main server
+ * @param sock Connection socket from S1
+ *
+ * Receives file with metadata (path, size, expiry time or 0)
+ * Creates parent directories as needed
+ * Streams data through a fixed transfer buffer into a temporary file,
+ * renamed over the destination once complete
+ * Accepts a valid header with status 1 before the data is sent
+ * Hashes the data as it streams and caches the hash on the file
+ * Replies with status 1 (stored) or -1 (failed)
+ */
+void handle_upload(int sock) {
+    // Request receive from server S1
+    printf("======Processing upload of TXT file======\n");
+
+    long status = -1;
+    int path_len;
+    if (read(sock, &path_len, sizeof(int)) != sizeof(int) || path_len <= 0 || path_len >= MAX_PATH_LEN) {
+        perror("Invalid path length");
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+    printf("Path Length is: %d\n", path_len);
+
+    char rel_path[MAX_PATH_LEN];
+    if (recv(sock, rel_path, path_len, MSG_WAITALL) != path_len) {
+        perror("Failed to receive path");
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+    rel_path[path_len] = '\0';
+    printf("Relative path is: %s\n", rel_path);
+
+    // Receive file size
+    long filesize;
+    if (recv(sock, &filesize, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        filesize < 0 || filesize > MAX_UPLOAD_SIZE) {
+        printf("Invalid file size\n");
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+    printf("Size of file received: %ld\n", filesize);
+
+    // Expiry time of a TTL upload, 0 to keep the file indefinitely
+    long expires;
+    if (recv(sock, &expires, sizeof(long), MSG_WAITALL) != sizeof(long) || expires < 0) {
+        printf("Invalid expiry time\n");
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+
+    // Header accepted: S1 lets the client stream the data
+    long accepted = 1;
+    send(sock, &accepted, sizeof(long), MSG_NOSIGNAL);
+
+    status = store_upload(sock, rel_path, filesize, expires, -1, 0, NULL, NULL);
+    send(sock, &status, sizeof(long), 0);
+}
+
+/**
+ * @brief Answers an upload preflight: can the file be stored without its data?
+ * @param sock Connection socket from S1
+ *
+ * Protocol ('H'):
+ *   1. S1 → Storage: 'H' + path_len + path + size + expires + proof
+ *      (SHA-256 of the upload, computed by the client)
+ *   2. Storage → S1: 3 (the destination already holds the content),
+ *      1 (stored from a file with the same content), 0 (content not in
+ *      this namespace, send the data) or -1 (failed)
+ *
+ * Only SHA-256 recorded by this server when it stored a file counts, and
+ * only files in the destination's namespace are considered, so a client
+ * cannot get content it does not have, nor content of another tenant.
+ * The destination only counts as up to date without an expiry on either
+ * side, since an upload changes or clears the expiry.
+ */
+void handle_preflight(int sock) {
+    printf("======Processing upload preflight======\n");
+
+    long status = -1;
+    int path_len;
+    char rel_path[MAX_PATH_LEN];
+    long filesize, expires;
+    unsigned char proof[CONTENT_PROOF_LEN];
+    if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+        path_len <= 0 || path_len >= MAX_PATH_LEN ||
+        recv(sock, rel_path, path_len, MSG_WAITALL) != path_len ||
+        recv(sock, &filesize, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &expires, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, proof, sizeof(proof), MSG_WAITALL) != sizeof(proof) ||
+        filesize < 0 || filesize > MAX_UPLOAD_SIZE || expires < 0) {
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+    rel_path[path_len] = '\0';
+
+    char fullpath[PATH_MAX];
+    snprintf(fullpath, sizeof(fullpath), "%s/S3%s", getenv("HOME"), rel_path);
+    int dest_fd = expires == 0 ? open(fullpath, O_RDONLY) : -1;
+    struct stat st;
+    unsigned long long hash;
+    int src_fd;
+    if (dest_fd >= 0 && fstat(dest_fd, &st) == 0 && st.st_size == filesize &&
+        content_proven(dest_fd, &st, proof) && fgetxattr(dest_fd, EXPIRES_XATTR, NULL, 0) < 0) {
+        status = 3;
+        printf("%s is already up to date\n", rel_path);
+    } else if ((src_fd = content_open(rel_path, proof, filesize, &hash)) >= 0) {
+        status = store_upload(sock, rel_path, filesize, expires, src_fd, hash, proof, NULL);
+        close(src_fd);
+    } else {
+        status = 0;
+    }
+    if (dest_fd >= 0) close(dest_fd);
+    send(sock, &status, sizeof(long), 0);
+}
+
+/**
+ * @brief Handles a chunked upload, receiving only the chunks not stored yet
+ * @param sock Connection socket from S1
+ *
+ * Protocol ('C'):
+ *   1. S1 → Storage: 'C' + path_len + path + size + expires + hash (XXH64
+ *      of the file) + count, then count x ChunkRef in file order
+ *   2. Storage → S1: missing_bytes + count need flags (1 = send the
+ *      chunk), or -1 if the upload is refused
+ *   3. S1 → Storage: the flagged chunks, in recipe order
+ *   4. Storage → S1: status (1 stored, -1 failed)
+ *
+ * Chunks found in the chunk index are copied from the stored files
+ * holding them, as long as those files are in the namespace of the
+ * destination. The result is stored as a whole file like any other
+ * upload, so downloads and every other request read it as usual.
+ */
+void handle_chunked_upload(int sock) {
+    printf("======Processing chunked upload======\n");
+
+    long status = -1;
+    int path_len, count;
+    char rel_path[MAX_PATH_LEN];
+    long filesize, expires;
+    ChunkPlan plan;
+    memset(&plan, 0, sizeof(plan));
+    if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+        path_len <= 0 || path_len >= MAX_PATH_LEN ||
+        recv(sock, rel_path, path_len, MSG_WAITALL) != path_len ||
+        recv(sock, &filesize, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &expires, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &plan.hash, sizeof(plan.hash), MSG_WAITALL) != sizeof(plan.hash) ||
+        recv(sock, &count, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+        filesize <= 0 || filesize > MAX_UPLOAD_SIZE || expires < 0 ||
+        count <= 0 || count > CHUNK_MAX_COUNT || count > filesize) {
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+    rel_path[path_len] = '\0';
+
+    plan.count = count;
+    plan.refs = malloc(count * sizeof(ChunkRef));
+    plan.source = malloc(count * sizeof(int));
+    plan.offset = malloc(count * sizeof(long));
+    unsigned char *need = malloc(count);
+    long recipe_len = (long)count * sizeof(ChunkRef);
+    int ok = plan.refs && plan.source && plan.offset && need &&
+             recv(sock, plan.refs, recipe_len, MSG_WAITALL) == recipe_len;
+
+    // The recipe must add up to the file, in chunks the transfer buffer holds
+    long total = 0;
+    for (int i = 0; ok && i < count; i++) {
+        if (plan.refs[i].len <= 0 || plan.refs[i].len > CHUNK_MAX_SIZE) ok = 0;
+        total += plan.refs[i].len;
+    }
+    if (!ok || total != filesize) {
+        send(sock, &status, sizeof(long), 0);
+        free(need);
+        plan_release(&plan);
+        return;
+    }
+
+    // Chunks the index knows in this namespace come from stored files, the rest from the client
+    char root[MAX_PATH_LEN];
+    tenant_root_of(rel_path, root);
+    if (!chunk_index) init_chunk_index();
+    long missing = 0;
+    int missing_count = 0;
+    for (int i = 0; i < count; i++) {
+        ChunkEntry *e = chunk_index ? chunk_find(plan.refs[i].hash, plan.refs[i].len, root) : NULL;
+        plan.source[i] = e ? plan_source(&plan, e->holder) : -1;
+        plan.offset[i] = e ? e->offset : 0;
+        need[i] = plan.source[i] < 0;
+        if (need[i]) {
+            missing += plan.refs[i].len;
+            missing_count++;
+        }
+    }
+    printf("Chunked upload of %s: %d of %d chunks (%ld of %ld bytes) needed\n",
+           rel_path, missing_count, count, missing, filesize);
+    send(sock, &missing, sizeof(long), 0);
+    send(sock, need, count, 0);
+    free(need);
+
+    status = store_upload(sock, rel_path, filesize, expires, -1, 0, NULL, &plan);
+    plan_release(&plan);
+    send(sock, &status, sizeof(long), 0);
+}
+
+/**
+ * @brief Opens a stored file, or one of its prior versions
+ * @param filepath Client path as sent by S1 (e.g., "~S1/docs/report")
+ * @param version Generation to open, 0 for the live file
+ * @param st Receives the metadata of the opened file
+ * @return Open descriptor, or -1 if there is no such file
+ */
+int open_stored_file(const char *filepath, long version, struct stat *st) {
+    const char *s1_part = strstr(filepath, "S1/");
+    if (!s1_part) return -1;
+
+    // Converts ~S1/.. to /home/user/S3/..
+    char local_path[MAX_PATH_LEN];
+    snprintf(local_path, sizeof(local_path), "%s/%s/%s", getenv("HOME"), "S3", s1_part + 3);
+    printf("Absolute path of file in S3: %s\n", local_path);
+
+    char serve_path[MAX_PATH_LEN];
+    resolve_version(local_path, s1_part + 2, version, serve_path, sizeof(serve_path));
+    int fd = open(serve_path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, st) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Processes file download requests from S1
+ * @param sock The connection socket from S1
+ *
+ * @param versioned Set for 'G' requests, which name a generation after the path
+ *
+ * Validates requested file exists
+ * Streams file with size prefix protocol
+ * Handles TXT files
+ * Implements proper error reporting
+ */
+void handle_download(int sock, int versioned) {
+    // Request receive from server S1
+    printf("======Processing download of TXT file======\n");
+
+    // Receive path length from S1
+    int path_len;
+    if (recv(sock, &path_len, sizeof(int), 0) != sizeof(int)) {
+        perror("Failed to receive path length");
+        return;
+    }
+    printf("File length receive from S1: %d\n", path_len);
+
+    // Receive original path (e.g., "~S1/docs/report.txt") from S1
+    char filepath[MAX_PATH_LEN];
+    if (recv(sock, filepath, path_len, 0) != path_len) {
+        perror("Failed to receive path");
+        return;
+    }
+    filepath[path_len] = '\0';
+    printf("File path receive from S1: %s\n", filepath);
+
+    // Generation requested by 'G', 0 for the live file
+    long version = 0;
+    if (versioned && recv(sock, &version, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        perror("Failed to receive version");
+        return;
+    }
+
+    // Open file (or the requested prior version) in S3
+    struct stat st;
+    int fd = open_stored_file(filepath, version, &st);
+    char status = (fd >= 0) ? 1 : -1;
+    send(sock, &status, 1, 0);  // First send status byte
+    if (fd < 0) {
+        printf("EFile not found\n");
+        char *err_msg = "EFile not found";
+        int msg_len = strlen(err_msg);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        return;
+    }
+
+    // Get file size
+    long file_size = st.st_size;
+
+    // Send file size to S1
+    send(sock, &file_size, sizeof(long), 0);
+
+    // Send file content to S1
+    send_file_data(sock, fd, file_size);
+
+    close(fd);       // Close the file
+    printf("File sent successfully to S1.\n\n");
+}
+
+/**
+ * @brief Fixed part of a redirect ticket, followed by the path and the MAC
+ *
+ * S1 issues tickets to clients that ask for a direct transfer; the client
+ * presents one here instead of sending the data through S1. The MAC covers
+ * the header and the path, so the client cannot alter anything S1 approved.
+ */
+typedef struct {
+    char op;                /**< 'U' upload or 'D' download */
+    int port;               /**< Storage server the ticket is valid for */
+    long not_after;         /**< Epoch seconds after which the ticket is refused */
+    long size;              /**< Upload size in bytes, 0 for downloads */
+    long arg;               /**< Expiry time of a TTL upload, or generation to download */
+    int path_len;           /**< Length of the path that follows */
+    unsigned char nonce[TICKET_NONCE_LEN];  /**< Random; the ticket is good for one transfer */
+} TicketHeader;
+
+unsigned char ticket_key[TICKET_KEY_LEN];
+int ticket_key_loaded = 0;
+
+/**
+ * @brief Loads the ticket key shared with S1 on first use
+ * @return 0 when the key is available, -1 otherwise
+ *
+ * S1 creates the key; a server on another host needs a copy of the file.
+ */
+int load_ticket_key(void) {
+    if (ticket_key_loaded) return 0;
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), TICKET_KEY_FILE);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Ticket key");
+        return -1;
+    }
+    int loaded = read(fd, ticket_key, TICKET_KEY_LEN) == TICKET_KEY_LEN;
+    close(fd);
+    if (!loaded) return -1;
+    ticket_key_loaded = 1;
+    return 0;
+}
+
+/**
+ * @brief A nonce already accepted, kept until what carried it expires
+ */
+typedef struct {
+    unsigned char nonce[TICKET_NONCE_LEN];
+    long not_after;         /**< Epoch seconds; the slot is free once this has passed */
+} SeenNonce;
+
+SeenNonce seen_nonces[NONCE_CACHE_SIZE];    // Used by the accept loop only
+
+/**
+ * @brief Accepts a ticket or S1 preamble nonce the first time it is presented
+ * @param nonce The nonce
+ * @param not_after Epoch seconds after which whatever carries it is refused anyway
+ * @return 1 if it was not seen before (now recorded), 0 if it was or the cache is full
+ *
+ * A full cache refuses rather than forget a live nonce, which would let
+ * that ticket or preamble be replayed.
+ */
+int nonce_first_use(const unsigned char *nonce, long not_after) {
+    long now = time(NULL);
+    int free_slot = -1;
+    for (int i = 0; i < NONCE_CACHE_SIZE; i++) {
+        if (seen_nonces[i].not_after < now) {
+            if (free_slot < 0) free_slot = i;
+        } else if (memcmp(seen_nonces[i].nonce, nonce, TICKET_NONCE_LEN) == 0) {
+            return 0;
+        }
+    }
+    if (free_slot < 0) return 0;
+    memcpy(seen_nonces[free_slot].nonce, nonce, TICKET_NONCE_LEN);
+    seen_nonces[free_slot].not_after = not_after;
+    return 1;
+}
+
+/**
+ * @brief Verifies a redirect ticket
+ * @param ticket Ticket as received (at least a header and a MAC long)
+ * @param len Length of ticket
+ * @param hdr Receives the fixed part
+ * @param path Receives the path (MAX_PATH_LEN bytes)
+ * @return NULL when the ticket is valid, otherwise the error to report
+ */
+const char *check_ticket(const unsigned char *ticket, int len, TicketHeader *hdr, char *path) {
+    if (load_ticket_key() < 0) return "ERedirected transfers are not enabled on this server";
+    memcpy(hdr, ticket, sizeof(*hdr));
+    if (hdr->path_len <= 0 || hdr->path_len >= MAX_PATH_LEN ||
+        len != (int)sizeof(*hdr) + hdr->path_len + TICKET_MAC_LEN)
+        return "EMalformed ticket";
+
+    // Compare in constant time so a tag cannot be guessed byte by byte
+    unsigned char mac[TICKET_MAC_LEN], diff = 0;
+    hmac_sha256(ticket_key, TICKET_KEY_LEN, ticket, len - TICKET_MAC_LEN, mac);
+    for (int i = 0; i < TICKET_MAC_LEN; i++)
+        diff |= mac[i] ^ ticket[len - TICKET_MAC_LEN + i];
+    if (diff) return "EInvalid ticket";
+    if (hdr->port != PORT_S3) return "ETicket was issued for another server";
+    if (time(NULL) > hdr->not_after) return "ETicket expired";
+    if (hdr->op != 'U' && hdr->op != 'D') return "EMalformed ticket";
+    if (!nonce_first_use(hdr->nonce, hdr->not_after)) return "ETicket was already used";
+
+    memcpy(path, ticket + sizeof(*hdr), hdr->path_len);
+    path[hdr->path_len] = '\0';
+    return NULL;
+}
+
+/**
+ * @brief Preamble S1 opens every connection with ('K')
+ */
+typedef struct {
+    long issued;                            /**< Epoch seconds when sent */
+    unsigned char nonce[TICKET_NONCE_LEN];  /**< Random, accepted once */
+} AuthHeader;
+
+/**
+ * @brief Checks S1's preamble on a new connection
+ * @param sock Connection that sent 'K'
+ * @return 0 if S1 sent it, -1 otherwise
+ *
+ * @details 'K' + AuthHeader + HMAC-SHA256 of the header with the ticket
+ * key, then the command. The port is open to clients so that they can
+ * present redirect tickets ('J'); every other command needs the preamble.
+ */
+int check_s1_auth(int sock) {
+    unsigned char msg[sizeof(AuthHeader) + TICKET_MAC_LEN];
+    struct timeval tv = { .tv_sec = TICKET_IO_SECS };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int received = recv(sock, msg, sizeof(msg), MSG_WAITALL) == sizeof(msg);
+    tv.tv_sec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (!received || load_ticket_key() < 0) return -1;
+
+    // Compare in constant time, as for tickets
+    unsigned char mac[TICKET_MAC_LEN], diff = 0;
+    hmac_sha256(ticket_key, TICKET_KEY_LEN, msg, sizeof(AuthHeader), mac);
+    for (int i = 0; i < TICKET_MAC_LEN; i++)
+        diff |= mac[i] ^ msg[sizeof(AuthHeader) + i];
+    AuthHeader hdr;
+    memcpy(&hdr, msg, sizeof(hdr));
+    long now = time(NULL);
+    if (diff || hdr.issued < now - AUTH_WINDOW_SECS || hdr.issued > now + AUTH_WINDOW_SECS) return -1;
+    return nonce_first_use(hdr.nonce, hdr.issued + AUTH_WINDOW_SECS) ? 0 : -1;
+}
+
+/**
+ * @brief Serves a transfer S1 redirected to this server
+ * @param sock Connection socket from the client
+ *
+ * Protocol ('J'):
+ *   1. Client → Storage: ticket_len + ticket
+ *   2. Storage → Client: status 1, or -1 + msg_len + msg
+ *   3. Download: file size + data, as S1 relays them for downlf
+ *      Upload: the client sends the size signed into the ticket, then
+ *      gets status 1 (stored) or -1 (failed)
+ *
+ * A ticket grants the one transfer S1 approved, once: its nonce is
+ * remembered until the ticket expires.
+ */
+void handle_ticket(int sock) {
+    printf("======Processing redirected transfer======\n");
+
+    // The peer is a client rather than S1, so do not wait on it forever
+    struct timeval tv = { .tv_sec = TICKET_IO_SECS };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    long status = -1;
+    int ticket_len;
+    unsigned char ticket[TICKET_MAX_LEN];
+    TicketHeader hdr;
+    char path[MAX_PATH_LEN];
+    const char *err = "EMalformed ticket";
+    if (recv(sock, &ticket_len, sizeof(int), MSG_WAITALL) == sizeof(int) &&
+        ticket_len >= (int)sizeof(hdr) + TICKET_MAC_LEN && ticket_len <= TICKET_MAX_LEN &&
+        recv(sock, ticket, ticket_len, MSG_WAITALL) == ticket_len)
+        err = check_ticket(ticket, ticket_len, &hdr, path);
+
+    struct stat st;
+    int fd = -1;
+    if (!err && hdr.op == 'D' && (fd = open_stored_file(path, hdr.arg, &st)) < 0)
+        err = "EFile not found";
+    if (err) {
+        printf("%s\n", err);
+        int msg_len = strlen(err);
+        send(sock, &status, sizeof(long), 0);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err, msg_len, 0);
+        return;
+    }
+
+    status = 1;
+    send(sock, &status, sizeof(long), 0);
+    if (hdr.op == 'D') {
+        long file_size = st.st_size;
+        send(sock, &file_size, sizeof(long), 0);
+        send_file_data(sock, fd, file_size);
+        close(fd);
+        printf("File sent directly to the client.\n\n");
+        return;
+    }
+
+    printf("Relative path is: %s\n", path);
+    status = store_upload(sock, path, hdr.size, hdr.arg, -1, 0, NULL, NULL);
+    send(sock, &status, sizeof(long), 0);
+}
+
+/**
+ * @brief Processes file deletion requests from S1
+ * @param sock The connection socket from S1
+ *
+ * Validates file path exists
+ * Verify path starts with ~S1/
+ * Moves the file into the trash (restorable until the reaper purges it)
+ * Returns success/error message to S1
+ * Implements secure path validation
+ */
+void handle_remove(int sock) 
+{
+    // Request receive from server S1
+    printf("======Processing remove of TXT file======\n");
+
+    // Receive path from S1 to delete a file
+    int path_len;
+    if (recv(sock, &path_len, sizeof(int), 0) != sizeof(int)) {
+        perror("Failed to receive path length.\n");
+        return;
+    }
+    printf("File length receive from S1: %d\n", path_len);
+
+    // Validate path length
+    if (path_len <= 0 || path_len >= MAX_PATH_LEN) {
+        send(sock, "EInvalid path length", 20, 0);
+        return;
+    }
+
+    // Receive original path (e.g., "~S1/docs/report.txt")
+    char filepath[MAX_PATH_LEN];
+    int bytes_received = recv(sock, filepath, path_len, 0);
+    if (bytes_received != path_len) {
+        perror("Failed to receive path");
+        send(sock, "EPath receive error", 18, 0);
+        return;
+    }
+    filepath[path_len] = '\0';
+    printf("File path receive from S1: %s\n", filepath);
+    
+
+    /* Security checks */
+    // 1. Prevent directory traversal
+    if (strstr(filepath, "../") || strstr(filepath, "/..")) {
+        send(sock, "EPath traversal not allowed", 26, 0);
+        return;
+    }
+
+    // 2. Verify path starts with ~S1/
+    if (strncmp(filepath, "~S1/", 4) != 0) {
+        send(sock, "EPath must start with ~S1/", 25, 0);
+        return;
+    }
+    
+    char local_path[MAX_PATH_LEN];
+    char *home_dir = NULL;
+    const char *s1_part = strstr(filepath, "S1/");
+
+    // Build absolute path with buffer safety
+    // Converts ~S1/.. to /home/username/S3/..
+    home_dir = getenv("HOME");
+    snprintf(local_path, MAX_PATH_LEN, "%s/S3/%s", home_dir, s1_part + 3);
+    printf("Absolute path of file in S3:%s\n",local_path);
+
+    // Execute deletion
+    struct stat st;
+    int counted = stat(local_path, &st) == 0 && S_ISREG(st.st_mode);
+    if (move_to_trash(local_path, s1_part + 2) == 0) {
+        if (counted) usage_add(s1_part + 2, -st.st_size, -1);
+        log_event('D', s1_part + 2);
+        index_remove(s1_part + 2);
+        send(sock, "SFile deleted successfully", 26, 0);
+        printf("SFile deleted successfully\n\n");
+    } else {
+        // Provide specific error messages
+        switch (errno) {
+            case ENOENT:
+                printf("EFile not found\n\n");
+                send(sock, "EFile not found", 15, 0);
+                break;
+            case EACCES:
+                printf("EPermission denied\n\n");
+                send(sock, "EPermission denied", 18, 0);
+                break;
+            default:
+                printf("EFile deletion failed\n\n");
+                send(sock, "EFile deletion failed", 21, 0);
+        }
+    }
+}
+
+/**
+ * @brief Receives the storage root a request from S1 runs in
+ * @param sock The connection socket from S1
+ * @param root Receives "" (default namespace) or a tenant root ("/.tenants/<name>")
+ * @return 0 on success, -1 if missing or not a tenant root
+ *
+ * @details root_len + root; paths of the request lie below the root, and
+ * a request in the default namespace leaves the tenants' roots out.
+ */
+int recv_tenant_root(int sock, char *root) {
+    int root_len;
+    root[0] = '\0';
+    if (recv(sock, &root_len, sizeof(int), MSG_WAITALL) != sizeof(int) || root_len < 0 ||
+        root_len >= MAX_PATH_LEN || (root_len > 0 && recv(sock, root, root_len, MSG_WAITALL) != root_len))
+        return -1;
+    root[root_len] = '\0';
+    if (root_len == 0) return 0;
+
+    // Goes into shell commands: only plain names
+    if (strncmp(root, "/" TENANT_DIR "/", strlen(TENANT_DIR) + 2) != 0 || strstr(root, "..")) return -1;
+    for (const char *c = root; *c; c++)
+        if (!isalnum((unsigned char)*c) && !strchr("/._-", *c)) return -1;
+    return 0;
+}
+
+/**
+ * @brief One file of a tar being streamed
+ */
+typedef struct {
+    char *path;                 /**< Absolute path */
+    long size;                  /**< Size when listed; the archive records exactly this many bytes */
+    long mtime;                 /**< Modification time when listed */
+    int mode;                   /**< Permission bits */
+    int uid;                    /**< Owner */
+    int gid;                    /**< Group */
+    char *record;               /**< Header block(s), plus data and padding of a small file */
+    long record_len;            /**< Bytes in record */
+    int fd;                     /**< Open file whose data follows record (large files), else -1 */
+    int ready;                  /**< Set once record (and fd) are prepared */
+} TarEntry;
+
+/**
+ * @brief A tar being streamed, shared by its reader threads
+ *
+ * Readers prepare entries in archive order, at most TAR_WINDOW ahead of
+ * the one being sent, so many files are read at once while memory stays
+ * bounded and the output order does not depend on which read finishes first.
+ */
+typedef struct {
+    TarEntry *entries;          /**< Files in archive order (sorted by name) */
+    int count;                  /**< Number of entries */
+    int capacity;               /**< Allocated entries */
+    size_t root_len;            /**< Length of the archive root, stripped from entry names */
+    int next;                   /**< Next entry a reader claims */
+    int sent;                   /**< Entries the sender is done with */
+    int stop;                   /**< Set when the receiver hung up */
+    unsigned long long id;      /**< XXH64 of every entry's name and metadata: names the archive layout */
+    pthread_mutex_t lock;       /**< Protects next, sent, stop and ready */
+    pthread_cond_t cond;        /**< Signals prepared entries and room in the window */
+} TarJob;
+
+// Job being listed by tar_collect_file() (one listing at a time)
+static TarJob *tar_collecting;
+static const char *tar_ext;                 // Extension of the files archived
+static char tar_skip_dir[MAX_PATH_LEN];     // Tenants' roots when archiving the default namespace, else ""
+
+/**
+ * @brief Rounds a length up to whole tar blocks
+ */
+static long tar_blocks(long len) {
+    return (len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+/**
+ * @brief Bytes of header for an entry name: one block, or a GNU long-name entry before it
+ */
+static long tar_header_len(size_t name_len) {
+    return name_len < 100 ? TAR_BLOCK : 2 * TAR_BLOCK + tar_blocks(name_len + 1);
+}
+
+/**
+ * @brief nftw() callback adding the archived files to the job being listed
+ */
+static int tar_collect_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type == FTW_D && tar_skip_dir[0] && strcmp(path, tar_skip_dir) == 0) return FTW_SKIP_SUBTREE;
+    const char *ext = strrchr(path, '.');
+    if (type != FTW_F || !ext || strcmp(ext, tar_ext) != 0) return 0;
+
+    TarJob *job = tar_collecting;
+    if (job->count == job->capacity) {
+        int capacity = job->capacity ? job->capacity * 2 : 64;
+        TarEntry *grown = realloc(job->entries, capacity * sizeof(TarEntry));
+        if (!grown) return FTW_STOP;
+        job->entries = grown;
+        job->capacity = capacity;
+    }
+    TarEntry *e = &job->entries[job->count];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->mode = st->st_mode & 07777;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->fd = -1;
+    if (e->path) job->count++;
+    return 0;
+}
+
+static int tar_compare_entries(const void *a, const void *b) {
+    return strcmp(((const TarEntry *)a)->path, ((const TarEntry *)b)->path);
+}
+
+/**
+ * @brief Lists the files of a tar
+ * @param job Job to fill
+ * @param dir Archive root; entry names are relative to it
+ * @param ext Extension of the files to archive (e.g., ".pdf")
+ * @param skip_dir Directory left out (the tenants' roots), or ""
+ * @return Size of the archive in bytes
+ *
+ * Entries are sorted by name, so the same tree always gives the same
+ * archive, and the archive id changes whenever any entry's header would.
+ */
+long tar_collect(TarJob *job, const char *dir, const char *ext, const char *skip_dir) {
+    memset(job, 0, sizeof(*job));
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    job->root_len = strlen(dir);
+    tar_collecting = job;
+    tar_ext = ext;
+    snprintf(tar_skip_dir, sizeof(tar_skip_dir), "%s", skip_dir);
+    nftw(dir, tar_collect_file, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+    qsort(job->entries, job->count, sizeof(TarEntry), tar_compare_entries);
+
+    HashState hs;
+    hash_init(&hs);
+    for (int i = 0; i < job->count; i++) {
+        const TarEntry *e = &job->entries[i];
+        hash_update(&hs, e->path + job->root_len, strlen(e->path + job->root_len) + 1);
+        hash_update(&hs, &e->size, sizeof(e->size));
+        hash_update(&hs, &e->mtime, sizeof(e->mtime));
+        hash_update(&hs, &e->mode, sizeof(e->mode));
+        hash_update(&hs, &e->uid, sizeof(e->uid));
+        hash_update(&hs, &e->gid, sizeof(e->gid));
+    }
+    job->id = hash_final(&hs);
+
+    // Headers and data of every entry, then two zero blocks
+    long size = 2 * TAR_BLOCK;
+    for (int i = 0; i < job->count; i++)
+        size += tar_header_len(strlen(job->entries[i].path + job->root_len + 1)) + tar_blocks(job->entries[i].size);
+    return size;
+}
+
+/**
+ * @brief Fills one tar header block (GNU format, as written by tar -cf)
+ */
+static void tar_header(unsigned char *h, const char *name, char type, long size, const TarEntry *e) {
+    memset(h, 0, TAR_BLOCK);
+    snprintf((char *)h, 100, "%s", name);
+    snprintf((char *)h + 100, 8, "%07o", e->mode);
+    snprintf((char *)h + 108, 8, "%07o", e->uid & 07777777);
+    snprintf((char *)h + 116, 8, "%07o", e->gid & 07777777);
+    if (size <= 077777777777L) {
+        snprintf((char *)h + 124, 12, "%011lo", size);
+    } else {
+        // Too large for octal: base-256, flagged by the high bit
+        h[124] = 0x80;
+        for (int i = 11; i > 0; i--, size >>= 8)
+            h[124 + i] = size & 0xff;
+    }
+    snprintf((char *)h + 136, 12, "%011lo", e->mtime);
+    h[156] = type;
+    memcpy(h + 257, "ustar  ", 8);
+
+    // Checksum over the block with the checksum field read as spaces
+    memset(h + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+}
+
+/**
+ * @brief Writes the header block(s) of an entry
+ * @param buf tar_header_len() zeroed bytes
+ */
+static void tar_fill_headers(const TarJob *job, const TarEntry *e, char *buf) {
+    const char *name = e->path + job->root_len + 1;
+    size_t name_len = strlen(name);
+    unsigned char *h = (unsigned char *)buf;
+    if (name_len >= 100) {
+        TarEntry link = {.mode = 0644};
+        tar_header(h, "././@LongLink", 'L', name_len + 1, &link);
+        memcpy(h + TAR_BLOCK, name, name_len);
+        h += tar_header_len(name_len) - TAR_BLOCK;
+    }
+    tar_header(h, name, '0', e->size, e);
+}
+
+/**
+ * @brief Prepares an entry: its header, and the data of a small file
+ *
+ * A file of up to TAR_INLINE_MAX bytes is read into the record, padded
+ * to whole blocks. A larger one stays open for the sender to sendfile(),
+ * with the start of it prefetched. Bytes missing because the file shrank
+ * or vanished since it was listed are sent as zeros.
+ */
+static void tar_prepare(TarJob *job, TarEntry *e) {
+    long head_len = tar_header_len(strlen(e->path + job->root_len + 1));
+    int inline_data = e->size <= TAR_INLINE_MAX;
+    e->record_len = head_len + (inline_data ? tar_blocks(e->size) : 0);
+    e->record = calloc(1, e->record_len);
+    if (!e->record) return;
+    tar_fill_headers(job, e, e->record);
+
+    e->fd = open(e->path, O_RDONLY);
+    if (e->fd < 0) {
+        printf("tar: %s vanished, archived as zeros\n", e->path);
+    } else if (inline_data) {
+        char *data = e->record + head_len;
+        long got = 0;
+        while (got < e->size) {
+            ssize_t n = pread(e->fd, data + got, e->size - got, got);
+            if (n <= 0) break;
+            got += n;
+        }
+        close(e->fd);
+        e->fd = -1;
+    } else {
+        posix_fadvise(e->fd, 0, TAR_READAHEAD, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * @brief Reader thread: prepares entries in order within the window
+ */
+static void *tar_reader(void *arg) {
+    TarJob *job = arg;
+
+    // Signals are handled by the main thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->stop && job->next < job->count && job->next >= job->sent + TAR_WINDOW)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (job->stop || job->next >= job->count) break;
+        TarEntry *e = &job->entries[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        tar_prepare(job, e);
+
+        pthread_mutex_lock(&job->lock);
+        e->ready = 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/**
+ * @brief Sends len bytes, or zeros when data is NULL
+ * @return 0 on success, -1 if the receiver hung up
+ */
+static int tar_send_bytes(int sock, const char *data, long len) {
+    static const char zeros[8 * TAR_BLOCK];
+    while (len > 0) {
+        long want = data ? len : (len < (long)sizeof(zeros) ? len : (long)sizeof(zeros));
+        ssize_t n = send(sock, data ? data : zeros, want, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        if (data) data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Streams the archive listed by tar_collect()
+ * @param job Listed job
+ * @param sock Receiver of exactly the size tar_collect() returned
+ * @return 0 when the whole archive was sent, -1 otherwise
+ *
+ * Up to TAR_THREADS readers prepare entries while this thread sends them
+ * in order, so reading overlaps sending and many files are read at once.
+ */
+int tar_stream(TarJob *job, int sock) {
+    pthread_t readers[TAR_THREADS];
+    int started = 0;
+    for (; started < TAR_THREADS && started < job->count; started++)
+        if (pthread_create(&readers[started], NULL, tar_reader, job) != 0) break;
+
+    int ok = 1;
+    for (int i = 0; i < job->count && ok; i++) {
+        TarEntry *e = &job->entries[i];
+        if (started) {
+            pthread_mutex_lock(&job->lock);
+            while (!e->ready) pthread_cond_wait(&job->cond, &job->lock);
+            pthread_mutex_unlock(&job->lock);
+        } else {
+            tar_prepare(job, e);
+        }
+
+        ok = e->record && tar_send_bytes(sock, e->record, e->record_len) == 0;
+        if (ok && e->size > TAR_INLINE_MAX) {
+            long moved = e->fd >= 0 ? send_file_data(sock, e->fd, e->size) : 0;
+            ok = tar_send_bytes(sock, NULL, tar_blocks(e->size) - moved) == 0;
+        }
+        free(e->record);
+        e->record = NULL;
+        if (e->fd >= 0) close(e->fd);
+        e->fd = -1;
+
+        pthread_mutex_lock(&job->lock);
+        job->sent = i + 1;
+        if (!ok) job->stop = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    if (ok) ok = tar_send_bytes(sock, NULL, 2 * TAR_BLOCK) == 0;
+
+    for (int i = 0; i < started; i++)
+        pthread_join(readers[i], NULL);
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Builds the member index of a listed archive
+ * @param job Listed job
+ * @param tar_size Archive size returned by tar_collect()
+ * @param len Receives the index length
+ * @return The index (malloc'd), or NULL if out of memory
+ *
+ * Text, one line per member after a header line:
+ *   w25tar <archive id> <archive size> <members>
+ *   <data offset> <size> <name>
+ * With it a client fetches single members as byte ranges ('B').
+ */
+char *tar_index(const TarJob *job, long tar_size, long *len) {
+    size_t cap = 64;
+    for (int i = 0; i < job->count; i++)
+        cap += strlen(job->entries[i].path + job->root_len + 1) + 48;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+
+    size_t n = snprintf(out, cap, "w25tar %016llx %ld %d\n", job->id, tar_size, job->count);
+    long pos = 0;
+    for (int i = 0; i < job->count; i++) {
+        const TarEntry *e = &job->entries[i];
+        const char *name = e->path + job->root_len + 1;
+        long head_len = tar_header_len(strlen(name));
+        n += snprintf(out + n, cap - n, "%ld %ld %s\n", pos + head_len, e->size, name);
+        pos += head_len + tar_blocks(e->size);
+    }
+    *len = n;
+    return out;
+}
+
+/**
+ * @brief Sends a byte range of a listed archive without producing the rest
+ * @param job Listed job
+ * @param sock Receiver of exactly length bytes
+ * @param offset First archive byte to send
+ * @param length Number of bytes (within the archive)
+ * @return 0 when the range was sent, -1 otherwise
+ *
+ * Only the files overlapping the range are opened, so fetching one
+ * member reads one file.
+ */
+int tar_send_range(TarJob *job, int sock, long offset, long length) {
+    long pos = 0, end = offset + length;
+    for (int i = 0; i < job->count && pos < end; i++) {
+        TarEntry *e = &job->entries[i];
+        long head_len = tar_header_len(strlen(e->path + job->root_len + 1));
+        long data_len = tar_blocks(e->size);
+        if (pos + head_len + data_len <= offset) {
+            pos += head_len + data_len;
+            continue;
+        }
+
+        // The header block(s) of the entry
+        if (pos + head_len > offset) {
+            char *head = calloc(1, head_len);
+            if (!head) return -1;
+            tar_fill_headers(job, e, head);
+            long from = offset > pos ? offset - pos : 0;
+            long to = end < pos + head_len ? end - pos : head_len;
+            int ok = tar_send_bytes(sock, head + from, to - from) == 0;
+            free(head);
+            if (!ok) return -1;
+        }
+        pos += head_len;
+
+        // Its data, zeros past the end of the file
+        if (pos < end && pos + data_len > offset) {
+            long from = offset > pos ? offset - pos : 0;
+            long to = end < pos + data_len ? end - pos : data_len;
+            long moved = 0;
+            if (from < e->size) {
+                int fd = open(e->path, O_RDONLY);
+                if (fd >= 0 && lseek(fd, from, SEEK_SET) == from)
+                    moved = send_file_data(sock, fd, (to < e->size ? to : e->size) - from);
+                if (fd >= 0) close(fd);
+            }
+            if (tar_send_bytes(sock, NULL, to - from - moved) < 0) return -1;
+        }
+        pos += data_len;
+    }
+
+    // The two zero blocks closing the archive
+    if (end > pos) return tar_send_bytes(sock, NULL, end - (offset > pos ? offset : pos));
+    return 0;
+}
+
+/**
+ * @brief Answers a tar request from a listed archive
+ * @param sock Requester (S1, or the client when S1 holds the files)
+ * @param job Listed job
+ * @param tar_size Archive size returned by tar_collect()
+ * @param mode 'T' the archive, 'E' its member index, 'B' a byte range of it
+ * @param id Archive id the range was taken from ('B')
+ * @param offset First byte of the range ('B')
+ * @param length Length of the range ('B')
+ * @return 0 when everything was sent, -1 otherwise
+ *
+ * Replies status 1 + length + bytes, or -1 + msg_len + msg when the
+ * archive changed since its index was made or the range is outside it.
+ */
+int tar_reply(int sock, TarJob *job, long tar_size, char mode, unsigned long long id, long offset, long length) {
+    const char *err_msg = NULL;
+    char *index = NULL;
+    long index_len = 0;
+    if (mode == 'B' && id != job->id)
+        err_msg = "EArchive changed since its index was made";
+    else if (mode == 'B' && (offset < 0 || length < 0 || offset > tar_size || length > tar_size - offset))
+        err_msg = "ERange outside the archive";
+    else if (mode == 'E' && !(index = tar_index(job, tar_size, &index_len)))
+        err_msg = "EOut of memory";
+    if (err_msg) {
+        long error = -1;
+        int msg_len = strlen(err_msg);
+        send(sock, &error, sizeof(long), 0);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        printf("%s\n", err_msg);
+        return -1;
+    }
+
+    long status = 1;
+    long len = mode == 'E' ? index_len : mode == 'B' ? length : tar_size;
+    send(sock, &status, sizeof(long), 0);
+    send(sock, &len, sizeof(long), 0);
+    int sent = mode == 'E' ? tar_send_bytes(sock, index, index_len)
+             : mode == 'B' ? tar_send_range(job, sock, offset, length)
+             : tar_stream(job, sock);
+    free(index);
+    return sent;
+}
+
+/**
+ * @brief Frees a tar job, including entries left unsent
+ */
+void tar_job_free(TarJob *job) {
+    for (int i = 0; i < job->count; i++) {
+        free(job->entries[i].path);
+        free(job->entries[i].record);
+        if (job->entries[i].fd >= 0) close(job->entries[i].fd);
+    }
+    free(job->entries);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+}
+
+/**
+ * @brief Handles tar archive creation for storage server
+ * @param sock The connection socket from S1
+ * @param mode 'T' the archive, 'E' its member index, 'B' a byte range of it
+ *
+ * Receives filetype (txt) and the storage root (tenant root or "")
+ * Creates tar of all matching txt files below that root
+ * Writes the archive itself (see tar_stream): files are read by a pool of
+ * threads and sent in name order, with no temporary file
+ * For 'B' the request also carries the archive id + offset + length
+ * taken from the index; only the files in that range are read
+ */
+void handle_downloadtar(int sock, char mode) {
+    // Request receive from server S1
+    printf("======Processing creation of tar file======\n");
+
+    // Receive filetype length and filetype
+    int type_len;
+    recv(sock, &type_len, sizeof(int), 0);
+    printf("Filetype length receive from S1: %d\n", type_len);
+    
+    char filetype[10];
+    recv(sock, filetype, type_len, 0);
+    filetype[type_len] = '\0';
+    printf("Filetype receive from S1: %s\n", filetype);
+
+    // Storage root to archive: a tenant's root, or "" for the default namespace
+    char root[MAX_PATH_LEN];
+    int request_valid = recv_tenant_root(sock, root) == 0;
+
+    // A byte range names the archive it was taken from
+    unsigned long long id = 0;
+    long offset = 0, length = 0;
+    if (mode == 'B' && (recv(sock, &id, sizeof(id), MSG_WAITALL) != sizeof(id) ||
+                        recv(sock, &offset, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+                        recv(sock, &length, sizeof(long), MSG_WAITALL) != sizeof(long)))
+        request_valid = 0;
+
+    // Validate filetype matches server's responsibility, the storage root and a range
+    if (strcmp(filetype, "txt") != 0 || !request_valid) {  // S3 only handles txts
+        long error = -1;
+        send(sock, &error, sizeof(long), 0);
+        char *err_msg = "EWrong filetype for this server";
+        int msg_len = strlen(err_msg);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        return;
+    }
+
+     // First check if S3 directory exists
+    struct stat st;
+    char s3_dir[MAX_PATH_LEN * 2];
+    snprintf(s3_dir, sizeof(s3_dir), "%s/S3%s", getenv("HOME"), root);
+
+    // The tenants' roots are not part of the default namespace
+    char skip_dir[MAX_PATH_LEN * 2 + 16] = "";
+    if (!root[0])
+        snprintf(skip_dir, sizeof(skip_dir), "%s/%s", s3_dir, TENANT_DIR);
+    if (stat(s3_dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        long error = -1;
+        send(sock, &error, sizeof(long), 0);
+        char *err_msg = "ES1 directory not found";
+        int msg_len = strlen(err_msg);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        printf("ES1 directory not found\n");
+        return;
+    }
+
+    // List the .txt files, sorted by name
+    TarJob job;
+    long tar_size = tar_collect(&job, s3_dir, ".txt", skip_dir);
+    if (job.count == 0) {
+        long error = -1;
+        send(sock, &error, sizeof(long), 0);
+        char *err_msg = "ENo .txt files found in S1 directory";
+        int msg_len = strlen(err_msg);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        printf("ENo .txt files found in S1 directory\n");
+        tar_job_free(&job);
+        return;
+    }
+
+    // Send the archive, its index or a range of it; the readers prefetch
+    // the next files while the archive streams
+    int sent = tar_reply(sock, &job, tar_size, mode, id, offset, length) == 0;
+    printf("Tar %c of %d file(s), %ld bytes %s\n\n", mode, job.count, tar_size,
+           sent ? "sent successfully to S1." : "cut short, S1 hung up.");
+    tar_job_free(&job);
+}
+
+/**
+ * @brief Generates directory listings for S1
+ * @param sock Connection socket from main server
+ * @param path Directory path to scan
+ *
+ * Lists all files with server's managed extension
+ * Recursively scans subdirectories when requested
+ * Returns sorted list of filenames with extensions
+ * Handles permission errors gracefully
+ */
+void handle_listing(int sock) {
+    // Request receive from server S1
+    printf("======Processing listing of txt files======\n");
+
+    // Step 1: Receive path length and path
+    int path_len = 0;
+    if (recv(sock, &path_len, sizeof(int), 0) <= 0 || path_len <= 0 || path_len >= 1024) {
+        perror("Failed to receive path length or invalid length");
+        long status = 0;
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+
+    char pathname[1024] = {0};
+    if (recv(sock, pathname, path_len, 0) <= 0) {
+        perror("Failed to receive pathname");
+        long status = 0;
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+    pathname[path_len] = '\0';
+    printf("Received pathname: %s\n", pathname);
+
+    // Step 2: Convert ~S3/... to actual home directory path
+    const char *home = getenv("HOME");
+    if (!home) {
+        perror("HOME not set");
+        long status = 0;
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+
+    if (strncmp(pathname, "~S3", 3) != 0) {
+        fprintf(stderr, "Invalid path prefix\n");
+        long status = 0;
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+
+    // Skip "~S3" and add the relative path after it
+    char full_path[1024];
+    snprintf(full_path, sizeof(full_path), "%s/S3%s", home, pathname + 3);
+    printf("Searching in directory: %s\n", full_path);
+
+    // Step 3: Run `find` command to list .pdf files
+    char command[PATH_MAX + 64];
+    snprintf(command, sizeof(command), "find %s -maxdepth 1 -type f -name \"*.txt\"", full_path);
+    printf("Executing: %s\n", command);
+
+    FILE *fp = popen(command, "r");
+    if (!fp) {
+        perror("Failed to run find");
+        long status = 0;
+        send(sock, &status, sizeof(long), 0);
+        return;
+    }
+
+    char **files = NULL;
+    int count = 0;
+    char line[1024];
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *newline = strchr(line, '\n');
+        if (newline) *newline = '\0';
+
+        char *slash = strrchr(line, '/');
+        if (slash) {
+            files = realloc(files, (count + 1) * sizeof(char *));
+            files[count++] = strdup(slash + 1);
+        }
+    }
+    pclose(fp);
+
+    // Step 4: Send results back to S1
+    long status = (count > 0) ? 1 : 0;
+    send(sock, &status, sizeof(long), 0);
+
+    if (status == 0) {
+        printf("No .txt files found.\n\n");
+        return;
+    }
+
+    send(sock, &count, sizeof(int), 0);
+    for (int i = 0; i < count; i++) {
+        int len = strlen(files[i]);
+        send(sock, &len, sizeof(int), 0);
+        send(sock, files[i], len, 0);
+        printf("Sent file: %s\n", files[i]);
+        free(files[i]);
+    }
+
+    free(files);
+    printf("Completed sending list to S1.\n\n");
+}
+
 
 /**
- * @brief Handles file uploads from main server
- * @param sock Connection socket from S1
+ * @brief One entry of a metadata reply to S1
+ */
+typedef struct {
+    long exists;                /**< 1 if the file exists, -1 otherwise */
+    long size;                  /**< Size in bytes */
+    long mtime;                 /**< Modification time (seconds since the epoch) */
+    unsigned long long hash;    /**< Cached XXH64 of the contents, 0 if unknown */
+} StatReply;
+
+/**
+ * @brief Answers metadata queries from S1 without touching file data
+ * @param sock The connection socket from S1
  *
- * Receives file with metadata (path, size)
- * Creates parent directories as needed
- * Implements overwrite protection
- * Validates file extension matches server type
+ * Receives a path count followed by that many (path_len, path) pairs
+ * Replies with one StatReply per path, in request order, in a single send
+ * Hashes come from the upload-time cache and are never computed here
  */
-void handle_upload(int sock) {
+void handle_stat(int sock) {
     // Request receive from server S1
-    printf("======Processing upload of TXT file======\n");
+    printf("======Processing stat of TXT files======\n");
 
-    int path_len;
-    read(sock, &path_len, sizeof(int));
-    printf("Path Length is: %d\n", path_len);
+    int count;
+    if (recv(sock, &count, sizeof(int), MSG_WAITALL) != sizeof(int) || count <= 0 || count > STAT_MAX_PATHS) {
+        printf("Invalid path count\n");
+        return;
+    }
 
-    char rel_path[1024];
-    read(sock, rel_path, path_len);
-    rel_path[path_len] = '\0';
-    printf("Relative path is: %s\n", rel_path);
+    StatReply replies[STAT_MAX_PATHS];
+    for (int i = 0; i < count; i++) {
+        int path_len;
+        char filepath[MAX_PATH_LEN];
+        if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 || path_len >= MAX_PATH_LEN ||
+            recv(sock, filepath, path_len, MSG_WAITALL) != path_len) {
+            perror("Failed to receive path");
+            return;
+        }
+        filepath[path_len] = '\0';
 
-    // Receive file size
-    long filesize;
-    read(sock, &filesize, sizeof(long));
-    printf("Size of file received: %d\n", filesize);
+        StatReply *reply = &replies[i];
+        memset(reply, 0, sizeof(*reply));
+        reply->exists = -1;
 
-    // Receive file data
-    char *filedata = malloc(filesize);
-    long received = 0;
-    while (received < filesize) {
-        int chunk = read(sock, filedata + received, filesize - received);
-        printf("File content sent to S1 : %s\n", filedata);
-        if (chunk <= 0) break;
-        received += chunk;
+        // Converts ~S1/.. to /home/user/S3/..
+        char *rel = strstr(filepath, "S1/");
+        if (!rel || strstr(filepath, "..")) continue;
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, sizeof(local_path), "%s/%s/%s", getenv("HOME"), "S3", rel + 3);
+
+        struct stat st;
+        if (stat(local_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            reply->exists = 1;
+            reply->size = st.st_size;
+            reply->mtime = st.st_mtime;
+            load_cached_hash(local_path, &st, &reply->hash);
+        }
+        printf("Stat %s: %s\n", local_path, reply->exists == 1 ? "found" : "not found");
     }
 
-    // Create full path for S3
-    char fullpath[1024];
-    snprintf(fullpath, sizeof(fullpath), "%s/S3%s", getenv("HOME"), rel_path);
-    printf("Full path is: %s\n", fullpath);
+    send(sock, replies, count * sizeof(StatReply), 0);
+}
 
-    // Create directory tree ~/S3/..
-    char mkdir_cmd[1024];
-    snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(strdup(fullpath)));
-    system(mkdir_cmd);
-    printf("Command to create directory is: %s\n", mkdir_cmd);
+/**
+ * @brief Reports this server's usage of every namespace to S1
+ * @param sock The connection socket from S1
+ *
+ * Replies status 1 + count + count x (prefix_len + prefix + bytes + files),
+ * read straight from the usage table in a single send
+ */
+void handle_usage(int sock) {
+    // Request receive from server S1
+    printf("======Processing usage report======\n");
 
-    // Create file and write data into it
-    FILE *fp = fopen(fullpath, "wb");
-    if (fp) {
-        fwrite(filedata, 1, filesize, fp);
-        fclose(fp);
-    } else {
-        perror("S3 write failed\n\n");
-        printf("S3 write failed\n\n");
+    long status = 1;
+    int count = 0;
+    size_t cap = sizeof(long) + sizeof(int) + USAGE_SLOTS * (sizeof(int) + USAGE_PREFIX_LEN + 2 * sizeof(long));
+    char *reply = malloc(cap);
+    if (!reply || !usage_table) {
+        status = -1;
+        send(sock, &status, sizeof(long), 0);
+        free(reply);
+        return;
     }
-    printf("File uploaded successfully\n\n");
 
-    free(filedata);
+    size_t off = sizeof(long) + sizeof(int);
+    for (int i = 0; i < USAGE_SLOTS; i++) {
+        UsageEntry *e = &usage_table->slots[i];
+        if (!e->used) continue;
+        int len = strlen(e->prefix);
+        memcpy(reply + off, &len, sizeof(int));
+        off += sizeof(int);
+        memcpy(reply + off, e->prefix, len);
+        off += len;
+        memcpy(reply + off, &e->bytes, sizeof(long));
+        off += sizeof(long);
+        memcpy(reply + off, &e->files, sizeof(long));
+        off += sizeof(long);
+        count++;
+    }
+    memcpy(reply, &status, sizeof(long));
+    memcpy(reply + sizeof(long), &count, sizeof(int));
+    send(sock, reply, off, 0);
+    free(reply);
+    printf("Usage of %d namespace(s) sent to S1\n", count);
 }
 
 /**
- * @brief Processes file download requests from S1
+ * @brief Reports the integrity scrubber's results to S1
  * @param sock The connection socket from S1
  *
- * Validates requested file exists
- * Streams file with size prefix protocol
- * Handles TXT files
- * Implements proper error reporting
+ * Replies status 1 + ScrubReport
  */
-void handle_download(int sock) {
+void handle_info(int sock) {
     // Request receive from server S1
-    printf("======Processing download of TXT file======\n");
+    printf("======Processing scrubber report======\n");
 
-    // Receive path length from S1
-    int path_len;
-    if (recv(sock, &path_len, sizeof(int), 0) != sizeof(int)) {
-        perror("Failed to receive path length");
-        return;
-    }
-    printf("File length receive from S1: %d\n", path_len);
+    ScrubReport report;
+    pthread_mutex_lock(&scrub_stats->lock);
+    report = scrub_stats->report;
+    pthread_mutex_unlock(&scrub_stats->lock);
 
-    // Receive original path (e.g., "~S1/docs/report.txt") from S1
+    long status = 1;
+    send(sock, &status, sizeof(long), 0);
+    send(sock, &report, sizeof(report), 0);
+}
+
+/**
+ * @brief Lists the versions of a stored file for S1
+ * @param sock The connection socket from S1
+ *
+ * Receives path_len + path (~S1/...)
+ * Replies status 1 + count + count x VersionInfo (newest first),
+ * or status -1 + msg_len + msg when the file has no versions
+ */
+void handle_versions(int sock) {
+    // Request receive from server S1
+    printf("======Processing version listing of TXT file======\n");
+
+    int path_len;
     char filepath[MAX_PATH_LEN];
-    if (recv(sock, filepath, path_len, 0) != path_len) {
+    if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 || path_len >= MAX_PATH_LEN ||
+        recv(sock, filepath, path_len, MSG_WAITALL) != path_len) {
         perror("Failed to receive path");
         return;
     }
     filepath[path_len] = '\0';
-    printf("File path receive from S1: %s\n", filepath);
 
-    // Build absolute path with buffer safety
-    // Converts ~S1/.. to /home/user/S3/..
-    char local_path[MAX_PATH_LEN];
-    snprintf(local_path, sizeof(local_path), "%s/%s/%s", getenv("HOME"), "S3", strstr(filepath, "S1/") + 3);
-    //snprintf(local_path, MAX_PATH_LEN, "%s/S3/%s", getenv("HOME");, s1_part + 3);
-    printf("Absolute path of file in S3:%s\n",local_path);
+    VersionInfo versions[VERSION_LIST_MAX];
+    int count = 0;
+    if (strncmp(filepath, "~S1/", 4) == 0 && !strstr(filepath, "..")) {
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, sizeof(local_path), "%s/S3/%s", getenv("HOME"), filepath + 4);
+        count = list_versions(local_path, filepath + 3, versions);
+    }
 
-    // Open file in S3
-    FILE *file = fopen(local_path, "rb");
-    char status = (file != NULL) ? 1 : -1;
-    send(sock, &status, 1, 0);  // First send status byte
-    if (!file) {
-        printf("EFile not found\n");
+    long status = count > 0 ? 1 : -1;
+    send(sock, &status, sizeof(long), 0);
+    if (count == 0) {
         char *err_msg = "EFile not found";
         int msg_len = strlen(err_msg);
         send(sock, &msg_len, sizeof(int), 0);
         send(sock, err_msg, msg_len, 0);
         return;
     }
-
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // Send file size to S1
-    send(sock, &file_size, sizeof(long), 0);
-
-    // Send file content to S1
-    char buffer[BUFFER_SIZE];
-    while (file_size > 0) {
-        int chunk = file_size > BUFFER_SIZE ? BUFFER_SIZE : file_size;
-        int bytes_read = fread(buffer, 1, chunk, file);
-        send(sock, buffer, bytes_read, 0);
-        //printf("File content sent to S1 : %s\n", buffer);
-        file_size -= bytes_read;
-    }
-    fclose(file);       // Close the file
-    printf("File sent successfully to S1.\n\n");
+    send(sock, &count, sizeof(int), 0);
+    send(sock, versions, count * sizeof(VersionInfo), 0);
+    printf("%d version(s) of %s sent to S1\n", count, filepath);
 }
 
 /**
- * @brief Processes file deletion requests from S1
+ * @brief Restores a removed file from the trash for S1
  * @param sock The connection socket from S1
  *
- * Validates file path exists
- * Verify path starts with ~S1/
- * Returns success/error message to S1
- * Implements secure path validation
+ * Receives path_len + path (~S1/...)
+ * Replies status 1 + restored size, or status -1 + msg_len + msg
  */
-void handle_remove(int sock) 
-{
+void handle_undelete(int sock) {
     // Request receive from server S1
-    printf("======Processing remove of TXT file======\n");
+    printf("======Processing undelete of TXT file======\n");
 
-    // Receive path from S1 to delete a file
     int path_len;
-    if (recv(sock, &path_len, sizeof(int), 0) != sizeof(int)) {
-        perror("Failed to receive path length.\n");
+    char filepath[MAX_PATH_LEN];
+    if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 || path_len >= MAX_PATH_LEN ||
+        recv(sock, filepath, path_len, MSG_WAITALL) != path_len) {
+        perror("Failed to receive path");
         return;
     }
-    printf("File length receive from S1: %d\n", path_len);
+    filepath[path_len] = '\0';
 
-    // Validate path length
-    if (path_len <= 0 || path_len >= MAX_PATH_LEN) {
-        send(sock, "EInvalid path length", 20, 0);
+    char *err_msg = NULL;
+    long size = 0;
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..")) {
+        err_msg = "EPath must start with ~S1/";
+    } else {
+        char local_path[MAX_PATH_LEN];
+        snprintf(local_path, sizeof(local_path), "%s/S3/%s", getenv("HOME"), filepath + 4);
+        if (restore_from_trash(local_path, filepath + 3, &size) == 0) {
+            usage_add(filepath + 3, size, 1);
+            log_event('A', filepath + 3);
+            index_update(filepath + 3, local_path);
+        }
+        else if (errno == EEXIST)
+            err_msg = "EA file already exists at this path";
+        else if (errno == ENOENT)
+            err_msg = "ENo removed file to restore at this path";
+        else
+            err_msg = "EFile restore failed";
+    }
+
+    long status = err_msg ? -1 : 1;
+    send(sock, &status, sizeof(long), 0);
+    if (err_msg) {
+        int msg_len = strlen(err_msg);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        printf("%s\n", err_msg);
         return;
     }
+    send(sock, &size, sizeof(long), 0);
+    printf("File %s restored.\n\n", filepath);
+}
 
-    // Receive original path (e.g., "~S1/docs/report.txt")
+/**
+ * @brief Gives a stored file its own inode before it is written in place
+ * @param fullpath Stored file
+ * @return 0 on success (fullpath is now a private copy), -1 on failure
+ *
+ * Versions kept without reflink support are hardlinks of an old inode,
+ * which must never change. The live file only shares its inode with one
+ * when an upload failed after keeping it, but an in-place write must not
+ * reach the version through it. The copy is a reflink where supported.
+ */
+int detach_hardlink(const char *fullpath) {
+    char temppath[MAX_PATH_LEN + 8];
+    snprintf(temppath, sizeof(temppath), "%s.part", fullpath);
+    int fd = open(fullpath, O_RDONLY);
+    int dst = fd >= 0 ? open(temppath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (dst < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    struct stat st;
+    int ok = fstat(fd, &st) == 0;
+    if (ok && ioctl(dst, FICLONE, fd) != 0) {
+        off_t offset = 0;
+        while (ok && offset < st.st_size)
+            ok = sendfile(dst, fd, &offset, st.st_size - offset) > 0;
+    }
+
+    // Carry over generation, expiry and append sequence
+    char names[BUFFER_SIZE], value[256];
+    ssize_t names_len = ok ? flistxattr(fd, names, sizeof(names)) : 0;
+    for (ssize_t i = 0; i < names_len; i += strlen(names + i) + 1) {
+        ssize_t value_len = fgetxattr(fd, names + i, value, sizeof(value));
+        if (value_len >= 0) fsetxattr(dst, names + i, value, value_len, 0);
+    }
+    close(dst);
+    close(fd);
+
+    if (!ok || rename(temppath, fullpath) < 0) {
+        unlink(temppath);
+        return -1;
+    }
+    printf("%s shared its inode, writing to a copy\n", fullpath);
+    return 0;
+}
+
+/**
+ * @brief Opens a stored file for updating in place and locks it
+ * @param fullpath Stored file
+ * @param flags Extra open flags: O_APPEND, O_CREAT (create if missing)
+ * @param created Set to 1 if the file was created
+ * @return Locked descriptor, -1 on failure
+ *
+ * The lock (flock) serialises writers per file. A file replaced or
+ * unlinked while waiting for the lock is opened again, so the lock
+ * always covers the inode currently at fullpath.
+ */
+int open_locked(const char *fullpath, int flags, int *created) {
+    for (int attempt = 0; attempt < 8; attempt++) {
+        int fd = -1;
+        *created = 0;
+        if (flags & O_CREAT) {
+            fd = open(fullpath, O_RDWR | flags | O_EXCL, 0644);
+            *created = fd >= 0;
+        }
+        if (fd < 0 && (!(flags & O_CREAT) || errno == EEXIST))
+            fd = open(fullpath, O_RDWR | (flags & ~O_CREAT));
+        if (fd < 0) {
+            if (errno == ENOENT && (flags & O_CREAT)) continue;
+            return -1;
+        }
+        if (flock(fd, LOCK_EX) < 0) {
+            close(fd);
+            return -1;
+        }
+
+        struct stat locked, current;
+        if (fstat(fd, &locked) == 0 && stat(fullpath, &current) == 0 &&
+            locked.st_ino == current.st_ino && locked.st_dev == current.st_dev) {
+            if (locked.st_nlink <= 1) return fd;
+            // Shared with a kept version: copy, then lock the copy
+            if (detach_hardlink(fullpath) < 0) {
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+/**
+ * @brief Checks that a range can be written into a stored file
+ * @param fullpath Stored file
+ * @param offset Start of the range
+ * @param expected Version the writer expects, 0 for any
+ * @param err Receives the error message ('E' prefixed)
+ * @param err_len Size of err
+ * @return 0 if the write may proceed, -1 otherwise
+ */
+int check_range(const char *fullpath, long offset, long expected, char *err, size_t err_len) {
+    struct stat st;
+    if (stat(fullpath, &st) < 0 || !S_ISREG(st.st_mode)) {
+        snprintf(err, err_len, "EFile not found");
+        return -1;
+    }
+    if (offset > st.st_size) {
+        snprintf(err, err_len, "EOffset is past the end of the file (%ld bytes)", (long)st.st_size);
+        return -1;
+    }
+    long gen = file_generation(fullpath);
+    if (expected > 0 && gen != expected) {
+        snprintf(err, err_len, "EVersion conflict: the file is at version %ld", gen);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a range of a stored file in place
+ * @param fullpath Stored file
+ * @param offset Start of the range (at most the file size)
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @param expected Version the writer expects, 0 for any
+ * @param version Receives the new version
+ * @param new_size Receives the new file size
+ * @param grown Receives how many bytes the file grew
+ * @param err Receives the error message ('E' prefixed)
+ * @param err_len Size of err
+ * @return 0 on success, -1 on failure
+ *
+ * The version check and the pwrite() happen under the file lock, so two
+ * writers expecting the same version cannot both succeed. Each write is
+ * a new generation (GEN_XATTR); the old contents are not kept as a
+ * version, as that would copy the whole file. The content hash is
+ * recomputed before the lock is released.
+ */
+int write_range(const char *fullpath, long offset, const char *data, long size, long expected,
+                long *version, long *new_size, long *grown, char *err, size_t err_len) {
+    int created;
+    int fd = open_locked(fullpath, 0, &created);
+    if (fd < 0) {
+        snprintf(err, err_len, errno == ENOENT ? "EFile not found" : "EFile could not be opened for writing");
+        return -1;
+    }
+    if (check_range(fullpath, offset, expected, err, err_len) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    long written = 0;
+    while (written < size) {
+        ssize_t n = pwrite(fd, data + written, size - written, offset + written);
+        if (n <= 0) break;
+        written += n;
+    }
+    if (written < size) {
+        perror("In-place write failed");
+        snprintf(err, err_len, "EWrite failed after %ld of %ld bytes", written, size);
+        close(fd);
+        return -1;
+    }
+
+    *version = file_generation(fullpath) + 1;
+    fsetxattr(fd, GEN_XATTR, version, sizeof(long), 0);
+    rehash_file(fd);
+    *new_size = offset + size > st.st_size ? offset + size : st.st_size;
+    *grown = *new_size - st.st_size;
+    close(fd);   // Releases the lock
+    return 0;
+}
+
+/**
+ * @brief Appends bytes to a stored text file for S1
+ * @param sock The connection socket from S1
+ *
+ * Only the new bytes travel, and they are written with a single
+ * O_APPEND write under the file lock: readers see all of them or none,
+ * and a failed write is truncated away. The sequence number makes a
+ * retried append harmless. Each file records the last sequence applied
+ * (APPEND_SEQ_XATTR); an append whose sequence is not above it was
+ * already applied and is acknowledged without writing. Sequence 0 means
+ * none: the append is applied and takes the next number.
+ *
+ * The content hash is recomputed before the lock is released.
+ *
+ * @details Protocol 'A' - Append:
+ *   1. S1 → Storage: 'A' + path_len + path (~S1/...) + seq + size
+ *   2. Storage → S1: status 1 (send the data), 2 + seq (already applied),
+ *      or -1 + msg_len + msg
+ *   3. S1 → Storage: size bytes
+ *   4. Storage → S1: status 1 + seq + new file size + created (0/1),
+ *      2 + seq, or -1 + msg_len + msg
+ */
+void handle_append(int sock) {
+    // Request receive from server S1
+    printf("======Processing append to TXT file======\n");
+
+    int path_len;
+    long seq, size;
     char filepath[MAX_PATH_LEN];
-    int bytes_received = recv(sock, filepath, path_len, 0);
-    if (bytes_received != path_len) {
-        perror("Failed to receive path");
-        send(sock, "EPath receive error", 18, 0);
+    if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 || path_len >= MAX_PATH_LEN ||
+        recv(sock, filepath, path_len, MSG_WAITALL) != path_len ||
+        recv(sock, &seq, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &size, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        perror("Failed to receive append request");
         return;
     }
     filepath[path_len] = '\0';
-    printf("File path receive from S1: %s\n", filepath);
-    
 
-    /* Security checks */
-    // 1. Prevent directory traversal
-    if (strstr(filepath, "../") || strstr(filepath, "/..")) {
-        send(sock, "EPath traversal not allowed", 26, 0);
+    char local_path[MAX_PATH_LEN];
+    snprintf(local_path, sizeof(local_path), "%s/S3/%s", getenv("HOME"), filepath + 4);
+    const char *ext = strrchr(filepath, '.');
+    const char *err_msg = NULL;
+    long status = 1, applied = 0;
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, "..") || !ext || strcmp(ext, ".txt") != 0)
+        err_msg = "EPath must be a .txt file under ~S1/";
+    else if (seq < 0 || size <= 0 || size > APPEND_MAX)
+        err_msg = "EInvalid append size or sequence";
+    else if (seq > 0 && getxattr(local_path, APPEND_SEQ_XATTR, &applied, sizeof(applied)) == sizeof(applied) &&
+             seq <= applied)
+        status = 2;
+
+    char *data = err_msg || status == 2 ? NULL : malloc(size);
+    if (!err_msg && status == 1 && !data) err_msg = "EOut of memory";
+    if (err_msg) {
+        status = -1;
+        int msg_len = strlen(err_msg);
+        send(sock, &status, sizeof(long), 0);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        printf("%s\n", err_msg);
+        return;
+    }
+    send(sock, &status, sizeof(long), 0);
+    if (status == 2) {
+        send(sock, &applied, sizeof(long), 0);
+        printf("Append %ld to %s already applied\n", seq, filepath);
         return;
     }
 
-    // 2. Verify path starts with ~S1/
-    if (strncmp(filepath, "~S1/", 4) != 0) {
-        send(sock, "EPath must start with ~S1/", 25, 0);
+    // Take all the bytes before touching the file
+    if (recv(sock, data, size, MSG_WAITALL) != size) {
+        perror("Append data incomplete");
+        free(data);
         return;
     }
-    
-    char local_path[MAX_PATH_LEN];
-    char *home_dir = NULL;
-    const char *s1_part = strstr(filepath, "S1/");
 
-    // Build absolute path with buffer safety
-    // Converts ~S1/.. to /home/username/S3/..
-    home_dir = getenv("HOME");
-    snprintf(local_path, MAX_PATH_LEN, "%s/S3/%s", home_dir, s1_part + 3);
-    printf("Absolute path of file in S3:%s\n",local_path);
+    char dir[MAX_PATH_LEN], mkdir_cmd[MAX_PATH_LEN + 16];
+    strcpy(dir, local_path);
+    snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dirname(dir));
+    system(mkdir_cmd);
 
-    // Execute deletion
-    if (remove(local_path) == 0) {
-        send(sock, "SFile deleted successfully", 26, 0);
-        printf("SFile deleted successfully\n\n");
+    int created;
+    struct stat st;
+    int fd = open_locked(local_path, O_APPEND | O_CREAT, &created);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Append open failed");
+        err_msg = "EFile could not be opened for appending";
     } else {
-        // Provide specific error messages
-        switch (errno) {
-            case ENOENT:
-                printf("EFile not found\n\n");
-                send(sock, "EFile not found", 15, 0);
-                break;
-            case EACCES:
-                printf("EPermission denied\n\n");
-                send(sock, "EPermission denied", 18, 0);
-                break;
-            default:
-                printf("EFile deletion failed\n\n");
-                send(sock, "EFile deletion failed", 21, 0);
+        // Another appender may have applied this sequence while we waited
+        if (fgetxattr(fd, APPEND_SEQ_XATTR, &applied, sizeof(applied)) != sizeof(applied))
+            applied = 0;
+        if (seq > 0 && seq <= applied) {
+            status = 2;
+        } else if (write(fd, data, size) != size) {
+            perror("Append write failed");
+            if (ftruncate(fd, st.st_size) < 0) perror("Append rollback failed");
+            err_msg = "EAppend failed";
+        } else {
+            applied = seq > 0 ? seq : applied + 1;
+            fsetxattr(fd, APPEND_SEQ_XATTR, &applied, sizeof(applied), 0);
+            rehash_file(fd);
+            index_append(filepath + 3, fd, st.st_size, data, size);
         }
     }
+    free(data);
+    if (fd >= 0) close(fd);   // Releases the lock
+    if (err_msg && created && fd >= 0) unlink(local_path);
+
+    if (err_msg) {
+        status = -1;
+        int msg_len = strlen(err_msg);
+        send(sock, &status, sizeof(long), 0);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        printf("%s\n", err_msg);
+        return;
+    }
+    send(sock, &status, sizeof(long), 0);
+    send(sock, &applied, sizeof(long), 0);
+    if (status == 2) {
+        printf("Append %ld to %s already applied\n", seq, filepath);
+        return;
+    }
+
+    long new_size = st.st_size + size, was_created = created;
+    send(sock, &new_size, sizeof(long), 0);
+    send(sock, &was_created, sizeof(long), 0);
+    usage_add(filepath + 3, size, created);
+    log_event(created ? 'A' : 'M', filepath + 3);
+    printf("Appended %ld bytes to %s (sequence %ld)\n\n", size, filepath, applied);
 }
 
 /**
- * @brief Handles tar archive creation for storage server
+ * @brief Writes a range of a stored file in place for S1
  * @param sock The connection socket from S1
  *
- * Receives filetype (txt)
- * Creates tar of all matching txt files in server's storage
- * Uses system tar command with grep filtering
- * Streams archive back to S1
- * Cleans up temporary files
+ * Only the range travels. It is received completely before the file is
+ * touched, then written by write_range().
+ *
+ * @details Protocol 'P' - Write in place:
+ *   1. S1 → Storage: 'P' + path_len + path (~S1/...) + offset + size + expected version (0 for any)
+ *   2. Storage → S1: status 1 (send the data) or -1 + msg_len + msg
+ *   3. S1 → Storage: size bytes
+ *   4. Storage → S1: status 1 + version + new file size + bytes grown, or -1 + msg_len + msg
  */
-void handle_downloadtar(int sock) {
+void handle_write(int sock) {
     // Request receive from server S1
-    printf("======Processing creation of tar file======\n");
-
-    // Receive filetype length and filetype
-    int type_len;
-    recv(sock, &type_len, sizeof(int), 0);
-    printf("Filetype length receive from S1: %d\n", type_len);
-    
-    char filetype[10];
-    recv(sock, filetype, type_len, 0);
-    filetype[type_len] = '\0';
-    printf("Filetype receive from S1: %s\n", filetype);
+    printf("======Processing in-place write of TXT file======\n");
 
-    // Validate filetype matches server's responsibility
-    if (strcmp(filetype, "txt") != 0) {  // S3 only handles txts
-        long error = -1;
-        send(sock, &error, sizeof(long), 0);
-        char *err_msg = "EWrong filetype for this server";
-        int msg_len = strlen(err_msg);
-        send(sock, &msg_len, sizeof(int), 0);
-        send(sock, err_msg, msg_len, 0);
+    int path_len;
+    long offset, size, expected;
+    char filepath[MAX_PATH_LEN];
+    if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 || path_len >= MAX_PATH_LEN ||
+        recv(sock, filepath, path_len, MSG_WAITALL) != path_len ||
+        recv(sock, &offset, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &size, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &expected, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        perror("Failed to receive write request");
         return;
     }
+    filepath[path_len] = '\0';
 
-     // First check if S3 directory exists
-    struct stat st;
-    char s3_dir[256];
-    snprintf(s3_dir, sizeof(s3_dir), "%s/S3", getenv("HOME"));
-    if (stat(s3_dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
-        long error = -1;
-        send(sock, &error, sizeof(long), 0);
-        char *err_msg = "ES1 directory not found";
-        int msg_len = strlen(err_msg);
-        send(sock, &msg_len, sizeof(int), 0);
-        send(sock, err_msg, msg_len, 0);
-        printf("ES1 directory not found\n");
-        return;
+    char local_path[MAX_PATH_LEN], err_msg[BUFFER_SIZE];
+    snprintf(local_path, sizeof(local_path), "%s/S3/%s", getenv("HOME"), filepath + 4);
+    long status = -1;
+    char *data = NULL;
+    if (strncmp(filepath, "~S1/", 4) != 0 || strstr(filepath, ".."))
+        snprintf(err_msg, sizeof(err_msg), "EPath must start with ~S1/");
+    else if (offset < 0 || size <= 0 || size > WRITE_MAX || expected < 0)
+        snprintf(err_msg, sizeof(err_msg), "EInvalid offset, size or version");
+    else if (check_range(local_path, offset, expected, err_msg, sizeof(err_msg)) == 0 && !(data = malloc(size)))
+        snprintf(err_msg, sizeof(err_msg), "EOut of memory");
+    else if (data)
+        status = 1;
+
+    send(sock, &status, sizeof(long), 0);
+    if (status == 1) {
+        // Take all the bytes before touching the file
+        if (recv(sock, data, size, MSG_WAITALL) != size) {
+            perror("Write data incomplete");
+            free(data);
+            return;
+        }
+        long reply[3];
+        if (write_range(local_path, offset, data, size, expected, &reply[0], &reply[1], &reply[2],
+                        err_msg, sizeof(err_msg)) < 0)
+            status = -1;
+        free(data);
+        send(sock, &status, sizeof(long), 0);
+        if (status == 1) {
+            send(sock, reply, sizeof(reply), 0);
+            usage_add(filepath + 3, reply[2], 0);
+            log_event('M', filepath + 3);
+            index_update(filepath + 3, local_path);
+            printf("Wrote %ld bytes at offset %ld of %s (version %ld)\n\n", size, offset, filepath, reply[0]);
+            return;
+        }
     }
+    int msg_len = strlen(err_msg);
+    send(sock, &msg_len, sizeof(int), 0);
+    send(sock, err_msg, msg_len, 0);
+    printf("%s\n", err_msg);
+}
 
-    // Check if there are any .txt files
-    char check_cmd[512];
-    snprintf(check_cmd, sizeof(check_cmd), 
-            "find %s -type f -name '*.txt' | head -n 1 | grep -q .", s3_dir);
-    
-    if (system(check_cmd) != 0) {
-        long error = -1;
-        send(sock, &error, sizeof(long), 0);
-        char *err_msg = "ENo .txt files found in S1 directory";
-        int msg_len = strlen(err_msg);
-        send(sock, &msg_len, sizeof(int), 0);
-        send(sock, err_msg, msg_len, 0);
-        printf("ENo .txt files found in S1 directory\n");
+/**
+ * @brief Finds the first occurrence of a literal
+ * @param hay Text to search
+ * @param hay_len Length of the text
+ * @param needle Literal to find
+ * @param n Length of the literal (at least 1)
+ * @return Start of the first occurrence, or NULL
+ *
+ * With SSE2, 16 candidate positions are tested at once against the
+ * literal's first and last byte; memcmp() runs only where both agree,
+ * which on text is rare.
+ */
+static const char *find_literal(const char *hay, size_t hay_len, const char *needle, size_t n) {
+    if (hay_len < n) return NULL;
+    if (n == 1) return memchr(hay, needle[0], hay_len);
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    for (; i + n - 1 + 16 <= hay_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + n - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                            _mm_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, n - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // Remaining tail (the whole text without SSE2)
+    while (i + n <= hay_len) {
+        const char *p = memchr(hay + i, needle[0], hay_len - n + 1 - i);
+        if (!p) return NULL;
+        if (memcmp(p, needle, n) == 0) return p;
+        i = p - hay + 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Counts line feeds, 16 bytes at a time with SSE2
+ */
+static long count_newlines(const char *p, size_t len) {
+    long count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16)
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(nl, _mm_loadu_si128((const __m128i *)(p + i)))));
+#endif
+    for (; i < len; i++)
+        count += p[i] == '\n';
+    return count;
+}
+
+/**
+ * @brief One grepf request, shared by its worker threads
+ */
+typedef struct {
+    int sock;                   /**< Connection from S1 */
+    int use_regex;              /**< 1 for a POSIX extended regex, 0 for a literal */
+    regex_t re;                 /**< Compiled regex (use_regex only) */
+    char pattern[GREP_MAX_PATTERN]; /**< Literal (use_regex == 0) */
+    size_t pattern_len;         /**< Length of the literal */
+    char **files;               /**< Absolute paths of the files to scan */
+    int file_count;             /**< Number of files */
+    int file_capacity;          /**< Allocated entries in files */
+    int next_file;              /**< Next file to claim (atomic) */
+    long matches;               /**< Matching lines sent (atomic) */
+    long bytes;                 /**< Bytes scanned (atomic) */
+    int stop;                   /**< Set once the match limit is hit or S1 hung up */
+    int hung_up;                /**< Set when a send to S1 failed */
+    pthread_mutex_t send_lock;  /**< Keeps reply batches whole */
+    size_t root_len;            /**< Length of "$HOME/S3" */
+} GrepJob;
+
+/**
+ * @brief Per-worker reply batch
+ */
+typedef struct {
+    char data[GREP_BATCH];
+    size_t len;
+} GrepBatch;
+
+/**
+ * @brief Sends a batch to S1 and empties it
+ */
+static void grep_flush(GrepJob *job, GrepBatch *batch) {
+    if (batch->len == 0) return;
+    pthread_mutex_lock(&job->send_lock);
+    if (!job->hung_up && send(job->sock, batch->data, batch->len, MSG_NOSIGNAL) != (ssize_t)batch->len) {
+        job->hung_up = 1;
+        job->stop = 1;
+    }
+    pthread_mutex_unlock(&job->send_lock);
+    batch->len = 0;
+}
+
+/**
+ * @brief Adds a match record: path_len + path + line_no + text_len + text
+ */
+static void grep_emit(GrepJob *job, GrepBatch *batch, const char *path, long line_no, const char *text, int text_len) {
+    if (__atomic_add_fetch(&job->matches, 1, __ATOMIC_RELAXED) > GREP_MAX_MATCHES) {
+        job->stop = 1;
         return;
     }
+    if (text_len > GREP_MAX_LINE) text_len = GREP_MAX_LINE;
+    int path_len = strlen(path);
+    size_t need = sizeof(int) + path_len + sizeof(long) + sizeof(int) + text_len;
+    if (batch->len + need > GREP_BATCH) grep_flush(job, batch);
+
+    char *p = batch->data + batch->len;
+    memcpy(p, &path_len, sizeof(int));
+    memcpy(p + sizeof(int), path, path_len);
+    p += sizeof(int) + path_len;
+    memcpy(p, &line_no, sizeof(long));
+    memcpy(p + sizeof(long), &text_len, sizeof(int));
+    memcpy(p + sizeof(long) + sizeof(int), text, text_len);
+    batch->len += need;
+}
 
-    // Create a temporary directory for server files
-    // Tar file will be created inside server_tmp directory
-    char temp_dir[] = "server_temp";
-    char dir_command[1024];
-    snprintf(dir_command, sizeof(dir_command), "mkdir %s", temp_dir);
-    if (system(dir_command)) {
-        send(sock, "ECould not create temp directory", 31, 0);
+/**
+ * @brief Scans one file and records every matching line
+ *
+ * The file is mapped and searched as a whole; after a match the scan
+ * resumes at the next line, so each line is reported once.
+ */
+static void grep_file(GrepJob *job, GrepBatch *batch, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
         return;
     }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
 
-    // Construct tar file name
-    char tar_filename[256];     // txtfiles.tar for txt tar file
-    snprintf(tar_filename, sizeof(tar_filename), "%s.tar", filetype);
+    char display[MAX_PATH_LEN];
+    snprintf(display, sizeof(display), "~S1%s", path + job->root_len);
 
-    // Create path for tar file (relative paths)
-    char server_tar_path[512];
-    snprintf(server_tar_path, sizeof(server_tar_path), "%s/%s", temp_dir, tar_filename);
-    printf("Tar file path is: %s\n", server_tar_path);
+    const char *pos = data, *end = data + st.st_size, *counted = data;
+    long line_no = 1;
+    while (pos < end && !job->stop) {
+        const char *match;
+        if (job->use_regex) {
+            // REG_STARTEND: search the mapping in place, no NUL terminator needed
+            regmatch_t m = {.rm_so = pos - data, .rm_eo = st.st_size};
+            if (regexec(&job->re, data, 1, &m, REG_STARTEND) != 0) break;
+            match = data + m.rm_so;
+        } else {
+            match = find_literal(pos, end - pos, job->pattern, job->pattern_len);
+            if (!match) break;
+        }
 
-    // Create file list (relative paths)
-    char list_path[512];
-    snprintf(list_path, sizeof(list_path), "%s/txt_files.list", temp_dir);
-    printf("List path is: %s\n", list_path);
-    
-    // Construct command for tar file creation
-    char cmd[1024];
-    snprintf(cmd, sizeof(cmd), "find ~/S3 -type f -name '*.txt' | sed 's|^.*/S3/||' > %s && tar -C ~/S3 -cf %s -T %s",
-            list_path, server_tar_path, list_path);
-    printf("Tar command is: %s\n", cmd);
-    int ret = system(cmd);
-    if (ret != 0) {
-        send(sock, "ETar creation failed", 19, 0);
-        // Cleanup temp files
-        remove(list_path);
-        remove(server_tar_path);
-        rmdir(temp_dir);
-        return;
-    }
-
-    // Open tar file
-    FILE *tar_file = fopen(server_tar_path, "rb");
-    if (!tar_file) {
-        printf("EFile not found\n");
-        long error = -1;
-        send(sock, &error, sizeof(long), 0);
-        char *err_msg = "ETar file not found";
-        int msg_len = strlen(err_msg);
-        send(sock, &msg_len, sizeof(int), 0);
-        send(sock, err_msg, msg_len, 0);
-        return;
+        const char *line_start = match;
+        while (line_start > pos && line_start[-1] != '\n') line_start--;
+        const char *line_end = memchr(match, '\n', end - match);
+        if (!line_end) line_end = end;
+
+        line_no += count_newlines(counted, line_start - counted);
+        counted = line_start;
+        grep_emit(job, batch, display, line_no, line_start, line_end - line_start);
+        pos = line_end + 1;
+    }
+    __atomic_add_fetch(&job->bytes, st.st_size, __ATOMIC_RELAXED);
+    munmap((void *)data, st.st_size);
+}
+
+/**
+ * @brief Releases a job (the connection is closed by its owner)
+ */
+static void grep_job_free(GrepJob *job) {
+    for (int i = 0; i < job->file_count; i++)
+        free(job->files[i]);
+    free(job->files);
+    if (job->use_regex) regfree(&job->re);
+    pthread_mutex_destroy(&job->send_lock);
+    free(job);
+}
+
+/**
+ * @brief Worker: claims files one at a time until none are left
+ */
+static void *grep_worker(void *arg) {
+    GrepJob *job = arg;
+    GrepBatch *batch = malloc(sizeof(GrepBatch));
+    if (!batch) return NULL;
+    batch->len = 0;
+
+    int i;
+    while (!job->stop && (i = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED)) < job->file_count) {
+        grep_file(job, batch, job->files[i]);
+        if (batch->len > GREP_BATCH / 2) grep_flush(job, batch);
     }
+    grep_flush(job, batch);
+    free(batch);
+    return NULL;
+}
 
-    // Move pointer to the end of file to get the size
-    fseek(tar_file, 0, SEEK_END);
-    long tar_size = ftell(tar_file);
-    fseek(tar_file, 0, SEEK_SET);
+/**
+ * @brief Runs a grepf request in the background and closes the connection
+ *
+ * Spreads the files over up to GREP_THREADS workers, then sends the end
+ * marker: -1 if every file was scanned, -2 if the output was cut at
+ * GREP_MAX_MATCHES lines, followed by files and bytes scanned.
+ */
+static void *grep_job_thread(void *arg) {
+    GrepJob *job = arg;
 
-    // Send status to S1 to proceed for sharing
-    long status = 1;
-    send(sock, &status, sizeof(long), 0);
+    // Signals are handled by the main thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
 
-    // Send tar file size to S1
-    send(sock, &tar_size, sizeof(long), 0);
+    pthread_t workers[GREP_THREADS];
+    int started = 0;
+    for (; started < GREP_THREADS && started < job->file_count; started++)
+        if (pthread_create(&workers[started], NULL, grep_worker, job) != 0) break;
+    if (started == 0) grep_worker(job);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
 
-    // Send tar file content to S1
-    char buffer[BUFFER_SIZE];
-    while (tar_size > 0) {
-        int chunk = tar_size > BUFFER_SIZE ? BUFFER_SIZE : tar_size;
-        fread(buffer, 1, chunk, tar_file);
-        send(sock, buffer, chunk, 0);
-        printf("File content sent to S1 : %s\n", buffer);
-        tar_size -= chunk;
+    int end = job->matches > GREP_MAX_MATCHES ? -2 : -1;
+    long files = job->file_count;
+    if (!job->hung_up) {
+        send(job->sock, &end, sizeof(int), MSG_NOSIGNAL);
+        send(job->sock, &files, sizeof(long), MSG_NOSIGNAL);
+        send(job->sock, &job->bytes, sizeof(long), MSG_NOSIGNAL);
     }
+    printf("grepf: %ld line(s) in %d file(s), %ld bytes scanned\n",
+           job->matches > GREP_MAX_MATCHES ? (long)GREP_MAX_MATCHES : job->matches, job->file_count, job->bytes);
+
+    close(job->sock);
+    grep_job_free(job);
+    return NULL;
+}
 
-    // Close the tar file
-    fclose(tar_file); 
+// File list being built by grep_collect_file() (main thread only)
+static GrepJob *grep_collecting;
+static char grep_skip_dir[PATH_MAX];    // Tenants' roots when searching the default namespace, else ""
 
-    // Cleanup temp files
-    remove(list_path);
-    remove(server_tar_path);
-    rmdir(temp_dir);
+/**
+ * @brief nftw() callback adding .txt files to the job being prepared
+ */
+static int grep_collect_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_D && grep_skip_dir[0] && strcmp(path, grep_skip_dir) == 0) return FTW_SKIP_SUBTREE;
+    const char *ext = strrchr(path, '.');
+    if (type != FTW_F || !ext || strcmp(ext, ".txt") != 0) return 0;
 
-    printf("Tar file sent successfully to S1.\n\n");
+    GrepJob *job = grep_collecting;
+    if (job->file_count == job->file_capacity) {
+        int capacity = job->file_capacity ? job->file_capacity * 2 : 64;
+        char **grown = realloc(job->files, capacity * sizeof(char *));
+        if (!grown) return 1;
+        job->files = grown;
+        job->file_capacity = capacity;
+    }
+    job->files[job->file_count] = strdup(path);
+    if (job->files[job->file_count]) job->file_count++;
+    return 0;
 }
 
 /**
- * @brief Generates directory listings for S1
- * @param sock Connection socket from main server
- * @param path Directory path to scan
+ * @brief Starts a text search for S1 ('F')
+ * @param sock The connection socket from S1
+ * @return 0 if a background job took over the socket, -1 otherwise
  *
- * Lists all files with server's managed extension
- * Recursively scans subdirectories when requested
- * Returns sorted list of filenames with extensions
- * Handles permission errors gracefully
+ * Only matching lines travel back, so searching the corpus costs far
+ * less than downloading it.
+ *
+ * @details Protocol 'F' - Find:
+ *   1. S1 → Storage: 'F' + path_len + path + regex (char) + pattern_len + pattern +
+ *      root_len + root (tenant storage root, "" for the default namespace)
+ *   2. Storage → S1: status (1), then per matching line: path_len + path (below the root) +
+ *      line_no + text_len + text, then end marker (int: -1 done, -2 cut at
+ *      GREP_MAX_MATCHES) + files scanned + bytes scanned;
+ *      or status (-1) + msg_len + msg
  */
-void handle_listing(int sock) {
+int handle_grep(int sock) {
     // Request receive from server S1
-    printf("======Processing listing of txt files======\n");
+    printf("======Processing text search======\n");
 
-    // Step 1: Receive path length and path
-    int path_len = 0;
-    if (recv(sock, &path_len, sizeof(int), 0) <= 0 || path_len <= 0 || path_len >= 1024) {
-        perror("Failed to receive path length or invalid length");
-        long status = 0;
-        send(sock, &status, sizeof(long), 0);
-        return;
+    long status = -1;
+    int path_len, pattern_len;
+    char filepath[MAX_PATH_LEN], tenant[MAX_PATH_LEN], use_regex;
+    GrepJob *job = calloc(1, sizeof(GrepJob));
+    const char *err_msg = NULL;
+    char regex_err[BUFFER_SIZE];
+    if (!job) {
+        err_msg = "EOut of memory";
+    } else if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 ||
+               path_len >= MAX_PATH_LEN || recv(sock, filepath, path_len, MSG_WAITALL) != path_len ||
+               recv(sock, &use_regex, 1, MSG_WAITALL) != 1 ||
+               recv(sock, &pattern_len, sizeof(int), MSG_WAITALL) != sizeof(int) || pattern_len <= 0 ||
+               pattern_len >= GREP_MAX_PATTERN || recv(sock, job->pattern, pattern_len, MSG_WAITALL) != pattern_len ||
+               recv_tenant_root(sock, tenant) < 0) {
+        err_msg = "EInvalid search request";
+    } else {
+        filepath[path_len] = '\0';
+        job->pattern[pattern_len] = '\0';
+        job->pattern_len = pattern_len;
+        if (strncmp(filepath, "~S1", 3) != 0 || (filepath[3] != '\0' && filepath[3] != '/') || strstr(filepath, ".."))
+            err_msg = "EPath must be in format: ~S1/...";
     }
-
-    char pathname[1024] = {0};
-    if (recv(sock, pathname, path_len, 0) <= 0) {
-        perror("Failed to receive pathname");
-        long status = 0;
+    if (!err_msg && use_regex) {
+        int rc = regcomp(&job->re, job->pattern, REG_EXTENDED | REG_NEWLINE);
+        if (rc != 0) {
+            regex_err[0] = 'E';
+            regerror(rc, &job->re, regex_err + 1, sizeof(regex_err) - 1);
+            err_msg = regex_err;
+        } else {
+            job->use_regex = 1;
+        }
+    }
+    if (err_msg) {
         send(sock, &status, sizeof(long), 0);
-        return;
+        int msg_len = strlen(err_msg);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        free(job);
+        return -1;
     }
-    pathname[path_len] = '\0';
-    printf("Received pathname: %s\n", pathname);
+    pthread_mutex_init(&job->send_lock, NULL);
 
-    // Step 2: Convert ~S3/... to actual home directory path
-    const char *home = getenv("HOME");
-    if (!home) {
-        perror("HOME not set");
-        long status = 0;
-        send(sock, &status, sizeof(long), 0);
-        return;
+    // Collect the files now; the scan itself runs in the background
+    char root[MAX_PATH_LEN], local_path[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/S3", getenv("HOME"));
+    snprintf(local_path, sizeof(local_path), "%s%s", root, filepath + 3);
+    job->root_len = strlen(root) + strlen(tenant);
+    grep_skip_dir[0] = '\0';
+    if (!tenant[0]) snprintf(grep_skip_dir, sizeof(grep_skip_dir), "%s/%s", root, TENANT_DIR);
+    grep_collecting = job;
+    nftw(local_path, grep_collect_file, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+    printf("Searching %d file(s) below %s for \"%s\"%s\n", job->file_count, filepath, job->pattern,
+           job->use_regex ? " (regex)" : "");
+
+    job->sock = sock;
+    status = 1;
+    send(sock, &status, sizeof(long), 0);
+
+    pthread_t runner;
+    if (pthread_create(&runner, NULL, grep_job_thread, job) != 0) {
+        perror("grep thread");
+        grep_job_free(job);
+        return -1;
     }
+    pthread_detach(runner);
+    return 0;
+}
 
-    if (strncmp(pathname, "~S3", 3) != 0) {
-        fprintf(stderr, "Invalid path prefix\n");
-        long status = 0;
-        send(sock, &status, sizeof(long), 0);
+/**
+ * @brief Query terms, looked up while the query is split
+ */
+typedef struct {
+    IndexTerm *terms[INDEX_MAX_QUERY_TERMS];
+    int count;
+    int missing;    /**< A word is in no file: nothing can match */
+    int too_many;
+} IndexQuery;
+
+static void index_query_word(const char *word, size_t n, void *arg) {
+    IndexQuery *q = arg;
+    IndexTerm *t = index_term(word, n, 0);
+    if (!t) {
+        q->missing = 1;
         return;
     }
+    for (int i = 0; i < q->count; i++)
+        if (q->terms[i] == t) return;
+    if (q->count == INDEX_MAX_QUERY_TERMS) q->too_many = 1;
+    else q->terms[q->count++] = t;
+}
 
-    // Skip "~S3" and add the relative path after it
-    char full_path[1024];
-    snprintf(full_path, sizeof(full_path), "%s/S3%s", home, pathname + 3);
-    printf("Searching in directory: %s\n", full_path);
+static int compare_term_sizes(const void *a, const void *b) {
+    const IndexTerm *x = *(IndexTerm *const *)a, *y = *(IndexTerm *const *)b;
+    unsigned int nx = x->count + x->npending, ny = y->count + y->npending;
+    return nx < ny ? -1 : nx > ny;
+}
 
-    // Step 3: Run `find` command to list .pdf files
-    char command[1024];
-    snprintf(command, sizeof(command), "find %s -maxdepth 1 -type f -name \"*.txt\"", full_path);
-    printf("Executing: %s\n", command);
+/**
+ * @brief Answers a keyword search from the index for S1
+ * @param sock The connection socket from S1
+ *
+ * Finds the files below a path containing every word of the query. The
+ * rarest word's list is decoded and each of its files is checked in the
+ * other lists by a skip lookup, so the cost depends on how many files
+ * hold the rarest word, not on the size of the corpus. Newest files come
+ * first; at most INDEX_MAX_RESULTS paths are returned with the total.
+ *
+ * @details Protocol 'K' - Keyword search:
+ *   1. S1 → S3: 'K' + path_len + path + query_len + query + root_len + root
+ *      (tenant storage root, "" for the default namespace)
+ *   2. S3 → S1: status (1) + total matches + search time (microseconds) +
+ *      count + count x (path_len + path, below the root); or status (-1) +
+ *      msg_len + msg
+ */
+void handle_search(int sock) {
+    // Request receive from server S1
+    printf("======Processing keyword search======\n");
 
-    FILE *fp = popen(command, "r");
-    if (!fp) {
-        perror("Failed to run find");
-        long status = 0;
-        send(sock, &status, sizeof(long), 0);
+    int path_len, query_len;
+    char filepath[MAX_PATH_LEN], query[BUFFER_SIZE], tenant[MAX_PATH_LEN];
+    if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 || path_len >= MAX_PATH_LEN ||
+        recv(sock, filepath, path_len, MSG_WAITALL) != path_len ||
+        recv(sock, &query_len, sizeof(int), MSG_WAITALL) != sizeof(int) || query_len <= 0 ||
+        query_len >= BUFFER_SIZE || recv(sock, query, query_len, MSG_WAITALL) != query_len ||
+        recv_tenant_root(sock, tenant) < 0) {
+        perror("Failed to receive search request");
         return;
     }
+    filepath[path_len] = '\0';
+    query[query_len] = '\0';
 
-    char **files = NULL;
+    const char *err_msg = NULL;
+    if (strncmp(filepath, "~S1", 3) != 0 || (filepath[3] != '\0' && filepath[3] != '/') || strstr(filepath, ".."))
+        err_msg = "EPath must be in format: ~S1/...";
+
+    // Files must lie below this path ("" for all)
+    const char *prefix = filepath + 3;
+    size_t prefix_len = strlen(prefix);
+    while (prefix_len > 0 && prefix[prefix_len - 1] == '/') prefix_len--;
+
+    struct timespec start, done;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char **paths = malloc(INDEX_MAX_RESULTS * sizeof(char *));
+    long total = 0;
     int count = 0;
-    char line[1024];
+    IndexQuery q = {0};
 
-    while (fgets(line, sizeof(line), fp)) {
-        char *newline = strchr(line, '\n');
-        if (newline) *newline = '\0';
+    pthread_mutex_lock(&index_lock);
+    if (!err_msg) {
+        index_words(query, query_len, index_query_word, &q);
+        if (q.too_many)
+            err_msg = "ENo more than 8 words per search";
+        else if (q.count == 0 && !q.missing)
+            err_msg = "ENo searchable words (two or more letters or digits) in the query";
+        else if (!paths)
+            err_msg = "EOut of memory";
+    }
+    if (!err_msg && !q.missing) {
+        qsort(q.terms, q.count, sizeof(IndexTerm *), compare_term_sizes);
+        IndexTerm *rarest = q.terms[0];
+        unsigned int *ids = malloc((size_t)(rarest->count + rarest->npending + 1) * sizeof(unsigned int));
+        unsigned int n = ids ? posting_decode(rarest, ids) : 0;
+        while (n-- > 0) {
+            const char *doc_path = index_docs[ids[n]];
+            if (!doc_path || strncmp(doc_path, prefix, prefix_len) != 0 ||
+                (doc_path[prefix_len] != '/' && doc_path[prefix_len] != '\0'))
+                continue;
 
-        char *slash = strrchr(line, '/');
-        if (slash) {
-            files = realloc(files, (count + 1) * sizeof(char *));
-            files[count++] = strdup(slash + 1);
+            // The default namespace does not reach into the tenants' roots
+            if (!tenant[0] && strncmp(doc_path, "/" TENANT_DIR "/", strlen(TENANT_DIR) + 2) == 0)
+                continue;
+            int all = 1;
+            for (int i = 1; i < q.count && all; i++)
+                all = posting_contains(q.terms[i], ids[n]);
+            if (!all) continue;
+            if (count < INDEX_MAX_RESULTS && (paths[count] = strdup(doc_path))) count++;
+            total++;
         }
+        free(ids);
     }
-    pclose(fp);
+    pthread_mutex_unlock(&index_lock);
+    clock_gettime(CLOCK_MONOTONIC, &done);
 
-    // Step 4: Send results back to S1
-    long status = (count > 0) ? 1 : 0;
+    long status = err_msg ? -1 : 1;
     send(sock, &status, sizeof(long), 0);
-
-    if (status == 0) {
-        printf("No .txt files found.\n\n");
-        return;
-    }
-
-    send(sock, &count, sizeof(int), 0);
-    for (int i = 0; i < count; i++) {
-        int len = strlen(files[i]);
-        send(sock, &len, sizeof(int), 0);
-        send(sock, files[i], len, 0);
-        printf("Sent file: %s\n", files[i]);
-        free(files[i]);
+    if (err_msg) {
+        int msg_len = strlen(err_msg);
+        send(sock, &msg_len, sizeof(int), 0);
+        send(sock, err_msg, msg_len, 0);
+        printf("%s\n", err_msg);
+    } else {
+        long micros = (done.tv_sec - start.tv_sec) * 1000000L + (done.tv_nsec - start.tv_nsec) / 1000;
+        send(sock, &total, sizeof(long), 0);
+        send(sock, &micros, sizeof(long), 0);
+        send(sock, &count, sizeof(int), 0);
+        for (int i = 0; i < count; i++) {
+            char client_path[MAX_PATH_LEN + 4];
+            int len = snprintf(client_path, sizeof(client_path), "~S1%s", paths[i] + strlen(tenant));
+            send(sock, &len, sizeof(int), 0);
+            send(sock, client_path, len, 0);
+        }
+        printf("\"%s\" below %s: %ld file(s) in %ld us\n", query, filepath, total, micros);
     }
-
-    free(files);
-    printf("Completed sending list to S1.\n\n");
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
 }
 
-
 /**
  * @brief Main entry point for S3 server in W25 Distributed Filesystem
  * 
@@ -545,6 +5201,7 @@ void handle_listing(int sock) {
  *          - 'R' Remove files from server
  *          - 'T' Create and send tar bundles
  *          - 'L' List available files
+ *          - 'F' Search the stored text files
  * 
  * @note The server runs indefinitely until manually terminated
  * @warning Uses SO_REUSEADDR|SO_REUSEPORT to allow quick socket recycling
@@ -584,11 +5241,61 @@ int main() {
     }
 
     // Listen
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
+    // Namespace usage counters, reported to S1 on request
+    if (init_usage_table() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Change events, streamed to watchers
+    if (init_event_log() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Keyword index, kept up to date by every change
+    if (init_index() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify stored files in the background
+    pthread_t scrubber;
+    if (pthread_create(&scrubber, NULL, scrub_thread, NULL) == 0)
+        pthread_detach(scrubber);
+    else
+        perror("scrubber thread");
+
+    // Enforce the version retention policy in the background
+    pthread_t pruner;
+    if (pthread_create(&pruner, NULL, prune_thread, NULL) == 0)
+        pthread_detach(pruner);
+    else
+        perror("pruner thread");
+
+    // Delete TTL uploads once they expire
+    pthread_t expirer;
+    if (pthread_create(&expirer, NULL, expire_thread, NULL) == 0)
+        pthread_detach(expirer);
+    else
+        perror("expirer thread");
+
+    // Purge the trash once the retention window has passed
+    pthread_t reaper;
+    if (pthread_create(&reaper, NULL, reap_thread, NULL) == 0)
+        pthread_detach(reaper);
+    else
+        perror("reaper thread");
+
+    // Compact the keyword index once its journal grows
+    pthread_t indexer;
+    if (pthread_create(&indexer, NULL, index_thread, NULL) == 0)
+        pthread_detach(indexer);
+    else
+        perror("indexer thread");
+
     printf("\n==============================================\n");
     printf("🚀  S3 Server is UP and listening on port %d\n", PORT_S3);
     printf("==============================================\n\n");
@@ -600,26 +5307,86 @@ int main() {
             continue;
         }
 
-        // Get command type
-        char command_type;
+        // Get command type. Clients may only present tickets ('J'); any
+        // other command must follow S1's preamble ('K')
+        char command_type = 0;
         recv(new_socket, &command_type, 1, 0);
+        if (command_type == 'K') {
+            if (check_s1_auth(new_socket) < 0 || recv(new_socket, &command_type, 1, 0) != 1) {
+                printf("Refused a connection with an invalid S1 preamble\n");
+                close(new_socket);
+                continue;
+            }
+        } else if (command_type != 'J') {
+            printf("Refused command '%c' without S1's preamble\n", command_type);
+            close(new_socket);
+            continue;
+        }
 
         switch (command_type) {
+            case 'F': // Text search (a background job keeps the socket)
+                if (handle_grep(new_socket) == 0) continue;
+                break;
+            case 'W': // Watch changes (a watcher thread keeps the socket)
+                if (handle_watch(new_socket) == 0) continue;
+                break;
             case 'U': // Upload
                 handle_upload(new_socket);
                 break;
             case 'D': // Download
-                handle_download(new_socket);
+                handle_download(new_socket, 0);
+                break;
+            case 'G': // Download a prior version
+                handle_download(new_socket, 1);
                 break;
             case 'R': // Remove
                 handle_remove(new_socket);
                 break;
             case 'T': // Tar
-                handle_downloadtar(new_socket);
+                handle_downloadtar(new_socket, 'T');
+                break;
+            case 'E': // Tar member index
+                handle_downloadtar(new_socket, 'E');
+                break;
+            case 'B': // Byte range of a tar
+                handle_downloadtar(new_socket, 'B');
                 break;
             case 'L': // List
                 handle_listing(new_socket);
                 break;
+            case 'S': // Stat
+                handle_stat(new_socket);
+                break;
+            case 'Q': // Usage
+                handle_usage(new_socket);
+                break;
+            case 'I': // Scrubber statistics
+                handle_info(new_socket);
+                break;
+            case 'V': // Version listing
+                handle_versions(new_socket);
+                break;
+            case 'N': // Undelete
+                handle_undelete(new_socket);
+                break;
+            case 'A': // Append
+                handle_append(new_socket);
+                break;
+            case 'P': // Write in place
+                handle_write(new_socket);
+                break;
+            case 'J': // Transfer redirected by S1
+                handle_ticket(new_socket);
+                break;
+            case 'H': // Upload preflight
+                handle_preflight(new_socket);
+                break;
+            case 'C': // Chunked upload
+                handle_chunked_upload(new_socket);
+                break;
+            case 'K': // Keyword search
+                handle_search(new_socket);
+                break;
             default:
                 printf("Unknown command type\n");
         }
@@ -5,35 +5,66 @@
  * ------------
  * This client connects to the main server (S1) and allows users to interact with
  * the distributed file system using custom commands:
- *   - uploadf: Upload files to distributed storage
- *   - downlf: Download files from server
- *   - removef: Delete file on server
+ *   - uploadf: Upload files to distributed storage, optionally with a TTL
+ *   - downlf: Download files (or a prior version) from server
+ *   - removef: Delete file on server (recoverable with undelf for a while)
  *   - downltar: Downloads .tar archive of all files of given type
  *   - dispfnames: Lists all files in directory
+ *   - statf: Shows existence, size, mtime and content hash of files
+ *   - stats: Shows integrity scrubber results of every server
+ *   - versions: Lists the stored versions of a file
+ *   - undelf: Restores a removed file
+ *   - watchf: Follows changes below a path as they happen
+ *   - zipls: Lists the members of a stored zip archive
+ *   - grepf: Searches stored .txt files on the server
+ *   - appendf: Appends a local file's bytes to a stored .txt file
+ *   - writef: Overwrites a range of a stored file in place
+ *   - searchf: Finds the stored .txt files containing given words
+ *   - symf: Finds where a C function, type or macro is defined
+ *   - login: Works in a tenant's own namespace from then on
  *
  * Key Behaviors:
  * --------------
  * - Sends user commands to S1.
- * - Receives responses and file data from S1.
+ * - Receives responses and file data from S1, or from the storage server
+ *   S1 redirects an uploadf/downlf --direct to (S1 holding the file itself
+ *   simply serves it).
  * - Validates filename formats (e.g. no paths for uploadf).
  * - Displays appropriate messages for success/error scenarios.
  *
  * Usage:
  * ------
  * Compile: gcc w25clients.c -o w25clients
- * Run:     ./w25clients 
+ * Run:     ./w25clients [host] [port]
  * 
- * Port: Always connects to S1 on localhost:6071 (can be changed via macro)
+ * Port: Connects to S1 on localhost:6071 unless a host (e.g. a load balancer
+ *       in front of S1 gateways) and port are given
  * 
  * Supported Client Commands:
  * --------------------------
  * 
- * 1. uploadf <filename> <destination_path>
+ * 1. uploadf [--direct|--chunked] <filename> <destination_path> [ttl]
  *    - Example: uploadf report.pdf ~S1/docs/
+ *    - Example: uploadf build.zip ~S1/tmp/ 2d (deleted after two days;
+ *      the TTL is in seconds or takes an s, m, h or d suffix)
+ *    - Example: uploadf --direct big.zip ~S1/tmp/ (S1 approves the upload,
+ *      the data goes straight to the storage server holding .zip files)
+ *    - The file's SHA-256 is sent first: when the destination or another
+ *      file in the same namespace already has that content, no data is
+ *      transferred
+ *    - Example: uploadf --chunked build.zip ~S1/builds/ (the file is cut
+ *      into content-defined chunks; only chunks the storage server does
+ *      not hold yet, e.g. the changed members of a rebuilt zip, are sent)
  *    - Supported extensions: .c, .pdf, .txt, .zip
  * 
- * 2. downlf <filepath>
+ * 2. downlf [--direct] [--version N] <filepath>
+ *    downlf --member <name> [--raw] <zip filepath>
  *    - Example: downlf ~S1/project/source.c
+ *    - Example: downlf --version 3 ~S1/project/source.c (see versions)
+ *    - Example: downlf --direct ~S1/docs/report.pdf (the file comes from
+ *      the storage server itself, with a ticket from S1)
+ *    - Example: downlf --member src/main.c ~S1/backup/all.zip (only that
+ *      member is transferred; --raw keeps it compressed as stored)
  * 
  * 3. removef <filepath>
  *    - Example: removef ~S1/old/notes.txt
@@ -42,12 +73,81 @@
  *    - Example: downltar .pdf → downloads pdffiles.tar
  *    - Supported types: .c, .pdf, .txt (excludes .zip)
  *    - Filename: cfiles.tar for c, pdf.tar for pdf, txt.tar for txt
+ *    downltar --index <filetype>
+ *    downltar --member <name> <filetype>
+ *    - Example: downltar --index .pdf → pdf.tar and its member index pdf.tar.idx
+ *    - Example: downltar --member docs/report.pdf .pdf → only report.pdf,
+ *      read as a byte range of the archive using pdf.tar.idx
  * 
  * 5. dispfnames <directory>
  *    - Example: dispfnames ~S1/project/
  *    - Output format: alphabetized by extension (.c → .pdf → .txt → .zip)
  * 
- * 6. exit
+ * 6. statf <filepath> [filepath ...]
+ *    - Example: statf ~S1/project/source.c ~S1/docs/report.pdf
+ *    - Metadata only: no file data is transferred
+ *    - Hash is the XXH64 recorded at upload ("unknown" if not cached)
+ * 
+ * 7. stats
+ *    - Per server: scrub passes, files and bytes verified, files without a
+ *      recorded hash, and hash mismatches (silent corruption) found
+ * 
+ * 8. versions <filepath>
+ *    - Example: versions ~S1/project/source.c
+ *    - Lists the live file and the prior versions kept by overwrites
+ * 
+ * 9. undelf <filepath>
+ *    - Example: undelf ~S1/old/notes.txt
+ *    - Restores the most recently removed file at that path
+ *    - Removed files are kept for 72 hours; supported: .c, .pdf, .txt
+ * 
+ * 10. watchf <path> [cursor]
+ *    - Example: watchf ~S1/project
+ *    - Example: watchf ~S1/project 42:7:0:3 (resume after a reconnect)
+ *    - Prints files added, modified and deleted below the path as it
+ *      happens, each with the cursor to resume from; runs until Ctrl-C
+ * 
+ * 11. zipls <zip filepath>
+ *    - Example: zipls ~S1/backup/all.zip
+ *    - Lists the members of a stored zip without downloading it
+ * 
+ * 12. grepf [-E] <pattern> <path>
+ *    - Example: grepf timeout ~S1/logs
+ *    - Example: grepf -E "^ERROR .*disk" ~S1/logs (POSIX extended regex)
+ *    - Searches the stored .txt files below the path on the server and
+ *      prints only the matching lines, as path:line: text
+ * 
+ * 13. appendf <local file> <filepath> [seq]
+ *    - Example: appendf new_lines.txt ~S1/logs/app.txt
+ *    - Example: appendf batch42.txt ~S1/logs/app.txt 42 (retrying with the
+ *      same sequence number never appends twice)
+ *    - Only the local file's bytes are sent (at most 1 MB); .txt only
+ * 
+ * 14. writef <filepath> <offset> <local file> [version]
+ *    - Example: writef ~S1/docs/report.pdf 4096 patch.bin
+ *    - Example: writef ~S1/docs/report.pdf 4096 patch.bin 3 (only if the
+ *      file is still at version 3, as shown by versions)
+ *    - Writes the local file's bytes (at most 1 MB) at the offset; the
+ *      rest of the stored file is left as it is
+ * 
+ * 15. searchf <word> [word ...] <path>
+ *    - Example: searchf disk timeout ~S1/logs
+ *    - Lists the stored .txt files below the path that contain every
+ *      word (case-insensitive), newest first, from the server's index
+ * 
+ * 16. symf <name> [path]
+ *    - Example: symf handle_upload_request
+ *    - Example: symf usage_* ~S1/src (every name starting with usage_)
+ *    - Lists the functions, prototypes, struct/union/enum tags, typedefs
+ *      and macros of that name in the stored .c files, with file and line
+ * 
+ * 17. login <tenant> <secret>
+ *    - Example: login acme s3cr3t
+ *    - From then on ~S1 is the tenant's own namespace: other tenants'
+ *      files cannot be seen or reached, and the tenant's sessions and
+ *      transfers are limited separately from everyone else's
+ * 
+ * 18. exit
  *    - Terminates client session
  * 
  * Path Specifications:
@@ -69,24 +169,532 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <time.h>
 #include <asm-generic/socket.h>
 
 
 #define PORT_S1 6071
 #define BUFFER_SIZE 1024
+#define TRANSFER_CHUNK (64 * 1024)  // Chunk size used to stream uploads
+#define STAT_MAX_PATHS 64           // Paths accepted by one statf command
+#define MAX_PATH_LEN 1024
+#define TICKET_MAX_LEN 2048         // Longest redirect ticket S1 hands out
+#define CHUNK_MIN_SIZE 2048         // Smallest chunk cut by uploadf --chunked (except the last)
+#define CHUNK_AVG_SIZE 8192         // Chunk size the cut masks aim for
+#define CHUNK_MAX_SIZE TRANSFER_CHUNK   // Largest chunk (the storage servers' limit)
+#define CHUNK_MASK_HARD (~0ULL << 49)   // Cut mask before CHUNK_AVG_SIZE (15 bits)
+#define CHUNK_MASK_EASY (~0ULL << 53)   // Cut mask after CHUNK_AVG_SIZE (11 bits)
+#define CHUNK_MAX_COUNT (1 << 20)   // Most chunks S1 accepts in one upload
+#define CONTENT_PROOF_LEN 32        // SHA-256 proving the content of an upload
+
+// Host S1 was reached on, also used for storage servers that run next to it
+const char *s1_host = "127.0.0.1";
+
+/**
+ * @brief Streaming state of the XXH64 content hash
+ *
+ * XXH64 processes 32-byte stripes in four independent lanes, so it hashes
+ * at memory speed while the data streams through the transfer buffer.
+ */
+typedef struct {
+    unsigned long long total_len;   /**< Bytes hashed so far */
+    unsigned long long v[4];        /**< Lane accumulators */
+    unsigned char mem[32];          /**< Partial stripe carried between updates */
+    unsigned int memsize;           /**< Bytes in mem */
+} HashState;
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static unsigned long long xxh_rotl(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long xxh_read64(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned long long xxh_round(unsigned long long acc, unsigned long long input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static unsigned long long xxh_merge(unsigned long long acc, unsigned long long val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * @brief Starts a new hash computation (seed 0)
+ * @param state Hash state to initialise
+ */
+void hash_init(HashState *state) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME64_1;
+}
+
+/**
+ * @brief Feeds data into a running hash
+ * @param state Hash state
+ * @param data Bytes to hash
+ * @param len Number of bytes
+ */
+void hash_update(HashState *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    state->total_len += len;
+
+    if (state->memsize + len < 32) {
+        memcpy(state->mem + state->memsize, p, len);
+        state->memsize += len;
+        return;
+    }
+
+    // Complete the stripe left over from the previous update
+    if (state->memsize) {
+        size_t fill = 32 - state->memsize;
+        memcpy(state->mem + state->memsize, p, fill);
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh_round(state->v[i], xxh_read64(state->mem + 8 * i));
+        p += fill;
+        state->memsize = 0;
+    }
+
+    while (p + 32 <= end) {
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh_round(state->v[i], xxh_read64(p + 8 * i));
+        p += 32;
+    }
+
+    if (p < end) {
+        memcpy(state->mem, p, end - p);
+        state->memsize = end - p;
+    }
+}
+
+/**
+ * @brief Returns the digest of everything fed so far
+ * @param state Hash state (not modified)
+ * @return 64-bit XXH64 digest
+ */
+unsigned long long hash_final(const HashState *state) {
+    unsigned long long h;
+    if (state->total_len >= 32) {
+        h = xxh_rotl(state->v[0], 1) + xxh_rotl(state->v[1], 7) +
+            xxh_rotl(state->v[2], 12) + xxh_rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh_merge(h, state->v[i]);
+    } else {
+        h = state->v[2] + XXH_PRIME64_5;
+    }
+    h += state->total_len;
+
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->memsize;
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        unsigned int k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (unsigned long long)k * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * @brief Streaming state of SHA-256 (FIPS 180-4), used to prove upload content
+ */
+typedef struct {
+    unsigned int h[8];              /**< Chaining value */
+    unsigned char block[64];        /**< Partial block carried between updates */
+    unsigned long long total_len;   /**< Bytes hashed so far */
+} Sha256State;
+
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static unsigned int sha256_rotr(unsigned int x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(unsigned int *h, const unsigned char *p) {
+    unsigned int w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (unsigned int)p[4 * i] << 24 | (unsigned int)p[4 * i + 1] << 16 |
+               (unsigned int)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        unsigned int s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        unsigned int t1 = k + (sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25)) +
+                          ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        unsigned int t2 = (sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+void sha256_init(Sha256State *state) {
+    static const unsigned int iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(state->h, iv, sizeof(iv));
+    state->total_len = 0;
+}
+
+void sha256_update(Sha256State *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t used = state->total_len % 64;
+    state->total_len += len;
+    if (used > 0) {
+        size_t fill = 64 - used < len ? 64 - used : len;
+        memcpy(state->block + used, p, fill);
+        p += fill;
+        len -= fill;
+        if (used + fill < 64) return;
+        sha256_block(state->h, state->block);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(state->h, p);
+    memcpy(state->block, p, len);
+}
+
+void sha256_final(Sha256State *state, unsigned char *digest) {
+    unsigned long long bits = state->total_len * 8;
+    unsigned char pad[72] = {0x80};
+    size_t used = state->total_len % 64;
+    size_t pad_len = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    sha256_update(state, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = state->h[i] >> 24;
+        digest[4 * i + 1] = state->h[i] >> 16;
+        digest[4 * i + 2] = state->h[i] >> 8;
+        digest[4 * i + 3] = state->h[i];
+    }
+}
+
+/**
+ * @brief Hashes a local file the way the servers hash stored files
+ * @param fp Open file, rewound afterwards
+ * @param buffer Scratch buffer of TRANSFER_CHUNK bytes
+ * @param proof Receives the SHA-256 of the contents
+ * @return XXH64 of the contents
+ */
+unsigned long long hash_file(FILE *fp, char *buffer, unsigned char *proof) {
+    HashState hs;
+    hash_init(&hs);
+    Sha256State proof_state;
+    sha256_init(&proof_state);
+    size_t n;
+    while ((n = fread(buffer, 1, TRANSFER_CHUNK, fp)) > 0) {
+        hash_update(&hs, buffer, n);
+        sha256_update(&proof_state, buffer, n);
+    }
+    rewind(fp);
+    sha256_final(&proof_state, proof);
+    return hash_final(&hs);
+}
+
+/**
+ * @brief Reads a status, printing the error message that follows a -1
+ * @param sock Connected socket to S1 or a storage server
+ * @return The status, or -1 if the connection failed
+ */
+long read_status(int sock) {
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Connection error\n");
+        return -1;
+    }
+    if (status == -1) {
+        int msg_len;
+        char error_msg[BUFFER_SIZE];
+        if (recv(sock, &msg_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+            msg_len <= 0 || msg_len >= BUFFER_SIZE ||
+            recv(sock, error_msg, msg_len, MSG_WAITALL) != msg_len) {
+            printf("Connection error\n");
+            return -1;
+        }
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("Server response: %s\n", error_msg + 1);
+    }
+    return status;
+}
+
+/**
+ * @brief Connects to the storage server named in a redirect reply
+ * @param sock The connected socket to S1, just after status 2
+ * @return Socket to the storage server with the ticket presented, or -1
+ *
+ * Reads port + host_len + host + ticket_len + ticket. A loopback host
+ * means the storage servers run next to S1, so the S1 host is used.
+ */
+int open_redirect(int sock) {
+    int port, host_len, ticket_len;
+    char host[64];
+    char ticket[TICKET_MAX_LEN];
+    if (recv(sock, &port, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+        recv(sock, &host_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+        host_len <= 0 || host_len >= (int)sizeof(host) ||
+        recv(sock, host, host_len, MSG_WAITALL) != host_len ||
+        recv(sock, &ticket_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+        ticket_len <= 0 || ticket_len > TICKET_MAX_LEN ||
+        recv(sock, ticket, ticket_len, MSG_WAITALL) != ticket_len) {
+        printf("Connection error\n");
+        return -1;
+    }
+    host[host_len] = '\0';
+    if (strncmp(host, "127.", 4) == 0)
+        snprintf(host, sizeof(host), "%s", s1_host);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    int data_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (data_sock < 0 || inet_pton(AF_INET, host, &addr.sin_addr) <= 0 ||
+        connect(data_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Connection to storage server failed");
+        if (data_sock >= 0) close(data_sock);
+        return -1;
+    }
+
+    char command_type = 'J';
+    send(data_sock, &command_type, 1, 0);
+    send(data_sock, &ticket_len, sizeof(int), 0);
+    send(data_sock, ticket, ticket_len, 0);
+    return data_sock;
+}
+
+/**
+ * @brief Streams a local file to a socket in chunks
+ * @param sock Destination socket
+ * @param fp Open file, positioned at the start
+ * @param filesize Number of bytes to send
+ * @return Number of bytes sent
+ *
+ * Never loads the whole file into memory; a peer that hangs up early
+ * ends the transfer instead of killing the client with SIGPIPE.
+ */
+long send_file_stream(int sock, FILE *fp, long filesize) {
+    char *buffer = malloc(TRANSFER_CHUNK);
+    long total_sent = 0;
+    while (buffer && total_sent < filesize) {
+        size_t n = fread(buffer, 1, TRANSFER_CHUNK, fp);
+        if (n == 0) break;
+        size_t written = 0;
+        while (written < n) {
+            int chunk = send(sock, buffer + written, n - written, MSG_NOSIGNAL);
+            if (chunk <= 0) break;
+            written += chunk;
+        }
+        if (written < n) break;
+        total_sent += n;
+    }
+    free(buffer);
+    return total_sent;
+}
+
+/**
+ * @brief One entry of a chunked upload's recipe (same layout on S1 and S2-S5)
+ */
+typedef struct {
+    unsigned long long hash;    /**< XXH64 of the chunk */
+    long len;                   /**< Chunk length in bytes */
+} ChunkRef;
+
+// Gear table of the chunker; fixed, so every client cuts the same data alike
+static unsigned long long gear[256];
+
+/**
+ * @brief Fills the gear table from a fixed seed (splitmix64)
+ */
+void gear_init(void) {
+    unsigned long long x = 0x7732356364633031ULL;
+    for (int i = 0; i < 256; i++) {
+        unsigned long long z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * @brief Finds the end of the next content-defined chunk (FastCDC)
+ * @param data Bytes from the start of the chunk
+ * @param n Bytes left in the file
+ * @return Length of the chunk
+ *
+ * A gear rolling hash over the bytes past CHUNK_MIN_SIZE cuts where its
+ * top bits are all zero. A stricter mask before CHUNK_AVG_SIZE and a
+ * looser one after it keep chunks close to the average. Cuts depend only
+ * on nearby bytes, so an edit changes the chunks around it and the rest
+ * of the file keeps its chunk hashes.
+ */
+long chunk_cut(const unsigned char *data, long n) {
+    if (n <= CHUNK_MIN_SIZE) return n;
+    long avg = n < CHUNK_AVG_SIZE ? n : CHUNK_AVG_SIZE;
+    long max = n < CHUNK_MAX_SIZE ? n : CHUNK_MAX_SIZE;
+    unsigned long long fp = 0;
+    long i = CHUNK_MIN_SIZE;
+    for (; i < avg; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & CHUNK_MASK_HARD)) return i + 1;
+    }
+    for (; i < max; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & CHUNK_MASK_EASY)) return i + 1;
+    }
+    return max;
+}
+
+/**
+ * @brief Splits a file into content-defined chunks and hashes it
+ * @param data The mapped file
+ * @param size File size (at least 1)
+ * @param refs Receives the recipe, freed by the caller
+ * @param hash Receives XXH64 of the whole file
+ * @param proof Receives SHA-256 of the whole file
+ * @return Number of chunks, or -1 if out of memory
+ */
+int chunk_file(const unsigned char *data, long size, ChunkRef **refs, unsigned long long *hash,
+               unsigned char *proof) {
+    *refs = malloc((size / CHUNK_MIN_SIZE + 1) * sizeof(ChunkRef));
+    if (!*refs) return -1;
+
+    HashState hs;
+    hash_init(&hs);
+    hash_update(&hs, data, size);
+    *hash = hash_final(&hs);
+    Sha256State proof_state;
+    sha256_init(&proof_state);
+    sha256_update(&proof_state, data, size);
+    sha256_final(&proof_state, proof);
+
+    int count = 0;
+    for (long off = 0; off < size; count++) {
+        long len = chunk_cut(data + off, size - off);
+        hash_init(&hs);
+        hash_update(&hs, data + off, len);
+        (*refs)[count].hash = hash_final(&hs);
+        (*refs)[count].len = len;
+        off += len;
+    }
+    return count;
+}
+
+/**
+ * @brief Sends len bytes, stopping if the peer hangs up
+ * @return 0 when everything was sent, -1 otherwise
+ */
+int send_all(int sock, const void *data, long len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends the recipe of a chunked upload and the chunks the server lacks
+ * @param sock The connected socket to S1, just after status 4
+ * @param data The mapped file
+ * @param refs The recipe
+ * @param count Chunks in the recipe
+ *
+ * S1 answers the recipe with the number of bytes missing (-1 if the
+ * upload is refused) and one need flag per chunk; only flagged chunks
+ * are sent. The final response follows either way.
+ */
+void send_chunks(int sock, const unsigned char *data, const ChunkRef *refs, int count) {
+    long missing = -1;
+    unsigned char *need = malloc(count);
+    if (!need || send_all(sock, refs, (long)count * sizeof(ChunkRef)) < 0 ||
+        recv(sock, &missing, sizeof(long), MSG_WAITALL) != sizeof(long) || missing < 0 ||
+        recv(sock, need, count, MSG_WAITALL) != count) {
+        free(need);
+        return;
+    }
+
+    long offset = 0, sent = 0;
+    int sent_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (need[i]) {
+            if (send_all(sock, data + offset, refs[i].len) < 0) break;
+            sent += refs[i].len;
+            sent_count++;
+        }
+        offset += refs[i].len;
+    }
+    free(need);
+    printf("Sent %d of %d chunks (%ld of %ld bytes)\n", sent_count, count, sent, offset);
+}
 
 /**
  * @brief Uploads a file to the server
  * @param sock The connected socket to S1 
  * @param filename Local file to upload
  * @param dest_path Destination path on server (~S1/...)
+ * @param ttl Seconds until the file expires, 0 to keep it indefinitely
+ * @param direct Ask S1 for a ticket and send the data to the storage server
+ * @param chunked Send a chunk recipe, then only the chunks the storage
+ *        server does not hold yet
  *
  * Validates file existence locally
- * Sends file with size prefix protocol
+ * Sends the command with the file size and content hash, then waits for
+ * S1 to accept the transfer (or to report the content is already stored)
+ * Streams the file in chunks without loading it into memory
  * Handles server responses and errors
  */
-void upload_file(int sock, const char *filename, const char *dest_path) {
+void upload_file(int sock, const char *filename, const char *dest_path, long ttl, int direct, int chunked) {
 
     // Open the file
     FILE *fp = fopen(filename, "rb");
@@ -100,34 +708,206 @@ void upload_file(int sock, const char *filename, const char *dest_path) {
     long filesize = ftell(fp);
     rewind(fp);
 
-    // Read the file into memory
-    char *filedata = malloc(filesize);
-    if (fread(filedata, 1, filesize, fp) != filesize) {
-        perror("Error reading file");
-        fclose(fp);
-        free(filedata);
-        return;
+    // Hash the file first, so content the servers already have is not sent
+    // (the SHA-256 proves the content is ours); a chunked upload also cuts
+    // the mapped file into its recipe
+    unsigned long long hash = 0;
+    unsigned char proof[CONTENT_PROOF_LEN];
+    int proven = 0;
+    unsigned char *data = MAP_FAILED;
+    ChunkRef *refs = NULL;
+    int count = 0;
+    if (chunked && filesize > 0)
+        data = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (data != MAP_FAILED) {
+        count = chunk_file(data, filesize, &refs, &hash, proof);
+        proven = count >= 0;
+        if (count > CHUNK_MAX_COUNT) {
+            printf("Too many chunks, sending the whole file\n");
+            count = 0;
+        }
+    } else {
+        char *buffer = malloc(TRANSFER_CHUNK);
+        hash = buffer ? hash_file(fp, buffer, proof) : 0;
+        proven = buffer != NULL;
+        free(buffer);
     }
-    fclose(fp);
 
-    // Send file size
-    write(sock, &filesize, sizeof(long));
+    // Send command with the file size, TTL, hash, chunk count and proof to server S1
+    char proof_hex[2 * CONTENT_PROOF_LEN + 1] = "";
+    for (int i = 0; proven && i < CONTENT_PROOF_LEN; i++)
+        sprintf(proof_hex + 2 * i, "%02x", proof[i]);
+    char command[BUFFER_SIZE];
+    snprintf(command, BUFFER_SIZE, "%suploadf %s %s %ld %ld %016llx %d %s", direct ? "redirect " : "",
+             filename, dest_path, filesize, ttl, hash, count > 0 ? count : 0, proof_hex);
+    send(sock, command, strlen(command), 0);
 
-    // Send file data in chunks
-    long total_sent = 0;
-    while (total_sent < filesize) {
-        int chunk = write(sock, filedata + total_sent, filesize - total_sent);
-        //printf("File content sent to server : %s\n", filedata);
-        if (chunk <= 0) break;
-        total_sent += chunk;
+    // S1 either accepts the transfer, redirects it (status 2), finds the content
+    // already stored (status 3), asks for the chunk recipe (status 4) or rejects
+    // it (invalid size, busy, ...); S1 keeps a redirected or chunked .c file itself
+    long status = read_status(sock);
+    if (status == 4)
+        send_chunks(sock, data, refs, count);
+    if (data != MAP_FAILED) munmap(data, filesize);
+    free(refs);
+    if (status == 2) {
+        int data_sock = open_redirect(sock);
+        status = data_sock < 0 ? -1 : read_status(data_sock);
+        if (status == 1) {
+            send_file_stream(data_sock, fp, filesize);
+
+            // The storage server confirms once the file is in place
+            long stored = -1;
+            recv(data_sock, &stored, sizeof(long), MSG_WAITALL);
+            printf("Server response: %s\n",
+                   stored == 1 ? "File uploaded successfully." : "Error processing the file.");
+        }
+        if (data_sock >= 0) close(data_sock);
+        fclose(fp);
+        return;
+    }
+    if (status != 1 && status != 3 && status != 4) {
+        fclose(fp);
+        return;
     }
 
+    // Send file data in chunks, unless the content is already stored (status 3)
+    // or went as a chunked upload (status 4)
+    if (status == 1)
+        send_file_stream(sock, fp, filesize);
+    fclose(fp);
+
     // Receive the server's response
     char response[1024];
     read(sock, response, sizeof(response));
     printf("Server response: %s\n", response);
+}
+
+/**
+ * @brief Appends the contents of a local file to a stored file
+ * @param sock The connected socket to S1
+ * @param filename Local file holding the bytes to append
+ * @param filepath Stored file (~S1/...)
+ * @param seq Sequence number of the append, 0 for none
+ *
+ * Sends the command with the size, then the bytes once S1 accepts them.
+ * An append whose sequence number the server has already applied is
+ * reported without sending any data.
+ */
+void append_file(int sock, const char *filename, const char *filepath, long seq) {
+
+    // Read the bytes to append
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Error opening file");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    char *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (!data || read(fd, data, st.st_size) != st.st_size) {
+        printf("Error reading file\n");
+        free(data);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    char command[BUFFER_SIZE];
+    snprintf(command, BUFFER_SIZE, "appendf %s %ld %ld", filepath, (long)st.st_size, seq);
+    send(sock, command, strlen(command), 0);
+
+    // First status: send the data; second: the result
+    long status, reply[2];
+    for (int step = 0; step < 2; step++) {
+        if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+            printf("Connection error\n");
+            break;
+        }
+        if (status == -1) {
+            int msg_len;
+            recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+            char error_msg[BUFFER_SIZE];
+            recv(sock, error_msg, msg_len, MSG_WAITALL);
+            error_msg[msg_len] = '\0';
+            // Ignore the leading 'E' in the error message before printing.
+            printf("Server response: %s\n", error_msg + 1);
+            break;
+        }
+        if (status == 1 && step == 0) {
+            send(sock, data, st.st_size, 0);
+            continue;
+        }
+        recv(sock, reply, sizeof(reply), MSG_WAITALL);
+        if (status == 2)
+            printf("Already applied (sequence %ld): nothing appended\n", reply[0]);
+        else
+            printf("Appended %ld bytes to %s (sequence %ld, now %ld bytes)\n",
+                   (long)st.st_size, filepath, reply[0], reply[1]);
+        break;
+    }
+    free(data);
+}
+
+/**
+ * @brief Writes the contents of a local file into a stored file at an offset
+ * @param sock The connected socket to S1
+ * @param filepath Stored file (~S1/...)
+ * @param offset Where the bytes go in the stored file
+ * @param filename Local file holding the bytes
+ * @param expected Version the stored file must be at, 0 for any
+ *
+ * Sends the command with the size, then the bytes once S1 accepts them.
+ */
+void write_range_file(int sock, const char *filepath, long offset, const char *filename, long expected) {
+
+    // Read the bytes to write
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Error opening file");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    char *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (!data || read(fd, data, st.st_size) != st.st_size) {
+        printf("Error reading file\n");
+        free(data);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    char command[BUFFER_SIZE];
+    snprintf(command, BUFFER_SIZE, "writef %s %ld %ld %ld", filepath, offset, (long)st.st_size, expected);
+    send(sock, command, strlen(command), 0);
 
-    free(filedata);
+    // First status: send the data; second: the result
+    long status, reply[2];
+    for (int step = 0; step < 2; step++) {
+        if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+            printf("Connection error\n");
+            break;
+        }
+        if (status == -1) {
+            int msg_len;
+            recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+            char error_msg[BUFFER_SIZE];
+            recv(sock, error_msg, msg_len, MSG_WAITALL);
+            error_msg[msg_len] = '\0';
+            // Ignore the leading 'E' in the error message before printing.
+            printf("Server response: %s\n", error_msg + 1);
+            break;
+        }
+        if (step == 0) {
+            send(sock, data, st.st_size, 0);
+            continue;
+        }
+        recv(sock, reply, sizeof(reply), MSG_WAITALL);
+        printf("Wrote %ld bytes at offset %ld of %s (now version %ld, %ld bytes)\n",
+               (long)st.st_size, offset, filepath, reply[0], reply[1]);
+    }
+    free(data);
 }
 
 /**
@@ -146,7 +926,10 @@ void download_file(int sock, const char *filepath) {
     // - Target server is connected properly to storage server
     // Otherwise, the server responds with a status value of -1 to indicate an error.
     long status;
-    int r = recv(sock, &status, sizeof(long), 0);
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Connection error\n");
+        return;
+    }
     //printf("Status received from S1: %d\n", status);
     if (status == -1) {
         // Error flow
@@ -160,6 +943,15 @@ void download_file(int sock, const char *filepath) {
         return;
     }
 
+    // Redirected: the storage server named in the ticket sends the file
+    if (status == 2) {
+        int data_sock = open_redirect(sock);
+        if (data_sock < 0) return;
+        download_file(data_sock, filepath);
+        close(data_sock);
+        return;
+    }
+
     // Receive file size or error
     long file_size;
     int bytes_received = recv(sock, &file_size, sizeof(long), 0);
@@ -210,16 +1002,14 @@ void download_file(int sock, const char *filepath) {
 }
 
 /**
- * @brief Initiates file deletion on server
+ * @brief Reports the result of a removef command
  * @param sock Connected socket to S1
- * @param filepath Server path to delete (~S1/...)
  *
- * Validates path format before sending
  * Displays progress feedback
  * Handles all server response messages
  * Supports deletion of all file types
  */
-void remove_file(int sock, const char *filepath) {
+void remove_file(int sock) {
 
     // Proceed to receive the response from server only if:
     // - Target server is connected properly to storage server
@@ -361,44 +1151,220 @@ void downloadtar_file(int sock, const char *filetype) {
 }
 
 /**
- * @brief Requests and displays directory contents
- * @param sock Connected socket to S1
- * @param path Server directory path to list (~S1/...)
- *
- * Shows hierarchical directory structure
- * Handles network errors gracefully
+ * @brief Reads a reply of status + length + data into a file
+ * @param sock The connected socket to S1, after a downltar index or range
+ * @param filename File to write, or NULL to return the data instead
+ * @param data Receives the data (malloc'd, NUL-terminated) when filename is NULL
+ * @return 0 when done, 1 if the archive changed since its index was made,
+ *         -1 on any other error (printed)
  */
-void list_file(int sock, const char *filepath){
-
-    // Prepare and send the command to S1
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "dispfnames %s", filepath);
-    send(sock, command, strlen(command), 0);
-
-    //printf("Command sent to S1: %s\n", command);
-
-    // Receive status
+int recv_tar_reply(int sock, const char *filename, char **data) {
     long status;
-    int r = recv(sock, &status, sizeof(long), 0);
-    if (r <= 0 || status != 1) {
-        printf("Failed to retrieve file list or invalid status received.\n");
-        return;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Connection error\n");
+        return -1;
+    }
+    if (status == -1) {
+        int msg_len;
+        char error_msg[BUFFER_SIZE];
+        if (recv(sock, &msg_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+            msg_len <= 0 || msg_len >= BUFFER_SIZE ||
+            recv(sock, error_msg, msg_len, MSG_WAITALL) != msg_len) {
+            printf("Connection error\n");
+            return -1;
+        }
+        error_msg[msg_len] = '\0';
+        if (strcmp(error_msg, "EArchive changed since its index was made") == 0) return 1;
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg + 1);
+        return -1;
     }
 
-    // Receive the total number of files
-    int file_count;
-    r = recv(sock, &file_count, sizeof(int), 0);
-    if (r <= 0) {
-        printf("Failed to receive file count.\n");
-        return;
+    long len;
+    if (recv(sock, &len, sizeof(long), MSG_WAITALL) != sizeof(long) || len < 0) {
+        printf("Connection error\n");
+        return -1;
+    }
+    // Into the file, or into memory; whatever cannot be kept is still read
+    char chunk[BUFFER_SIZE];
+    FILE *out = filename ? fopen(filename, "wb") : NULL;
+    char *buf = filename ? NULL : malloc(len + 1);
+    if (filename ? !out : !buf) perror(filename ? filename : "malloc");
+
+    long done = 0;
+    while (done < len) {
+        long want = len - done < BUFFER_SIZE ? len - done : BUFFER_SIZE;
+        ssize_t n = recv(sock, buf ? buf + done : chunk, want, 0);
+        if (n <= 0) break;
+        if (out) fwrite(chunk, 1, n, out);
+        done += n;
+    }
+    if (out) fclose(out);
+    if (done < len) printf("Connection error\n");
+    if (done < len || (filename ? !out : !buf)) {
+        free(buf);
+        return -1;
     }
+    if (buf) {
+        buf[len] = '\0';
+        *data = buf;
+    }
+    return 0;
+}
 
-    printf("Number of files received: %d\n", file_count);
+/**
+ * @brief Finds a member in a tar index
+ * @param index Index text (see downloadtar_indexed)
+ * @param name Member name, relative to the archive root
+ * @param offset Receives the offset of the member's data in the archive
+ * @param size Receives the member's size
+ * @return 0 if found, -1 otherwise
+ */
+int find_tar_member(const char *index, const char *name, long *offset, long *size) {
+    const char *line = strchr(index, '\n');
+    size_t name_len = strlen(name);
+    while (line && *++line) {
+        int skip = 0;
+        if (sscanf(line, "%ld %ld %n", offset, size, &skip) == 2 && skip > 0 &&
+            strncmp(line + skip, name, name_len) == 0 && line[skip + name_len] == '\n')
+            return 0;
+        line = strchr(line, '\n');
+    }
+    return -1;
+}
 
-    // Receive and display all filenames
-    for (int i = 0; i < file_count; i++) {
-        int fnlen;
-        r = recv(sock, &fnlen, sizeof(int), 0);
+/**
+ * @brief Downloads a tar archive with its member index, or one member of it
+ * @param sock The connected socket to S1
+ * @param filetype The extension (.c/.pdf/.txt)
+ * @param member Member to fetch (relative to ~S1/), or NULL for the whole archive
+ *
+ * The index is kept next to the archive as <archive>.idx:
+ *   w25tar <archive id> <archive size> <members>
+ *   <data offset> <size> <name>
+ * Archives are built on request and always come out the same for the same
+ * files, so a member is fetched as a byte range of the archive named by
+ * the id. A cached index that no longer matches is fetched again, once.
+ */
+void downloadtar_indexed(int sock, const char *filetype, const char *member) {
+    char tar_name[50], idx_name[64];
+    const char *ext = filetype + 1;
+    snprintf(tar_name, sizeof(tar_name), strcmp(ext, "c") == 0 ? "%sfiles.tar" : "%s.tar", ext);
+    snprintf(idx_name, sizeof(idx_name), "%s.idx", tar_name);
+    if (member && strncmp(member, "~S1/", 4) == 0) member += 4;
+
+    // A member reuses the index saved by an earlier download
+    char *index = NULL;
+    int cached = 0;
+    FILE *fp = member ? fopen(idx_name, "rb") : NULL;
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        long len = ftell(fp);
+        rewind(fp);
+        index = len > 0 ? malloc(len + 1) : NULL;
+        if (index && fread(index, 1, len, fp) == (size_t)len) {
+            index[len] = '\0';
+            cached = 1;
+        } else {
+            free(index);
+            index = NULL;
+        }
+        fclose(fp);
+    }
+
+    int result = 1;
+    for (int attempt = 0; attempt < 2 && result == 1; attempt++) {
+        char command[BUFFER_SIZE];
+        if (!index) {
+            snprintf(command, BUFFER_SIZE, "downltar %s index", filetype);
+            send(sock, command, strlen(command), 0);
+            if (recv_tar_reply(sock, NULL, &index) != 0) return;
+            cached = 0;
+            FILE *idx = fopen(idx_name, "wb");
+            if (idx) {
+                fputs(index, idx);
+                fclose(idx);
+            }
+        }
+
+        unsigned long long id;
+        long offset = 0, length = 0;
+        int found = sscanf(index, "w25tar %llx %ld", &id, &length) == 2;
+        if (found && member) found = find_tar_member(index, member, &offset, &length) == 0;
+        if (!found && cached) {
+            // Possibly stored after the index was saved
+            free(index);
+            index = NULL;
+            continue;
+        }
+        if (!found) {
+            printf(member ? "No member %s in %s\n" : "Invalid index for %s%s\n", member ? member : "", tar_name);
+            result = -1;
+            break;
+        }
+
+        // The bytes of the member, or the whole archive
+        const char *out_name = tar_name;
+        if (member) {
+            out_name = strrchr(member, '/');
+            out_name = out_name ? out_name + 1 : member;
+        }
+        snprintf(command, BUFFER_SIZE, "downltar %s range %016llx %ld %ld", filetype, id, offset, length);
+        send(sock, command, strlen(command), 0);
+        result = recv_tar_reply(sock, out_name, NULL);
+        if (result == 0)
+            printf("File %s downloaded successfully (%ld bytes; index in %s).\n", out_name, length, idx_name);
+
+        // Changed on the server: take a new index
+        free(index);
+        index = NULL;
+    }
+    free(index);
+    if (result == 1) printf("Archive changed while downloading, try again.\n");
+}
+
+/**
+ * @brief Displays directory contents after a dispfnames command
+ * @param sock Connected socket to S1
+ *
+ * Shows hierarchical directory structure
+ * Handles network errors gracefully
+ */
+void list_file(int sock){
+
+    // Receive status
+    long status;
+    int r = recv(sock, &status, sizeof(long), 0);
+    if (r > 0 && status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+    if (r <= 0 || status != 1) {
+        printf("Failed to retrieve file list or invalid status received.\n");
+        return;
+    }
+
+    // Receive the total number of files
+    int file_count;
+    r = recv(sock, &file_count, sizeof(int), 0);
+    if (r <= 0) {
+        printf("Failed to receive file count.\n");
+        return;
+    }
+
+    printf("Number of files received: %d\n", file_count);
+
+    // Receive and display all filenames
+    for (int i = 0; i < file_count; i++) {
+        int fnlen;
+        r = recv(sock, &fnlen, sizeof(int), 0);
         if (r <= 0) {
             printf("Error receiving filename length for file %d.\n", i + 1);
             break;
@@ -418,25 +1384,583 @@ void list_file(int sock, const char *filepath){
     printf("File list retrieval complete.\n");
 }
 
+/**
+ * @brief One entry of a statf reply from S1
+ */
+typedef struct {
+    long exists;                /**< 1 if the file exists, -1 otherwise */
+    long size;                  /**< Size in bytes */
+    long mtime;                 /**< Modification time (seconds since the epoch) */
+    unsigned long long hash;    /**< XXH64 of the contents, 0 if unknown */
+} StatReply;
+
+/**
+ * @brief Receives and displays file metadata
+ * @param sock Connected socket to S1
+ * @param paths Paths that were sent in the statf command
+ * @param count Number of paths
+ *
+ * Prints one line per path, in the order requested
+ */
+void stat_files(int sock, char **paths, int count) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+
+    int reply_count;
+    StatReply replies[STAT_MAX_PATHS];
+    if (recv(sock, &reply_count, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+        reply_count != count ||
+        recv(sock, replies, count * sizeof(StatReply), MSG_WAITALL) != (long)(count * sizeof(StatReply))) {
+        printf("Failed to receive file metadata.\n");
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (replies[i].exists != 1) {
+            printf("%s: not found\n", paths[i]);
+            continue;
+        }
+        char when[64];
+        time_t mtime = replies[i].mtime;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+        if (replies[i].hash)
+            printf("%s: %ld bytes, modified %s, hash %016llx\n", paths[i], replies[i].size, when, replies[i].hash);
+        else
+            printf("%s: %ld bytes, modified %s, hash unknown\n", paths[i], replies[i].size, when);
+    }
+}
+
+/**
+ * @brief Integrity scrubber results of one server, as sent by S1
+ */
+typedef struct {
+    long passes;                        /**< Completed passes, -1 if the server is unreachable */
+    long files_checked;                 /**< Files re-hashed (all passes) */
+    long bytes_checked;                 /**< Bytes re-read (all passes) */
+    long unverified;                    /**< Files without a valid cached hash in the last pass */
+    long mismatches;                    /**< Files whose contents no longer match their hash */
+    long last_pass_end;                 /**< Time the last pass finished, 0 if none yet */
+    char last_mismatch[MAX_PATH_LEN];   /**< Most recent mismatching file */
+} ScrubReport;
+
+/**
+ * @brief Receives and displays the scrubber results of S1-S4
+ * @param sock Connected socket to S1
+ */
+void show_stats(int sock) {
+
+    // Receive status
+    long status;
+    int count;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long) || status != 1 ||
+        recv(sock, &count, sizeof(int), MSG_WAITALL) != sizeof(int) || count <= 0 || count > 4) {
+        printf("Failed to retrieve server statistics.\n");
+        return;
+    }
+
+    ScrubReport reports[4];
+    if (recv(sock, reports, count * sizeof(ScrubReport), MSG_WAITALL) != (long)(count * sizeof(ScrubReport))) {
+        printf("Failed to retrieve server statistics.\n");
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        ScrubReport *r = &reports[i];
+        if (r->passes < 0) {
+            printf("S%d: unreachable\n", i + 1);
+            continue;
+        }
+        char when[64] = "none yet";
+        if (r->last_pass_end) {
+            time_t t = r->last_pass_end;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        }
+        printf("S%d: %ld scrub passes (last: %s), %ld files / %ld bytes verified, %ld without hash, %ld mismatches\n",
+               i + 1, r->passes, when, r->files_checked, r->bytes_checked, r->unverified, r->mismatches);
+        if (r->mismatches && r->last_mismatch[0])
+            printf("    last mismatch: %s\n", r->last_mismatch);
+    }
+}
+
+/**
+ * @brief One entry of a version listing from S1
+ */
+typedef struct {
+    long version;               /**< Generation number (1 = first upload) */
+    long size;                  /**< Size in bytes */
+    long mtime;                 /**< Time this version was written */
+    long current;               /**< 1 for the live file, 0 for a prior version */
+} VersionInfo;
+
+/**
+ * @brief Receives and displays the versions of a file
+ * @param sock Connected socket to S1
+ * @param filepath Path that was sent in the versions command
+ */
+void list_versions(int sock, const char *filepath) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+
+    int count;
+    VersionInfo versions[64];
+    if (recv(sock, &count, sizeof(int), MSG_WAITALL) != sizeof(int) || count <= 0 || count > 64 ||
+        recv(sock, versions, count * sizeof(VersionInfo), MSG_WAITALL) != (long)(count * sizeof(VersionInfo))) {
+        printf("Failed to retrieve versions.\n");
+        return;
+    }
+
+    printf("Versions of %s:\n", filepath);
+    for (int i = 0; i < count; i++) {
+        char when[64];
+        time_t mtime = versions[i].mtime;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+        printf("  version %ld: %ld bytes, written %s%s\n", versions[i].version, versions[i].size, when,
+               versions[i].current ? " (current)" : "");
+    }
+}
+
+/**
+ * @brief Receives the result of an undelete request
+ * @param sock Connected socket to S1
+ * @param filepath Path that was sent in the undelf command
+ */
+void undelete_file(int sock, const char *filepath) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+
+    long size;
+    if (recv(sock, &size, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Connection lost\n");
+        return;
+    }
+    printf("File restored: %s (%ld bytes)\n", filepath, size);
+}
+
+/**
+ * @brief Prints the member list of a stored zip archive
+ * @param sock The connected socket to S1
+ *
+ * Output follows "unzip -l": uncompressed and compressed size, method,
+ * modification time and name of every member, then the totals.
+ */
+void list_zip(int sock) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+
+    printf("%12s %12s  %-7s %-16s  %s\n", "Length", "Compressed", "Method", "Modified", "Name");
+    long total_usize = 0, total_csize = 0;
+    int count = 0;
+    while (1) {
+        int name_len;
+        if (recv(sock, &name_len, sizeof(int), MSG_WAITALL) != sizeof(int)) {
+            printf("Connection lost\n");
+            return;
+        }
+        if (name_len < 0) {
+            if (name_len == -2) printf("(listing incomplete: the archive's central directory is corrupt)\n");
+            break;
+        }
+
+        char name[MAX_PATH_LEN];
+        long usize, csize, mtime;
+        int method;
+        if (name_len >= MAX_PATH_LEN || recv(sock, name, name_len, MSG_WAITALL) != name_len ||
+            recv(sock, &usize, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+            recv(sock, &csize, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+            recv(sock, &method, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+            recv(sock, &mtime, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+            printf("Connection lost\n");
+            return;
+        }
+        name[name_len] = '\0';
+
+        char timebuf[32], method_buf[16];
+        time_t t = mtime;
+        strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M", localtime(&t));
+        if (method == 0) strcpy(method_buf, "Stored");
+        else if (method == 8) strcpy(method_buf, "Deflate");
+        else snprintf(method_buf, sizeof(method_buf), "#%d", method);
+        printf("%12ld %12ld  %-7s %-16s  %s\n", usize, csize, method_buf, timebuf, name);
+        total_usize += usize;
+        total_csize += csize;
+        count++;
+    }
+    printf("%12ld %12ld  %d member(s)\n", total_usize, total_csize, count);
+}
+
+/**
+ * @brief Prints the matching lines of a grepf search
+ * @param sock The connected socket to S1
+ *
+ * Lines arrive grouped by file but files in no particular order, since
+ * the server scans them in parallel.
+ */
+void print_matches(int sock) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+
+    long count = 0;
+    while (1) {
+        int path_len;
+        if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int)) {
+            printf("Connection lost\n");
+            return;
+        }
+        if (path_len < 0) {
+            long files, bytes;
+            if (recv(sock, &files, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+                recv(sock, &bytes, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+                printf("Connection lost\n");
+                return;
+            }
+            if (path_len == -2) printf("(stopped after %ld matching lines)\n", count);
+            printf("%ld matching line(s) in %ld file(s), %ld bytes searched\n", count, files, bytes);
+            return;
+        }
+
+        char path[MAX_PATH_LEN + 4], text[BUFFER_SIZE];
+        long line_no;
+        int text_len;
+        if (path_len >= (int)sizeof(path) || recv(sock, path, path_len, MSG_WAITALL) != path_len ||
+            recv(sock, &line_no, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+            recv(sock, &text_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+            text_len < 0 || text_len >= BUFFER_SIZE ||
+            (text_len > 0 && recv(sock, text, text_len, MSG_WAITALL) != text_len)) {
+            printf("Connection lost\n");
+            return;
+        }
+        path[path_len] = '\0';
+        text[text_len] = '\0';
+        printf("%s:%ld: %s\n", path, line_no, text);
+        count++;
+    }
+}
+
+/**
+ * @brief Prints the files found by a searchf keyword search
+ * @param sock The connected socket to S1
+ */
+void print_search_results(int sock) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+
+    long total, micros;
+    int count;
+    if (recv(sock, &total, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &micros, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &count, sizeof(int), MSG_WAITALL) != sizeof(int)) {
+        printf("Connection lost\n");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        int path_len;
+        char path[MAX_PATH_LEN + 4];
+        if (recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 ||
+            path_len >= (int)sizeof(path) || recv(sock, path, path_len, MSG_WAITALL) != path_len) {
+            printf("Connection lost\n");
+            return;
+        }
+        path[path_len] = '\0';
+        printf("%s\n", path);
+    }
+    if (count < total)
+        printf("%ld file(s) match, first %d shown (%.2f ms)\n", total, count, micros / 1000.0);
+    else
+        printf("%ld file(s) match (%.2f ms)\n", total, micros / 1000.0);
+}
+
+/**
+ * @brief Reports the outcome of a login
+ * @param sock The connected socket to S1
+ * @param name Tenant logged in as
+ */
+void login_tenant(int sock, const char *name) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+    printf("Logged in as %s; ~S1 is now the tenant's namespace\n", name);
+}
+
+/**
+ * @brief Prints the definitions found by a symf lookup
+ * @param sock The connected socket to S1
+ *
+ * One line per definition: kind, name and ~S1/path:line.
+ */
+void print_symbols(int sock) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+
+    long total;
+    int count;
+    if (recv(sock, &total, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+        recv(sock, &count, sizeof(int), MSG_WAITALL) != sizeof(int)) {
+        printf("Connection lost\n");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        char kind;
+        int line, name_len, path_len;
+        char name[BUFFER_SIZE], path[MAX_PATH_LEN + 4];
+        if (recv(sock, &kind, 1, MSG_WAITALL) != 1 ||
+            recv(sock, &line, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+            recv(sock, &name_len, sizeof(int), MSG_WAITALL) != sizeof(int) || name_len <= 0 ||
+            name_len >= (int)sizeof(name) || recv(sock, name, name_len, MSG_WAITALL) != name_len ||
+            recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) || path_len <= 0 ||
+            path_len >= (int)sizeof(path) || recv(sock, path, path_len, MSG_WAITALL) != path_len) {
+            printf("Connection lost\n");
+            return;
+        }
+        name[name_len] = '\0';
+        path[path_len] = '\0';
+
+        const char *label = kind == 'f' ? "function" : kind == 'p' ? "prototype" : kind == 's' ? "struct" :
+                            kind == 'u' ? "union" : kind == 'e' ? "enum" : kind == 't' ? "typedef" : "macro";
+        printf("%-9s  %-32s  %s:%d\n", label, name, path, line);
+    }
+    if (total == 0)
+        printf("No definition found\n");
+    else if (count < total)
+        printf("%ld definition(s), first %d shown\n", total, count);
+}
+
+/**
+ * @brief Prints the changes S1 streams for a watchf command
+ * @param sock The connected socket to S1
+ *
+ * Runs until the connection closes. Every change is printed with the
+ * cursor ("s1:s2:s3:s4", the next change wanted from each server) that
+ * resumes the watch right after it.
+ */
+void watch_changes(int sock) {
+
+    // Receive status
+    long status;
+    if (recv(sock, &status, sizeof(long), MSG_WAITALL) != sizeof(long)) {
+        printf("Invalid status received.\n");
+        return;
+    }
+    if (status == -1) {
+        // Error flow
+        int msg_len;
+        recv(sock, &msg_len, sizeof(int), MSG_WAITALL);
+        char error_msg[BUFFER_SIZE];
+        recv(sock, error_msg, msg_len, MSG_WAITALL);
+        error_msg[msg_len] = '\0';
+        // Ignore the leading 'E' in the error message before printing.
+        printf("%s\n", error_msg+1);
+        return;
+    }
+
+    long cursor[4];
+    if (recv(sock, cursor, sizeof(cursor), MSG_WAITALL) != sizeof(cursor)) {
+        printf("Connection lost\n");
+        return;
+    }
+    printf("Watching from cursor %ld:%ld:%ld:%ld (Ctrl-C to stop)\n", cursor[0], cursor[1], cursor[2], cursor[3]);
+    fflush(stdout);
+
+    const char *servers[] = {"S1", "S2", "S3", "S4"};
+    while (1) {
+        char type;
+        int server, path_len;
+        long seq, when;
+        char path[MAX_PATH_LEN + 4];
+        if (recv(sock, &type, 1, MSG_WAITALL) != 1 ||
+            recv(sock, &server, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+            recv(sock, &seq, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+            recv(sock, &when, sizeof(long), MSG_WAITALL) != sizeof(long) ||
+            recv(sock, &path_len, sizeof(int), MSG_WAITALL) != sizeof(int) ||
+            server < 0 || server > 3 || path_len < 0 || path_len >= (int)sizeof(path) ||
+            (path_len > 0 && recv(sock, path, path_len, MSG_WAITALL) != path_len)) {
+            printf("Watch ended\n");
+            return;
+        }
+        path[path_len] = '\0';
+
+        if (type == 'U') {
+            printf("%s is unreachable, its changes are not followed\n", servers[server]);
+        } else if (type == 'G') {
+            // The server no longer holds the changes the cursor asked for
+            cursor[server] = seq;
+            printf("Some changes on %s were missed; re-list with dispfnames\n", servers[server]);
+        } else {
+            cursor[server] = seq + 1;
+            char timebuf[32];
+            time_t t = when;
+            strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+            printf("%s  %-8s  %s  (cursor %ld:%ld:%ld:%ld)\n", timebuf,
+                   type == 'A' ? "added" : type == 'M' ? "modified" : "deleted", path,
+                   cursor[0], cursor[1], cursor[2], cursor[3]);
+        }
+        fflush(stdout);
+    }
+}
+
 /**
  * @brief Main entry point for W25 Distributed Filesystem Client
  * 
+ * @param argc Argument count
+ * @param argv Optional S1 host (IPv4 address) and port
  * @return int Returns 0 on normal exit, -1 on socket/connection errors
  * 
- * @details Establishes connection to S1 server (localhost:PORT_S1) and provides
+ * @details Establishes connection to S1 server (localhost:PORT_S1 by default) and provides
  *          an interactive command-line interface for file operations including:
  *          - uploadf: Upload files to server (supports .c, .pdf, .txt, .zip)
  *          - downlf: Download files from server
  *          - removef: Delete files from server
  *          - downltar: Download tar bundles by file type
+ *          - statf: Show metadata of one or more files
+ *          - stats: Show integrity scrubber results
+ *          - versions: List the versions of a file
+ *          - undelf: Restore a removed file
+ *          - watchf: Follow changes below a path
+ *          - zipls: List the members of a stored zip
+ *          - grepf: Search the stored text files
+ *          - appendf: Append to a stored text file
+ *          - writef: Overwrite part of a stored file
+ *          - searchf: Find text files by keywords
+ *          - symf: Find C definitions by name
+ *          - login: Switch to a tenant's namespace
  *          - exit: Terminate the client session
  * 
  * @note The client maintains persistent connection until 'exit' command
  * @warning All file operations are restricted to ~S1/ paths
  */
-int main() {
+int main(int argc, char *argv[]) {
     int sock = 0;
     struct sockaddr_in serv_addr;
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : PORT_S1;
+    s1_host = host;
+    gear_init();
 
     // Create socket
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -445,10 +1969,10 @@ int main() {
     }
 
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT_S1);
+    serv_addr.sin_port = htons(port);
     
     // Convert IPv4 address from text to binary form
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
+    if (inet_pton(AF_INET, host, &serv_addr.sin_addr) <= 0) {
         perror("Invalid address/ Address not supported");
         return -1;
     }
@@ -462,7 +1986,7 @@ int main() {
     printf("Connected to S1 server\n");
     printf("====================================\n");
     printf("🖥️    W25 Client - Distributed FS     \n");
-    printf("     Connected to: %d\n", PORT_S1);
+    printf("     Connected to: %d\n", port);
     printf("====================================\n\n");
 
     char input[BUFFER_SIZE];
@@ -484,15 +2008,34 @@ int main() {
         //*************Upload file************/
         //************************************/
         if (strcmp(command, "uploadf") == 0) {
-            // Get the second token (i.e; filename)
+            // Get the second token (i.e; filename), after the optional --direct or --chunked
             char *filename = strtok(NULL, " ");
+            int direct = filename && strcmp(filename, "--direct") == 0;
+            int chunked = filename && strcmp(filename, "--chunked") == 0;
+            if (direct || chunked) filename = strtok(NULL, " ");
             // Get the third token (i.e; destination path)
             char *dest_path = strtok(NULL, " ");
+            // Optional fourth token (i.e; time to live, e.g. 3600, 30m, 12h, 7d)
+            char *ttl_str = strtok(NULL, " ");
             if (!filename || !dest_path) {
-                printf("Invalid command syntax. Usage: uploadf filename ~S1/..\n");
+                printf("Invalid command syntax. Usage: uploadf [--direct|--chunked] filename ~S1/.. [ttl]\n");
                 continue;
             }
 
+            long ttl = 0;
+            if (ttl_str) {
+                char *unit;
+                ttl = strtol(ttl_str, &unit, 10);
+                if (strcmp(unit, "m") == 0) ttl *= 60;
+                else if (strcmp(unit, "h") == 0) ttl *= 3600;
+                else if (strcmp(unit, "d") == 0) ttl *= 86400;
+                else if (*unit && strcmp(unit, "s") != 0) ttl = 0;
+                if (ttl <= 0) {
+                    printf("Invalid TTL. Use seconds or a number with an s, m, h or d suffix\n");
+                    continue;
+                }
+            }
+
             // Check if filename contains any '/' — disallow paths
             if (strchr(filename, '/')) {
                 printf("Invalid command syntax. Usage: uploadf filename ~S1/..\n");
@@ -519,21 +2062,42 @@ int main() {
                 continue;
             }
 
-            // Send command to server S1
-            char command[BUFFER_SIZE];
-            snprintf(command, BUFFER_SIZE, "uploadf %s %s", filename, dest_path);
-            send(sock, command, strlen(command), 0);
-            //printf("Command send to S1: %s\n", command);
-
             // Client server communication to upload file from PWD to server
-            upload_file(sock, filename, dest_path);
+            // (sends the command once the file size is known)
+            upload_file(sock, filename, dest_path, ttl, direct, chunked);
         } 
         //************************************/
         //************Download file***********/
         //************************************/
         else if (strcmp(command, "downlf") == 0) {
-            // Get the second token (i.e; filepath)
+            // Get the filepath, after the optional --version N, --member NAME, --raw and --direct
             char *filepath = strtok(NULL, " ");
+            long version = 0;
+            char *member = NULL;
+            int raw = 0;
+            int direct = 0;
+            while (filepath && strncmp(filepath, "--", 2) == 0) {
+                if (strcmp(filepath, "--version") == 0) {
+                    char *version_str = strtok(NULL, " ");
+                    version = version_str ? strtol(version_str, NULL, 10) : 0;
+                    if (version <= 0) break;
+                } else if (strcmp(filepath, "--member") == 0) {
+                    member = strtok(NULL, " ");
+                    if (!member) break;
+                } else if (strcmp(filepath, "--raw") == 0) {
+                    raw = 1;
+                } else if (strcmp(filepath, "--direct") == 0) {
+                    direct = 1;
+                } else {
+                    break;
+                }
+                filepath = strtok(NULL, " ");
+            }
+            if (filepath && strncmp(filepath, "--", 2) == 0) {
+                printf("Invalid command syntax. Usage: downlf [--direct] [--version N] ~S1/path/to/file\n"
+                       "                                 downlf --member NAME [--raw] ~S1/path/to/file.zip\n");
+                continue;
+            }
             if (!filepath) {
                 printf("Invalid command syntax. Usage: downlf ~S1/path/to/file\n");
                 continue;
@@ -562,9 +2126,25 @@ int main() {
                 continue;
             }
 
+            // One member of a zip: only its bytes are transferred
+            if (member) {
+                if (strcmp(ext, ".zip") != 0 || version > 0 || direct) {
+                    printf("--member applies to the live version of a .zip file, through S1\n");
+                    continue;
+                }
+                char command[BUFFER_SIZE];
+                snprintf(command, BUFFER_SIZE, "downlm %s %d %s", filepath, raw, member);
+                send(sock, command, strlen(command), 0);
+                download_file(sock, member);
+                continue;
+            }
+
              // Send command to server S1
             char command[BUFFER_SIZE];
-            snprintf(command, BUFFER_SIZE, "downlf %s", filepath);
+            if (version > 0)
+                snprintf(command, BUFFER_SIZE, "%sdownlf %s %ld", direct ? "redirect " : "", filepath, version);
+            else
+                snprintf(command, BUFFER_SIZE, "%sdownlf %s", direct ? "redirect " : "", filepath);
             send(sock, command, strlen(command), 0);
             //printf("Command send to S1: %s\n", command);
 
@@ -612,17 +2192,27 @@ int main() {
             send(sock, command, strlen(command), 0);
 
             // Client server communication to remove a file from server
-            remove_file(sock, filepath);
+            remove_file(sock);
         } 
         //************************************/
         //**********Downlaod tar file*********/
         //************************************/
         else if (strcmp(command, "downltar") == 0) {
-            // Get the second token (i.e; filetype)
+            // Get the second token (i.e; filetype), after the optional --index or --member NAME
             // Supported file types: .c, .pdf, .txt 
             char *filetype = strtok(NULL, " ");
+            int indexed = 0;
+            char *member = NULL;
+            if (filetype && strcmp(filetype, "--index") == 0) {
+                indexed = 1;
+                filetype = strtok(NULL, " ");
+            } else if (filetype && strcmp(filetype, "--member") == 0) {
+                indexed = 1;
+                member = strtok(NULL, " ");
+                filetype = member ? strtok(NULL, " ") : NULL;
+            }
             if (!filetype) {
-                printf("Invalid command syntax. Usage: downltar <.c|.pdf|.txt>\n");
+                printf("Invalid command syntax. Usage: downltar [--index | --member NAME] <.c|.pdf|.txt>\n");
                 continue;
             }
 
@@ -633,6 +2223,12 @@ int main() {
                 continue;
             }
 
+            // The archive with its member index, or one member of it
+            if (indexed) {
+                downloadtar_indexed(sock, filetype, member);
+                continue;
+            }
+
             // Send entire command to server S1
             char command[BUFFER_SIZE];
             snprintf(command, BUFFER_SIZE, "downltar %s", filetype);
@@ -666,10 +2262,254 @@ int main() {
             //printf("Command sent to S1: %s\n", command);
 
             // Client server communication to list all files from server
-            list_file(sock, filepath);
+            list_file(sock);
+        }
+        //************************************/
+        //**************Stat files************/
+        //************************************/
+        else if (strcmp(command, "statf") == 0) {
+            // Every remaining token is a filepath
+            char *paths[STAT_MAX_PATHS];
+            int count = 0, valid = 1;
+            char *filepath;
+            while ((filepath = strtok(NULL, " ")) && count < STAT_MAX_PATHS) {
+                // Check filepath prefix
+                if (strncmp(filepath, "~S1/", 4) != 0)
+                    valid = 0;
+                paths[count++] = filepath;
+            }
+            if (count == 0 || filepath) {
+                printf("Invalid command syntax. Usage: statf ~S1/path/to/file [more files] (at most %d)\n", STAT_MAX_PATHS);
+                continue;
+            }
+            if (!valid) {
+                printf("Filepath must start with ~S1. Usage: statf ~S1/path/to/file\n");
+                continue;
+            }
+
+            // Send the command with all paths to S1
+            char command[BUFFER_SIZE];
+            int len = snprintf(command, BUFFER_SIZE, "statf");
+            for (int i = 0; i < count && len < BUFFER_SIZE; i++)
+                len += snprintf(command + len, BUFFER_SIZE - len, " %s", paths[i]);
+            send(sock, command, strlen(command), 0);
+
+            // Client server communication to fetch file metadata
+            stat_files(sock, paths, count);
+        }
+        //************************************/
+        //************Server stats************/
+        //************************************/
+        else if (strcmp(command, "stats") == 0) {
+            send(sock, "stats", 5, 0);
+            show_stats(sock);
+        }
+        //************************************/
+        //************File versions***********/
+        //************************************/
+        else if (strcmp(command, "versions") == 0) {
+            char *filepath = strtok(NULL, " ");
+            if (!filepath || strncmp(filepath, "~S1/", 4) != 0) {
+                printf("Invalid command syntax. Usage: versions ~S1/path/to/file\n");
+                continue;
+            }
+
+            char command[BUFFER_SIZE];
+            snprintf(command, BUFFER_SIZE, "versions %s", filepath);
+            send(sock, command, strlen(command), 0);
+            list_versions(sock, filepath);
+        }
+        //************************************/
+        //************Undelete file***********/
+        //************************************/
+        else if (strcmp(command, "undelf") == 0) {
+            char *filepath = strtok(NULL, " ");
+            if (!filepath || strncmp(filepath, "~S1/", 4) != 0) {
+                printf("Invalid command syntax. Usage: undelf ~S1/path/to/file\n");
+                continue;
+            }
+
+            // Check file type
+            char *ext = strrchr(filepath, '.');
+            if (!ext || (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 &&
+                         strcmp(ext, ".txt") != 0)) {
+                printf("Unsupported file type. Allowed: .c, .pdf, .txt\n");
+                continue;
+            }
+
+            char command[BUFFER_SIZE];
+            snprintf(command, BUFFER_SIZE, "undelf %s", filepath);
+            send(sock, command, strlen(command), 0);
+            undelete_file(sock, filepath);
+        }
+        //************************************/
+        //***********List zip members*********/
+        //************************************/
+        else if (strcmp(command, "zipls") == 0) {
+            char *filepath = strtok(NULL, " ");
+            char *ext = filepath ? strrchr(filepath, '.') : NULL;
+            if (!filepath || strncmp(filepath, "~S1/", 4) != 0 || !ext || strcmp(ext, ".zip") != 0) {
+                printf("Invalid command syntax. Usage: zipls ~S1/path/to/file.zip\n");
+                continue;
+            }
+
+            char command[BUFFER_SIZE];
+            snprintf(command, BUFFER_SIZE, "zipls %s", filepath);
+            send(sock, command, strlen(command), 0);
+            list_zip(sock);
+        }
+        //************************************/
+        //********Write part of a file********/
+        //************************************/
+        else if (strcmp(command, "writef") == 0) {
+            char *filepath = strtok(NULL, " ");
+            char *offset_str = strtok(NULL, " ");
+            char *filename = strtok(NULL, " ");
+            char *version_str = strtok(NULL, " ");
+            char *end = NULL, *version_end = NULL;
+            long offset = offset_str ? strtol(offset_str, &end, 10) : -1;
+            long expected = version_str ? strtol(version_str, &version_end, 10) : 0;
+            if (!filepath || !filename || strncmp(filepath, "~S1/", 4) != 0 || *end != '\0' || offset < 0 ||
+                (version_str && (*version_end != '\0' || expected <= 0))) {
+                printf("Invalid command syntax. Usage: writef ~S1/path offset localfile [version]\n");
+                continue;
+            }
+            write_range_file(sock, filepath, offset, filename, expected);
+        }
+        //************************************/
+        //*************Append text************/
+        //************************************/
+        else if (strcmp(command, "appendf") == 0) {
+            char *filename = strtok(NULL, " ");
+            char *filepath = strtok(NULL, " ");
+            char *seq_str = strtok(NULL, " ");
+            char *end = NULL;
+            long seq = seq_str ? strtol(seq_str, &end, 10) : 0;
+            if (!filename || !filepath || strncmp(filepath, "~S1/", 4) != 0 ||
+                (seq_str && (*end != '\0' || seq <= 0))) {
+                printf("Invalid command syntax. Usage: appendf localfile ~S1/path/file.txt [seq]\n");
+                continue;
+            }
+            char *ext = strrchr(filepath, '.');
+            if (!ext || strcmp(ext, ".txt") != 0) {
+                printf("Only .txt files can be appended to\n");
+                continue;
+            }
+            append_file(sock, filename, filepath, seq);
+        }
+        //************************************/
+        //************Search text*************/
+        //************************************/
+        else if (strcmp(command, "grepf") == 0) {
+            // Rest of the line: [-E] pattern path; the pattern may contain spaces
+            char *args = strtok(NULL, "");
+            int use_regex = 0;
+            if (args && strncmp(args, "-E ", 3) == 0) {
+                use_regex = 1;
+                args += 3;
+            }
+            char *filepath = args ? strrchr(args, ' ') : NULL;
+            if (!filepath || filepath == args || strncmp(filepath + 1, "~S1", 3) != 0) {
+                printf("Invalid command syntax. Usage: grepf [-E] pattern ~S1/path\n");
+                continue;
+            }
+            *filepath++ = '\0';
+
+            // Drop the quotes around a pattern with spaces
+            size_t len = strlen(args);
+            if (len >= 2 && args[0] == '"' && args[len - 1] == '"') {
+                args[len - 1] = '\0';
+                args++;
+            }
+            if (*args == '\0') {
+                printf("Invalid command syntax. Usage: grepf [-E] pattern ~S1/path\n");
+                continue;
+            }
+
+            char command[BUFFER_SIZE];
+            snprintf(command, BUFFER_SIZE, "grepf %d %s %s", use_regex, filepath, args);
+            send(sock, command, strlen(command), 0);
+            print_matches(sock);
+        }
+        //************************************/
+        //**********Search by keyword*********/
+        //************************************/
+        else if (strcmp(command, "searchf") == 0) {
+            // Rest of the line: words, then the path
+            char *args = strtok(NULL, "");
+            char *filepath = args ? strrchr(args, ' ') : NULL;
+            if (!filepath || strncmp(filepath + 1, "~S1", 3) != 0) {
+                printf("Invalid command syntax. Usage: searchf word [word ...] ~S1/path\n");
+                continue;
+            }
+            *filepath++ = '\0';
+
+            char command[BUFFER_SIZE];
+            snprintf(command, BUFFER_SIZE, "searchf %s %s", filepath, args);
+            send(sock, command, strlen(command), 0);
+            print_search_results(sock);
+        }
+        //************************************/
+        //*********Log in as a tenant*********/
+        //************************************/
+        else if (strcmp(command, "login") == 0) {
+            char *name = strtok(NULL, " ");
+            char *secret = strtok(NULL, " ");
+            if (!name || !secret) {
+                printf("Invalid command syntax. Usage: login tenant secret\n");
+                continue;
+            }
+
+            char command[BUFFER_SIZE];
+            snprintf(command, BUFFER_SIZE, "login %s %s", name, secret);
+            send(sock, command, strlen(command), 0);
+            login_tenant(sock, name);
+        }
+        //************************************/
+        //*********Find a C definition********/
+        //************************************/
+        else if (strcmp(command, "symf") == 0) {
+            char *name = strtok(NULL, " ");
+            // Optional third token (i.e; directory to search below)
+            char *filepath = strtok(NULL, " ");
+            if (!name || (filepath && strncmp(filepath, "~S1", 3) != 0)) {
+                printf("Invalid command syntax. Usage: symf name [~S1/path]\n");
+                continue;
+            }
+
+            char command[BUFFER_SIZE];
+            if (filepath)
+                snprintf(command, BUFFER_SIZE, "symf %s %s", name, filepath);
+            else
+                snprintf(command, BUFFER_SIZE, "symf %s", name);
+            send(sock, command, strlen(command), 0);
+            print_symbols(sock);
+        }
+        //************************************/
+        //**********Watch for changes*********/
+        //************************************/
+        else if (strcmp(command, "watchf") == 0) {
+            char *filepath = strtok(NULL, " ");
+            // Optional third token (i.e; cursor printed by an earlier watch)
+            char *cursor_str = strtok(NULL, " ");
+            if (!filepath || strncmp(filepath, "~S1", 3) != 0) {
+                printf("Invalid command syntax. Usage: watchf ~S1/path [cursor]\n");
+                continue;
+            }
+
+            char command[BUFFER_SIZE];
+            if (cursor_str)
+                snprintf(command, BUFFER_SIZE, "watchf %s %s", filepath, cursor_str);
+            else
+                snprintf(command, BUFFER_SIZE, "watchf %s", filepath);
+            send(sock, command, strlen(command), 0);
+
+            // Follows changes until the connection ends
+            watch_changes(sock);
+            break;
         } else {
             printf("Invalid command.\n");
-            printf("Supported: uploadf, downlf, removef, downltar, dispfnames\n");
+            printf("Supported: uploadf, downlf, removef, downltar, dispfnames, statf, stats, versions, undelf, watchf, zipls, grepf, appendf, writef, searchf, symf, login\n");
         }
     }
 